@@ -0,0 +1,395 @@
+//=============================================================================
+// DeflateBenchmark.cpp - PC round trip and speed check for Deflate
+//
+// Checks Deflate against zlib on each file given on the command line plus a
+// few built in cases (empty, one byte, zeros, random, text followed by
+// random). Whatever Deflate compresses at levels 0, 1, 6 and 9 must inflate
+// in zlib, whatever zlib compresses at those levels must inflate in Deflate,
+// raw streams must inflate and hand back the input read past their end,
+// truncated streams must be rejected, and so must corrupted ones that zlib
+// rejects. Input is fed in pieces of several sizes, down to a byte at a time
+// for the smaller cases.
+// Then each file is timed the way a MODE Z transfer sees it: effective is
+// file bytes per second of compression, wire is compressed bytes per
+// second, and the last column is the effective rate once an 11 MB/s link
+// carries the compressed bytes. The error lines Deflate prints come from
+// the rejection checks.
+//
+//   g++ -O2 -I../XboxHomebrewStore -o DeflateBenchmark DeflateBenchmark.cpp ../XboxHomebrewStore/Deflate.cpp -lz
+//   ./DeflateBenchmark ../XboxHomebrewStore/json.h ../XboxHomebrewStore/Media/Background.jpg
+//=============================================================================
+
+#include "Deflate.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <zlib.h>
+
+#define BENCHMARK_MIN_SECONDS 0.5
+#define BENCHMARK_LINK_MBS 11.0
+#define BENCHMARK_BYTEWISE_LIMIT 200000
+
+namespace {
+    typedef std::vector<uint8_t> Bytes;
+
+    const int32_t mLevels[4] = {0, 1, 6, 9};
+    const uint32_t mPieceSizes[4] = {1, 7, 4096, 65536};
+
+    double Now()
+    {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+    }
+
+    bool AppendOutput(const uint8_t* data, uint32_t size, void* userData)
+    {
+        Bytes* out = (Bytes*)userData;
+        out->insert(out->end(), data, data + size);
+        return true;
+    }
+
+    // Hands out the input at most pieceSize bytes per call
+    typedef struct
+    {
+        const Bytes* data;
+        size_t position;
+        uint32_t pieceSize;
+    } Reader;
+
+    bool ReadInput(uint8_t* buffer, uint32_t size, uint32_t* bytesRead, void* userData)
+    {
+        Reader* reader = (Reader*)userData;
+        size_t count = reader->data->size() - reader->position;
+        if (count > size) {
+            count = size;
+        }
+        if (count > reader->pieceSize) {
+            count = reader->pieceSize;
+        }
+        if (count > 0) {
+            memcpy(buffer, &(*reader->data)[reader->position], count);
+        }
+        reader->position += count;
+        *bytesRead = (uint32_t)count;
+        return true;
+    }
+
+    bool Compress(const Bytes& data, int32_t level, uint32_t pieceSize, Bytes& out)
+    {
+        out.clear();
+        DeflateStream* stream = Deflate::CreateCompressor(level, AppendOutput, &out);
+        if (stream == NULL) {
+            return false;
+        }
+        bool result = true;
+        for (size_t position = 0; position < data.size() && result; position += pieceSize)
+        {
+            size_t count = data.size() - position < pieceSize ? data.size() - position : pieceSize;
+            result = Deflate::Compress(stream, &data[position], (uint32_t)count);
+        }
+        result = result && Deflate::Finish(stream);
+        Deflate::DestroyCompressor(stream);
+        return result;
+    }
+
+    bool Inflate(const Bytes& compressed, bool raw, uint32_t pieceSize, Bytes& out, Bytes* unused)
+    {
+        out.clear();
+        Reader reader;
+        reader.data = &compressed;
+        reader.position = 0;
+        reader.pieceSize = pieceSize;
+        InflateStream* stream = raw ? Deflate::CreateRawDecompressor(ReadInput, &reader, AppendOutput, &out)
+                                    : Deflate::CreateDecompressor(ReadInput, &reader, AppendOutput, &out);
+        if (stream == NULL) {
+            return false;
+        }
+        bool result = Deflate::Decompress(stream);
+        if (result && unused != NULL)
+        {
+            uint8_t buffer[INFLATE_UNUSED_MAX];
+            uint32_t count = Deflate::TakeUnusedInput(stream, buffer, sizeof(buffer));
+            unused->assign(buffer, buffer + count);
+            unused->insert(unused->end(), compressed.begin() + reader.position, compressed.end());
+        }
+        Deflate::DestroyDecompressor(stream);
+        return result;
+    }
+
+    bool ZlibCompress(const Bytes& data, int32_t level, bool raw, Bytes& out)
+    {
+        z_stream z;
+        memset(&z, 0, sizeof(z));
+        if (deflateInit2(&z, level, Z_DEFLATED, raw ? -15 : 15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            return false;
+        }
+        out.resize(deflateBound(&z, (uLong)data.size()));
+        z.next_in = data.empty() ? NULL : (Bytef*)&data[0];
+        z.avail_in = (uInt)data.size();
+        z.next_out = &out[0];
+        z.avail_out = (uInt)out.size();
+        bool result = deflate(&z, Z_FINISH) == Z_STREAM_END;
+        out.resize(z.total_out);
+        deflateEnd(&z);
+        return result;
+    }
+
+    bool ZlibInflate(const Bytes& compressed, size_t size, Bytes& out)
+    {
+        out.resize(size + 1);
+        uLongf length = (uLongf)out.size();
+        if (uncompress(&out[0], &length, compressed.empty() ? NULL : &compressed[0], (uLong)compressed.size()) != Z_OK) {
+            return false;
+        }
+        out.resize(length);
+        return true;
+    }
+
+    bool Fail(const std::string& name, const char* what, int32_t level, uint32_t pieceSize)
+    {
+        printf("FAIL %s: %s, level %d, %u byte pieces\n", name.c_str(), what, level, pieceSize);
+        return false;
+    }
+
+    bool CheckCase(const std::string& name, const Bytes& data)
+    {
+        Bytes compressed;
+        Bytes out;
+        for (int32_t i = 0; i < 4; i++)
+        {
+            const int32_t level = mLevels[i];
+            for (int32_t p = 0; p < 4; p++)
+            {
+                const uint32_t pieceSize = mPieceSizes[p];
+                if (pieceSize == 1 && data.size() > BENCHMARK_BYTEWISE_LIMIT) {
+                    continue;
+                }
+
+                if (!Compress(data, level, pieceSize, compressed) || !ZlibInflate(compressed, data.size(), out) || out != data) {
+                    return Fail(name, "Deflate output does not inflate in zlib", level, pieceSize);
+                }
+
+                Bytes zlibCompressed;
+                if (!ZlibCompress(data, level, false, zlibCompressed)) {
+                    return Fail(name, "zlib could not compress", level, pieceSize);
+                }
+                if (!Inflate(zlibCompressed, false, pieceSize, out, NULL) || out != data) {
+                    return Fail(name, "zlib output does not inflate in Deflate", level, pieceSize);
+                }
+
+                // A zip member is followed by whatever comes next in the archive
+                Bytes raw;
+                Bytes unused;
+                const char* trailer = "PK\x07\x08 next member";
+                if (!ZlibCompress(data, level, true, raw)) {
+                    return Fail(name, "zlib could not compress raw", level, pieceSize);
+                }
+                raw.insert(raw.end(), trailer, trailer + strlen(trailer));
+                if (!Inflate(raw, true, pieceSize, out, &unused) || out != data ||
+                    unused != Bytes(trailer, trailer + strlen(trailer)))
+                {
+                    return Fail(name, "raw stream does not inflate or hand back its trailer", level, pieceSize);
+                }
+            }
+        }
+
+        // Cut short, a flipped bit in the middle, a wrong checksum
+        if (!ZlibCompress(data, 6, false, compressed)) {
+            return Fail(name, "zlib could not compress", 6, 0);
+        }
+        Bytes truncated(compressed.begin(), compressed.begin() + compressed.size() / 2);
+        if (Inflate(truncated, false, 4096, out, NULL)) {
+            return Fail(name, "truncated stream accepted", 6, 4096);
+        }
+        Bytes checksum = compressed;
+        checksum[checksum.size() - 1] ^= 0x01;
+        if (Inflate(checksum, false, 4096, out, NULL)) {
+            return Fail(name, "wrong checksum accepted", 6, 4096);
+        }
+
+        // Some flips still decode to the same bytes, so Deflate has to agree
+        // with zlib: reject what it rejects, and otherwise give the same output
+        for (int32_t i = 1; i < 16; i++)
+        {
+            Bytes corrupt = compressed;
+            corrupt[corrupt.size() * i / 16] ^= 0x10;
+            Bytes zlibOut;
+            bool zlibAccepted = ZlibInflate(corrupt, data.size(), zlibOut);
+            bool accepted = Inflate(corrupt, false, 4096, out, NULL);
+            if (accepted && (zlibAccepted == false || out != zlibOut)) {
+                return Fail(name, "corrupted stream accepted", 6, 4096);
+            }
+        }
+        Bytes rawTruncated;
+        if (ZlibCompress(data, 6, true, rawTruncated) && rawTruncated.size() > 2)
+        {
+            rawTruncated.resize(rawTruncated.size() / 2);
+            if (Inflate(rawTruncated, true, 4096, out, NULL)) {
+                return Fail(name, "truncated raw stream accepted", 6, 4096);
+            }
+        }
+        return true;
+    }
+
+    // Seconds per call, repeated until BENCHMARK_MIN_SECONDS have passed
+    template <typename Fn>
+    double TimeSeconds(Fn fn)
+    {
+        int32_t runs = 0;
+        double start = Now();
+        double elapsed = 0;
+        do
+        {
+            fn();
+            runs++;
+            elapsed = Now() - start;
+        } while (elapsed < BENCHMARK_MIN_SECONDS);
+        return elapsed / runs;
+    }
+
+    struct CompressRun
+    {
+        const Bytes* data;
+        int32_t level;
+        Bytes* out;
+        void operator()() const { Compress(*data, level, 65536, *out); }
+    };
+
+    struct ZlibCompressRun
+    {
+        const Bytes* data;
+        int32_t level;
+        Bytes* out;
+        void operator()() const { ZlibCompress(*data, level, false, *out); }
+    };
+
+    struct InflateRun
+    {
+        const Bytes* compressed;
+        Bytes* out;
+        void operator()() const { Inflate(*compressed, false, 65536, *out, NULL); }
+    };
+
+    struct ZlibInflateRun
+    {
+        const Bytes* compressed;
+        size_t size;
+        Bytes* out;
+        void operator()() const { ZlibInflate(*compressed, size, *out); }
+    };
+
+    void Benchmark(const std::string& name, const Bytes& data)
+    {
+        const double megabytes = data.size() / 1048576.0;
+        printf("\n%s, %u bytes\n", name.c_str(), (uint32_t)data.size());
+        printf("  level   ratio    zlib  effective MB/s  wire MB/s  zlib MB/s  inflate MB/s    zlib  at %.0f MB/s link\n",
+            BENCHMARK_LINK_MBS);
+        for (int32_t i = 0; i < 4; i++)
+        {
+            const int32_t level = mLevels[i];
+            Bytes compressed;
+            Bytes zlibCompressed;
+            Bytes out;
+            CompressRun compressRun = {&data, level, &compressed};
+            ZlibCompressRun zlibCompressRun = {&data, level, &zlibCompressed};
+            double compressSeconds = TimeSeconds(compressRun);
+            double zlibCompressSeconds = TimeSeconds(zlibCompressRun);
+            InflateRun inflateRun = {&compressed, &out};
+            ZlibInflateRun zlibInflateRun = {&compressed, data.size(), &out};
+            double inflateSeconds = TimeSeconds(inflateRun);
+            double zlibInflateSeconds = TimeSeconds(zlibInflateRun);
+
+            // Whichever is slower, compressing or carrying the compressed bytes
+            double ratio = (double)compressed.size() / data.size();
+            double linkSeconds = compressed.size() / 1048576.0 / BENCHMARK_LINK_MBS;
+            double transferSeconds = compressSeconds > linkSeconds ? compressSeconds : linkSeconds;
+            printf("  %5d  %5.1f%%  %5.1f%%  %14.1f  %9.1f  %9.1f  %12.1f  %6.1f  %10.1f MB/s\n", level, ratio * 100.0,
+                100.0 * zlibCompressed.size() / data.size(), megabytes / compressSeconds,
+                compressed.size() / 1048576.0 / compressSeconds, megabytes / zlibCompressSeconds,
+                megabytes / inflateSeconds, megabytes / zlibInflateSeconds, megabytes / transferSeconds);
+        }
+    }
+
+    bool ReadFile(const char* path, Bytes& data)
+    {
+        FILE* fp = fopen(path, "rb");
+        if (fp == NULL) {
+            return false;
+        }
+        uint8_t buffer[65536];
+        size_t bytesRead;
+        while ((bytesRead = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+            data.insert(data.end(), buffer, buffer + bytesRead);
+        }
+        fclose(fp);
+        return true;
+    }
+
+    void Fill(Bytes& data, size_t offset, uint32_t seed)
+    {
+        for (size_t i = offset; i < data.size(); i++)
+        {
+            seed = seed * 1664525 + 1013904223;
+            data[i] = (uint8_t)(seed >> 24);
+        }
+    }
+}
+
+int main(int argc, char** argv)
+{
+    Deflate::Init();
+
+    std::vector<std::string> names;
+    std::vector<Bytes> cases;
+    names.push_back("empty");
+    cases.push_back(Bytes());
+    names.push_back("one byte");
+    cases.push_back(Bytes(1, 'a'));
+    names.push_back("1 MB of zeros");
+    cases.push_back(Bytes(1024 * 1024, 0));
+    names.push_back("300 KB random");
+    cases.push_back(Bytes(300000));
+    Fill(cases.back(), 0, 1);
+
+    for (int32_t i = 1; i < argc; i++)
+    {
+        Bytes data;
+        if (!ReadFile(argv[i], data))
+        {
+            printf("Could not read %s\n", argv[i]);
+            return 1;
+        }
+        if (i == 1)
+        {
+            // Compressible text running into incompressible data
+            Bytes mixed(data.begin(), data.begin() + (data.size() < 100000 ? data.size() : 100000));
+            mixed.resize(mixed.size() + 70000);
+            Fill(mixed, mixed.size() - 70000, 2);
+            names.push_back(std::string(argv[i]) + " + random");
+            cases.push_back(mixed);
+        }
+        names.push_back(argv[i]);
+        cases.push_back(data);
+    }
+
+    for (size_t i = 0; i < cases.size(); i++)
+    {
+        if (!CheckCase(names[i], cases[i])) {
+            return 1;
+        }
+    }
+    printf("%u cases round trip against zlib at levels 0, 1, 6 and 9; bad streams are rejected\n", (uint32_t)cases.size());
+
+    for (size_t i = 0; i < cases.size(); i++)
+    {
+        if (cases[i].size() >= 65536) {
+            Benchmark(names[i], cases[i]);
+        }
+    }
+    return 0;
+}
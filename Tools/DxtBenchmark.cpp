@@ -0,0 +1,135 @@
+//=============================================================================
+// DxtBenchmark.cpp - PC quality and speed check for DxtEncoder
+//
+// Encodes each image given on the command line to BC1 and BC3, decodes it
+// again and prints the PSNR against the source plus the encode time. Images
+// are first stretched to power of two sizes of at most 1024, the sizes
+// TryCompressImageFile caches (point sampled here, bilinear there).
+//
+//   g++ -O2 -I../XboxHomebrewStore -o DxtBenchmark DxtBenchmark.cpp ../XboxHomebrewStore/DxtEncoder.cpp
+//   ./DxtBenchmark ../XboxHomebrewStore/Media/Cover.jpg ../Artwork/Screenshot.png
+//=============================================================================
+
+#include "DxtEncoder.h"
+
+#define STB_IMAGE_IMPLEMENTATION
+#define STBI_ONLY_JPEG
+#define STBI_ONLY_PNG
+#include "stb_image.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <vector>
+
+#define BENCHMARK_MIN_SECONDS 0.5
+#define BENCHMARK_MAX_SIZE 1024
+
+namespace {
+    int32_t TextureSize(int32_t value)
+    {
+        int32_t result = 1;
+        while (result < value && result < BENCHMARK_MAX_SIZE)
+        {
+            result <<= 1;
+        }
+        return result;
+    }
+
+    double Now()
+    {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+    }
+
+    void Stretch(const uint8_t* pixels, int32_t width, int32_t height, uint8_t* out, int32_t outWidth, int32_t outHeight)
+    {
+        for (int32_t y = 0; y < outHeight; y++)
+        {
+            int32_t sy = (int32_t)(((int64_t)y * 2 + 1) * height / (outHeight * 2));
+            for (int32_t x = 0; x < outWidth; x++)
+            {
+                int32_t sx = (int32_t)(((int64_t)x * 2 + 1) * width / (outWidth * 2));
+                memcpy(out + ((size_t)y * outWidth + x) * 4, pixels + ((size_t)sy * width + sx) * 4, 4);
+            }
+        }
+    }
+
+    // PSNR over RGB, or over alpha alone when alphaOnly is set
+    double Psnr(const uint8_t* a, const uint8_t* b, int32_t pixelCount, bool alphaOnly)
+    {
+        double sum = 0;
+        for (int32_t i = 0; i < pixelCount; i++)
+        {
+            for (int32_t c = alphaOnly ? 3 : 0; c < (alphaOnly ? 4 : 3); c++)
+            {
+                double d = (double)a[i * 4 + c] - b[i * 4 + c];
+                sum += d * d;
+            }
+        }
+        double mse = sum / ((double)pixelCount * (alphaOnly ? 1 : 3));
+        return mse == 0 ? 99.0 : 10.0 * log10(255.0 * 255.0 / mse);
+    }
+
+    void Benchmark(const char* name, const uint8_t* rgba, int32_t width, int32_t height, DxtFormat format)
+    {
+        std::vector<uint8_t> encoded(DxtEncoder::GetEncodedSize(format, width, height));
+        std::vector<uint8_t> decoded((size_t)width * height * 4);
+
+        int32_t runs = 0;
+        double start = Now();
+        double elapsed = 0;
+        do
+        {
+            DxtEncoder::EncodeImage(rgba, width, height, format, &encoded[0]);
+            runs++;
+            elapsed = Now() - start;
+        } while (elapsed < BENCHMARK_MIN_SECONDS);
+
+        DxtEncoder::DecodeImage(&encoded[0], width, height, format, &decoded[0]);
+        double ms = elapsed * 1000.0 / runs;
+        printf("%-28s %4dx%-4d %s  RGB %5.2f dB", name, width, height, format == DXT_FORMAT_BC1 ? "BC1" : "BC3",
+            Psnr(rgba, &decoded[0], width * height, false));
+        if (format == DXT_FORMAT_BC3)
+        {
+            printf("  A %5.2f dB", Psnr(rgba, &decoded[0], width * height, true));
+        }
+        printf("  %7.3f ms  %6.1f MPix/s\n", ms, (double)width * height / (ms * 1000.0));
+    }
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        printf("Usage: %s image [image ...]\n", argv[0]);
+        return 1;
+    }
+
+    for (int32_t i = 1; i < argc; i++)
+    {
+        int32_t width = 0;
+        int32_t height = 0;
+        int32_t channels = 0;
+        uint8_t* pixels = stbi_load(argv[i], &width, &height, &channels, 4);
+        if (pixels == NULL)
+        {
+            printf("%s: could not be decoded\n", argv[i]);
+            continue;
+        }
+
+        const char* name = strrchr(argv[i], '/');
+        name = name != NULL ? name + 1 : argv[i];
+        int32_t texWidth = TextureSize(width);
+        int32_t texHeight = TextureSize(height);
+        std::vector<uint8_t> rgba((size_t)texWidth * texHeight * 4);
+        Stretch(pixels, width, height, &rgba[0], texWidth, texHeight);
+        stbi_image_free(pixels);
+
+        Benchmark(name, &rgba[0], texWidth, texHeight, DXT_FORMAT_BC1);
+        Benchmark(name, &rgba[0], texWidth, texHeight, DXT_FORMAT_BC3);
+    }
+    return 0;
+}
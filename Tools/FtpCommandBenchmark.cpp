@@ -0,0 +1,460 @@
+//=============================================================================
+// FtpCommandBenchmark.cpp - PC check and timing of the FTP command reader
+//
+// Feeds pipelined control commands through a Unix socket pair into the old
+// per byte reader (SocketReceiveString / SocketReceiveLetter plus the
+// substr() trimming) and into the buffered CommandReader FtpServer uses now
+// (FillCommandReader / TakeCommand / parseCommandLine). First both readers
+// get the same mixed lines, written a few bytes at a time so lines straddle
+// recv() calls, and must split them into identical commands and arguments.
+// Then each reads 200k pipelined SIZE commands and prints commands/s.
+// FtpServer.cpp needs Winsock and the XDK, so both readers are mirrored
+// here; keep them in step when those change.
+//
+//   g++ -O2 -o FtpCommandBenchmark FtpCommandBenchmark.cpp -lpthread
+//   ./FtpCommandBenchmark
+//=============================================================================
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+#define BENCHMARK_COMMAND_COUNT 200000
+#define BENCHMARK_WRITE_CHUNK 7
+#define FTP_COMMAND_BUFFER_SIZE 4096
+#define FTP_OLD_COMMAND_BUFFER_SIZE 512
+#define SOCKET_ERROR -1
+
+namespace {
+    typedef int SOCKET;
+    typedef timeval TIMEVAL;
+
+    typedef enum _ReceiveStatus {
+        ReceiveStatus_OK = 1,
+        ReceiveStatus_Network_Error,
+        ReceiveStatus_Timeout,
+        ReceiveStatus_Invalid_Data,
+        ReceiveStatus_Insufficient_Buffer,
+        ReceiveStatus_Incomplete
+    } ReceiveStatus;
+
+    typedef struct _CommandReader {
+        char buffer[FTP_COMMAND_BUFFER_SIZE];
+        uint32_t start;
+        uint32_t end;
+        bool discarding;
+    } CommandReader;
+
+    typedef struct _CommandLine {
+        const char* command;
+        uint32_t commandLength;
+        const char* param;
+        uint32_t paramLength;
+    } CommandLine;
+
+    int mCommandTimeout = 5;
+
+    //-------------------------------------------------------------------------
+    // Old reader: one select() and one 1 byte recv() per character
+    //-------------------------------------------------------------------------
+
+    ReceiveStatus SocketReceiveLetter(SOCKET s, char* pch, uint32_t dwMaxChars, uint32_t* pdwCharsReceived) {
+        char buf[4];
+        int dw;
+        TIMEVAL tv;
+        fd_set fds;
+
+        tv.tv_sec = mCommandTimeout;
+        tv.tv_usec = 0;
+        FD_ZERO(&fds);
+        FD_SET(s, &fds);
+        dw = select(s + 1, &fds, 0, 0, &tv);
+        if (dw == SOCKET_ERROR || dw == 0)
+            return ReceiveStatus_Timeout;
+        dw = recv(s, &buf[0], 1, 0);
+        if (dw == SOCKET_ERROR || dw == 0)
+            return ReceiveStatus_Network_Error;
+
+        if (dwMaxChars == 0) {
+            return ReceiveStatus_Insufficient_Buffer;
+        }
+
+        pch[0] = buf[0];
+
+        *pdwCharsReceived = 1;
+        return ReceiveStatus_OK;
+    }
+
+    ReceiveStatus SocketReceiveString(SOCKET s, char* psz, uint32_t dwMaxChars, uint32_t* pdwCharsReceived) {
+        uint32_t dwChars = 0;
+        ReceiveStatus status, statusError;
+        char buf[2];
+        uint32_t dw;
+
+        for (;;) {
+            if (dwChars == dwMaxChars) {
+                statusError = ReceiveStatus_Insufficient_Buffer;
+                break;
+            }
+
+            status = SocketReceiveLetter(s, psz, dwMaxChars - dwChars, &dw);
+            if (status == ReceiveStatus_OK) {
+                dwChars += dw;
+                if (*psz == '\r')
+                    *psz = 0;
+                else if (*psz == '\n') {
+                    *psz = 0;
+                    *pdwCharsReceived = dwChars;
+                    return ReceiveStatus_OK;
+                }
+                psz += dw;
+            } else if (status == ReceiveStatus_Invalid_Data || status == ReceiveStatus_Insufficient_Buffer) {
+                statusError = status;
+                break;
+            } else {
+                return status;
+            }
+        }
+
+        // A non-critical error occurred, read until end of line
+        for (;;) {
+            status = SocketReceiveLetter(s, buf, sizeof(buf) / sizeof(char), &dw);
+            if (status == ReceiveStatus_OK) {
+                if (*buf == '\n') {
+                    return statusError;
+                }
+            } else if (status == ReceiveStatus_Invalid_Data || status == ReceiveStatus_Insufficient_Buffer) {
+                // Go on...
+            } else {
+                return status;
+            }
+        }
+    }
+
+    bool isOldCommandSpace(char c) {
+        return c == ' ' || c == '\r' || c == '\n' || (unsigned char)c < 32;
+    }
+
+    // The command loop's trimming and split after SocketReceiveString
+    ReceiveStatus OldReceiveCommand(SOCKET s, std::string& szCmd, std::string& pszParam) {
+        char cmdBuffer[FTP_OLD_COMMAND_BUFFER_SIZE];
+        uint32_t dw = 0;
+        ReceiveStatus status = SocketReceiveString(s, cmdBuffer, FTP_OLD_COMMAND_BUFFER_SIZE, &dw);
+        if (status != ReceiveStatus_OK)
+            return status;
+
+        if (dw >= FTP_OLD_COMMAND_BUFFER_SIZE)
+            dw = FTP_OLD_COMMAND_BUFFER_SIZE - 1;
+        cmdBuffer[dw] = '\0';
+
+        std::string line(cmdBuffer);
+        while (line.size() > 0 && isOldCommandSpace(line[0]))
+            line = line.substr(1);
+        while (line.size() > 0 && isOldCommandSpace(line[line.size() - 1]))
+            line = line.substr(0, line.size() - 1);
+        size_t sp = line.find(' ');
+        szCmd = (sp != std::string::npos) ? line.substr(0, sp) : line;
+        pszParam = (sp != std::string::npos) ? line.substr(sp + 1) : "";
+        while (pszParam.size() > 0 && isOldCommandSpace(pszParam[0]))
+            pszParam = pszParam.substr(1);
+        while (pszParam.size() > 0 && isOldCommandSpace(pszParam[pszParam.size() - 1]))
+            pszParam = pszParam.substr(0, pszParam.size() - 1);
+        return ReceiveStatus_OK;
+    }
+
+    //-------------------------------------------------------------------------
+    // New reader, as in FtpServer.cpp
+    //-------------------------------------------------------------------------
+
+    bool isCommandSpace(char c) {
+        return c == ' ' || (unsigned char)c < 32;
+    }
+
+    void parseCommandLine(char* first, char* last, CommandLine* line) {
+        while (first < last && isCommandSpace(*first))
+            first++;
+        while (last > first && isCommandSpace(last[-1]))
+            last--;
+        *last = '\0';
+
+        line->command = first;
+        char* space = (char*)memchr(first, ' ', last - first);
+        if (space == NULL) {
+            line->commandLength = (uint32_t)(last - first);
+            line->param = last;
+            line->paramLength = 0;
+            return;
+        }
+
+        *space = '\0';
+        line->commandLength = (uint32_t)(space - first);
+        char* param = space + 1;
+        while (param < last && isCommandSpace(*param))
+            param++;
+        line->param = param;
+        line->paramLength = (uint32_t)(last - param);
+    }
+
+    void ResetCommandReader(CommandReader* reader) {
+        reader->start = 0;
+        reader->end = 0;
+        reader->discarding = false;
+    }
+
+    ReceiveStatus TakeCommand(CommandReader* reader, CommandLine* line) {
+        char* newline = (char*)memchr(reader->buffer + reader->start, '\n', reader->end - reader->start);
+        if (newline == NULL) {
+            return ReceiveStatus_Incomplete;
+        }
+
+        char* first = reader->buffer + reader->start;
+        reader->start = (uint32_t)(newline - reader->buffer) + 1;
+        if (reader->discarding) {
+            reader->discarding = false;
+            return ReceiveStatus_Insufficient_Buffer;
+        }
+        parseCommandLine(first, newline, line);
+        return ReceiveStatus_OK;
+    }
+
+    ReceiveStatus FillCommandReader(SOCKET s, CommandReader* reader) {
+        if (reader->start > 0) {
+            memmove(reader->buffer, reader->buffer + reader->start, reader->end - reader->start);
+            reader->end -= reader->start;
+            reader->start = 0;
+        }
+        if (reader->end == FTP_COMMAND_BUFFER_SIZE) {
+            reader->discarding = true;
+            reader->end = 0;
+        }
+
+        int received = recv(s, reader->buffer + reader->end, FTP_COMMAND_BUFFER_SIZE - reader->end, 0);
+        if (received == SOCKET_ERROR || received == 0)
+            return ReceiveStatus_Network_Error;
+        reader->end += (uint32_t)received;
+        return ReceiveStatus_OK;
+    }
+
+    ReceiveStatus ReceiveCommand(SOCKET s, CommandReader* reader, CommandLine* line) {
+        TIMEVAL tv;
+        fd_set fds;
+
+        for (;;) {
+            ReceiveStatus status = TakeCommand(reader, line);
+            if (status != ReceiveStatus_Incomplete)
+                return status;
+
+            tv.tv_sec = mCommandTimeout;
+            tv.tv_usec = 0;
+            FD_ZERO(&fds);
+            FD_SET(s, &fds);
+            int ready = select(s + 1, &fds, 0, 0, &tv);
+            if (ready == SOCKET_ERROR || ready == 0)
+                return ReceiveStatus_Timeout;
+            status = FillCommandReader(s, reader);
+            if (status != ReceiveStatus_OK)
+                return status;
+        }
+    }
+
+    //-------------------------------------------------------------------------
+    // Harness
+    //-------------------------------------------------------------------------
+
+    typedef struct
+    {
+        SOCKET s;
+        const std::string* data;
+        size_t chunk;
+    } WriterJob;
+
+    void* WriterThread(void* param)
+    {
+        WriterJob* job = (WriterJob*)param;
+        size_t offset = 0;
+        while (offset < job->data->size())
+        {
+            size_t size = job->data->size() - offset;
+            if (job->chunk > 0 && size > job->chunk) {
+                size = job->chunk;
+            }
+            ssize_t written = write(job->s, job->data->data() + offset, size);
+            if (written <= 0) {
+                break;
+            }
+            offset += (size_t)written;
+        }
+        shutdown(job->s, SHUT_WR);
+        return NULL;
+    }
+
+    // Socket pair with a thread writing data into one end; returns the other
+    bool StartWriter(const std::string& data, size_t chunk, int sockets[2], WriterJob* job, pthread_t* thread)
+    {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) != 0) {
+            return false;
+        }
+        job->s = sockets[0];
+        job->data = &data;
+        job->chunk = chunk;
+        return pthread_create(thread, NULL, WriterThread, job) == 0;
+    }
+
+    void StopWriter(int sockets[2], pthread_t thread)
+    {
+        pthread_join(thread, NULL);
+        close(sockets[0]);
+        close(sockets[1]);
+    }
+
+    double Now()
+    {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+    }
+
+    // Lines the old reader also accepted. Both readers treat a lone CR as
+    // space at the ends; the old one also cut the line at an embedded CR, so
+    // those are left out. A line over the old 512 byte buffer, or the new
+    // 4096 byte one, is reported as too long by both.
+    bool CheckSplits()
+    {
+        std::vector<std::string> lines;
+        lines.push_back("USER xbox\r\n");
+        lines.push_back("  NOOP  \r\n");
+        lines.push_back("STOR  my file.txt \r\n");
+        lines.push_back("PWD\n");
+        lines.push_back("\r\n");
+        lines.push_back("\n");
+        lines.push_back("MDTM 20240101120000 /E/a b\r\n");
+        lines.push_back("CWD \t/E/Games/Some Game\t\r\n");
+        lines.push_back("RNTO /E/two  spaces  inside.txt\r\n");
+        lines.push_back("SITE CHMOD 755 file\r\n");
+        lines.push_back(std::string(5000, 'A') + "\r\n");
+        lines.push_back("QUIT\r\n");
+
+        std::string data;
+        for (size_t i = 0; i < lines.size(); i++) {
+            data += lines[i];
+        }
+
+        int oldSockets[2];
+        int newSockets[2];
+        WriterJob oldJob;
+        WriterJob newJob;
+        pthread_t oldThread;
+        pthread_t newThread;
+        if (!StartWriter(data, BENCHMARK_WRITE_CHUNK, oldSockets, &oldJob, &oldThread) ||
+            !StartWriter(data, BENCHMARK_WRITE_CHUNK, newSockets, &newJob, &newThread))
+        {
+            printf("Could not create the socket pairs\n");
+            return false;
+        }
+
+        CommandReader* reader = new CommandReader();
+        ResetCommandReader(reader);
+        uint32_t mismatches = 0;
+        for (size_t i = 0; i < lines.size(); i++)
+        {
+            std::string oldCommand;
+            std::string oldParam;
+            ReceiveStatus oldStatus = OldReceiveCommand(oldSockets[1], oldCommand, oldParam);
+
+            CommandLine line;
+            ReceiveStatus newStatus = ReceiveCommand(newSockets[1], reader, &line);
+            std::string newCommand;
+            std::string newParam;
+            if (newStatus == ReceiveStatus_OK)
+            {
+                newCommand.assign(line.command, line.commandLength);
+                newParam.assign(line.param, line.paramLength);
+            }
+
+            if (oldStatus != newStatus || oldCommand != newCommand || oldParam != newParam)
+            {
+                printf("Mismatch on line %u: old %d [%s|%s] new %d [%s|%s]\n", (uint32_t)i, oldStatus,
+                    oldCommand.c_str(), oldParam.c_str(), newStatus, newCommand.c_str(), newParam.c_str());
+                mismatches++;
+            }
+        }
+        delete reader;
+
+        StopWriter(oldSockets, oldThread);
+        StopWriter(newSockets, newThread);
+        if (mismatches == 0) {
+            printf("%u lines split identically by both readers\n", (uint32_t)lines.size());
+        }
+        return mismatches == 0;
+    }
+
+    // Commands per second for one reader over 200k pipelined SIZE commands
+    double Benchmark(const std::string& data, bool buffered)
+    {
+        int sockets[2];
+        WriterJob job;
+        pthread_t thread;
+        if (!StartWriter(data, 0, sockets, &job, &thread)) {
+            return 0;
+        }
+
+        CommandReader* reader = new CommandReader();
+        ResetCommandReader(reader);
+        std::string command;
+        std::string param;
+        uint32_t count = 0;
+        double start = Now();
+        for (; count < BENCHMARK_COMMAND_COUNT; count++)
+        {
+            if (buffered)
+            {
+                CommandLine line;
+                if (ReceiveCommand(sockets[1], reader, &line) != ReceiveStatus_OK) {
+                    break;
+                }
+                command.assign(line.command, line.commandLength);
+                param.assign(line.param, line.paramLength);
+            }
+            else if (OldReceiveCommand(sockets[1], command, param) != ReceiveStatus_OK)
+            {
+                break;
+            }
+        }
+        double elapsed = Now() - start;
+        delete reader;
+
+        StopWriter(sockets, thread);
+        printf("%-9s %u commands in %7.3f s  %12.0f commands/s\n", buffered ? "buffered" : "per byte", count, elapsed,
+            count / elapsed);
+        return count / elapsed;
+    }
+}
+
+int main()
+{
+    if (!CheckSplits()) {
+        return 1;
+    }
+
+    std::string data;
+    char line[64];
+    for (uint32_t i = 0; i < BENCHMARK_COMMAND_COUNT; i++)
+    {
+        snprintf(line, sizeof(line), "SIZE /E/Saves/file%u.sav\r\n", i);
+        data += line;
+    }
+
+    double perByte = Benchmark(data, false);
+    double buffered = Benchmark(data, true);
+    if (perByte > 0) {
+        printf("%.0fx\n", buffered / perByte);
+    }
+    return 0;
+}
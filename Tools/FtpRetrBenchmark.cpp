@@ -0,0 +1,408 @@
+//=============================================================================
+// FtpRetrBenchmark.cpp - PC throughput check for the RETR read ahead
+//
+// Sends a file over a loopback TCP connection with the old synchronous RETR
+// loop (read 64 KB, send it, repeat) and with the SendPipeline FtpServer uses
+// now (a reader thread filling a ring of FTP_SEND_BUFFER_COUNT buffers while
+// the sender drains it). The client checks every byte it receives, including
+// a REST start that is not sector aligned and a RANG range that has to stop
+// partway through a buffer. Then each sender is timed
+// unthrottled, and with the disk and the link slowed to roughly a console's
+// drive and 100 Mbit network, at two socket buffer sizes.
+// FtpServer.cpp needs Winsock and the XDK, so both senders are mirrored here
+// with POSIX calls in place of the Win32 ones, leaving out the ABOR polling
+// and MODE Z; keep them in step when those change.
+//
+//   g++ -O2 -o FtpRetrBenchmark FtpRetrBenchmark.cpp -lpthread
+//   ./FtpRetrBenchmark
+//=============================================================================
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FTP_SEND_BUFFER_COUNT 4
+#define FTP_SEND_BUFFER_SIZE (128 * 1024)
+#define FTP_SECTOR_SIZE 2048
+#define SEND_SOCKET_BUFFER_SIZE (64 * 1024)
+
+#define BENCHMARK_FILE_SIZE (32 * 1024 * 1024)
+#define BENCHMARK_REST_OFFSET 1234567
+#define BENCHMARK_RANGE_LENGTH 700001
+#define BENCHMARK_DISK_MBS 12.5
+#define BENCHMARK_LINK_MBS 11.0
+
+namespace {
+    // Simulated drive and link rates in MB/s, zero for unthrottled
+    double mDiskRate = 0;
+    double mLinkRate = 0;
+
+    void Throttle(double rate, size_t bytes)
+    {
+        if (rate > 0) {
+            usleep((useconds_t)(bytes / (rate * 1048576.0) * 1e6));
+        }
+    }
+
+    ssize_t ThrottledRead(int file, char* buffer, size_t size)
+    {
+        ssize_t bytesRead = read(file, buffer, size);
+        if (bytesRead > 0) {
+            Throttle(mDiskRate, (size_t)bytesRead);
+        }
+        return bytesRead;
+    }
+
+    //-------------------------------------------------------------------------
+    // Old sender: FileRead a socket buffer, send it, repeat
+    //-------------------------------------------------------------------------
+
+    bool OldSendSocketFile(int sData, int file)
+    {
+        uint32_t bufferSize = SEND_SOCKET_BUFFER_SIZE;
+        char* szBuffer = (char*)malloc(bufferSize);
+
+        while (true) {
+            ssize_t bytesRead = ThrottledRead(file, szBuffer, bufferSize);
+            if (bytesRead < 0) {
+                free(szBuffer);
+                return false;
+            }
+
+            if (bytesRead == 0) {
+                free(szBuffer);
+                return true;
+            }
+
+            int bytesToSend = (int)bytesRead;
+            int bufferOffset = 0;
+
+            while (bytesToSend > 0) {
+                int sent = (int)send(sData, szBuffer + bufferOffset, bytesToSend, 0);
+                if (sent < 1) {
+                    free(szBuffer);
+                    return false;
+                }
+                bytesToSend -= sent;
+                bufferOffset += sent;
+            }
+        }
+    }
+
+    //-------------------------------------------------------------------------
+    // SendPipeline, as in FtpServer.cpp
+    //-------------------------------------------------------------------------
+
+    typedef struct _SendPipeline {
+        int file;
+        pthread_t thread;
+        sem_t filled;
+        sem_t empty;
+        char* memory;
+        uint32_t lengths[FTP_SEND_BUFFER_COUNT];
+        uint32_t skip;
+        volatile bool cancelRequested;
+        volatile bool readFailed;
+    } SendPipeline;
+
+    void* SendPipelineThread(void* lParam)
+    {
+        SendPipeline* pipeline = (SendPipeline*)lParam;
+        uint32_t index = 0;
+
+        while (true) {
+            sem_wait(&pipeline->empty);
+            if (pipeline->cancelRequested) {
+                break;
+            }
+
+            ssize_t bytesRead = ThrottledRead(pipeline->file, pipeline->memory + index * FTP_SEND_BUFFER_SIZE, FTP_SEND_BUFFER_SIZE);
+            if (bytesRead < 0) {
+                pipeline->readFailed = true;
+                bytesRead = 0;
+            }
+            pipeline->lengths[index] = (uint32_t)bytesRead;
+            sem_post(&pipeline->filled);
+
+            if (bytesRead == 0) {
+                break;
+            }
+            index = (index + 1) % FTP_SEND_BUFFER_COUNT;
+        }
+        return NULL;
+    }
+
+    // Always takes the unbuffered path's sector alignment, so REST exercises skip
+    bool OpenSendPipeline(const char* path, uint32_t offset, SendPipeline* pipeline)
+    {
+        memset(pipeline, 0, sizeof(SendPipeline));
+
+        uint32_t alignedOffset = offset - (offset % FTP_SECTOR_SIZE);
+        pipeline->file = open(path, O_RDONLY);
+        if (pipeline->file < 0) {
+            return false;
+        }
+        pipeline->skip = offset - alignedOffset;
+
+        if (alignedOffset > 0 && lseek(pipeline->file, alignedOffset, SEEK_SET) < 0) {
+            close(pipeline->file);
+            return false;
+        }
+
+        if (posix_memalign((void**)&pipeline->memory, 4096, FTP_SEND_BUFFER_COUNT * FTP_SEND_BUFFER_SIZE) != 0) {
+            close(pipeline->file);
+            return false;
+        }
+
+        sem_init(&pipeline->filled, 0, 0);
+        sem_init(&pipeline->empty, 0, FTP_SEND_BUFFER_COUNT);
+        return pthread_create(&pipeline->thread, NULL, SendPipelineThread, pipeline) == 0;
+    }
+
+    void CloseSendPipeline(SendPipeline* pipeline)
+    {
+        pipeline->cancelRequested = true;
+        sem_post(&pipeline->empty);
+        pthread_join(pipeline->thread, NULL);
+        sem_destroy(&pipeline->filled);
+        sem_destroy(&pipeline->empty);
+        free(pipeline->memory);
+        close(pipeline->file);
+    }
+
+    // Sends up to length bytes from the pipeline
+    bool SendSocketFile(int sData, SendPipeline* pipeline, uint32_t length)
+    {
+        uint32_t bufferSize = SEND_SOCKET_BUFFER_SIZE;
+        uint32_t skip = pipeline->skip;
+        uint32_t index = 0;
+        uint32_t remaining = length;
+
+        while (remaining > 0) {
+            sem_wait(&pipeline->filled);
+            const char* buffer = pipeline->memory + index * FTP_SEND_BUFFER_SIZE;
+            const uint32_t bufferLength = pipeline->lengths[index];
+            if (bufferLength == 0) {
+                if (pipeline->readFailed) {
+                    return false;
+                }
+                break;
+            }
+
+            uint32_t bufferOffset = skip < bufferLength ? skip : bufferLength;
+            skip -= bufferOffset;
+            const uint32_t bufferEnd = bufferOffset + (bufferLength - bufferOffset < remaining ? bufferLength - bufferOffset : remaining);
+            remaining -= bufferEnd - bufferOffset;
+
+            while (bufferOffset < bufferEnd) {
+                int bytesToSend = (int)(bufferEnd - bufferOffset < bufferSize ? bufferEnd - bufferOffset : bufferSize);
+                int sent = (int)send(sData, buffer + bufferOffset, bytesToSend, 0);
+                if (sent < 1) {
+                    return false;
+                }
+                bufferOffset += (uint32_t)sent;
+            }
+
+            sem_post(&pipeline->empty);
+            index = (index + 1) % FTP_SEND_BUFFER_COUNT;
+        }
+        return true;
+    }
+
+    //-------------------------------------------------------------------------
+    // Harness
+    //-------------------------------------------------------------------------
+
+    uint8_t ExpectedByte(uint64_t position)
+    {
+        uint32_t value = (uint32_t)(position * 2654435761u) ^ (uint32_t)(position >> 11);
+        return (uint8_t)(value >> 13);
+    }
+
+    typedef struct
+    {
+        int s;
+        uint32_t start;
+        uint64_t received;
+        bool matched;
+    } Client;
+
+    // Drains the data connection at the simulated link rate, checking bytes
+    void* ClientThread(void* param)
+    {
+        Client* client = (Client*)param;
+        static char buffer[64 * 1024];
+        client->received = 0;
+        client->matched = true;
+        ssize_t bytesRead;
+        while ((bytesRead = recv(client->s, buffer, sizeof(buffer), 0)) > 0)
+        {
+            for (ssize_t i = 0; i < bytesRead && client->matched; i++)
+            {
+                if ((uint8_t)buffer[i] != ExpectedByte(client->start + client->received + i)) {
+                    client->matched = false;
+                }
+            }
+            client->received += (uint64_t)bytesRead;
+            Throttle(mLinkRate, (size_t)bytesRead);
+        }
+        return NULL;
+    }
+
+    bool ConnectLoopback(int socketBufferSize, int* sender, int* receiver)
+    {
+        int listener = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in address;
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t addressLength = sizeof(address);
+        if (bind(listener, (sockaddr*)&address, addressLength) != 0 || listen(listener, 1) != 0 ||
+            getsockname(listener, (sockaddr*)&address, &addressLength) != 0)
+        {
+            close(listener);
+            return false;
+        }
+
+        *receiver = socket(AF_INET, SOCK_STREAM, 0);
+        setsockopt(*receiver, SOL_SOCKET, SO_RCVBUF, &socketBufferSize, sizeof(socketBufferSize));
+        if (connect(*receiver, (sockaddr*)&address, addressLength) != 0)
+        {
+            close(listener);
+            close(*receiver);
+            return false;
+        }
+        *sender = accept(listener, NULL, NULL);
+        close(listener);
+        setsockopt(*sender, SOL_SOCKET, SO_SNDBUF, &socketBufferSize, sizeof(socketBufferSize));
+        return *sender >= 0;
+    }
+
+    double Now()
+    {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+    }
+
+    // MB/s for one transfer of up to length bytes from offset, or -1 when the
+    // data was wrong; the old sender has no length, so it always sends the rest
+    double Run(const char* path, bool pipelined, uint32_t offset, uint32_t length, int socketBufferSize)
+    {
+        int sender;
+        Client client;
+        client.start = offset;
+        if (!ConnectLoopback(socketBufferSize, &sender, &client.s)) {
+            return -1;
+        }
+        pthread_t clientThread;
+        pthread_create(&clientThread, NULL, ClientThread, &client);
+
+        double start = Now();
+        bool ok;
+        if (pipelined)
+        {
+            SendPipeline pipeline;
+            ok = OpenSendPipeline(path, offset, &pipeline);
+            if (ok)
+            {
+                ok = SendSocketFile(sender, &pipeline, length);
+                CloseSendPipeline(&pipeline);
+            }
+        }
+        else
+        {
+            int file = open(path, O_RDONLY);
+            ok = file >= 0 && lseek(file, offset, SEEK_SET) == (off_t)offset && OldSendSocketFile(sender, file);
+            if (file >= 0) {
+                close(file);
+            }
+        }
+        shutdown(sender, SHUT_WR);
+        pthread_join(clientThread, NULL);
+        double elapsed = Now() - start;
+        close(sender);
+        close(client.s);
+
+        uint64_t expected = BENCHMARK_FILE_SIZE - offset;
+        if (pipelined && length < expected) {
+            expected = length;
+        }
+        if (!ok || !client.matched || client.received != expected) {
+            return -1;
+        }
+        return client.received / elapsed / 1048576.0;
+    }
+
+    bool WriteTestFile(const char* path)
+    {
+        FILE* fp = fopen(path, "wb");
+        if (fp == NULL) {
+            return false;
+        }
+        static uint8_t buffer[64 * 1024];
+        for (uint64_t position = 0; position < BENCHMARK_FILE_SIZE; position += sizeof(buffer))
+        {
+            for (size_t i = 0; i < sizeof(buffer); i++) {
+                buffer[i] = ExpectedByte(position + i);
+            }
+            fwrite(buffer, 1, sizeof(buffer), fp);
+        }
+        return fclose(fp) == 0;
+    }
+
+    void PrintRow(const char* label, const char* path, int socketBufferSize)
+    {
+        double old = Run(path, false, 0, 0xFFFFFFFF, socketBufferSize);
+        double pipelined = Run(path, true, 0, 0xFFFFFFFF, socketBufferSize);
+        printf("%-44s old %8.1f MB/s  pipelined %8.1f MB/s\n", label, old, pipelined);
+    }
+}
+
+int main()
+{
+    char path[] = "/tmp/FtpRetrBenchmarkXXXXXX";
+    int file = mkstemp(path);
+    if (file < 0 || !WriteTestFile(path))
+    {
+        printf("Could not write the test file\n");
+        return 1;
+    }
+    close(file);
+
+    // Both senders must deliver the file byte for byte, also from a REST
+    // offset in the middle of a sector, and the pipeline must stop at the end
+    // of a RANG range that spans several buffers
+    bool ok = Run(path, false, 0, 0xFFFFFFFF, SEND_SOCKET_BUFFER_SIZE) >= 0 &&
+              Run(path, true, 0, 0xFFFFFFFF, SEND_SOCKET_BUFFER_SIZE) >= 0 &&
+              Run(path, false, BENCHMARK_REST_OFFSET, 0xFFFFFFFF, SEND_SOCKET_BUFFER_SIZE) >= 0 &&
+              Run(path, true, BENCHMARK_REST_OFFSET, 0xFFFFFFFF, SEND_SOCKET_BUFFER_SIZE) >= 0 &&
+              Run(path, true, BENCHMARK_REST_OFFSET, BENCHMARK_RANGE_LENGTH, SEND_SOCKET_BUFFER_SIZE) >= 0 &&
+              Run(path, true, BENCHMARK_FILE_SIZE - 1, 1, SEND_SOCKET_BUFFER_SIZE) >= 0;
+    if (!ok)
+    {
+        printf("A sender delivered the wrong data\n");
+        unlink(path);
+        return 1;
+    }
+    printf("Both senders delivered %u MB intact, from 0 and from REST %u; ranges stop on their last byte\n\n",
+        BENCHMARK_FILE_SIZE >> 20, BENCHMARK_REST_OFFSET);
+
+    PrintRow("page cache, unthrottled, 64 KB socket", path, 64 * 1024);
+    mDiskRate = BENCHMARK_DISK_MBS;
+    mLinkRate = BENCHMARK_LINK_MBS;
+    PrintRow("disk 12.5 MB/s, link 11 MB/s, 4 KB socket", path, 4 * 1024);
+    PrintRow("disk 12.5 MB/s, link 11 MB/s, 64 KB socket", path, 64 * 1024);
+
+    unlink(path);
+    return 0;
+}
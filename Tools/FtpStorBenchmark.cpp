@@ -0,0 +1,429 @@
+//=============================================================================
+// FtpStorBenchmark.cpp - PC throughput check for the STOR write behind
+//
+// Uploads a file over a loopback TCP connection into the old STOR loop (one
+// buffer of a socket buffer plus 128 KB, written out and shifted down with
+// memmove once 128 KB has arrived) and into the ReceivePipeline FtpServer
+// uses now (data received straight into a ring of FTP_RECV_BUFFER_COUNT
+// buffers while a writer thread empties it). Both written files are read
+// back and checked byte for byte. Then each receiver is timed unthrottled,
+// and with the disk and the link slowed to roughly a console's drive and
+// 100 Mbit network, at two socket buffer sizes.
+// FtpServer.cpp needs Winsock and the XDK, so both receivers are mirrored
+// here with POSIX calls in place of the Win32 ones. The ring always takes
+// the unbuffered path, padding the last write to a sector and trimming it
+// on close; ALLO and MODE Z are left out. Keep them in step when those
+// change.
+//
+//   g++ -O2 -o FtpStorBenchmark FtpStorBenchmark.cpp -lpthread
+//   ./FtpStorBenchmark
+//=============================================================================
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FTP_RECV_BUFFER_COUNT 4
+#define FTP_RECV_BUFFER_SIZE (256 * 1024)
+#define FTP_SECTOR_SIZE 2048
+#define RECV_SOCKET_BUFFER_SIZE (64 * 1024)
+
+#define BENCHMARK_UPLOAD_SIZE (64 * 1024 * 1024 + 1234)
+#define BENCHMARK_DISK_MBS 14.0
+#define BENCHMARK_LINK_MBS 11.0
+
+namespace {
+    // Simulated drive and link rates in MB/s, zero for unthrottled
+    double mDiskRate = 0;
+    double mLinkRate = 0;
+
+    void Throttle(double rate, size_t bytes)
+    {
+        if (rate > 0) {
+            usleep((useconds_t)(bytes / (rate * 1048576.0) * 1e6));
+        }
+    }
+
+    bool ThrottledWrite(int file, const char* buffer, size_t size)
+    {
+        Throttle(mDiskRate, size);
+        return write(file, buffer, size) == (ssize_t)size;
+    }
+
+    // SocketReceiveData: bytesRead of zero once the client has closed
+    bool SocketReceiveData(int s, char* buffer, uint32_t size, uint32_t* bytesRead)
+    {
+        ssize_t result = recv(s, buffer, size, 0);
+        if (result < 0) {
+            return false;
+        }
+        *bytesRead = (uint32_t)result;
+        return true;
+    }
+
+    //-------------------------------------------------------------------------
+    // Old receiver: combined buffer, written 128 KB at a time, then memmove
+    //-------------------------------------------------------------------------
+
+    bool OldReceiveSocketFile(int sData, int fileHandle, int socketBufferSize)
+    {
+        int driveSectorBufferSize = 128 * 1024;
+        int combinedBufferSize = socketBufferSize + driveSectorBufferSize;
+        char* combinedBuffer = (char*)malloc(combinedBufferSize);
+
+        bool fileComplete = false;
+
+        uint32_t totalBytesToWrite = 0;
+        uint32_t totalWritten = 0;
+
+        while (true) {
+            while (!fileComplete && totalBytesToWrite < (uint32_t)driveSectorBufferSize) {
+                uint32_t bytesRead = 0;
+                if (SocketReceiveData(sData, combinedBuffer + totalBytesToWrite, socketBufferSize, &bytesRead) == false) {
+                    free(combinedBuffer);
+                    return false;
+                }
+                totalBytesToWrite += bytesRead;
+                if (bytesRead == 0) {
+                    fileComplete = true;
+                    break;
+                }
+            }
+
+            if (fileComplete && totalBytesToWrite == 0) {
+                free(combinedBuffer);
+                return true;
+            }
+
+            uint32_t bytesToWrite = (uint32_t)driveSectorBufferSize < totalBytesToWrite ? driveSectorBufferSize : totalBytesToWrite;
+            if (!ThrottledWrite(fileHandle, combinedBuffer, bytesToWrite)) {
+                free(combinedBuffer);
+                return false;
+            }
+            uint32_t bytesWritten = bytesToWrite;
+
+            totalBytesToWrite -= bytesWritten;
+            totalWritten += bytesWritten;
+            memmove(combinedBuffer, combinedBuffer + bytesWritten, totalBytesToWrite);
+        }
+    }
+
+    //-------------------------------------------------------------------------
+    // ReceivePipeline, as in FtpServer.cpp
+    //-------------------------------------------------------------------------
+
+    typedef struct _ReceivePipeline {
+        int file;
+        pthread_t thread;
+        sem_t filled;
+        sem_t empty;
+        char* memory;
+        uint32_t lengths[FTP_RECV_BUFFER_COUNT];
+        uint32_t index;
+        bool holdingSlot;
+        uint32_t startOffset;
+        uint32_t totalReceived;
+        volatile bool writeFailed;
+    } ReceivePipeline;
+
+    void* ReceivePipelineThread(void* lParam)
+    {
+        ReceivePipeline* pipeline = (ReceivePipeline*)lParam;
+        uint32_t index = 0;
+
+        while (true) {
+            sem_wait(&pipeline->filled);
+            const uint32_t length = pipeline->lengths[index];
+            if (length == 0) {
+                break;
+            }
+
+            // Once a write has failed the rest are only drained so the receiver never blocks
+            if (pipeline->writeFailed == false) {
+                const uint32_t bytesToWrite = (length + FTP_SECTOR_SIZE - 1) & ~(FTP_SECTOR_SIZE - 1);
+                if (!ThrottledWrite(pipeline->file, pipeline->memory + index * FTP_RECV_BUFFER_SIZE, bytesToWrite)) {
+                    pipeline->writeFailed = true;
+                }
+            }
+
+            sem_post(&pipeline->empty);
+            index = (index + 1) % FTP_RECV_BUFFER_COUNT;
+        }
+        return NULL;
+    }
+
+    bool OpenReceivePipeline(const char* path, ReceivePipeline* pipeline)
+    {
+        memset(pipeline, 0, sizeof(ReceivePipeline));
+
+        pipeline->file = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (pipeline->file < 0) {
+            return false;
+        }
+
+        if (posix_memalign((void**)&pipeline->memory, 4096, FTP_RECV_BUFFER_COUNT * FTP_RECV_BUFFER_SIZE) != 0) {
+            close(pipeline->file);
+            return false;
+        }
+
+        sem_init(&pipeline->filled, 0, 0);
+        sem_init(&pipeline->empty, 0, FTP_RECV_BUFFER_COUNT);
+        return pthread_create(&pipeline->thread, NULL, ReceivePipelineThread, pipeline) == 0;
+    }
+
+    bool CloseReceivePipeline(ReceivePipeline* pipeline)
+    {
+        // A zero length buffer tells the writer it has everything
+        if (pipeline->holdingSlot == false) {
+            sem_wait(&pipeline->empty);
+        }
+        pipeline->lengths[pipeline->index] = 0;
+        sem_post(&pipeline->filled);
+        pthread_join(pipeline->thread, NULL);
+        sem_destroy(&pipeline->filled);
+        sem_destroy(&pipeline->empty);
+        free(pipeline->memory);
+
+        // Drops the sector padding of the last write
+        bool result = ftruncate(pipeline->file, pipeline->startOffset + pipeline->totalReceived) == 0 &&
+                      pipeline->writeFailed == false;
+        close(pipeline->file);
+        return result;
+    }
+
+    bool ReceiveSocketFile(int sData, ReceivePipeline* pipeline, uint32_t socketBufferSize)
+    {
+        while (true) {
+            sem_wait(&pipeline->empty);
+            pipeline->holdingSlot = true;
+            if (pipeline->writeFailed) {
+                return false;
+            }
+
+            // Received straight into place; only whole buffers go to the writer
+            // until the client closes the connection
+            char* buffer = pipeline->memory + pipeline->index * FTP_RECV_BUFFER_SIZE;
+            uint32_t length = 0;
+            bool fileComplete = false;
+            while (length < FTP_RECV_BUFFER_SIZE) {
+                uint32_t bytesRead = 0;
+                uint32_t bytesToRead = FTP_RECV_BUFFER_SIZE - length < socketBufferSize ? FTP_RECV_BUFFER_SIZE - length : socketBufferSize;
+                if (SocketReceiveData(sData, buffer + length, bytesToRead, &bytesRead) == false) {
+                    return false;
+                }
+                if (bytesRead == 0) {
+                    fileComplete = true;
+                    break;
+                }
+                length += bytesRead;
+            }
+
+            if (length > 0) {
+                pipeline->lengths[pipeline->index] = length;
+                pipeline->totalReceived += length;
+                pipeline->holdingSlot = false;
+                sem_post(&pipeline->filled);
+                pipeline->index = (pipeline->index + 1) % FTP_RECV_BUFFER_COUNT;
+            }
+            if (fileComplete) {
+                return true;
+            }
+        }
+    }
+
+    //-------------------------------------------------------------------------
+    // Harness
+    //-------------------------------------------------------------------------
+
+    uint8_t ExpectedByte(uint64_t position)
+    {
+        uint32_t value = (uint32_t)(position * 2654435761u) ^ (uint32_t)(position >> 11);
+        return (uint8_t)(value >> 13);
+    }
+
+    // The whole upload, built once so the client only has to send
+    char* mUpload = NULL;
+
+    // Uploads the test pattern at the simulated link rate in odd sized sends
+    void* ClientThread(void* param)
+    {
+        int s = *(int*)param;
+        const size_t chunkSize = 40000;
+        size_t sent = 0;
+        while (sent < BENCHMARK_UPLOAD_SIZE)
+        {
+            size_t bytesToSend = BENCHMARK_UPLOAD_SIZE - sent < chunkSize ? BENCHMARK_UPLOAD_SIZE - sent : chunkSize;
+            size_t offset = 0;
+            while (offset < bytesToSend)
+            {
+                ssize_t result = send(s, mUpload + sent + offset, bytesToSend - offset, 0);
+                if (result < 1) {
+                    return NULL;
+                }
+                offset += (size_t)result;
+            }
+            sent += bytesToSend;
+            Throttle(mLinkRate, bytesToSend);
+        }
+        shutdown(s, SHUT_WR);
+        return NULL;
+    }
+
+    bool ConnectLoopback(int socketBufferSize, int* sender, int* receiver)
+    {
+        int listener = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in address;
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t addressLength = sizeof(address);
+        setsockopt(listener, SOL_SOCKET, SO_RCVBUF, &socketBufferSize, sizeof(socketBufferSize));
+        if (bind(listener, (sockaddr*)&address, addressLength) != 0 || listen(listener, 1) != 0 ||
+            getsockname(listener, (sockaddr*)&address, &addressLength) != 0)
+        {
+            close(listener);
+            return false;
+        }
+
+        *sender = socket(AF_INET, SOCK_STREAM, 0);
+        setsockopt(*sender, SOL_SOCKET, SO_SNDBUF, &socketBufferSize, sizeof(socketBufferSize));
+        if (connect(*sender, (sockaddr*)&address, addressLength) != 0)
+        {
+            close(listener);
+            close(*sender);
+            return false;
+        }
+        *receiver = accept(listener, NULL, NULL);
+        close(listener);
+        return *receiver >= 0;
+    }
+
+    bool CheckFile(const char* path)
+    {
+        FILE* fp = fopen(path, "rb");
+        if (fp == NULL) {
+            return false;
+        }
+        static uint8_t buffer[64 * 1024];
+        uint64_t position = 0;
+        size_t bytesRead;
+        bool matched = true;
+        while (matched && (bytesRead = fread(buffer, 1, sizeof(buffer), fp)) > 0)
+        {
+            for (size_t i = 0; i < bytesRead; i++)
+            {
+                if (buffer[i] != ExpectedByte(position + i))
+                {
+                    matched = false;
+                    break;
+                }
+            }
+            position += bytesRead;
+        }
+        fclose(fp);
+        return matched && position == BENCHMARK_UPLOAD_SIZE;
+    }
+
+    double Now()
+    {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+    }
+
+    // MB/s for one upload, or -1 when the written file was wrong
+    double Run(const char* path, bool pipelined, int socketBufferSize)
+    {
+        int sender;
+        int receiver;
+        if (!ConnectLoopback(socketBufferSize, &sender, &receiver)) {
+            return -1;
+        }
+        pthread_t clientThread;
+        pthread_create(&clientThread, NULL, ClientThread, &sender);
+
+        double start = Now();
+        bool ok;
+        if (pipelined)
+        {
+            ReceivePipeline pipeline;
+            ok = OpenReceivePipeline(path, &pipeline);
+            if (ok)
+            {
+                ok = ReceiveSocketFile(receiver, &pipeline, (uint32_t)socketBufferSize);
+                ok = CloseReceivePipeline(&pipeline) && ok;
+            }
+        }
+        else
+        {
+            int file = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            ok = file >= 0 && OldReceiveSocketFile(receiver, file, socketBufferSize);
+            if (file >= 0) {
+                ok = close(file) == 0 && ok;
+            }
+        }
+        double elapsed = Now() - start;
+        pthread_join(clientThread, NULL);
+        close(sender);
+        close(receiver);
+
+        if (!ok || !CheckFile(path)) {
+            return -1;
+        }
+        return BENCHMARK_UPLOAD_SIZE / elapsed / 1048576.0;
+    }
+
+    void PrintRow(const char* label, const char* path, int socketBufferSize)
+    {
+        double old = Run(path, false, socketBufferSize);
+        double pipelined = Run(path, true, socketBufferSize);
+        printf("%-42s old %8.1f MB/s  ring %8.1f MB/s\n", label, old, pipelined);
+    }
+}
+
+int main()
+{
+    char path[] = "/tmp/FtpStorBenchmarkXXXXXX";
+    int file = mkstemp(path);
+    if (file < 0)
+    {
+        printf("Could not create the output file\n");
+        return 1;
+    }
+    close(file);
+
+    mUpload = (char*)malloc(BENCHMARK_UPLOAD_SIZE);
+    for (uint32_t i = 0; i < BENCHMARK_UPLOAD_SIZE; i++) {
+        mUpload[i] = (char)ExpectedByte(i);
+    }
+
+    // Both receivers must write the upload byte for byte, and the ring must
+    // trim the sector padding of its last write
+    if (Run(path, false, RECV_SOCKET_BUFFER_SIZE) < 0 || Run(path, true, RECV_SOCKET_BUFFER_SIZE) < 0)
+    {
+        printf("A receiver wrote the wrong data\n");
+        unlink(path);
+        free(mUpload);
+        return 1;
+    }
+    printf("Both receivers wrote %u bytes intact\n\n", BENCHMARK_UPLOAD_SIZE);
+
+    PrintRow("page cache, unthrottled, 64 KB socket", path, 64 * 1024);
+    mDiskRate = BENCHMARK_DISK_MBS;
+    mLinkRate = BENCHMARK_LINK_MBS;
+    PrintRow("disk 14 MB/s, link 11 MB/s, 8 KB socket", path, 8 * 1024);
+    PrintRow("disk 14 MB/s, link 11 MB/s, 64 KB socket", path, 64 * 1024);
+
+    unlink(path);
+    free(mUpload);
+    return 0;
+}
@@ -0,0 +1,414 @@
+//=============================================================================
+// GlyphBenchmark.cpp - PC timing of per glyph text measurement and quads
+//
+// Compares the old std::map<uint32_t, Rect> charmap against the flat glyph
+// table BitmapFont uses now: direct indexing below U+0100, an open addressed
+// table above, UVs and advances precomputed. Drawing.cpp needs D3D, so the
+// table lookup (LookupGlyph / StoreGlyph) and the inner loops of
+// Drawing::DrawFont and Font's MeasureInternal are mirrored here; keep them in
+// step when those change.
+//
+//   g++ -O2 -I../XboxHomebrewStore -o GlyphBenchmark GlyphBenchmark.cpp
+//   ./GlyphBenchmark
+//=============================================================================
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#define SSFN_IMPLEMENTATION
+#include "ssfn.h"
+
+#define BENCHMARK_MIN_SECONDS 2.0
+#define GLYPH_DIRECT_COUNT 256
+#define ATLAS_SIZE 512
+
+namespace {
+    typedef struct
+    {
+        int32_t x;
+        int32_t y;
+        int32_t width;
+        int32_t height;
+    } Rect;
+
+    typedef struct
+    {
+        uint32_t unicode;
+        Rect rect;
+        float u0, v0, u1, v1;
+        int32_t advance;
+        uint32_t lastUsed;
+        bool present;
+        bool pinned;
+        bool missing;
+    } Glyph;
+
+    typedef struct
+    {
+        Glyph glyphs[GLYPH_DIRECT_COUNT];
+        std::vector<Glyph> extendedGlyphs;
+        uint32_t extendedCount;
+        int32_t spacing;
+    } GlyphTable;
+
+    typedef struct
+    {
+        float x, y, z, rhw;
+        uint32_t diffuse;
+        float u, v;
+    } TexVertex;
+
+    std::vector<TexVertex> mScratch;
+
+    double Now()
+    {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+    }
+
+    inline void SetVertex(TexVertex* v, float x, float y, float u, float tv, uint32_t color)
+    {
+        v->x = x; v->y = y; v->z = 0.5f; v->rhw = 1.0f; v->diffuse = color; v->u = u; v->v = tv;
+    }
+
+    // Drawing's AppendQuad with clipping off
+    inline void AppendQuad(float x0, float y0, float x1, float y1, float u0, float v0, float u1, float v1, uint32_t color)
+    {
+        size_t offset = mScratch.size();
+        mScratch.resize(offset + 6);
+        TexVertex* v = &mScratch[offset];
+        SetVertex(&v[0], x1, y0, u1, v0, color);
+        SetVertex(&v[1], x1, y1, u1, v1, color);
+        SetVertex(&v[2], x0, y1, u0, v1, color);
+        SetVertex(&v[3], x1, y0, u1, v0, color);
+        SetVertex(&v[4], x0, y1, u0, v1, color);
+        SetVertex(&v[5], x0, y0, u0, v0, color);
+    }
+
+    uint32_t HashCodePoint(uint32_t unicode)
+    {
+        return unicode * 2654435761u;
+    }
+
+    void InsertExtendedGlyph(std::vector<Glyph>& table, const Glyph& glyph)
+    {
+        uint32_t mask = (uint32_t)table.size() - 1;
+        uint32_t index = HashCodePoint(glyph.unicode) & mask;
+        while (table[index].present && table[index].unicode != glyph.unicode) {
+            index = (index + 1) & mask;
+        }
+        table[index] = glyph;
+    }
+
+    const Glyph* LookupGlyph(const GlyphTable* font, uint32_t unicode)
+    {
+        if (unicode < GLYPH_DIRECT_COUNT)
+        {
+            const Glyph* glyph = &font->glyphs[unicode];
+            return glyph->present ? glyph : NULL;
+        }
+
+        if (font->extendedGlyphs.empty()) {
+            return NULL;
+        }
+
+        uint32_t mask = (uint32_t)font->extendedGlyphs.size() - 1;
+        uint32_t index = HashCodePoint(unicode) & mask;
+        while (true)
+        {
+            const Glyph* glyph = &font->extendedGlyphs[index];
+            if (!glyph->present) {
+                return NULL;
+            }
+            if (glyph->unicode == unicode) {
+                return glyph;
+            }
+            index = (index + 1) & mask;
+        }
+    }
+
+    // Drawing's GetGlyph, minus on demand rasterising
+    const Glyph* GetGlyph(GlyphTable* font, uint32_t unicode, uint32_t frameIndex)
+    {
+        Glyph* glyph = (Glyph*)LookupGlyph(font, unicode);
+        if (glyph == NULL || glyph->missing) {
+            return NULL;
+        }
+        glyph->lastUsed = frameIndex;
+        return glyph;
+    }
+
+    void StoreGlyph(GlyphTable* font, const Glyph& glyph)
+    {
+        if (glyph.unicode < GLYPH_DIRECT_COUNT)
+        {
+            font->glyphs[glyph.unicode] = glyph;
+            return;
+        }
+
+        if (LookupGlyph(font, glyph.unicode) == NULL)
+        {
+            if ((font->extendedCount + 1) * 2 > font->extendedGlyphs.size())
+            {
+                size_t capacity = font->extendedGlyphs.empty() ? 16 : font->extendedGlyphs.size() * 2;
+                std::vector<Glyph> table(capacity);
+                memset(&table[0], 0, capacity * sizeof(Glyph));
+                for (size_t i = 0; i < font->extendedGlyphs.size(); i++)
+                {
+                    if (font->extendedGlyphs[i].present) {
+                        InsertExtendedGlyph(table, font->extendedGlyphs[i]);
+                    }
+                }
+                font->extendedGlyphs.swap(table);
+            }
+            font->extendedCount++;
+        }
+        InsertExtendedGlyph(font->extendedGlyphs, glyph);
+    }
+
+    // Printable ASCII, Latin-1 and the typographic punctuation store text uses
+    void BuildFonts(std::map<uint32_t, Rect>* charmap, GlyphTable* table)
+    {
+        static const uint32_t extended[] = {0x2013, 0x2014, 0x2018, 0x2019, 0x201c, 0x201d, 0x2022, 0x2026, 0x20ac, 0x2122};
+        std::vector<uint32_t> codePoints;
+        for (uint32_t c = 0x20; c < 0x7f; c++) {
+            codePoints.push_back(c);
+        }
+        for (uint32_t c = 0xa0; c < 0x100; c++) {
+            codePoints.push_back(c);
+        }
+        for (size_t i = 0; i < sizeof(extended) / sizeof(extended[0]); i++) {
+            codePoints.push_back(extended[i]);
+        }
+
+        memset(table->glyphs, 0, sizeof(table->glyphs));
+        table->extendedCount = 0;
+        table->spacing = 1;
+        int32_t x = 0;
+        int32_t y = 0;
+        for (size_t i = 0; i < codePoints.size(); i++)
+        {
+            Rect rect;
+            rect.width = 6 + (int32_t)(codePoints[i] % 9);
+            rect.height = 20;
+            if (x + rect.width > ATLAS_SIZE) {
+                x = 0;
+                y += rect.height;
+            }
+            rect.x = x;
+            rect.y = y;
+            x += rect.width + 1;
+
+            (*charmap)[codePoints[i]] = rect;
+
+            Glyph glyph;
+            memset(&glyph, 0, sizeof(glyph));
+            glyph.unicode = codePoints[i];
+            glyph.rect = rect;
+            glyph.u0 = rect.x / (float)ATLAS_SIZE;
+            glyph.v0 = rect.y / (float)ATLAS_SIZE;
+            glyph.u1 = (rect.x + rect.width) / (float)ATLAS_SIZE;
+            glyph.v1 = (rect.y + rect.height) / (float)ATLAS_SIZE;
+            glyph.advance = rect.width + table->spacing;
+            glyph.present = true;
+            StoreGlyph(table, glyph);
+        }
+    }
+
+    int32_t MeasureMap(const std::map<uint32_t, Rect>& charmap, int32_t spacing, const std::string& message)
+    {
+        int32_t width = 0;
+        bool first = true;
+        const char* p = message.c_str();
+        while (*p)
+        {
+            char* cursor = (char*)p;
+            uint32_t unicode = ssfn_utf8(&cursor);
+            p = cursor;
+            std::map<uint32_t, Rect>::const_iterator it = charmap.find(unicode);
+            if (it == charmap.end()) {
+                continue;
+            }
+            if (!first) {
+                width += spacing;
+            }
+            width += it->second.width;
+            first = false;
+        }
+        return width;
+    }
+
+    int32_t MeasureTable(GlyphTable* table, const std::string& message)
+    {
+        int32_t width = 0;
+        bool first = true;
+        const char* p = message.c_str();
+        while (*p)
+        {
+            char* cursor = (char*)p;
+            uint32_t unicode = ssfn_utf8(&cursor);
+            p = cursor;
+            const Glyph* glyph = GetGlyph(table, unicode, 1);
+            if (glyph == NULL) {
+                continue;
+            }
+            width += glyph->advance;
+            first = false;
+        }
+        if (!first) {
+            width -= table->spacing;
+        }
+        return width;
+    }
+
+    void DrawMap(const std::map<uint32_t, Rect>& charmap, int32_t spacing, const std::string& message, float x, float y)
+    {
+        const float sx = 1.0f, sy = 1.0f;
+        float xPos = x;
+        float yPos = y;
+        const float invW = 1.0f / (float)ATLAS_SIZE;
+        const float invH = 1.0f / (float)ATLAS_SIZE;
+
+        const char* p = message.c_str();
+        while (*p)
+        {
+            char* cursor = (char*)p;
+            uint32_t unicode = ssfn_utf8(&cursor);
+            p = cursor;
+
+            std::map<uint32_t, Rect>::const_iterator it = charmap.find(unicode);
+            if (it == charmap.end()) {
+                continue;
+            }
+
+            const Rect& rect = it->second;
+            float u0 = rect.x * invW;
+            float v0 = rect.y * invH;
+            float u1 = u0 + rect.width * invW;
+            float v1 = v0 + rect.height * invH;
+
+            float px = xPos - 0.5f;
+            float py = yPos - 0.5f;
+            AppendQuad(px, py, px + (float)rect.width * sx, py + (float)rect.height * sy, u0, v0, u1, v1, 0xffffffff);
+
+            xPos += (float)(rect.width + spacing) * sx;
+        }
+    }
+
+    void DrawTable(GlyphTable* table, const std::string& message, float x, float y)
+    {
+        const float sx = 1.0f, sy = 1.0f;
+        float xPos = x;
+        float yPos = y;
+
+        const char* p = message.c_str();
+        while (*p)
+        {
+            char* cursor = (char*)p;
+            uint32_t unicode = ssfn_utf8(&cursor);
+            p = cursor;
+
+            const Glyph* glyph = GetGlyph(table, unicode, 1);
+            if (glyph == NULL) {
+                continue;
+            }
+
+            float px = xPos - 0.5f;
+            float py = yPos - 0.5f;
+            AppendQuad(px, py, px + (float)glyph->rect.width * sx, py + (float)glyph->rect.height * sy, glyph->u0, glyph->v0, glyph->u1, glyph->v1, 0xffffffff);
+
+            xPos += (float)glyph->advance * sx;
+        }
+    }
+
+    uint32_t CountGlyphs(const std::vector<std::string>& labels)
+    {
+        uint32_t count = 0;
+        for (size_t i = 0; i < labels.size(); i++)
+        {
+            const char* p = labels[i].c_str();
+            while (*p)
+            {
+                char* cursor = (char*)p;
+                ssfn_utf8(&cursor);
+                p = cursor;
+                count++;
+            }
+        }
+        return count;
+    }
+
+    volatile int32_t mSink;
+
+    // Runs one pass over every label until the minimum time is up; returns ns per glyph
+    template <typename Pass>
+    double Time(Pass pass, uint32_t glyphsPerPass)
+    {
+        uint32_t passes = 0;
+        double start = Now();
+        double elapsed = 0;
+        do
+        {
+            pass();
+            passes++;
+            elapsed = Now() - start;
+        } while (elapsed < BENCHMARK_MIN_SECONDS);
+        return elapsed * 1e9 / ((double)passes * glyphsPerPass);
+    }
+
+    std::map<uint32_t, Rect> mCharmap;
+    GlyphTable mTable;
+    std::vector<std::string> mLabels;
+
+    struct MeasureMapPass { void operator()() const { for (size_t i = 0; i < mLabels.size(); i++) mSink += MeasureMap(mCharmap, mTable.spacing, mLabels[i]); } };
+    struct MeasureTablePass { void operator()() const { for (size_t i = 0; i < mLabels.size(); i++) mSink += MeasureTable(&mTable, mLabels[i]); } };
+    struct DrawMapPass { void operator()() const { mScratch.clear(); for (size_t i = 0; i < mLabels.size(); i++) DrawMap(mCharmap, mTable.spacing, mLabels[i], 10.0f, 20.0f * i); mSink += (int32_t)mScratch.size(); } };
+    struct DrawTablePass { void operator()() const { mScratch.clear(); for (size_t i = 0; i < mLabels.size(); i++) DrawTable(&mTable, mLabels[i], 10.0f, 20.0f * i); mSink += (int32_t)mScratch.size(); } };
+}
+
+int main()
+{
+    BuildFonts(&mCharmap, &mTable);
+
+    // A store page worth of labels: names, authors, footer and a description
+    mLabels.push_back("Xbox Homebrew Store");
+    mLabels.push_back("XBMC4Gamers");
+    mLabels.push_back("Team Resurgent");
+    mLabels.push_back("Pok\xc3\xa9mon Crystal Clear \xe2\x80\x93 Emulator Edition");
+    mLabels.push_back("Caf\xc3\xa9 Manager Deluxe");
+    mLabels.push_back("Item 12 of 268");
+    mLabels.push_back("Select");
+    mLabels.push_back("Back");
+    mLabels.push_back("Categories");
+    mLabels.push_back("A fast, accurate N64 emulator for the original Xbox with widescreen and 720p support\xe2\x80\xa6");
+    mLabels.push_back("\xe2\x80\x9cUnleashX\xe2\x80\x9d \xe2\x80\x94 dashboard replacement \xc2\xa9 2003");
+    mLabels.push_back("Version 1.2.3 (build 4567) \xe2\x80\xa2 12.4 MB");
+
+    for (size_t i = 0; i < mLabels.size(); i++)
+    {
+        if (MeasureMap(mCharmap, mTable.spacing, mLabels[i]) != MeasureTable(&mTable, mLabels[i]))
+        {
+            printf("Mismatch measuring \"%s\"\n", mLabels[i].c_str());
+            return 1;
+        }
+    }
+
+    uint32_t glyphs = CountGlyphs(mLabels);
+    mScratch.reserve(glyphs * 6);
+    double measureMap = Time(MeasureMapPass(), glyphs);
+    double measureTable = Time(MeasureTablePass(), glyphs);
+    double drawMap = Time(DrawMapPass(), glyphs);
+    double drawTable = Time(DrawTablePass(), glyphs);
+
+    printf("%u glyphs per pass, %u in the font (%u above U+00FF)\n", glyphs, (uint32_t)mCharmap.size(), mTable.extendedCount);
+    printf("measure  std::map %6.2f ns/glyph   table %6.2f ns/glyph   %.1fx\n", measureMap, measureTable, measureMap / measureTable);
+    printf("quads    std::map %6.2f ns/glyph   table %6.2f ns/glyph   %.1fx\n", drawMap, drawTable, drawMap / drawTable);
+    return 0;
+}
@@ -17,6 +17,11 @@ namespace {
     static float s_safeTop = 0.0f;
     static float s_safeRight = 0.0f;
     static float s_safeBottom = 0.0f;
+    static volatile LONG s_invalidated = 1;
+    static bool s_wakePending = false;
+    static DWORD s_wakeTick = 0;
+    static uint32_t s_framesRendered = 0;
+    static uint32_t s_framesSkipped = 0;
 }
 
 void Context::SetD3dDevice(D3DDevice* d3dDevice)
@@ -146,4 +151,47 @@ int32_t Context::GetGridRows()
 int32_t Context::GetGridCells()
 {
     return GetGridCols() * GetGridRows();
+}
+
+void Context::Invalidate()
+{
+    InterlockedExchange((LONG*)&s_invalidated, 1);
+}
+
+void Context::InvalidateAfter(uint32_t milliseconds)
+{
+    DWORD wakeTick = GetTickCount() + milliseconds;
+    if (s_wakePending == false || (LONG)(wakeTick - s_wakeTick) < 0) {
+        s_wakeTick = wakeTick;
+        s_wakePending = true;
+    }
+}
+
+bool Context::ConsumeInvalidation()
+{
+    bool invalidated = InterlockedExchange((LONG*)&s_invalidated, 0) != 0;
+    if (s_wakePending == true && (LONG)(GetTickCount() - s_wakeTick) >= 0) {
+        s_wakePending = false;
+        invalidated = true;
+    }
+    return invalidated;
+}
+
+void Context::CountFrame(bool rendered)
+{
+    if (rendered == true) {
+        s_framesRendered++;
+    } else {
+        s_framesSkipped++;
+    }
+}
+
+uint32_t Context::GetFramesRendered()
+{
+    return s_framesRendered;
+}
+
+uint32_t Context::GetFramesSkipped()
+{
+    return s_framesSkipped;
 }
\ No newline at end of file
@@ -34,4 +34,12 @@ public:
     static int32_t GetGridCols();
     static int32_t GetGridRows();
     static int32_t GetGridCells();
+
+    /** Idle frame skipping: anything that changes what is on screen calls Invalidate (safe from any thread). */
+    static void Invalidate();
+    static void InvalidateAfter(uint32_t milliseconds);
+    static bool ConsumeInvalidation();
+    static void CountFrame(bool rendered);
+    static uint32_t GetFramesRendered();
+    static uint32_t GetFramesSkipped();
 };
\ No newline at end of file
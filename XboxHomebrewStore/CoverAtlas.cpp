@@ -0,0 +1,137 @@
+//=============================================================================
+// CoverAtlas.cpp - Shared DXT1 texture holding the store grid covers
+//
+// Cached covers are always 256x256 DXT1 (see TextureHelper::TryCompressImageFile)
+// so the atlas is a grid of equal slots. Blocks are copied straight from the
+// cache file into a slot, and when the atlas is full the least recently drawn
+// slot is reused. There are enough slots for the visible grid plus a row, so
+// covers that just scrolled out are still resident when scrolling back.
+//=============================================================================
+
+#include "CoverAtlas.h"
+#include "Context.h"
+#include "TextureHelper.h"
+#include "Debug.h"
+
+#define COVER_ATLAS_SLOT_SIZE 256
+
+namespace {
+    typedef struct
+    {
+        std::string appId;
+        uint32_t lastUsed;
+    } CoverAtlasSlot;
+
+    D3DTexture* mTexture = nullptr;
+    int32_t mSlotCols = 0;
+    int32_t mSlotRows = 0;
+    std::vector<CoverAtlasSlot> mSlots;
+    std::map<std::string, int32_t> mSlotLookup;
+    uint32_t mUseCounter = 0;
+}
+
+bool CoverAtlas::Init()
+{
+    int32_t slotsNeeded = Context::GetGridCells() + Context::GetGridCols();
+    mSlotCols = 4;
+    mSlotRows = 4;
+    while (mSlotCols * mSlotRows < slotsNeeded) {
+        if (mSlotCols == mSlotRows) {
+            mSlotCols *= 2;
+        } else {
+            mSlotRows *= 2;
+        }
+    }
+
+    if (FAILED(Context::GetD3dDevice()->CreateTexture(mSlotCols * COVER_ATLAS_SLOT_SIZE, mSlotRows * COVER_ATLAS_SLOT_SIZE, 1, 0, D3DFMT_DXT1, D3DPOOL_DEFAULT, &mTexture))) {
+        Debug::Print("CoverAtlas: failed to create %dx%d atlas\n", mSlotCols * COVER_ATLAS_SLOT_SIZE, mSlotRows * COVER_ATLAS_SLOT_SIZE);
+        mTexture = nullptr;
+        return false;
+    }
+
+    mSlots.resize(mSlotCols * mSlotRows);
+    Clear();
+    return true;
+}
+
+D3DTexture* CoverAtlas::GetTexture()
+{
+    return mTexture;
+}
+
+bool CoverAtlas::Contains(const std::string appId)
+{
+    return mSlotLookup.find(appId) != mSlotLookup.end();
+}
+
+bool CoverAtlas::TryAdd(const std::string appId, const std::string filePath)
+{
+    if (mTexture == nullptr) {
+        return false;
+    }
+
+    if (Contains(appId)) {
+        return true;
+    }
+
+    // Prefer an empty slot, otherwise evict the least recently drawn
+    int32_t slotIndex = 0;
+    for (int32_t i = 0; i < (int32_t)mSlots.size(); i++) {
+        if (mSlots[i].appId.empty()) {
+            slotIndex = i;
+            break;
+        }
+        if (mSlots[i].lastUsed < mSlots[slotIndex].lastUsed) {
+            slotIndex = i;
+        }
+    }
+
+    CoverAtlasSlot& slot = mSlots[slotIndex];
+    if (!slot.appId.empty()) {
+        mSlotLookup.erase(slot.appId);
+        slot.appId.clear();
+    }
+
+    int32_t x = (slotIndex % mSlotCols) * COVER_ATLAS_SLOT_SIZE;
+    int32_t y = (slotIndex / mSlotCols) * COVER_ATLAS_SLOT_SIZE;
+    if (TextureHelper::TryLoadCompressedIntoTexture(filePath, mTexture, x, y, COVER_ATLAS_SLOT_SIZE, COVER_ATLAS_SLOT_SIZE) == false) {
+        return false;
+    }
+
+    slot.appId = appId;
+    slot.lastUsed = ++mUseCounter;
+    mSlotLookup[appId] = slotIndex;
+    return true;
+}
+
+bool CoverAtlas::TryGetSprite(const std::string appId, Sprite* sprite)
+{
+    std::map<std::string, int32_t>::iterator it = mSlotLookup.find(appId);
+    if (it == mSlotLookup.end()) {
+        return false;
+    }
+
+    int32_t slotIndex = it->second;
+    mSlots[slotIndex].lastUsed = ++mUseCounter;
+
+    // Half texel inset so bilinear filtering does not bleed in the neighbouring slot
+    const float invW = 1.0f / (float)(mSlotCols * COVER_ATLAS_SLOT_SIZE);
+    const float invH = 1.0f / (float)(mSlotRows * COVER_ATLAS_SLOT_SIZE);
+    float x = (float)((slotIndex % mSlotCols) * COVER_ATLAS_SLOT_SIZE);
+    float y = (float)((slotIndex / mSlotCols) * COVER_ATLAS_SLOT_SIZE);
+    sprite->u0 = (x + 0.5f) * invW;
+    sprite->v0 = (y + 0.5f) * invH;
+    sprite->u1 = (x + COVER_ATLAS_SLOT_SIZE - 0.5f) * invW;
+    sprite->v1 = (y + COVER_ATLAS_SLOT_SIZE - 0.5f) * invH;
+    return true;
+}
+
+void CoverAtlas::Clear()
+{
+    for (int32_t i = 0; i < (int32_t)mSlots.size(); i++) {
+        mSlots[i].appId.clear();
+        mSlots[i].lastUsed = 0;
+    }
+    mSlotLookup.clear();
+    mUseCounter = 0;
+}
@@ -0,0 +1,19 @@
+//=============================================================================
+// CoverAtlas.h - Shared DXT1 texture holding the store grid covers
+//=============================================================================
+
+#pragma once
+
+#include "Main.h"
+#include "Drawing.h"
+
+class CoverAtlas
+{
+public:
+    static bool Init();
+    static D3DTexture* GetTexture();
+    static bool Contains(const std::string appId);
+    static bool TryAdd(const std::string appId, const std::string filePath);
+    static bool TryGetSprite(const std::string appId, Sprite* sprite);
+    static void Clear();
+};
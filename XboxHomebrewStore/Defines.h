@@ -21,6 +21,13 @@
 
 #define STORE_CACHE_FILE_LIMIT  100
 
+#define COVER_DOWNLOAD_WIDTH     144
+#define COVER_DOWNLOAD_HEIGHT    204
+#define COVER_THUMBNAIL_WIDTH    18
+#define COVER_THUMBNAIL_HEIGHT   26
+#define SCREENSHOT_DOWNLOAD_WIDTH   640
+#define SCREENSHOT_DOWNLOAD_HEIGHT  360
+
 #define ASSET_HEADER_HEIGHT 56.0f
 #define ASSET_SIDEBAR_Y 76.0f
 #define ASSET_SIDEBAR_WIDTH 172.0f
@@ -50,4 +57,6 @@
 
 #define SCROLL_SPEED 40.0f
 #define SCROLL_PAUSE 1.5f
-#define SCROLL_GAP 48
\ No newline at end of file
+#define SCROLL_GAP 48
+#define TEXT_LAYOUT_CACHE_SIZE 64
+#define FRAME_IDLE_SLEEP_MS 16
\ No newline at end of file
@@ -0,0 +1,1120 @@
+//=============================================================================
+// Deflate.cpp - Streaming zlib (RFC 1950/1951) compression and decompression
+//
+// The compressor is greedy LZ77 over a 32 KB window with hash chains, whose
+// length grows with the level. Blocks use the fixed Huffman codes, and any
+// block that would come out larger than its input is sent stored instead, so
+// incompressible data costs five bytes per block rather than growing by a
+// ninth. Level 0 never searches for matches and only frames the data.
+//
+// The decompressor takes any conforming stream (stored, fixed and dynamic
+// blocks). It pulls its input through a callback, so the caller can feed it
+// straight from a socket, and hands output on 32 KB at a time as the history
+// window fills. Raw streams (zip members) have no zlib header or checksum,
+// and whatever input was read past their end can be taken back afterwards.
+//
+// CRC32, which zip and XCRC need, lives here as it does in zlib.
+//=============================================================================
+
+#include "Deflate.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Errors go to the debugger on the Xbox and to stderr in a PC build
+#if defined(_MSC_VER)
+#include "Debug.h"
+#define DEFLATE_ERROR(message) Debug::Print(message)
+#else
+#define DEFLATE_ERROR(message) fputs(message, stderr)
+#endif
+
+#define DEFLATE_WINDOW_SIZE 32768
+#define DEFLATE_WINDOW_MASK (DEFLATE_WINDOW_SIZE - 1)
+#define DEFLATE_BUFFER_SIZE (2 * DEFLATE_WINDOW_SIZE)
+#define DEFLATE_MIN_MATCH 3
+#define DEFLATE_MAX_MATCH 258
+#define DEFLATE_MIN_LOOKAHEAD (DEFLATE_MAX_MATCH + DEFLATE_MIN_MATCH + 1)
+#define DEFLATE_MAX_DISTANCE (DEFLATE_WINDOW_SIZE - DEFLATE_MIN_LOOKAHEAD)
+#define DEFLATE_TOO_FAR 4096
+#define DEFLATE_HASH_BITS 15
+#define DEFLATE_HASH_SIZE (1 << DEFLATE_HASH_BITS)
+#define DEFLATE_HASH_MASK (DEFLATE_HASH_SIZE - 1)
+#define DEFLATE_BLOCK_SYMBOLS 16384
+#define DEFLATE_OUTPUT_SIZE 16384
+#define DEFLATE_MAX_STORED 65535
+
+#define INFLATE_INPUT_SIZE (INFLATE_UNUSED_MAX - 4)
+#define INFLATE_FAST_BITS 10
+#define INFLATE_FAST_SIZE (1 << INFLATE_FAST_BITS)
+#define INFLATE_MAX_BITS 15
+
+struct DeflateStream
+{
+    DeflateOutputFn output;
+    void* userData;
+    bool store;
+    int32_t maxChain;
+    uint32_t niceLength;
+    uint8_t window[DEFLATE_BUFFER_SIZE];
+    uint16_t head[DEFLATE_HASH_SIZE];
+    uint16_t prev[DEFLATE_WINDOW_SIZE];
+    uint32_t windowEnd;
+    uint32_t position;
+    uint32_t blockStart;
+    uint16_t symbols[DEFLATE_BLOCK_SYMBOLS];
+    uint16_t distances[DEFLATE_BLOCK_SYMBOLS];
+    uint32_t symbolCount;
+    uint32_t blockBits;
+    uint8_t out[DEFLATE_OUTPUT_SIZE];
+    uint32_t outLength;
+    uint32_t bitBuffer;
+    int32_t bitCount;
+    uint32_t adler;
+    uint32_t totalIn;
+    uint32_t totalOut;
+    bool failed;
+};
+
+typedef struct
+{
+    uint16_t counts[INFLATE_MAX_BITS + 1];
+    uint16_t symbols[288];
+    uint16_t fast[INFLATE_FAST_SIZE];
+} HuffmanTable;
+
+struct InflateStream
+{
+    InflateInputFn input;
+    void* inputUserData;
+    DeflateOutputFn output;
+    void* outputUserData;
+    uint8_t inputBuffer[INFLATE_INPUT_SIZE];
+    uint32_t inputPosition;
+    uint32_t inputLength;
+    bool inputEnded;
+    uint32_t bitBuffer;
+    int32_t bitCount;
+    uint8_t window[DEFLATE_WINDOW_SIZE];
+    uint32_t windowPosition;
+    HuffmanTable lengthTable;
+    HuffmanTable distanceTable;
+    uint32_t adler;
+    uint32_t totalIn;
+    uint32_t totalOut;
+    bool raw;
+    bool failed;
+};
+
+namespace {
+    uint32_t Min(uint32_t a, uint32_t b)
+    {
+        return a < b ? a : b;
+    }
+
+    const uint16_t mLengthBase[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83,
+        99, 115, 131, 163, 195, 227, 258};
+    const uint8_t mLengthExtra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5,
+        5, 0};
+    const uint16_t mDistanceBase[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769,
+        1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+    const uint8_t mDistanceExtra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11,
+        11, 12, 12, 13, 13};
+    const uint8_t mCodeLengthOrder[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+    // Filled by Init: length and distance to code, and the fixed Huffman
+    // codes already bit reversed for the LSB first bit writer
+    uint8_t mLengthCode[256];
+    uint8_t mDistanceCode[512];
+    uint16_t mFixedCode[288];
+    uint8_t mFixedLength[288];
+    uint8_t mFixedDistanceCode[30];
+
+    // CRC32 tables for four table lookups per 32 bit word (slicing by four)
+    uint32_t mCrcTable[4][256];
+
+    uint32_t ReverseBits(uint32_t code, int32_t length)
+    {
+        uint32_t result = 0;
+        for (int32_t i = 0; i < length; i++)
+        {
+            result = (result << 1) | (code & 1);
+            code >>= 1;
+        }
+        return result;
+    }
+
+    uint8_t FixedLengthOf(uint32_t symbol)
+    {
+        return symbol < 144 ? 8 : symbol < 256 ? 9 : symbol < 280 ? 7 : 8;
+    }
+
+    uint32_t UpdateAdler32(uint32_t adler, const uint8_t* data, uint32_t size)
+    {
+        uint32_t a = adler & 0xFFFF;
+        uint32_t b = adler >> 16;
+        while (size > 0)
+        {
+            // 5552 bytes is the most that cannot overflow b before the modulo
+            uint32_t count = Min(size, (uint32_t)5552);
+            size -= count;
+            while (count-- > 0)
+            {
+                a += *data++;
+                b += a;
+            }
+            a %= 65521;
+            b %= 65521;
+        }
+        return (b << 16) | a;
+    }
+
+    uint32_t DistanceCodeOf(uint32_t distance)
+    {
+        return distance <= 256 ? mDistanceCode[distance - 1] : mDistanceCode[256 + ((distance - 1) >> 7)];
+    }
+
+    //-------------------------------------------------------------------------
+    // Compressor
+    //-------------------------------------------------------------------------
+
+    void FlushOutput(DeflateStream* stream)
+    {
+        if (stream->outLength > 0 && stream->failed == false)
+        {
+            if (stream->output(stream->out, stream->outLength, stream->userData) == false)
+            {
+                stream->failed = true;
+            }
+            stream->totalOut += stream->outLength;
+        }
+        stream->outLength = 0;
+    }
+
+    void PutByte(DeflateStream* stream, uint8_t value)
+    {
+        stream->out[stream->outLength++] = value;
+        if (stream->outLength == DEFLATE_OUTPUT_SIZE)
+        {
+            FlushOutput(stream);
+        }
+    }
+
+    void PutBytes(DeflateStream* stream, const uint8_t* data, uint32_t size)
+    {
+        while (size > 0)
+        {
+            uint32_t count = Min(size, DEFLATE_OUTPUT_SIZE - stream->outLength);
+            memcpy(stream->out + stream->outLength, data, count);
+            stream->outLength += count;
+            data += count;
+            size -= count;
+            if (stream->outLength == DEFLATE_OUTPUT_SIZE)
+            {
+                FlushOutput(stream);
+            }
+        }
+    }
+
+    void PutBits(DeflateStream* stream, uint32_t value, int32_t count)
+    {
+        stream->bitBuffer |= value << stream->bitCount;
+        stream->bitCount += count;
+        while (stream->bitCount >= 8)
+        {
+            PutByte(stream, (uint8_t)stream->bitBuffer);
+            stream->bitBuffer >>= 8;
+            stream->bitCount -= 8;
+        }
+    }
+
+    void AlignBits(DeflateStream* stream)
+    {
+        if (stream->bitCount > 0)
+        {
+            PutByte(stream, (uint8_t)stream->bitBuffer);
+        }
+        stream->bitBuffer = 0;
+        stream->bitCount = 0;
+    }
+
+    void WriteStoredBlock(DeflateStream* stream, bool final)
+    {
+        const uint8_t* data = stream->window + stream->blockStart;
+        uint32_t remaining = stream->position - stream->blockStart;
+        do
+        {
+            uint32_t count = Min(remaining, (uint32_t)DEFLATE_MAX_STORED);
+            PutBits(stream, final && count == remaining ? 1 : 0, 3);
+            AlignBits(stream);
+            PutByte(stream, (uint8_t)count);
+            PutByte(stream, (uint8_t)(count >> 8));
+            PutByte(stream, (uint8_t)~count);
+            PutByte(stream, (uint8_t)(~count >> 8));
+            PutBytes(stream, data, count);
+            data += count;
+            remaining -= count;
+        } while (remaining > 0);
+    }
+
+    void WriteFixedBlock(DeflateStream* stream, bool final)
+    {
+        PutBits(stream, final ? 1 : 0, 1);
+        PutBits(stream, 1, 2);
+        for (uint32_t i = 0; i < stream->symbolCount; i++)
+        {
+            const uint32_t distance = stream->distances[i];
+            if (distance == 0)
+            {
+                const uint32_t literal = stream->symbols[i];
+                PutBits(stream, mFixedCode[literal], mFixedLength[literal]);
+                continue;
+            }
+            const uint32_t length = stream->symbols[i] + DEFLATE_MIN_MATCH;
+            const uint32_t lengthCode = mLengthCode[length - DEFLATE_MIN_MATCH];
+            PutBits(stream, mFixedCode[257 + lengthCode], mFixedLength[257 + lengthCode]);
+            PutBits(stream, length - mLengthBase[lengthCode], mLengthExtra[lengthCode]);
+            const uint32_t distanceCode = DistanceCodeOf(distance);
+            PutBits(stream, mFixedDistanceCode[distanceCode], 5);
+            PutBits(stream, distance - mDistanceBase[distanceCode], mDistanceExtra[distanceCode]);
+        }
+        PutBits(stream, mFixedCode[256], mFixedLength[256]);
+    }
+
+    // Ends the current block as whichever of fixed or stored is smaller
+    void FlushBlock(DeflateStream* stream, bool final)
+    {
+        const uint32_t storedLength = stream->position - stream->blockStart;
+        const uint32_t storedBits = (storedLength / DEFLATE_MAX_STORED + 1) * (3 + 7 + 32) + storedLength * 8;
+        const uint32_t fixedBits = 3 + stream->blockBits + mFixedLength[256];
+        if (stream->store || storedBits < fixedBits)
+        {
+            WriteStoredBlock(stream, final);
+        }
+        else
+        {
+            WriteFixedBlock(stream, final);
+        }
+        stream->symbolCount = 0;
+        stream->blockBits = 0;
+        stream->blockStart = stream->position;
+    }
+
+    uint32_t InsertString(DeflateStream* stream, uint32_t position)
+    {
+        const uint8_t* data = stream->window + position;
+        const uint32_t hash = ((data[0] << 10) ^ (data[1] << 5) ^ data[2]) & DEFLATE_HASH_MASK;
+        const uint32_t candidate = stream->head[hash];
+        stream->prev[position & DEFLATE_WINDOW_MASK] = (uint16_t)candidate;
+        stream->head[hash] = (uint16_t)position;
+        return candidate;
+    }
+
+    uint32_t LongestMatch(DeflateStream* stream, uint32_t candidate, uint32_t* matchDistance)
+    {
+        const uint32_t position = stream->position;
+        const uint32_t maxLength = Min(stream->windowEnd - position, (uint32_t)DEFLATE_MAX_MATCH);
+        const uint32_t limit = position > DEFLATE_MAX_DISTANCE ? position - DEFLATE_MAX_DISTANCE : 0;
+        const uint8_t* scan = stream->window + position;
+        uint32_t bestLength = DEFLATE_MIN_MATCH - 1;
+        int32_t chain = stream->maxChain;
+
+        while (candidate > limit && chain-- > 0)
+        {
+            const uint8_t* match = stream->window + candidate;
+            if (match[bestLength] == scan[bestLength] && match[0] == scan[0] && match[1] == scan[1])
+            {
+                uint32_t length = 2;
+                while (length < maxLength && match[length] == scan[length])
+                {
+                    length++;
+                }
+                if (length > bestLength)
+                {
+                    bestLength = length;
+                    *matchDistance = position - candidate;
+                    if (length >= stream->niceLength || length == maxLength)
+                    {
+                        break;
+                    }
+                }
+            }
+            const uint32_t next = stream->prev[candidate & DEFLATE_WINDOW_MASK];
+            if (next >= candidate)
+            {
+                break;
+            }
+            candidate = next;
+        }
+
+        // A short match far back costs more bits than the literals it replaces
+        if (bestLength == DEFLATE_MIN_MATCH && *matchDistance > DEFLATE_TOO_FAR)
+        {
+            return 0;
+        }
+        return bestLength >= DEFLATE_MIN_MATCH ? bestLength : 0;
+    }
+
+    // Encodes the window up to the point where a match could still run past
+    // the data received so far, or all of it when finishing
+    void ProcessWindow(DeflateStream* stream, bool finishing)
+    {
+        if (stream->store)
+        {
+            stream->position = stream->windowEnd;
+            return;
+        }
+
+        while (stream->position < stream->windowEnd)
+        {
+            const uint32_t lookahead = stream->windowEnd - stream->position;
+            if (finishing == false && lookahead < DEFLATE_MIN_LOOKAHEAD)
+            {
+                break;
+            }
+            if (stream->symbolCount == DEFLATE_BLOCK_SYMBOLS)
+            {
+                FlushBlock(stream, false);
+            }
+
+            uint32_t length = 0;
+            uint32_t distance = 0;
+            if (lookahead >= DEFLATE_MIN_MATCH)
+            {
+                length = LongestMatch(stream, InsertString(stream, stream->position), &distance);
+            }
+
+            const uint32_t index = stream->symbolCount++;
+            if (length == 0)
+            {
+                const uint32_t literal = stream->window[stream->position];
+                stream->symbols[index] = (uint16_t)literal;
+                stream->distances[index] = 0;
+                stream->blockBits += mFixedLength[literal];
+                stream->position++;
+                continue;
+            }
+
+            const uint32_t lengthCode = mLengthCode[length - DEFLATE_MIN_MATCH];
+            const uint32_t distanceCode = DistanceCodeOf(distance);
+            stream->symbols[index] = (uint16_t)(length - DEFLATE_MIN_MATCH);
+            stream->distances[index] = (uint16_t)distance;
+            stream->blockBits += mFixedLength[257 + lengthCode] + mLengthExtra[lengthCode] + 5 + mDistanceExtra[distanceCode];
+            for (uint32_t i = 1; i < length; i++)
+            {
+                if (stream->position + i + DEFLATE_MIN_MATCH <= stream->windowEnd)
+                {
+                    InsertString(stream, stream->position + i);
+                }
+            }
+            stream->position += length;
+        }
+    }
+
+    // Drops the older half of the window; positions before it stop matching
+    void SlideWindow(DeflateStream* stream)
+    {
+        memmove(stream->window, stream->window + DEFLATE_WINDOW_SIZE, stream->windowEnd - DEFLATE_WINDOW_SIZE);
+        stream->windowEnd -= DEFLATE_WINDOW_SIZE;
+        stream->position -= DEFLATE_WINDOW_SIZE;
+        stream->blockStart -= DEFLATE_WINDOW_SIZE;
+        for (uint32_t i = 0; i < DEFLATE_HASH_SIZE; i++)
+        {
+            stream->head[i] = stream->head[i] >= DEFLATE_WINDOW_SIZE ? (uint16_t)(stream->head[i] - DEFLATE_WINDOW_SIZE) : 0;
+        }
+        for (uint32_t i = 0; i < DEFLATE_WINDOW_SIZE; i++)
+        {
+            stream->prev[i] = stream->prev[i] >= DEFLATE_WINDOW_SIZE ? (uint16_t)(stream->prev[i] - DEFLATE_WINDOW_SIZE) : 0;
+        }
+    }
+
+    //-------------------------------------------------------------------------
+    // Decompressor
+    //-------------------------------------------------------------------------
+
+    bool NextByte(InflateStream* stream, uint8_t* value)
+    {
+        if (stream->inputPosition == stream->inputLength)
+        {
+            uint32_t bytesRead = 0;
+            if (stream->inputEnded ||
+                stream->input(stream->inputBuffer, INFLATE_INPUT_SIZE, &bytesRead, stream->inputUserData) == false ||
+                bytesRead == 0)
+            {
+                stream->inputEnded = true;
+                return false;
+            }
+            stream->inputPosition = 0;
+            stream->inputLength = bytesRead;
+            stream->totalIn += bytesRead;
+        }
+        *value = stream->inputBuffer[stream->inputPosition++];
+        return true;
+    }
+
+    bool NeedBits(InflateStream* stream, int32_t count)
+    {
+        while (stream->bitCount < count)
+        {
+            uint8_t value;
+            if (NextByte(stream, &value) == false)
+            {
+                return false;
+            }
+            stream->bitBuffer |= (uint32_t)value << stream->bitCount;
+            stream->bitCount += 8;
+        }
+        return true;
+    }
+
+    void DropBits(InflateStream* stream, int32_t count)
+    {
+        stream->bitBuffer >>= count;
+        stream->bitCount -= count;
+    }
+
+    bool GetBits(InflateStream* stream, int32_t count, uint32_t* value)
+    {
+        if (NeedBits(stream, count) == false)
+        {
+            return false;
+        }
+        *value = stream->bitBuffer & ((1U << count) - 1);
+        DropBits(stream, count);
+        return true;
+    }
+
+    void FlushWindow(InflateStream* stream)
+    {
+        if (stream->windowPosition > 0 && stream->failed == false)
+        {
+            stream->adler = UpdateAdler32(stream->adler, stream->window, stream->windowPosition);
+            if (stream->output(stream->window, stream->windowPosition, stream->outputUserData) == false)
+            {
+                stream->failed = true;
+            }
+            stream->totalOut += stream->windowPosition;
+        }
+        stream->windowPosition = 0;
+    }
+
+    void PutOutput(InflateStream* stream, uint8_t value)
+    {
+        stream->window[stream->windowPosition++] = value;
+        if (stream->windowPosition == DEFLATE_WINDOW_SIZE)
+        {
+            FlushWindow(stream);
+        }
+    }
+
+    // Canonical Huffman codes from code lengths (RFC 1951 3.2.2); codes no
+    // longer than the fast table width decode with a single lookup
+    bool BuildTable(HuffmanTable* table, const uint8_t* lengths, uint32_t count)
+    {
+        memset(table->counts, 0, sizeof(table->counts));
+        for (uint32_t i = 0; i < count; i++)
+        {
+            table->counts[lengths[i]]++;
+        }
+        table->counts[0] = 0;
+
+        int32_t left = 1;
+        for (int32_t length = 1; length <= INFLATE_MAX_BITS; length++)
+        {
+            left = (left << 1) - table->counts[length];
+            if (left < 0)
+            {
+                return false;
+            }
+        }
+
+        uint16_t offsets[INFLATE_MAX_BITS + 1];
+        uint16_t nextCode[INFLATE_MAX_BITS + 1];
+        offsets[1] = 0;
+        nextCode[1] = 0;
+        for (int32_t length = 1; length < INFLATE_MAX_BITS; length++)
+        {
+            offsets[length + 1] = offsets[length] + table->counts[length];
+            nextCode[length + 1] = (uint16_t)((nextCode[length] + table->counts[length]) << 1);
+        }
+
+        memset(table->fast, 0, sizeof(table->fast));
+        for (uint32_t symbol = 0; symbol < count; symbol++)
+        {
+            const int32_t length = lengths[symbol];
+            if (length == 0)
+            {
+                continue;
+            }
+            table->symbols[offsets[length]++] = (uint16_t)symbol;
+            const uint32_t code = nextCode[length]++;
+            if (length <= INFLATE_FAST_BITS)
+            {
+                for (uint32_t fill = ReverseBits(code, length); fill < INFLATE_FAST_SIZE; fill += 1U << length)
+                {
+                    table->fast[fill] = (uint16_t)((length << 9) | symbol);
+                }
+            }
+        }
+        return true;
+    }
+
+    bool DecodeSymbol(InflateStream* stream, const HuffmanTable* table, uint32_t* symbol)
+    {
+        // Near the end of the input there may be fewer bits than the longest code
+        NeedBits(stream, INFLATE_MAX_BITS);
+
+        const uint32_t entry = table->fast[stream->bitBuffer & (INFLATE_FAST_SIZE - 1)];
+        if (entry != 0)
+        {
+            const int32_t length = entry >> 9;
+            if (length > stream->bitCount)
+            {
+                return false;
+            }
+            DropBits(stream, length);
+            *symbol = entry & 0x1FF;
+            return true;
+        }
+
+        int32_t code = 0;
+        int32_t first = 0;
+        int32_t index = 0;
+        for (int32_t length = 1; length <= INFLATE_MAX_BITS && length <= stream->bitCount; length++)
+        {
+            code |= (stream->bitBuffer >> (length - 1)) & 1;
+            const int32_t count = table->counts[length];
+            if (code - count < first)
+            {
+                DropBits(stream, length);
+                *symbol = table->symbols[index + (code - first)];
+                return true;
+            }
+            index += count;
+            first = (first + count) << 1;
+            code <<= 1;
+        }
+        return false;
+    }
+
+    bool InflateStored(InflateStream* stream)
+    {
+        DropBits(stream, stream->bitCount & 7);
+        uint32_t length;
+        uint32_t complement;
+        if (GetBits(stream, 16, &length) == false || GetBits(stream, 16, &complement) == false ||
+            length != (~complement & 0xFFFF))
+        {
+            return false;
+        }
+
+        // Whole bytes still in the bit buffer come first, then the input buffer directly
+        while (length > 0 && stream->bitCount > 0)
+        {
+            PutOutput(stream, (uint8_t)stream->bitBuffer);
+            DropBits(stream, 8);
+            length--;
+        }
+        while (length > 0 && stream->failed == false)
+        {
+            if (stream->inputPosition == stream->inputLength)
+            {
+                uint8_t value;
+                if (NextByte(stream, &value) == false)
+                {
+                    return false;
+                }
+                stream->inputPosition--;
+            }
+            uint32_t count = Min(length, stream->inputLength - stream->inputPosition);
+            count = Min(count, DEFLATE_WINDOW_SIZE - stream->windowPosition);
+            memcpy(stream->window + stream->windowPosition, stream->inputBuffer + stream->inputPosition, count);
+            stream->inputPosition += count;
+            stream->windowPosition += count;
+            length -= count;
+            if (stream->windowPosition == DEFLATE_WINDOW_SIZE)
+            {
+                FlushWindow(stream);
+            }
+        }
+        return stream->failed == false;
+    }
+
+    bool InflateCodes(InflateStream* stream)
+    {
+        while (stream->failed == false)
+        {
+            uint32_t symbol;
+            if (DecodeSymbol(stream, &stream->lengthTable, &symbol) == false)
+            {
+                return false;
+            }
+            if (symbol < 256)
+            {
+                PutOutput(stream, (uint8_t)symbol);
+                continue;
+            }
+            if (symbol == 256)
+            {
+                return true;
+            }
+
+            symbol -= 257;
+            uint32_t extra;
+            if (symbol >= 29 || GetBits(stream, mLengthExtra[symbol], &extra) == false)
+            {
+                return false;
+            }
+            uint32_t length = mLengthBase[symbol] + extra;
+
+            if (DecodeSymbol(stream, &stream->distanceTable, &symbol) == false || symbol >= 30 ||
+                GetBits(stream, mDistanceExtra[symbol], &extra) == false)
+            {
+                return false;
+            }
+            const uint32_t distance = mDistanceBase[symbol] + extra;
+            if (distance > stream->totalOut + stream->windowPosition)
+            {
+                return false;
+            }
+
+            // The window is circular, and a flush keeps its contents, so the
+            // source never needs to be anywhere but in it
+            while (length-- > 0)
+            {
+                PutOutput(stream, stream->window[(stream->windowPosition - distance) & DEFLATE_WINDOW_MASK]);
+            }
+        }
+        return false;
+    }
+
+    bool InflateFixed(InflateStream* stream)
+    {
+        uint8_t lengths[288];
+        for (uint32_t i = 0; i < 288; i++)
+        {
+            lengths[i] = FixedLengthOf(i);
+        }
+        BuildTable(&stream->lengthTable, lengths, 288);
+        memset(lengths, 5, 30);
+        BuildTable(&stream->distanceTable, lengths, 30);
+        return InflateCodes(stream);
+    }
+
+    bool InflateDynamic(InflateStream* stream)
+    {
+        uint32_t literalCount;
+        uint32_t distanceCount;
+        uint32_t codeLengthCount;
+        if (GetBits(stream, 5, &literalCount) == false || GetBits(stream, 5, &distanceCount) == false ||
+            GetBits(stream, 4, &codeLengthCount) == false)
+        {
+            return false;
+        }
+        literalCount += 257;
+        distanceCount += 1;
+        codeLengthCount += 4;
+        if (literalCount > 286 || distanceCount > 30)
+        {
+            return false;
+        }
+
+        uint8_t lengths[286 + 30];
+        memset(lengths, 0, sizeof(lengths));
+        for (uint32_t i = 0; i < codeLengthCount; i++)
+        {
+            uint32_t value;
+            if (GetBits(stream, 3, &value) == false)
+            {
+                return false;
+            }
+            lengths[mCodeLengthOrder[i]] = (uint8_t)value;
+        }
+        if (BuildTable(&stream->lengthTable, lengths, 19) == false)
+        {
+            return false;
+        }
+
+        const uint32_t total = literalCount + distanceCount;
+        uint32_t index = 0;
+        while (index < total)
+        {
+            uint32_t symbol;
+            if (DecodeSymbol(stream, &stream->lengthTable, &symbol) == false)
+            {
+                return false;
+            }
+            if (symbol < 16)
+            {
+                lengths[index++] = (uint8_t)symbol;
+                continue;
+            }
+
+            uint8_t value = 0;
+            uint32_t repeat;
+            if (symbol == 16)
+            {
+                if (index == 0 || GetBits(stream, 2, &repeat) == false)
+                {
+                    return false;
+                }
+                value = lengths[index - 1];
+                repeat += 3;
+            }
+            else if (symbol == 17)
+            {
+                if (GetBits(stream, 3, &repeat) == false)
+                {
+                    return false;
+                }
+                repeat += 3;
+            }
+            else
+            {
+                if (GetBits(stream, 7, &repeat) == false)
+                {
+                    return false;
+                }
+                repeat += 11;
+            }
+            if (index + repeat > total)
+            {
+                return false;
+            }
+            while (repeat-- > 0)
+            {
+                lengths[index++] = value;
+            }
+        }
+
+        if (lengths[256] == 0 || BuildTable(&stream->lengthTable, lengths, literalCount) == false ||
+            BuildTable(&stream->distanceTable, lengths + literalCount, distanceCount) == false)
+        {
+            return false;
+        }
+        return InflateCodes(stream);
+    }
+}
+
+void Deflate::Init()
+{
+    uint32_t code = 0;
+    for (; code < 28; code++)
+    {
+        for (uint32_t n = 0; n < (1U << mLengthExtra[code]); n++)
+        {
+            mLengthCode[mLengthBase[code] - DEFLATE_MIN_MATCH + n] = (uint8_t)code;
+        }
+    }
+    mLengthCode[DEFLATE_MAX_MATCH - DEFLATE_MIN_MATCH] = 28;
+
+    for (code = 0; code < 16; code++)
+    {
+        for (uint32_t n = 0; n < (1U << mDistanceExtra[code]); n++)
+        {
+            mDistanceCode[mDistanceBase[code] - 1 + n] = (uint8_t)code;
+        }
+    }
+    for (; code < 30; code++)
+    {
+        for (uint32_t n = 0; n < (1U << (mDistanceExtra[code] - 7)); n++)
+        {
+            mDistanceCode[256 + ((mDistanceBase[code] - 1) >> 7) + n] = (uint8_t)code;
+        }
+    }
+
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t crc = i;
+        for (int32_t k = 0; k < 8; k++)
+        {
+            crc = (crc & 1) ? (0xEDB88320U ^ (crc >> 1)) : (crc >> 1);
+        }
+        mCrcTable[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        for (int32_t t = 1; t < 4; t++)
+        {
+            mCrcTable[t][i] = (mCrcTable[t - 1][i] >> 8) ^ mCrcTable[0][mCrcTable[t - 1][i] & 0xFF];
+        }
+    }
+
+    // RFC 1951 3.2.6: 00110000.., 110010000.., 0000000.., 11000000..
+    for (uint32_t symbol = 0; symbol < 288; symbol++)
+    {
+        const uint32_t start = symbol < 144 ? 0x30 : symbol < 256 ? 0x190 - 144 : symbol < 280 ? 0 - 256 : 0xC0 - 280;
+        mFixedLength[symbol] = FixedLengthOf(symbol);
+        mFixedCode[symbol] = (uint16_t)ReverseBits(start + symbol, mFixedLength[symbol]);
+    }
+    for (uint32_t symbol = 0; symbol < 30; symbol++)
+    {
+        mFixedDistanceCode[symbol] = (uint8_t)ReverseBits(symbol, 5);
+    }
+}
+
+DeflateStream* Deflate::CreateCompressor(int32_t level, DeflateOutputFn output, void* userData)
+{
+    static const uint16_t maxChains[DEFLATE_LEVEL_MAX + 1] = {0, 4, 8, 16, 32, 64, 128, 256, 1024, 4096};
+    static const uint16_t niceLengths[DEFLATE_LEVEL_MAX + 1] = {0, 8, 16, 32, 32, 64, 128, 128, 258, 258};
+
+    DeflateStream* stream = (DeflateStream*)malloc(sizeof(DeflateStream));
+    if (stream == NULL)
+    {
+        DEFLATE_ERROR("Error: Could not allocate deflate stream.\n");
+        return NULL;
+    }
+    memset(stream->head, 0, sizeof(stream->head));
+    memset(stream->prev, 0, sizeof(stream->prev));
+    if (level < DEFLATE_LEVEL_STORE || level > DEFLATE_LEVEL_MAX)
+    {
+        level = DEFLATE_LEVEL_DEFAULT;
+    }
+    stream->output = output;
+    stream->userData = userData;
+    stream->store = level == DEFLATE_LEVEL_STORE;
+    stream->maxChain = maxChains[level];
+    stream->niceLength = niceLengths[level];
+    stream->windowEnd = 0;
+    stream->position = 0;
+    stream->blockStart = 0;
+    stream->symbolCount = 0;
+    stream->blockBits = 0;
+    stream->outLength = 0;
+    stream->bitBuffer = 0;
+    stream->bitCount = 0;
+    stream->adler = 1;
+    stream->totalIn = 0;
+    stream->totalOut = 0;
+    stream->failed = false;
+
+    // zlib header: deflate with a 32 KB window, FLEVEL from the level, FCHECK
+    const uint32_t flevel = level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3;
+    uint32_t header = (0x78 << 8) | (flevel << 6);
+    header += 31 - (header % 31);
+    PutByte(stream, (uint8_t)(header >> 8));
+    PutByte(stream, (uint8_t)header);
+    return stream;
+}
+
+bool Deflate::Compress(DeflateStream* stream, const void* data, uint32_t size)
+{
+    const uint8_t* input = (const uint8_t*)data;
+    stream->adler = UpdateAdler32(stream->adler, input, size);
+    stream->totalIn += size;
+
+    while (size > 0 && stream->failed == false)
+    {
+        if (stream->windowEnd == DEFLATE_BUFFER_SIZE)
+        {
+            // The block may still need the bytes about to slide out if it ends stored
+            FlushBlock(stream, false);
+            if (stream->store)
+            {
+                stream->windowEnd = 0;
+                stream->position = 0;
+                stream->blockStart = 0;
+            }
+            else
+            {
+                SlideWindow(stream);
+            }
+        }
+        const uint32_t count = Min(size, DEFLATE_BUFFER_SIZE - stream->windowEnd);
+        memcpy(stream->window + stream->windowEnd, input, count);
+        stream->windowEnd += count;
+        input += count;
+        size -= count;
+        ProcessWindow(stream, false);
+    }
+    return stream->failed == false;
+}
+
+bool Deflate::Finish(DeflateStream* stream)
+{
+    ProcessWindow(stream, true);
+    FlushBlock(stream, true);
+    AlignBits(stream);
+    PutByte(stream, (uint8_t)(stream->adler >> 24));
+    PutByte(stream, (uint8_t)(stream->adler >> 16));
+    PutByte(stream, (uint8_t)(stream->adler >> 8));
+    PutByte(stream, (uint8_t)stream->adler);
+    FlushOutput(stream);
+    return stream->failed == false;
+}
+
+uint32_t Deflate::GetCompressorTotalIn(const DeflateStream* stream)
+{
+    return stream->totalIn;
+}
+
+uint32_t Deflate::GetCompressorTotalOut(const DeflateStream* stream)
+{
+    return stream->totalOut + stream->outLength;
+}
+
+void Deflate::DestroyCompressor(DeflateStream* stream)
+{
+    free(stream);
+}
+
+InflateStream* Deflate::CreateDecompressor(InflateInputFn input, void* inputUserData, DeflateOutputFn output, void* outputUserData)
+{
+    InflateStream* stream = (InflateStream*)malloc(sizeof(InflateStream));
+    if (stream == NULL)
+    {
+        DEFLATE_ERROR("Error: Could not allocate inflate stream.\n");
+        return NULL;
+    }
+    stream->input = input;
+    stream->inputUserData = inputUserData;
+    stream->output = output;
+    stream->outputUserData = outputUserData;
+    stream->inputPosition = 0;
+    stream->inputLength = 0;
+    stream->inputEnded = false;
+    stream->bitBuffer = 0;
+    stream->bitCount = 0;
+    stream->windowPosition = 0;
+    stream->adler = 1;
+    stream->totalIn = 0;
+    stream->totalOut = 0;
+    stream->raw = false;
+    stream->failed = false;
+    return stream;
+}
+
+InflateStream* Deflate::CreateRawDecompressor(InflateInputFn input, void* inputUserData, DeflateOutputFn output, void* outputUserData)
+{
+    InflateStream* stream = CreateDecompressor(input, inputUserData, output, outputUserData);
+    if (stream != NULL)
+    {
+        stream->raw = true;
+    }
+    return stream;
+}
+
+bool Deflate::Decompress(InflateStream* stream)
+{
+    if (stream->raw == false)
+    {
+        uint32_t cmf;
+        uint32_t flg;
+        if (GetBits(stream, 8, &cmf) == false || GetBits(stream, 8, &flg) == false || (cmf & 0x0F) != 8 ||
+            (cmf >> 4) > 7 || ((cmf << 8) | flg) % 31 != 0 || (flg & 0x20) != 0)
+        {
+            DEFLATE_ERROR("Error: Not a zlib stream.\n");
+            return false;
+        }
+    }
+
+    uint32_t final = 0;
+    while (final == 0)
+    {
+        uint32_t type;
+        if (GetBits(stream, 1, &final) == false || GetBits(stream, 2, &type) == false)
+        {
+            return false;
+        }
+        bool result = false;
+        if (type == 0)
+        {
+            result = InflateStored(stream);
+        }
+        else if (type == 1)
+        {
+            result = InflateFixed(stream);
+        }
+        else if (type == 2)
+        {
+            result = InflateDynamic(stream);
+        }
+        if (result == false)
+        {
+            DEFLATE_ERROR("Error: Invalid or truncated deflate stream.\n");
+            return false;
+        }
+    }
+
+    FlushWindow(stream);
+    DropBits(stream, stream->bitCount & 7);
+    if (stream->raw)
+    {
+        return stream->failed == false;
+    }
+
+    uint32_t adler = 0;
+    for (int32_t i = 0; i < 4; i++)
+    {
+        uint32_t value;
+        if (GetBits(stream, 8, &value) == false)
+        {
+            return false;
+        }
+        adler = (adler << 8) | value;
+    }
+    if (adler != stream->adler)
+    {
+        DEFLATE_ERROR("Error: zlib stream checksum mismatch.\n");
+        return false;
+    }
+    return stream->failed == false;
+}
+
+uint32_t Deflate::GetDecompressorTotalIn(const InflateStream* stream)
+{
+    return stream->totalIn - (stream->inputLength - stream->inputPosition);
+}
+
+uint32_t Deflate::GetDecompressorTotalOut(const InflateStream* stream)
+{
+    return stream->totalOut + stream->windowPosition;
+}
+
+// After a raw stream has ended: the whole bytes still held as bits, then
+// the rest of the input buffer
+uint32_t Deflate::TakeUnusedInput(InflateStream* stream, uint8_t* buffer, uint32_t size)
+{
+    uint32_t count = 0;
+    DropBits(stream, stream->bitCount & 7);
+    while (stream->bitCount > 0 && count < size)
+    {
+        buffer[count++] = (uint8_t)stream->bitBuffer;
+        DropBits(stream, 8);
+    }
+    const uint32_t remaining = Min(stream->inputLength - stream->inputPosition, size - count);
+    memcpy(buffer + count, stream->inputBuffer + stream->inputPosition, remaining);
+    stream->inputPosition += remaining;
+    return count + remaining;
+}
+
+void Deflate::DestroyDecompressor(InflateStream* stream)
+{
+    free(stream);
+}
+
+uint32_t Deflate::UpdateCrc32(uint32_t crc, const void* data, uint32_t size)
+{
+    const uint8_t* bytes = (const uint8_t*)data;
+    crc = ~crc;
+    while (size > 0 && ((uintptr_t)bytes & 3) != 0)
+    {
+        crc = mCrcTable[0][(crc ^ *bytes++) & 0xFF] ^ (crc >> 8);
+        size--;
+    }
+    while (size >= 4)
+    {
+        crc ^= *(const uint32_t*)bytes;
+        crc = mCrcTable[3][crc & 0xFF] ^ mCrcTable[2][(crc >> 8) & 0xFF] ^ mCrcTable[1][(crc >> 16) & 0xFF] ^
+              mCrcTable[0][crc >> 24];
+        bytes += 4;
+        size -= 4;
+    }
+    while (size > 0)
+    {
+        crc = mCrcTable[0][(crc ^ *bytes++) & 0xFF] ^ (crc >> 8);
+        size--;
+    }
+    return ~crc;
+}
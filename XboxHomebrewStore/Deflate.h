@@ -0,0 +1,48 @@
+//=============================================================================
+// Deflate.h - Streaming zlib (RFC 1950/1951) compression and decompression
+//
+// Platform independent (no XTL dependencies) so it can be built on a PC for
+// round trip and speed checks against zlib.
+//=============================================================================
+
+#pragma once
+
+#include <stdint.h>
+
+#define DEFLATE_LEVEL_STORE 0
+#define DEFLATE_LEVEL_DEFAULT 6
+#define DEFLATE_LEVEL_MAX 9
+
+// Receives compressed (or decompressed) output; false stops the stream
+typedef bool (*DeflateOutputFn)(const uint8_t* data, uint32_t size, void* userData);
+
+// Supplies compressed input; *bytesRead of zero means the input has ended
+typedef bool (*InflateInputFn)(uint8_t* buffer, uint32_t size, uint32_t* bytesRead, void* userData);
+
+typedef struct DeflateStream DeflateStream;
+typedef struct InflateStream InflateStream;
+
+// Input a raw stream read past its end, at most this much
+#define INFLATE_UNUSED_MAX (16384 + 4)
+
+class Deflate
+{
+public:
+    static void Init();
+    static DeflateStream* CreateCompressor(int32_t level, DeflateOutputFn output, void* userData);
+    static bool Compress(DeflateStream* stream, const void* data, uint32_t size);
+    static bool Finish(DeflateStream* stream);
+    static uint32_t GetCompressorTotalIn(const DeflateStream* stream);
+    static uint32_t GetCompressorTotalOut(const DeflateStream* stream);
+    static void DestroyCompressor(DeflateStream* stream);
+
+    static InflateStream* CreateDecompressor(InflateInputFn input, void* inputUserData, DeflateOutputFn output, void* outputUserData);
+    static InflateStream* CreateRawDecompressor(InflateInputFn input, void* inputUserData, DeflateOutputFn output, void* outputUserData);
+    static bool Decompress(InflateStream* stream);
+    static uint32_t GetDecompressorTotalIn(const InflateStream* stream);
+    static uint32_t GetDecompressorTotalOut(const InflateStream* stream);
+    static uint32_t TakeUnusedInput(InflateStream* stream, uint8_t* buffer, uint32_t size);
+    static void DestroyDecompressor(InflateStream* stream);
+
+    static uint32_t UpdateCrc32(uint32_t crc, const void* data, uint32_t size);
+};
@@ -1,5 +1,7 @@
 #include "Drawing.h"
 #include "Context.h"
+#include "Profiler.h"
+#include "Deflate.h"
 
 #define SSFN_IMPLEMENTATION
 #define SFFN_MAXLINES 8192
@@ -10,12 +12,69 @@
 #include "ssfn.h"
 
 #define DRAW_BATCH_MAX_VERTS 16380
-#define SAVE_STATE_COUNT 21
+#define DRAW_BATCH_LOOKBACK 16
+#define SHADOW_TEXTURE_STAGES 4
+#define BAKED_FONT_MAGIC 0x544e4642
+#define BAKED_FONT_VERSION 2
 
 namespace 
 {
-    uint32_t mSavedStateIndex;
-    uint32_t mSavedState[4 * SAVE_STATE_COUNT];
+    // Header of a baked font blob, followed by glyphCount Glyph records,
+    // skylineCount SkylineNode records and pixelSize bytes of swizzled
+    // level 0 texture data.
+    typedef struct
+    {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t sourceStamp;
+        uint32_t warmSetStamp;
+        char fontName[32];
+        int32_t fontStyle;
+        int32_t fontSize;
+        int32_t lineHeight;
+        int32_t spacing;
+        int32_t textureDimension;
+        uint32_t glyphCount;
+        uint32_t skylineCount;
+        uint32_t pixelSize;
+    } BakedFontHeader;
+
+    // Only printable ASCII is baked up front and pinned; everything else is
+    // rasterised into the remaining space the first time it is drawn.
+    const char* mWarmGlyphs = " !\"#$%&'()*+,-./0123456789:;<=>?@ABCDEFGHIJKLMNOPQRSTUVWXYZ[\\]^_`abcdefghijklmnopqrstuvwxyz{|}~";
+
+    typedef struct
+    {
+        D3DTexture* texture;
+        std::vector<TEXVERTEX> vertices;
+        float minX, minY, maxX, maxY;
+    } DrawBatch;
+
+    uint32_t mDrawCallCount;
+    uint32_t mVertexCount;
+
+    // Shadow of the device state last issued through Drawing. Entries start
+    // unknown, so the first set of each one always reaches the device.
+    DWORD mRenderStates[D3DRS_MAX];
+    bool mRenderStateKnown[D3DRS_MAX];
+    DWORD mStageStates[SHADOW_TEXTURE_STAGES][D3DTSS_MAX];
+    bool mStageStateKnown[SHADOW_TEXTURE_STAGES][D3DTSS_MAX];
+    D3DTexture* mTextures[SHADOW_TEXTURE_STAGES];
+    bool mTextureKnown[SHADOW_TEXTURE_STAGES];
+    DWORD mVertexShader;
+    bool mVertexShaderKnown;
+    uint32_t mStateChangesIssued;
+    uint32_t mStateChangesSuppressed;
+    uint32_t mFrameIndex;
+
+    // Batches live for one frame; the pool and each vertex vector keep their
+    // capacity so steady state frames do not allocate.
+    std::vector<DrawBatch*> mBatches;
+    uint32_t mBatchCount;
+    std::vector<TEXVERTEX> mScratch;
+
+    bool mClipEnabled;
+    float mClipX0, mClipY0, mClipX1, mClipY1;
 
     float MeasureWordWidth(BitmapFont* font, const char* p, const char** outEnd)
     {
@@ -28,13 +87,13 @@ namespace
             if (unicode == ' ' || unicode == '\n' || unicode == '\t') {
                 break;
             }
-            std::map<uint32_t, Rect>::const_iterator it = font->charmap.find(unicode);
-            if (it != font->charmap.end())
+            const Glyph* glyph = Drawing::GetGlyph(font, unicode);
+            if (glyph != nullptr)
             {
                 if (!first) {
                     width += (float)font->spacing;
                 }
-                width += (float)it->second.width;
+                width += (float)glyph->rect.width;
                 first = false;
             }
             p = cursor;
@@ -42,109 +101,838 @@ namespace
         *outEnd = p;
         return width;
     }
+
+    uint32_t SpreadBits(uint32_t value)
+    {
+        value &= 0x0000ffff;
+        value = (value | (value << 8)) & 0x00ff00ff;
+        value = (value | (value << 4)) & 0x0f0f0f0f;
+        value = (value | (value << 2)) & 0x33333333;
+        value = (value | (value << 1)) & 0x55555555;
+        return value;
+    }
+
+    // Per column and per row texel offsets for the swizzled layout. x bits
+    // take the even positions and y bits the odd ones within the square
+    // part; a non-square texture repeats that square along its long side.
+    void BuildSwizzleTables(uint32_t width, uint32_t height, std::vector<uint32_t>& xOffsets, std::vector<uint32_t>& yOffsets)
+    {
+        xOffsets.resize(width);
+        for (uint32_t x = 0; x < width; x++)
+        {
+            if (x < height * 2) {
+                xOffsets[x] = SpreadBits(x);
+            } else {
+                xOffsets[x] = SpreadBits(x % (2 * height)) + (x / (2 * height)) * 2 * height * height;
+            }
+        }
+
+        yOffsets.resize(height);
+        for (uint32_t y = 0; y < height; y++)
+        {
+            if (y < width) {
+                yOffsets[y] = SpreadBits(y) << 1;
+            } else {
+                yOffsets[y] = (SpreadBits(y % width) << 1) + (y / width) * width * width;
+            }
+        }
+    }
+
+    void SetVertex(TEXVERTEX* v, float x, float y, float u, float tv, uint32_t color)
+    {
+        v->x = x; v->y = y; v->z = 0.5f; v->rhw = 1.0f; v->diffuse = color; v->u = u; v->v = tv;
+    }
+
+    // Appends an axis aligned quad to the scratch buffer, clipped against the
+    // active clip rect with texture coordinates adjusted to match.
+    void AppendQuad(float x0, float y0, float x1, float y1, float u0, float v0, float u1, float v1, uint32_t color)
+    {
+        if (mClipEnabled)
+        {
+            if (x1 <= mClipX0 || x0 >= mClipX1 || y1 <= mClipY0 || y0 >= mClipY1) {
+                return;
+            }
+            if (x0 < mClipX0) {
+                u0 += (u1 - u0) * (mClipX0 - x0) / (x1 - x0);
+                x0 = mClipX0;
+            }
+            if (x1 > mClipX1) {
+                u1 -= (u1 - u0) * (x1 - mClipX1) / (x1 - x0);
+                x1 = mClipX1;
+            }
+            if (y0 < mClipY0) {
+                v0 += (v1 - v0) * (mClipY0 - y0) / (y1 - y0);
+                y0 = mClipY0;
+            }
+            if (y1 > mClipY1) {
+                v1 -= (v1 - v0) * (y1 - mClipY1) / (y1 - y0);
+                y1 = mClipY1;
+            }
+        }
+
+        size_t offset = mScratch.size();
+        mScratch.resize(offset + 6);
+        TEXVERTEX* v = &mScratch[offset];
+        SetVertex(&v[0], x1, y0, u1, v0, color);
+        SetVertex(&v[1], x1, y1, u1, v1, color);
+        SetVertex(&v[2], x0, y1, u0, v1, color);
+        SetVertex(&v[3], x1, y0, u1, v0, color);
+        SetVertex(&v[4], x0, y1, u0, v1, color);
+        SetVertex(&v[5], x0, y0, u0, v0, color);
+    }
+
+    uint32_t HashCodePoint(uint32_t unicode)
+    {
+        return unicode * 2654435761u;
+    }
+
+    void InsertExtendedGlyph(std::vector<Glyph>& table, const Glyph& glyph)
+    {
+        uint32_t mask = (uint32_t)table.size() - 1;
+        uint32_t index = HashCodePoint(glyph.unicode) & mask;
+        while (table[index].present && table[index].unicode != glyph.unicode) {
+            index = (index + 1) & mask;
+        }
+        table[index] = glyph;
+    }
+
+    // Returns the table slot for a code point, including glyphs recorded as
+    // missing from the font.
+    Glyph* LookupGlyph(BitmapFont* font, uint32_t unicode)
+    {
+        if (unicode < GLYPH_DIRECT_COUNT)
+        {
+            Glyph* glyph = &font->glyphs[unicode];
+            return glyph->present ? glyph : nullptr;
+        }
+
+        if (font->extendedGlyphs.empty()) {
+            return nullptr;
+        }
+
+        uint32_t mask = (uint32_t)font->extendedGlyphs.size() - 1;
+        uint32_t index = HashCodePoint(unicode) & mask;
+        while (true)
+        {
+            Glyph* glyph = &font->extendedGlyphs[index];
+            if (!glyph->present) {
+                return nullptr;
+            }
+            if (glyph->unicode == unicode) {
+                return glyph;
+            }
+            index = (index + 1) & mask;
+        }
+    }
+
+    void StoreGlyph(BitmapFont* font, const Glyph& glyph)
+    {
+        if (glyph.unicode < GLYPH_DIRECT_COUNT)
+        {
+            font->glyphs[glyph.unicode] = glyph;
+            return;
+        }
+
+        if (LookupGlyph(font, glyph.unicode) == nullptr)
+        {
+            // Keep the load factor at or below one half so probes stay short.
+            if ((font->extendedCount + 1) * 2 > font->extendedGlyphs.size())
+            {
+                size_t capacity = font->extendedGlyphs.empty() ? 16 : font->extendedGlyphs.size() * 2;
+                std::vector<Glyph> table(capacity);
+                memset(&table[0], 0, capacity * sizeof(Glyph));
+                for (size_t i = 0; i < font->extendedGlyphs.size(); i++)
+                {
+                    if (font->extendedGlyphs[i].present) {
+                        InsertExtendedGlyph(table, font->extendedGlyphs[i]);
+                    }
+                }
+                font->extendedGlyphs.swap(table);
+            }
+            font->extendedCount++;
+        }
+        InsertExtendedGlyph(font->extendedGlyphs, glyph);
+    }
+
+    void EncodeUtf8(uint32_t unicode, char* out)
+    {
+        if (unicode < 0x80) {
+            *out++ = (char)unicode;
+        } else if (unicode < 0x800) {
+            *out++ = (char)(0xc0 | (unicode >> 6));
+            *out++ = (char)(0x80 | (unicode & 0x3f));
+        } else if (unicode < 0x10000) {
+            *out++ = (char)(0xe0 | (unicode >> 12));
+            *out++ = (char)(0x80 | ((unicode >> 6) & 0x3f));
+            *out++ = (char)(0x80 | (unicode & 0x3f));
+        } else {
+            *out++ = (char)(0xf0 | (unicode >> 18));
+            *out++ = (char)(0x80 | ((unicode >> 12) & 0x3f));
+            *out++ = (char)(0x80 | ((unicode >> 6) & 0x3f));
+            *out++ = (char)(0x80 | (unicode & 0x3f));
+        }
+        *out = 0;
+    }
+
+    // Bottom-left skyline packer. Nodes are ordered by x and always span the
+    // full atlas width.
+    bool SkylineAllocate(std::vector<SkylineNode>& skyline, int32_t atlasWidth, int32_t atlasHeight, int32_t width, int32_t height, int32_t* outX, int32_t* outY)
+    {
+        int32_t bestIndex = -1;
+        int32_t bestY = atlasHeight;
+        int32_t bestWidth = atlasWidth + 1;
+        for (size_t i = 0; i < skyline.size(); i++)
+        {
+            int32_t x = skyline[i].x;
+            if (x + width > atlasWidth) {
+                break;
+            }
+
+            int32_t y = 0;
+            int32_t remaining = width;
+            for (size_t j = i; remaining > 0; j++)
+            {
+                if (skyline[j].y > y) {
+                    y = skyline[j].y;
+                }
+                remaining -= skyline[j].width;
+            }
+
+            if (y + height > atlasHeight) {
+                continue;
+            }
+            if (y < bestY || (y == bestY && skyline[i].width < bestWidth))
+            {
+                bestIndex = (int32_t)i;
+                bestY = y;
+                bestWidth = skyline[i].width;
+            }
+        }
+
+        if (bestIndex < 0) {
+            return false;
+        }
+
+        SkylineNode node;
+        node.x = skyline[bestIndex].x;
+        node.y = bestY + height;
+        node.width = width;
+        skyline.insert(skyline.begin() + bestIndex, node);
+
+        size_t i = bestIndex + 1;
+        while (i < skyline.size())
+        {
+            int32_t previousEnd = skyline[i - 1].x + skyline[i - 1].width;
+            if (skyline[i].x >= previousEnd) {
+                break;
+            }
+            int32_t shrink = previousEnd - skyline[i].x;
+            skyline[i].x += shrink;
+            skyline[i].width -= shrink;
+            if (skyline[i].width > 0) {
+                break;
+            }
+            skyline.erase(skyline.begin() + i);
+        }
+
+        i = 0;
+        while (i + 1 < skyline.size())
+        {
+            if (skyline[i].y == skyline[i + 1].y)
+            {
+                skyline[i].width += skyline[i + 1].width;
+                skyline.erase(skyline.begin() + i + 1);
+            }
+            else
+            {
+                i++;
+            }
+        }
+
+        *outX = node.x;
+        *outY = bestY;
+        return true;
+    }
+
+    // Renders one glyph into a pixel buffer with a one texel transparent
+    // border so bilinear filtering never picks up a neighbour.
+    void RenderGlyph(ssfn_t* context, const char* text, int32_t left, int32_t top, uint32_t* pixels, int32_t pixelsWidth, int32_t pixelsHeight, int32_t x, int32_t y)
+    {
+        ssfn_buf_t buffer;
+        memset(&buffer, 0, sizeof(buffer));
+        buffer.ptr = (uint8_t*)pixels;
+        buffer.x = x + 1 + left;
+        buffer.y = y + 1 + top;
+        buffer.w = pixelsWidth;
+        buffer.h = pixelsHeight;
+        buffer.p = (uint16_t)(pixelsWidth * 4);
+        buffer.bg = 0xffffffff;
+        buffer.fg = 0xffffffff;
+        ssfn_render(context, &buffer, text);
+    }
+
+    void RecordMissingGlyph(BitmapFont* font, uint32_t unicode)
+    {
+        Glyph glyph;
+        memset(&glyph, 0, sizeof(glyph));
+        glyph.unicode = unicode;
+        glyph.present = true;
+        glyph.missing = true;
+        StoreGlyph(font, glyph);
+    }
+
+    void EvictGlyphs(BitmapFont* font);
+
+    // Rasterises a glyph on first use and uploads it into free atlas space.
+    // Returns nullptr when the atlas is full even after eviction; nothing is
+    // recorded in that case so the glyph is retried on a later frame.
+    Glyph* RasteriseGlyph(BitmapFont* font, uint32_t unicode, bool allowEvict)
+    {
+        char text[8];
+        EncodeUtf8(unicode, text);
+
+        ssfn_t* context = (ssfn_t*)font->context;
+        ssfn_select(context, SSFN_FAMILY_ANY, font->fontName.c_str(), (int)font->fontStyle, (int)font->fontSize);
+
+        int boundsWidth;
+        int boundsHeight;
+        int boundsLeft;
+        int boundsTop;
+        if (ssfn_bbox(context, text, &boundsWidth, &boundsHeight, &boundsLeft, &boundsTop) != 0)
+        {
+            RecordMissingGlyph(font, unicode);
+            return LookupGlyph(font, unicode);
+        }
+
+        const int32_t cellWidth = boundsWidth + 2;
+        const int32_t cellHeight = boundsHeight + 2;
+        int32_t x;
+        int32_t y;
+        if (!SkylineAllocate(font->skyline, font->image.width, font->image.height, cellWidth, cellHeight, &x, &y))
+        {
+            if (!allowEvict) {
+                return nullptr;
+            }
+            EvictGlyphs(font);
+            ssfn_select(context, SSFN_FAMILY_ANY, font->fontName.c_str(), (int)font->fontStyle, (int)font->fontSize);
+            if (!SkylineAllocate(font->skyline, font->image.width, font->image.height, cellWidth, cellHeight, &x, &y)) {
+                return nullptr;
+            }
+        }
+
+        std::vector<uint32_t> pixels(cellWidth * cellHeight, 0);
+        RenderGlyph(context, text, boundsLeft, boundsTop, &pixels[0], cellWidth, cellHeight, 0, 0);
+
+        PROFILE_SCOPE("TextureUpload");
+        D3DLOCKED_RECT lockedRect;
+        if (SUCCEEDED(font->image.texture->LockRect(0, &lockedRect, nullptr, 0)))
+        {
+            Profiler::AddCounter(PROFILER_COUNTER_TEXTURE_BYTES, cellWidth * cellHeight * 4);
+            POINT point;
+            point.x = x;
+            point.y = y;
+            XGSwizzleRect(&pixels[0], cellWidth * 4, nullptr, lockedRect.pBits, font->image.width, font->image.height, &point, 4);
+            font->image.texture->UnlockRect(0);
+        }
+
+        Rect rect;
+        rect.x = x + 1;
+        rect.y = y + 1;
+        rect.width = boundsWidth;
+        rect.height = boundsHeight;
+        Drawing::SetGlyph(font, unicode, rect, font->image.width, font->image.height);
+        return LookupGlyph(font, unicode);
+    }
+
+    // Folded into the baked font header so changing mWarmGlyphs alone makes
+    // an existing blob stale.
+    uint32_t GetWarmSetStamp()
+    {
+        return Deflate::UpdateCrc32(0, mWarmGlyphs, (uint32_t)strlen(mWarmGlyphs));
+    }
+
+    bool IsUnitRange(float value)
+    {
+        return value >= 0.0f && value <= 1.0f;
+    }
+
+    // A baked glyph is drawn and later repacked straight from its record, so
+    // its cell and UVs must lie inside the atlas.
+    bool IsBakedGlyphValid(const Glyph& glyph, int32_t textureDimension)
+    {
+        const Rect& rect = glyph.rect;
+        if (!glyph.present || rect.x < 0 || rect.y < 0 || rect.width < 0 || rect.height < 0 ||
+            rect.x + rect.width > textureDimension || rect.y + rect.height > textureDimension) {
+            return false;
+        }
+        return IsUnitRange(glyph.u0) && IsUnitRange(glyph.v0) && IsUnitRange(glyph.u1) && IsUnitRange(glyph.v1);
+    }
+
+    // SkylineAllocate walks nodes to the right until it has covered a cell's
+    // width, so the nodes must tile the atlas width exactly.
+    bool IsBakedSkylineValid(const std::vector<SkylineNode>& skyline, int32_t textureDimension)
+    {
+        int32_t x = 0;
+        for (size_t i = 0; i < skyline.size(); i++)
+        {
+            const SkylineNode& node = skyline[i];
+            if (node.x != x || node.width <= 0 || node.width > textureDimension - x || node.y < 0 || node.y > textureDimension) {
+                return false;
+            }
+            x += node.width;
+        }
+        return x == textureDimension;
+    }
+
+    bool GlyphUsedMoreRecently(const Glyph& a, const Glyph& b)
+    {
+        return a.lastUsed > b.lastUsed;
+    }
+
+    // Drops the least recently used half of the on demand glyphs and repacks
+    // the rest behind the warm set. Anything already recorded for this frame
+    // is flushed first and the GPU drained, because surviving glyphs move.
+    void EvictGlyphs(BitmapFont* font)
+    {
+        Drawing::Flush();
+        Context::GetD3dDevice()->BlockUntilIdle();
+
+        std::vector<Glyph> retained;
+        std::vector<Glyph> dynamicGlyphs;
+        for (uint32_t i = 0; i < GLYPH_DIRECT_COUNT; i++)
+        {
+            const Glyph& glyph = font->glyphs[i];
+            if (glyph.present) {
+                (glyph.pinned || glyph.missing ? retained : dynamicGlyphs).push_back(glyph);
+            }
+        }
+        for (size_t i = 0; i < font->extendedGlyphs.size(); i++)
+        {
+            const Glyph& glyph = font->extendedGlyphs[i];
+            if (glyph.present) {
+                (glyph.pinned || glyph.missing ? retained : dynamicGlyphs).push_back(glyph);
+            }
+        }
+        std::sort(dynamicGlyphs.begin(), dynamicGlyphs.end(), GlyphUsedMoreRecently);
+
+        Drawing::ClearGlyphs(font);
+        font->skyline = font->pinnedSkyline;
+        font->generation++;
+        for (size_t i = 0; i < retained.size(); i++) {
+            StoreGlyph(font, retained[i]);
+        }
+
+        size_t keepCount = dynamicGlyphs.size() / 2;
+        for (size_t i = 0; i < dynamicGlyphs.size(); i++)
+        {
+            if (i >= keepCount && dynamicGlyphs[i].lastUsed != mFrameIndex) {
+                break;
+            }
+            Glyph* glyph = RasteriseGlyph(font, dynamicGlyphs[i].unicode, false);
+            if (glyph == nullptr) {
+                break;
+            }
+            glyph->lastUsed = dynamicGlyphs[i].lastUsed;
+        }
+    }
+
+    bool BatchOverlaps(const DrawBatch* batch, float minX, float minY, float maxX, float maxY)
+    {
+        return minX < batch->maxX && maxX > batch->minX && minY < batch->maxY && maxY > batch->minY;
+    }
+
+    // Moves the scratch quads into the frame's batch list. The quads join the
+    // most recent batch with the same texture as long as no batch recorded in
+    // between overlaps them, so merging never changes what ends up on top.
+    void SubmitScratch(D3DTexture* texture)
+    {
+        if (mScratch.empty()) {
+            return;
+        }
+
+        float minX = mScratch[0].x, maxX = mScratch[0].x;
+        float minY = mScratch[0].y, maxY = mScratch[0].y;
+        for (size_t i = 1; i < mScratch.size(); i++)
+        {
+            const TEXVERTEX& v = mScratch[i];
+            if (v.x < minX) { minX = v.x; }
+            if (v.x > maxX) { maxX = v.x; }
+            if (v.y < minY) { minY = v.y; }
+            if (v.y > maxY) { maxY = v.y; }
+        }
+
+        DrawBatch* target = nullptr;
+        uint32_t visited = 0;
+        for (int32_t i = (int32_t)mBatchCount - 1; i >= 0 && visited < DRAW_BATCH_LOOKBACK; i--, visited++)
+        {
+            DrawBatch* batch = mBatches[i];
+            if (batch->texture == texture)
+            {
+                target = batch;
+                break;
+            }
+            if (BatchOverlaps(batch, minX, minY, maxX, maxY)) {
+                break;
+            }
+        }
+
+        if (target == nullptr)
+        {
+            if (mBatchCount == mBatches.size()) {
+                mBatches.push_back(new DrawBatch());
+            }
+            target = mBatches[mBatchCount++];
+            target->texture = texture;
+            target->vertices.clear();
+            target->minX = minX;
+            target->minY = minY;
+            target->maxX = maxX;
+            target->maxY = maxY;
+        }
+        else
+        {
+            if (minX < target->minX) { target->minX = minX; }
+            if (minY < target->minY) { target->minY = minY; }
+            if (maxX > target->maxX) { target->maxX = maxX; }
+            if (maxY > target->maxY) { target->maxY = maxY; }
+        }
+
+        target->vertices.insert(target->vertices.end(), mScratch.begin(), mScratch.end());
+        mScratch.clear();
+    }
+
+    void BuildTextLayoutPass(BitmapFont* font, const std::string& message, float maxWidth, TextLayout* layout)
+    {
+        layout->font = font;
+        layout->message = message;
+        layout->maxWidth = maxWidth;
+        layout->generation = font->generation;
+        layout->quads.clear();
+        layout->lineStarts.clear();
+        layout->lineStarts.push_back(0);
+        layout->dynamicGlyphs.clear();
+
+        float xPos = 0;
+        float yPos = 0;
+        float lineWidth = 0;
+        float maxLineWidth = 0;
+        const float lineHeight = (float)font->line_height;
+        const bool wrap = maxWidth > 0;
+
+        const char* p = message.c_str();
+        while (*p)
+        {
+            char* cursor = (char*)p;
+            uint32_t unicode = ssfn_utf8(&cursor);
+            p = cursor;
+
+            bool newLine = unicode == '\n';
+            const Glyph* glyph = nullptr;
+            float charWidth = 0;
+            if (!newLine)
+            {
+                glyph = Drawing::GetGlyph(font, unicode);
+                if (glyph == nullptr) {
+                    continue;
+                }
+
+                charWidth = (float)glyph->rect.width + (lineWidth > 0 ? (float)font->spacing : 0);
+                if (wrap && lineWidth > 0)
+                {
+                    if (unicode == ' ')
+                    {
+                        const char* nextWordStart = p;
+                        float nextWordW = MeasureWordWidth(font, nextWordStart, &nextWordStart);
+                        if (lineWidth + (float)font->spacing + (float)glyph->rect.width + nextWordW > maxWidth)
+                        {
+                            newLine = true;
+                            glyph = nullptr;
+                        }
+                    }
+                    else if (lineWidth + charWidth > maxWidth)
+                    {
+                        newLine = true;
+                    }
+                }
+            }
+
+            if (newLine)
+            {
+                if (lineWidth > maxLineWidth) {
+                    maxLineWidth = lineWidth;
+                }
+                xPos = 0;
+                yPos += lineHeight;
+                lineWidth = 0;
+                layout->lineStarts.push_back((uint32_t)layout->quads.size());
+                if (glyph == nullptr) {
+                    continue;
+                }
+                charWidth = (float)glyph->rect.width;
+            }
+
+            Sprite quad;
+            quad.x = xPos;
+            quad.y = yPos;
+            quad.width = (float)glyph->rect.width;
+            quad.height = (float)glyph->rect.height;
+            quad.u0 = glyph->u0;
+            quad.v0 = glyph->v0;
+            quad.u1 = glyph->u1;
+            quad.v1 = glyph->v1;
+            quad.diffuse = 0xffffffff;
+            layout->quads.push_back(quad);
+
+            if (!glyph->pinned && std::find(layout->dynamicGlyphs.begin(), layout->dynamicGlyphs.end(), unicode) == layout->dynamicGlyphs.end()) {
+                layout->dynamicGlyphs.push_back(unicode);
+            }
+
+            xPos += charWidth;
+            lineWidth += charWidth;
+        }
+
+        if (lineWidth > maxLineWidth) {
+            maxLineWidth = lineWidth;
+        }
+        layout->lineHeight = lineHeight;
+        layout->width = maxLineWidth;
+        layout->height = lineHeight * (float)layout->lineStarts.size();
+    }
 }
 
 void Drawing::Init()
 {
-    mSavedStateIndex = 0;
-}
-
-void Drawing::SaveRenderState()
-{
-    uint32_t* savedStatePage = &mSavedState[mSavedStateIndex];
-    mSavedStateIndex += SAVE_STATE_COUNT;
-
-    Context::GetD3dDevice()->GetRenderState(D3DRS_ALPHABLENDENABLE, &savedStatePage[0]);
-    Context::GetD3dDevice()->GetRenderState(D3DRS_SRCBLEND, &savedStatePage[1]);
-    Context::GetD3dDevice()->GetRenderState(D3DRS_DESTBLEND, &savedStatePage[2]);
-    Context::GetD3dDevice()->GetRenderState(D3DRS_ALPHATESTENABLE, &savedStatePage[3]);
-    Context::GetD3dDevice()->GetRenderState(D3DRS_ALPHAREF, &savedStatePage[4]);
-    Context::GetD3dDevice()->GetRenderState(D3DRS_ALPHAFUNC, &savedStatePage[5]);
-    Context::GetD3dDevice()->GetRenderState(D3DRS_FILLMODE, &savedStatePage[6]);
-    Context::GetD3dDevice()->GetRenderState(D3DRS_CULLMODE, &savedStatePage[7]);
-    Context::GetD3dDevice()->GetRenderState(D3DRS_ZENABLE, &savedStatePage[8]);
-    Context::GetD3dDevice()->GetRenderState(D3DRS_STENCILENABLE, &savedStatePage[9]);
-    Context::GetD3dDevice()->GetRenderState(D3DRS_STENCILFUNC, &savedStatePage[10]);
-    Context::GetD3dDevice()->GetRenderState(D3DRS_STENCILREF, &savedStatePage[11]);
-    Context::GetD3dDevice()->GetRenderState(D3DRS_STENCILMASK, &savedStatePage[12]);
-    Context::GetD3dDevice()->GetRenderState(D3DRS_STENCILWRITEMASK, &savedStatePage[13]);
-    Context::GetD3dDevice()->GetRenderState(D3DRS_STENCILPASS, &savedStatePage[14]);
-    Context::GetD3dDevice()->GetRenderState(D3DRS_COLORWRITEENABLE, &savedStatePage[15]);
-    Context::GetD3dDevice()->GetRenderState(D3DRS_EDGEANTIALIAS, &savedStatePage[16]);
-    Context::GetD3dDevice()->GetTextureStageState(0, D3DTSS_MINFILTER, &savedStatePage[17]);
-    Context::GetD3dDevice()->GetTextureStageState(0, D3DTSS_MAGFILTER, &savedStatePage[18]);
-    Context::GetD3dDevice()->GetTextureStageState(0, D3DTSS_COLOROP, &savedStatePage[19]);
-    Context::GetD3dDevice()->GetTextureStageState(0, D3DTSS_COLORARG1, &savedStatePage[20]);
-    Context::GetD3dDevice()->GetTextureStageState(0, D3DTSS_COLORARG2, &savedStatePage[21]);
-}
-
-void Drawing::RestoreRenderState()
-{
-    mSavedStateIndex -= SAVE_STATE_COUNT;
-    uint32_t* savedStatePage = &mSavedState[mSavedStateIndex];
-
-    Context::GetD3dDevice()->SetTexture(0, nullptr);
-
-    Context::GetD3dDevice()->SetRenderState(D3DRS_ALPHABLENDENABLE, savedStatePage[0]);
-    Context::GetD3dDevice()->SetRenderState(D3DRS_SRCBLEND, savedStatePage[1]);
-    Context::GetD3dDevice()->SetRenderState(D3DRS_DESTBLEND, savedStatePage[2]);
-    Context::GetD3dDevice()->SetRenderState(D3DRS_ALPHATESTENABLE, savedStatePage[3]);
-    Context::GetD3dDevice()->SetRenderState(D3DRS_ALPHAREF, savedStatePage[4]);
-    Context::GetD3dDevice()->SetRenderState(D3DRS_ALPHAFUNC, savedStatePage[5]);
-    Context::GetD3dDevice()->SetRenderState(D3DRS_FILLMODE, savedStatePage[6]);
-    Context::GetD3dDevice()->SetRenderState(D3DRS_CULLMODE, savedStatePage[7]);
-    Context::GetD3dDevice()->SetRenderState(D3DRS_ZENABLE, savedStatePage[8]);
-    Context::GetD3dDevice()->SetRenderState(D3DRS_STENCILENABLE, savedStatePage[9]);
-    Context::GetD3dDevice()->SetRenderState(D3DRS_STENCILFUNC, savedStatePage[10]);
-    Context::GetD3dDevice()->SetRenderState(D3DRS_STENCILREF, savedStatePage[11]);
-    Context::GetD3dDevice()->SetRenderState(D3DRS_STENCILMASK, savedStatePage[12]);
-    Context::GetD3dDevice()->SetRenderState(D3DRS_STENCILWRITEMASK, savedStatePage[13]);
-    Context::GetD3dDevice()->SetRenderState(D3DRS_STENCILPASS, savedStatePage[14]);
-    Context::GetD3dDevice()->SetRenderState(D3DRS_COLORWRITEENABLE, savedStatePage[15]);
-    Context::GetD3dDevice()->SetRenderState(D3DRS_EDGEANTIALIAS, savedStatePage[16]);
-    Context::GetD3dDevice()->SetTextureStageState(0, D3DTSS_MINFILTER, savedStatePage[17]);
-    Context::GetD3dDevice()->SetTextureStageState(0, D3DTSS_MAGFILTER, savedStatePage[18]);
-    Context::GetD3dDevice()->SetTextureStageState(0, D3DTSS_COLOROP, savedStatePage[19]);
-    Context::GetD3dDevice()->SetTextureStageState(0, D3DTSS_COLORARG1, savedStatePage[20]);
-    Context::GetD3dDevice()->SetTextureStageState(0, D3DTSS_COLORARG2, savedStatePage[21]);
+    mFrameIndex = 0;
+    mDrawCallCount = 0;
+    mVertexCount = 0;
+    mStateChangesIssued = 0;
+    mStateChangesSuppressed = 0;
+    InvalidateDeviceState();
+    mBatchCount = 0;
+    mClipEnabled = false;
+}
+
+void Drawing::BeginFrame()
+{
+    mFrameIndex++;
+    mDrawCallCount = 0;
+    mVertexCount = 0;
+    mStateChangesIssued = 0;
+    mStateChangesSuppressed = 0;
+    mBatchCount = 0;
+    mClipEnabled = false;
+}
+
+void Drawing::EndFrame()
+{
+    Flush();
+}
+
+void Drawing::Flush()
+{
+    if (mBatchCount == 0) {
+        return;
+    }
+
+    PROFILE_SCOPE("Flush");
+
+    SetRenderState(D3DRS_ZENABLE, FALSE);
+    SetRenderState(D3DRS_STENCILENABLE, FALSE);
+    SetRenderState(D3DRS_ALPHABLENDENABLE, TRUE);
+    SetRenderState(D3DRS_SRCBLEND, D3DBLEND_SRCALPHA);
+    SetRenderState(D3DRS_DESTBLEND, D3DBLEND_INVSRCALPHA);
+    SetVertexShader(D3DFVF_XYZRHW | D3DFVF_DIFFUSE | D3DFVF_TEX1);
+    SetTextureStageState(0, D3DTSS_MINFILTER, D3DTEXF_LINEAR);
+    SetTextureStageState(0, D3DTSS_MAGFILTER, D3DTEXF_LINEAR);
+    SetTextureStageState(0, D3DTSS_COLORARG1, D3DTA_TEXTURE);
+    SetTextureStageState(0, D3DTSS_COLORARG2, D3DTA_DIFFUSE);
+    SetTextureStageState(0, D3DTSS_ALPHAARG1, D3DTA_TEXTURE);
+    SetTextureStageState(0, D3DTSS_ALPHAARG2, D3DTA_DIFFUSE);
+
+    for (uint32_t i = 0; i < mBatchCount; i++)
+    {
+        DrawBatch* batch = mBatches[i];
+        DWORD op = batch->texture != nullptr ? D3DTOP_MODULATE : D3DTOP_SELECTARG2;
+        SetTexture(0, batch->texture);
+        SetTextureStageState(0, D3DTSS_COLOROP, op);
+        SetTextureStageState(0, D3DTSS_ALPHAOP, op);
+
+        UINT remaining = (UINT)batch->vertices.size();
+        const TEXVERTEX* vertices = remaining > 0 ? &batch->vertices[0] : nullptr;
+        while (remaining > 0)
+        {
+            UINT count = remaining > (UINT)DRAW_BATCH_MAX_VERTS ? (UINT)DRAW_BATCH_MAX_VERTS : remaining;
+            mDrawCallCount++;
+            mVertexCount += count;
+            Context::GetD3dDevice()->DrawPrimitiveUP(D3DPT_TRIANGLELIST, count / 3, vertices, sizeof(TEXVERTEX));
+            vertices += count;
+            remaining -= count;
+        }
+    }
+
+    // Textures can be released and reallocated between frames, so never let
+    // the shadow keep one bound past the flush.
+    SetTexture(0, nullptr);
+    mBatchCount = 0;
+}
+
+uint32_t Drawing::GetDrawCallCount()
+{
+    return mDrawCallCount;
+}
+
+uint32_t Drawing::GetVertexCount()
+{
+    return mVertexCount;
+}
+
+uint32_t Drawing::GetStateChangesIssued()
+{
+    return mStateChangesIssued;
+}
+
+uint32_t Drawing::GetStateChangesSuppressed()
+{
+    return mStateChangesSuppressed;
+}
+
+void Drawing::InvalidateDeviceState()
+{
+    memset(mRenderStateKnown, 0, sizeof(mRenderStateKnown));
+    memset(mStageStateKnown, 0, sizeof(mStageStateKnown));
+    memset(mTextureKnown, 0, sizeof(mTextureKnown));
+    mVertexShaderKnown = false;
+}
+
+void Drawing::SetRenderState(D3DRENDERSTATETYPE state, DWORD value)
+{
+    if (mRenderStateKnown[state] && mRenderStates[state] == value)
+    {
+        mStateChangesSuppressed++;
+        return;
+    }
+    mRenderStates[state] = value;
+    mRenderStateKnown[state] = true;
+    mStateChangesIssued++;
+    Context::GetD3dDevice()->SetRenderState(state, value);
+}
+
+void Drawing::SetTextureStageState(DWORD stage, D3DTEXTURESTAGESTATETYPE type, DWORD value)
+{
+    if (mStageStateKnown[stage][type] && mStageStates[stage][type] == value)
+    {
+        mStateChangesSuppressed++;
+        return;
+    }
+    mStageStates[stage][type] = value;
+    mStageStateKnown[stage][type] = true;
+    mStateChangesIssued++;
+    Context::GetD3dDevice()->SetTextureStageState(stage, type, value);
+}
+
+void Drawing::SetTexture(DWORD stage, D3DTexture* texture)
+{
+    if (mTextureKnown[stage] && mTextures[stage] == texture)
+    {
+        mStateChangesSuppressed++;
+        return;
+    }
+    mTextures[stage] = texture;
+    mTextureKnown[stage] = true;
+    mStateChangesIssued++;
+    Context::GetD3dDevice()->SetTexture(stage, texture);
+}
+
+void Drawing::SetVertexShader(DWORD handle)
+{
+    if (mVertexShaderKnown && mVertexShader == handle)
+    {
+        mStateChangesSuppressed++;
+        return;
+    }
+    mVertexShader = handle;
+    mVertexShaderKnown = true;
+    mStateChangesIssued++;
+    Context::GetD3dDevice()->SetVertexShader(handle);
 }
 
 void Drawing::Swizzle(const void* src, const uint32_t& depth, const uint32_t& width, const uint32_t& height, void* dest) 
 {
-    for (UINT y = 0; y < height; y++) {
-        UINT sy = 0;
-        if (y < width) {
-            for (int32_t bit = 0; bit < 16; bit++)
-                sy |= ((y >> bit) & 1) << (2 * bit);
-            sy <<= 1; // y counts twice
-        } else {
-            UINT y_mask = y % width;
-            for (int32_t bit = 0; bit < 16; bit++)
-                sy |= ((y_mask >> bit) & 1) << (2 * bit);
-            sy <<= 1; // y counts twice
-            sy += (y / width) * width * width;
-        }
-        BYTE* s = (BYTE*)src + y * width * depth;
-        for (UINT x = 0; x < width; x++) {
-            UINT sx = 0;
-            if (x < height * 2) {
-                for (int32_t bit = 0; bit < 16; bit++)
-                    sx |= ((x >> bit) & 1) << (2 * bit);
-            } else {
-                int32_t x_mask = x % (2 * height);
-                for (int32_t bit = 0; bit < 16; bit++)
-                    sx |= ((x_mask >> bit) & 1) << (2 * bit);
-                sx += (x / (2 * height)) * 2 * height * height;
+    std::vector<uint32_t> xOffsets;
+    std::vector<uint32_t> yOffsets;
+    BuildSwizzleTables(width, height, xOffsets, yOffsets);
+
+    // The texel index splits into an x part and a y part, so each row is a
+    // gather through the column table plus one row offset.
+    for (uint32_t y = 0; y < height; y++)
+    {
+        const uint32_t rowOffset = yOffsets[y];
+        if (depth == 4)
+        {
+            const uint32_t* s = (const uint32_t*)src + y * width;
+            uint32_t* d = (uint32_t*)dest + rowOffset;
+            for (uint32_t x = 0; x < width; x++) {
+                d[xOffsets[x]] = s[x];
+            }
+        }
+        else if (depth == 2)
+        {
+            const uint16_t* s = (const uint16_t*)src + y * width;
+            uint16_t* d = (uint16_t*)dest + rowOffset;
+            for (uint32_t x = 0; x < width; x++) {
+                d[xOffsets[x]] = s[x];
+            }
+        }
+        else
+        {
+            const uint8_t* s = (const uint8_t*)src + y * width * depth;
+            uint8_t* d = (uint8_t*)dest;
+            for (uint32_t x = 0; x < width; x++) {
+                memcpy(d + (rowOffset + xOffsets[x]) * depth, s + x * depth, depth);
+            }
+        }
+    }
+}
+
+void Drawing::Deswizzle(const void* src, const uint32_t& depth, const uint32_t& width, const uint32_t& height, void* dest)
+{
+    std::vector<uint32_t> xOffsets;
+    std::vector<uint32_t> yOffsets;
+    BuildSwizzleTables(width, height, xOffsets, yOffsets);
+
+    for (uint32_t y = 0; y < height; y++)
+    {
+        const uint32_t rowOffset = yOffsets[y];
+        if (depth == 4)
+        {
+            const uint32_t* s = (const uint32_t*)src + rowOffset;
+            uint32_t* d = (uint32_t*)dest + y * width;
+            for (uint32_t x = 0; x < width; x++) {
+                d[x] = s[xOffsets[x]];
+            }
+        }
+        else if (depth == 2)
+        {
+            const uint16_t* s = (const uint16_t*)src + rowOffset;
+            uint16_t* d = (uint16_t*)dest + y * width;
+            for (uint32_t x = 0; x < width; x++) {
+                d[x] = s[xOffsets[x]];
+            }
+        }
+        else
+        {
+            const uint8_t* s = (const uint8_t*)src;
+            uint8_t* d = (uint8_t*)dest + y * width * depth;
+            for (uint32_t x = 0; x < width; x++) {
+                memcpy(d + x * depth, s + (rowOffset + xOffsets[x]) * depth, depth);
             }
-            BYTE* d = (BYTE*)dest + (sx + sy) * depth;
-            for (unsigned int i = 0; i < depth; ++i)
-                *d++ = *s++;
         }
     }
 }
 
 bool Drawing::TryCreateImage(uint8_t* imageData, D3DFORMAT format, int32_t width, int32_t height, Image* image) 
 {
+    PROFILE_SCOPE("TextureUpload");
     image->width = width;
     image->height = height;
 
@@ -159,6 +947,7 @@ bool Drawing::TryCreateImage(uint8_t* imageData, D3DFORMAT format, int32_t width
     
     D3DLOCKED_RECT lockedRect;
     if (SUCCEEDED(image->texture->LockRect(0, &lockedRect, nullptr, 0))) {
+        Profiler::AddCounter(PROFILER_COUNTER_TEXTURE_BYTES, surfaceDesc.Size);
         uint8_t* tempBuffer = (uint8_t*)malloc(surfaceDesc.Size);
         memset(tempBuffer, 0, surfaceDesc.Size);
         uint8_t* src = imageData;
@@ -203,165 +992,279 @@ bool Drawing::LoadFont(const std::string filePath, void* context)
     return result == 0;
 }
 
+void Drawing::ClearGlyphs(BitmapFont* font)
+{
+    memset(font->glyphs, 0, sizeof(font->glyphs));
+    font->extendedGlyphs.clear();
+    font->extendedCount = 0;
+}
+
+void Drawing::SetGlyph(BitmapFont* font, uint32_t unicode, const Rect& rect, int32_t textureWidth, int32_t textureHeight)
+{
+    Glyph glyph;
+    memset(&glyph, 0, sizeof(glyph));
+    glyph.unicode = unicode;
+    glyph.rect = rect;
+    glyph.u0 = rect.x / (float)textureWidth;
+    glyph.v0 = rect.y / (float)textureHeight;
+    glyph.u1 = (rect.x + rect.width) / (float)textureWidth;
+    glyph.v1 = (rect.y + rect.height) / (float)textureHeight;
+    glyph.advance = rect.width + font->spacing;
+    glyph.lastUsed = mFrameIndex;
+    glyph.present = true;
+    StoreGlyph(font, glyph);
+}
+
+const Glyph* Drawing::FindGlyph(const BitmapFont* font, uint32_t unicode)
+{
+    const Glyph* glyph = LookupGlyph((BitmapFont*)font, unicode);
+    return glyph != nullptr && !glyph->missing ? glyph : nullptr;
+}
+
+const Glyph* Drawing::GetGlyph(BitmapFont* font, uint32_t unicode)
+{
+    Glyph* glyph = LookupGlyph(font, unicode);
+    if (glyph == nullptr && font->context != nullptr) {
+        glyph = RasteriseGlyph(font, unicode, true);
+    }
+    if (glyph == nullptr || glyph->missing) {
+        return nullptr;
+    }
+    glyph->lastUsed = mFrameIndex;
+    return glyph;
+}
 
 bool Drawing::TryGenerateBitmapFont(void* context, const std::string fontName, int32_t fontStyle, int32_t fontSize, int32_t lineHeight, int32_t spacing, int32_t textureDimension, BitmapFont* bitmapFont) 
 {
     ssfn_select((ssfn_t*)context, SSFN_FAMILY_ANY, fontName.c_str(), (int)fontStyle, (int)fontSize);
 
+    ClearGlyphs(bitmapFont);
+    bitmapFont->line_height = lineHeight;
+    bitmapFont->spacing = spacing;
+    bitmapFont->context = nullptr;
+    bitmapFont->fontName = fontName;
+    bitmapFont->fontStyle = fontStyle;
+    bitmapFont->fontSize = fontSize;
+    bitmapFont->generation = 0;
+
     int32_t textureWidth = textureDimension;
     int32_t textureHeight = textureDimension;
 
+    SkylineNode root;
+    root.x = 0;
+    root.y = 0;
+    root.width = textureWidth;
+    bitmapFont->skyline.clear();
+    bitmapFont->skyline.push_back(root);
+
     uint32_t* imageData = (uint32_t*)malloc(textureWidth * textureHeight * 4);
     memset(imageData, 0, textureWidth * textureHeight * 4);
 
-    int32_t x = 2;
-    int32_t y = 2;
-
-    char* charsToEncode = " !\"#$%&'()*+,-./0123456789:;<=>?@ABCDEFGHIJKLMNOPQRSTUVWXYZ[\\]^_`abcdefghijklmnopqrstuvwxyz{|}~";
-    char* currentCharPos = charsToEncode;
+    const char* currentCharPos = mWarmGlyphs;
     while (*currentCharPos) {
-        char* nextCharPos = currentCharPos;
+        char* nextCharPos = (char*)currentCharPos;
         uint32_t unicode = ssfn_utf8(&nextCharPos);
-
-        int32_t length = nextCharPos - currentCharPos;
-        char* currentChar = (char*)malloc(length + 1);
-        memcpy(currentChar, currentCharPos, length);
-        currentChar[length] = 0;
-
         currentCharPos = nextCharPos;
 
+        char currentChar[8];
+        EncodeUtf8(unicode, currentChar);
+
         int bounds_width;
         int bounds_height;
         int bounds_left;
         int bounds_top;
         int ret = ssfn_bbox((ssfn_t*)context, currentChar, &bounds_width, &bounds_height, &bounds_left, &bounds_top);
         if (ret != 0) {
-            free(currentChar);
             continue;
         }
 
-        if ((x + bounds_width + 2) > textureWidth) {
-            x = 2;
-            y = y + bounds_height + 2;
+        int32_t x;
+        int32_t y;
+        if (!SkylineAllocate(bitmapFont->skyline, textureWidth, textureHeight, bounds_width + 2, bounds_height + 2, &x, &y)) {
+            continue;
         }
 
         Rect rect;
-        rect.x = x;
-        rect.y = y;
+        rect.x = x + 1;
+        rect.y = y + 1;
         rect.width = bounds_width;
         rect.height = bounds_height;
+        SetGlyph(bitmapFont, unicode, rect, textureWidth, textureHeight);
+        LookupGlyph(bitmapFont, unicode)->pinned = true;
 
-        bitmapFont->charmap[unicode] = rect;
-
-        ssfn_buf_t buffer;
-        memset(&buffer, 0, sizeof(buffer));
-        buffer.ptr = (uint8_t*)imageData;
-        buffer.x = x + bounds_left;
-        buffer.y = y + bounds_top;
-        buffer.w = textureWidth;
-        buffer.h = textureHeight;
-        buffer.p = (uint16_t)(textureWidth * 4);
-        buffer.bg = 0xffffffff;
-        buffer.fg = 0xffffffff;
-
-        ssfn_render((ssfn_t*)context, &buffer, currentChar);
-
-        x = x + bounds_width + 2;
-        free(currentChar);
+        RenderGlyph((ssfn_t*)context, currentChar, bounds_left, bounds_top, imageData, textureWidth, textureHeight, x, y);
     }
-
-    bitmapFont->line_height = lineHeight;
-    bitmapFont->spacing = spacing;
+    bitmapFont->pinnedSkyline = bitmapFont->skyline;
 
     bool result = TryCreateImage((uint8_t*)imageData, D3DFMT_A8R8G8B8, textureWidth, textureHeight, &bitmapFont->image);
     free(imageData);
+    if (result) {
+        bitmapFont->context = context;
+    }
     return result;
 }
 
-void Drawing::DrawFont(BitmapFont* font, const std::string message, uint32_t color, float x, float y)
+bool Drawing::TrySaveBakedFont(BitmapFont* bitmapFont, const std::string filePath, uint32_t sourceStamp)
 {
-    const float sx = Context::GetScaleX(), sy = Context::GetScaleY();
-    x *= sx; y *= sy;
-    static TEXVERTEX batchBuf[DRAW_BATCH_MAX_VERTS];
-    UINT vertexCount = 0;
-    float xPos = x;
-    float yPos = y;
-    const float invW = 1.0f / (float)font->image.width;
-    const float invH = 1.0f / (float)font->image.height;
-
-    SaveRenderState();
-    Context::GetD3dDevice()->SetVertexShader(D3DFVF_XYZRHW | D3DFVF_DIFFUSE | D3DFVF_TEX1);
-    Context::GetD3dDevice()->SetTexture(0, font->image.texture);
-    Context::GetD3dDevice()->SetTextureStageState(0, D3DTSS_MINFILTER, D3DTEXF_LINEAR);
-    Context::GetD3dDevice()->SetTextureStageState(0, D3DTSS_MAGFILTER, D3DTEXF_LINEAR);
+    D3DSURFACE_DESC surfaceDesc;
+    if (bitmapFont->image.texture == nullptr || FAILED(bitmapFont->image.texture->GetLevelDesc(0, &surfaceDesc))) {
+        return false;
+    }
 
-    const char* p = message.c_str();
-    while (*p)
+    std::vector<Glyph> glyphs;
+    for (uint32_t i = 0; i < GLYPH_DIRECT_COUNT; i++)
     {
-        char* cursor = (char*)p;
-        uint32_t unicode = ssfn_utf8(&cursor);
-        p = cursor;
-
-        std::map<uint32_t, Rect>::const_iterator it = font->charmap.find(unicode);
-        if (it == font->charmap.end()) {
-            continue;
+        if (bitmapFont->glyphs[i].present && bitmapFont->glyphs[i].pinned) {
+            glyphs.push_back(bitmapFont->glyphs[i]);
+        }
+    }
+    for (size_t i = 0; i < bitmapFont->extendedGlyphs.size(); i++)
+    {
+        if (bitmapFont->extendedGlyphs[i].present && bitmapFont->extendedGlyphs[i].pinned) {
+            glyphs.push_back(bitmapFont->extendedGlyphs[i]);
         }
+    }
 
-        const Rect& rect = it->second;
+    BakedFontHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = BAKED_FONT_MAGIC;
+    header.version = BAKED_FONT_VERSION;
+    header.sourceStamp = sourceStamp;
+    header.warmSetStamp = GetWarmSetStamp();
+    strncpy(header.fontName, bitmapFont->fontName.c_str(), sizeof(header.fontName) - 1);
+    header.fontStyle = bitmapFont->fontStyle;
+    header.fontSize = bitmapFont->fontSize;
+    header.lineHeight = bitmapFont->line_height;
+    header.spacing = bitmapFont->spacing;
+    header.textureDimension = bitmapFont->image.width;
+    header.glyphCount = (uint32_t)glyphs.size();
+    header.skylineCount = (uint32_t)bitmapFont->pinnedSkyline.size();
+    header.pixelSize = surfaceDesc.Size;
 
-        if (vertexCount + 6 > (UINT)DRAW_BATCH_MAX_VERTS)
-        {
-            Context::GetD3dDevice()->DrawPrimitiveUP(D3DPT_TRIANGLELIST, vertexCount / 3, batchBuf, sizeof(TEXVERTEX));
-            vertexCount = 0;
+    D3DLOCKED_RECT lockedRect;
+    if (FAILED(bitmapFont->image.texture->LockRect(0, &lockedRect, nullptr, D3DLOCK_READONLY))) {
+        return false;
+    }
+
+    bool ok = false;
+    FILE* fp = fopen(filePath.c_str(), "wb");
+    if (fp)
+    {
+        ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+        if (ok && header.glyphCount > 0) {
+            ok = fwrite(&glyphs[0], sizeof(Glyph), header.glyphCount, fp) == header.glyphCount;
         }
+        if (ok && header.skylineCount > 0) {
+            ok = fwrite(&bitmapFont->pinnedSkyline[0], sizeof(SkylineNode), header.skylineCount, fp) == header.skylineCount;
+        }
+        if (ok) {
+            ok = fwrite(lockedRect.pBits, 1, header.pixelSize, fp) == header.pixelSize;
+        }
+        fclose(fp);
+    }
+    bitmapFont->image.texture->UnlockRect(0);
 
-        float uvX = rect.x * invW;
-        float uvY = rect.y * invH;
-        float uvW = rect.width * invW;
-        float uvH = rect.height * invH;
-        float u0 = uvX, v0 = uvY, u1 = uvX + uvW, v1 = uvY + uvH;
+    if (!ok) {
+        remove(filePath.c_str());
+    }
+    return ok;
+}
 
-        float px = xPos - 0.5f;
-        float py = yPos - 0.5f;
-        float fw = (float)rect.width * sx;
-        float fh = (float)rect.height * sy;
+bool Drawing::TryLoadBakedFont(void* context, const std::string filePath, uint32_t sourceStamp, const std::string fontName, int32_t fontStyle, int32_t fontSize, int32_t lineHeight, int32_t spacing, int32_t textureDimension, BitmapFont* bitmapFont)
+{
+    FILE* fp = fopen(filePath.c_str(), "rb");
+    if (!fp) {
+        return false;
+    }
+
+    BakedFontHeader header;
+    if (fread(&header, sizeof(header), 1, fp) != 1) {
+        fclose(fp);
+        return false;
+    }
+    header.fontName[sizeof(header.fontName) - 1] = 0;
+
+    // Anything that would change the rasterised output makes the blob stale.
+    if (header.magic != BAKED_FONT_MAGIC || header.version != BAKED_FONT_VERSION || header.sourceStamp != sourceStamp ||
+        header.warmSetStamp != GetWarmSetStamp() || fontName != header.fontName || header.fontStyle != fontStyle ||
+        header.fontSize != fontSize || header.lineHeight != lineHeight || header.spacing != spacing || header.textureDimension != textureDimension ||
+        header.glyphCount > GLYPH_DIRECT_COUNT * 4 || header.skylineCount == 0 || header.skylineCount > (uint32_t)textureDimension)
+    {
+        fclose(fp);
+        return false;
+    }
 
-        TEXVERTEX* v = &batchBuf[vertexCount];
-        v[0].x = px + fw; v[0].y = py;     v[0].z = 0.5f; v[0].rhw = 1.0f; v[0].diffuse = color; v[0].u = u1; v[0].v = v0;
-        v[1].x = px + fw; v[1].y = py+fh; v[1].z = 0.5f; v[1].rhw = 1.0f; v[1].diffuse = color; v[1].u = u1; v[1].v = v1;
-        v[2].x = px;      v[2].y = py+fh; v[2].z = 0.5f; v[2].rhw = 1.0f; v[2].diffuse = color; v[2].u = u0; v[2].v = v1;
-        v[3].x = px + fw; v[3].y = py;     v[3].z = 0.5f; v[3].rhw = 1.0f; v[3].diffuse = color; v[3].u = u1; v[3].v = v0;
-        v[4].x = px;      v[4].y = py+fh; v[4].z = 0.5f; v[4].rhw = 1.0f; v[4].diffuse = color; v[4].u = u0; v[4].v = v1;
-        v[5].x = px;      v[5].y = py;     v[5].z = 0.5f; v[5].rhw = 1.0f; v[5].diffuse = color; v[5].u = u0; v[5].v = v0;
+    std::vector<Glyph> glyphs(header.glyphCount);
+    std::vector<SkylineNode> skyline(header.skylineCount);
+    bool ok = header.glyphCount == 0 || fread(&glyphs[0], sizeof(Glyph), header.glyphCount, fp) == header.glyphCount;
+    ok = ok && fread(&skyline[0], sizeof(SkylineNode), header.skylineCount, fp) == header.skylineCount;
+    for (uint32_t i = 0; ok && i < header.glyphCount; i++) {
+        ok = IsBakedGlyphValid(glyphs[i], textureDimension);
+    }
+    ok = ok && IsBakedSkylineValid(skyline, textureDimension);
+    if (!ok) {
+        fclose(fp);
+        return false;
+    }
 
-        vertexCount += 6;
-        xPos += (float)(rect.width + font->spacing) * sx;
+    Image image;
+    image.width = textureDimension;
+    image.height = textureDimension;
+    if (FAILED(D3DXCreateTexture(Context::GetD3dDevice(), image.width, image.height, 1, 0, D3DFMT_A8R8G8B8, D3DPOOL_DEFAULT, &image.texture))) {
+        fclose(fp);
+        return false;
     }
 
-    if (vertexCount > 0) {
-        Context::GetD3dDevice()->DrawPrimitiveUP(D3DPT_TRIANGLELIST, vertexCount / 3, batchBuf, sizeof(TEXVERTEX));
+    D3DSURFACE_DESC surfaceDesc;
+    image.texture->GetLevelDesc(0, &surfaceDesc);
+    image.uv_width = image.width / (float)surfaceDesc.Width;
+    image.uv_height = image.height / (float)surfaceDesc.Height;
+
+    // The pixels are stored already swizzled, so they go straight in.
+    PROFILE_SCOPE("TextureUpload");
+    D3DLOCKED_RECT lockedRect;
+    ok = surfaceDesc.Size == header.pixelSize && SUCCEEDED(image.texture->LockRect(0, &lockedRect, nullptr, 0));
+    if (ok)
+    {
+        ok = fread(lockedRect.pBits, 1, header.pixelSize, fp) == header.pixelSize;
+        image.texture->UnlockRect(0);
+        Profiler::AddCounter(PROFILER_COUNTER_TEXTURE_BYTES, header.pixelSize);
+    }
+    fclose(fp);
+    if (!ok)
+    {
+        image.texture->Release();
+        return false;
     }
 
-    RestoreRenderState();
+    ClearGlyphs(bitmapFont);
+    bitmapFont->line_height = lineHeight;
+    bitmapFont->spacing = spacing;
+    bitmapFont->fontName = fontName;
+    bitmapFont->fontStyle = fontStyle;
+    bitmapFont->fontSize = fontSize;
+    bitmapFont->generation = 0;
+    bitmapFont->image = image;
+    for (uint32_t i = 0; i < header.glyphCount; i++)
+    {
+        glyphs[i].lastUsed = 0;
+        glyphs[i].pinned = true;
+        StoreGlyph(bitmapFont, glyphs[i]);
+    }
+    bitmapFont->skyline = skyline;
+    bitmapFont->pinnedSkyline = skyline;
+    bitmapFont->context = context;
+    return true;
 }
 
-void Drawing::DrawFontWrapped(BitmapFont* font, const std::string message, uint32_t color, float x, float y, float maxWidth)
+void Drawing::DrawFont(BitmapFont* font, const std::string message, uint32_t color, float x, float y)
 {
     const float sx = Context::GetScaleX(), sy = Context::GetScaleY();
-    x *= sx; y *= sy; maxWidth *= sx;
-    static TEXVERTEX batchBuf[DRAW_BATCH_MAX_VERTS];
-    UINT vertexCount = 0;
+    x *= sx; y *= sy;
     float xPos = x;
     float yPos = y;
-    float lineWidth = 0;
-    const float invW = 1.0f / (float)font->image.width;
-    const float invH = 1.0f / (float)font->image.height;
-
-    SaveRenderState();
-    Context::GetD3dDevice()->SetVertexShader(D3DFVF_XYZRHW | D3DFVF_DIFFUSE | D3DFVF_TEX1);
-    Context::GetD3dDevice()->SetTexture(0, font->image.texture);
-    Context::GetD3dDevice()->SetTextureStageState(0, D3DTSS_MINFILTER, D3DTEXF_LINEAR);
-    Context::GetD3dDevice()->SetTextureStageState(0, D3DTSS_MAGFILTER, D3DTEXF_LINEAR);
+    uint32_t generation = font->generation;
+    bool restarted = false;
 
     const char* p = message.c_str();
     while (*p)
@@ -370,121 +1273,136 @@ void Drawing::DrawFontWrapped(BitmapFont* font, const std::string message, uint3
         uint32_t unicode = ssfn_utf8(&cursor);
         p = cursor;
 
-        if (unicode == '\n')
+        const Glyph* glyph = GetGlyph(font, unicode);
+        if (font->generation != generation && !restarted)
         {
+            // The atlas was repacked while rasterising; quads recorded so far
+            // point at old locations.
+            mScratch.clear();
             xPos = x;
-            yPos += (float)font->line_height * sy;
-            lineWidth = 0;
+            p = message.c_str();
+            generation = font->generation;
+            restarted = true;
             continue;
         }
-
-        std::map<uint32_t, Rect>::const_iterator it = font->charmap.find(unicode);
-        if (it == font->charmap.end()) {
+        if (glyph == nullptr) {
             continue;
         }
 
-        const Rect& rect = it->second;
-        float charWidth = ((float)rect.width + (lineWidth > 0 ? (float)font->spacing : 0)) * sx;
+        float px = xPos - 0.5f;
+        float py = yPos - 0.5f;
+        AppendQuad(px, py, px + (float)glyph->rect.width * sx, py + (float)glyph->rect.height * sy, glyph->u0, glyph->v0, glyph->u1, glyph->v1, color);
 
-        if (unicode == ' ')
-        {
-            const char* nextWordStart = p;
-            float nextWordW = MeasureWordWidth(font, nextWordStart, &nextWordStart) * sx;
-            if (lineWidth > 0 && lineWidth + (float)font->spacing * sx + (float)rect.width * sx + nextWordW > maxWidth)
-            {
-                xPos = x;
-                yPos += (float)font->line_height * sy;
-                lineWidth = 0;
-                continue;
-            }
-        }
-        else if (lineWidth > 0 && lineWidth + charWidth > maxWidth)
-        {
-            xPos = x;
-            yPos += (float)font->line_height * sy;
-            lineWidth = 0;
-            charWidth = (float)rect.width * sx;
-        }
+        xPos += (float)glyph->advance * sx;
+    }
 
-        if (vertexCount + 6 > (UINT)DRAW_BATCH_MAX_VERTS)
-        {
-            Context::GetD3dDevice()->DrawPrimitiveUP(D3DPT_TRIANGLELIST, vertexCount / 3, batchBuf, sizeof(TEXVERTEX));
-            vertexCount = 0;
-        }
+    SubmitScratch(font->image.texture);
+}
+
+void Drawing::DrawFontWrapped(BitmapFont* font, const std::string message, uint32_t color, float x, float y, float maxWidth)
+{
+    static TextLayout layout;
+    BuildTextLayout(font, message, maxWidth, &layout);
+    DrawTextLayout(&layout, color, x, y);
+}
 
-        float uvX = rect.x * invW;
-        float uvY = rect.y * invH;
-        float uvW = rect.width * invW;
-        float uvH = rect.height * invH;
-        float u0 = uvX, v0 = uvY, u1 = uvX + uvW, v1 = uvY + uvH;
+void Drawing::BuildTextLayout(BitmapFont* font, const std::string& message, float maxWidth, TextLayout* layout)
+{
+    uint32_t generation = font->generation;
+    BuildTextLayoutPass(font, message, maxWidth, layout);
+    if (font->generation != generation)
+    {
+        // Rasterising a new glyph repacked the atlas part way through.
+        BuildTextLayoutPass(font, message, maxWidth, layout);
+    }
+}
 
-        float px = xPos - 0.5f;
-        float py = yPos - 0.5f;
-        float fw = (float)rect.width * sx;
-        float fh = (float)rect.height * sy;
+void Drawing::DrawTextLayout(TextLayout* layout, uint32_t color, float x, float y)
+{
+    if (layout->generation != layout->font->generation) {
+        BuildTextLayout(layout->font, layout->message, layout->maxWidth, layout);
+    }
+    for (size_t i = 0; i < layout->dynamicGlyphs.size(); i++) {
+        GetGlyph(layout->font, layout->dynamicGlyphs[i]);
+    }
 
-        TEXVERTEX* v = &batchBuf[vertexCount];
-        v[0].x = px + fw; v[0].y = py;     v[0].z = 0.5f; v[0].rhw = 1.0f; v[0].diffuse = color; v[0].u = u1; v[0].v = v0;
-        v[1].x = px + fw; v[1].y = py+fh; v[1].z = 0.5f; v[1].rhw = 1.0f; v[1].diffuse = color; v[1].u = u1; v[1].v = v1;
-        v[2].x = px;      v[2].y = py+fh; v[2].z = 0.5f; v[2].rhw = 1.0f; v[2].diffuse = color; v[2].u = u0; v[2].v = v1;
-        v[3].x = px + fw; v[3].y = py;     v[3].z = 0.5f; v[3].rhw = 1.0f; v[3].diffuse = color; v[3].u = u1; v[3].v = v0;
-        v[4].x = px;      v[4].y = py+fh; v[4].z = 0.5f; v[4].rhw = 1.0f; v[4].diffuse = color; v[4].u = u0; v[4].v = v1;
-        v[5].x = px;      v[5].y = py;     v[5].z = 0.5f; v[5].rhw = 1.0f; v[5].diffuse = color; v[5].u = u0; v[5].v = v0;
+    const float sx = Context::GetScaleX(), sy = Context::GetScaleY();
+    const uint32_t lineCount = (uint32_t)layout->lineStarts.size();
 
-        vertexCount += 6;
-        xPos += ((float)rect.width + (lineWidth > 0 ? (float)font->spacing : 0)) * sx;
-        lineWidth += charWidth;
+    // Skip whole lines outside the clip rect; glyphs may hang a little past
+    // their line so keep one line of slack on each side.
+    uint32_t firstLine = 0;
+    uint32_t lastLine = lineCount;
+    if (mClipEnabled && layout->lineHeight > 0)
+    {
+        float top = (mClipY0 / sy - y) / layout->lineHeight - 1.0f;
+        float bottom = (mClipY1 / sy - y) / layout->lineHeight + 2.0f;
+        if (bottom <= 0.0f) {
+            return;
+        }
+        firstLine = top > 0.0f ? (uint32_t)top : 0;
+        if (bottom < (float)lineCount) {
+            lastLine = (uint32_t)bottom;
+        }
+    }
+    if (firstLine >= lastLine) {
+        return;
     }
 
-    if (vertexCount > 0) {
-        Context::GetD3dDevice()->DrawPrimitiveUP(D3DPT_TRIANGLELIST, vertexCount / 3, batchBuf, sizeof(TEXVERTEX));
+    for (uint32_t line = firstLine; line < lastLine; line++)
+    {
+        uint32_t first = layout->lineStarts[line];
+        uint32_t last = line + 1 < lineCount ? layout->lineStarts[line + 1] : (uint32_t)layout->quads.size();
+        for (uint32_t i = first; i < last; i++)
+        {
+            const Sprite& quad = layout->quads[i];
+            float px = (x + quad.x) * sx - 0.5f;
+            float py = (y + quad.y) * sy - 0.5f;
+            float fw = quad.width * sx;
+            if (mClipEnabled)
+            {
+                // Quads run left to right within a line.
+                if (px >= mClipX1) {
+                    break;
+                }
+                if (px + fw <= mClipX0) {
+                    continue;
+                }
+            }
+            AppendQuad(px, py, px + fw, py + quad.height * sy, quad.u0, quad.v0, quad.u1, quad.v1, color);
+        }
     }
 
-    RestoreRenderState();
+    SubmitScratch(layout->font->image.texture);
 }
 
 void Drawing::DrawFilledRect(uint32_t color, float x, float y, float width, float height)
 {
     const float sx = Context::GetScaleX(), sy = Context::GetScaleY();
     x *= sx; y *= sy; width *= sx; height *= sy;
-    VERTEX vertices[4];
-    float px = x, py = y, fw = width, fh = height;
-
-    vertices[0].x = px;      vertices[0].y = py;      vertices[0].z = 0.5f; vertices[0].rhw = 1.0f; vertices[0].diffuse = color;
-    vertices[1].x = px + fw; vertices[1].y = py;      vertices[1].z = 0.5f; vertices[1].rhw = 1.0f; vertices[1].diffuse = color;
-    vertices[2].x = px;      vertices[2].y = py + fh; vertices[2].z = 0.5f; vertices[2].rhw = 1.0f; vertices[2].diffuse = color;
-    vertices[3].x = px + fw; vertices[3].y = py + fh; vertices[3].z = 0.5f; vertices[3].rhw = 1.0f; vertices[3].diffuse = color;
-
-    SaveRenderState();
-    Context::GetD3dDevice()->SetVertexShader(D3DFVF_XYZRHW | D3DFVF_DIFFUSE);
-    Context::GetD3dDevice()->SetTexture(0, nullptr);
-    Context::GetD3dDevice()->DrawPrimitiveUP(D3DPT_TRIANGLESTRIP, 2, vertices, sizeof(VERTEX));
-    RestoreRenderState();
+    AppendQuad(x, y, x + width, y + height, 0.0f, 0.0f, 0.0f, 0.0f, color);
+    SubmitScratch(nullptr);
 }
 
 void Drawing::DrawTexturedRect(D3DTexture* texture, uint32_t diffuse, float x, float y, float width, float height)
 {
     const float sx = Context::GetScaleX(), sy = Context::GetScaleY();
     x *= sx; y *= sy; width *= sx; height *= sy;
-    TEXVERTEX vertices[4];
-    float px = x, py = y, fw = width, fh = height;
-
-    vertices[0].x = px;      vertices[0].y = py;      vertices[0].z = 0.5f; vertices[0].rhw = 1.0f; vertices[0].diffuse = diffuse; vertices[0].u = 0.0f; vertices[0].v = 0.0f;
-    vertices[1].x = px + fw; vertices[1].y = py;      vertices[1].z = 0.5f; vertices[1].rhw = 1.0f; vertices[1].diffuse = diffuse; vertices[1].u = 1.0f; vertices[1].v = 0.0f;
-    vertices[2].x = px;      vertices[2].y = py + fh; vertices[2].z = 0.5f; vertices[2].rhw = 1.0f; vertices[2].diffuse = diffuse; vertices[2].u = 0.0f; vertices[2].v = 1.0f;
-    vertices[3].x = px + fw; vertices[3].y = py + fh; vertices[3].z = 0.5f; vertices[3].rhw = 1.0f; vertices[3].diffuse = diffuse; vertices[3].u = 1.0f; vertices[3].v = 1.0f;
-
-    SaveRenderState();
-    Context::GetD3dDevice()->SetVertexShader(D3DFVF_XYZRHW | D3DFVF_DIFFUSE | D3DFVF_TEX1);
-    Context::GetD3dDevice()->SetTexture(0, texture);
-    Context::GetD3dDevice()->SetTextureStageState(0, D3DTSS_MINFILTER, D3DTEXF_LINEAR);
-    Context::GetD3dDevice()->SetTextureStageState(0, D3DTSS_MAGFILTER, D3DTEXF_LINEAR);
-    Context::GetD3dDevice()->SetTextureStageState(0, D3DTSS_COLOROP, D3DTOP_MODULATE);
-    Context::GetD3dDevice()->SetTextureStageState(0, D3DTSS_ALPHAOP, D3DTOP_MODULATE);
-    Context::GetD3dDevice()->SetTextureStageState(0, D3DTSS_COLORARG1, D3DTA_TEXTURE);
-    Context::GetD3dDevice()->SetTextureStageState(0, D3DTSS_COLORARG2, D3DTA_DIFFUSE);
-    Context::GetD3dDevice()->DrawPrimitiveUP(D3DPT_TRIANGLESTRIP, 2, vertices, sizeof(TEXVERTEX));
-    RestoreRenderState();
+    AppendQuad(x, y, x + width, y + height, 0.0f, 0.0f, 1.0f, 1.0f, diffuse);
+    SubmitScratch(texture);
+}
+
+void Drawing::DrawSprites(D3DTexture* texture, const Sprite* sprites, int32_t count)
+{
+    const float sx = Context::GetScaleX(), sy = Context::GetScaleY();
+    for (int32_t i = 0; i < count; i++)
+    {
+        const Sprite& sprite = sprites[i];
+        float px = sprite.x * sx;
+        float py = sprite.y * sy;
+        AppendQuad(px, py, px + sprite.width * sx, py + sprite.height * sy, sprite.u0, sprite.v0, sprite.u1, sprite.v1, sprite.diffuse);
+    }
+    SubmitScratch(texture);
 }
 
 void Drawing::DrawNinePatch(D3DTexture* texture, uint32_t diffuse, float x, float y, float width, float height, float cornerWidthPx, float cornerHeightPx, float contentWidthPx, float contentHeightPx)
@@ -516,138 +1434,33 @@ void Drawing::DrawNinePatch(D3DTexture* texture, uint32_t diffuse, float x, floa
         ch = height / 2;
     }
 
-    const float u0 = 0.0f;
-    const float u1 = (float)cw / surfaceW;
-    const float u2 = (float)(contentW - cw) / surfaceW;
-    const float u3 = (float)contentW / surfaceW;
-    const float v0 = 0.0f;
-    const float v1 = (float)ch / surfaceH;
-    const float v2 = (float)(contentH - ch) / surfaceH;
-    const float v3 = (float)contentH / surfaceH;
-
-    const float x0 = (float)x;
-    const float x1 = (float)(x + cw);
-    const float x2 = (float)(x + width - cw);
-    const float x3 = (float)(x + width);
-    const float y0 = (float)y;
-    const float y1 = (float)(y + ch);
-    const float y2 = (float)(y + height - ch);
-    const float y3 = (float)(y + height);
-
-    TEXVERTEX batchBuf[54];
-    int32_t v = 0;
-
-    batchBuf[v].x = x0; batchBuf[v].y = y0; batchBuf[v].z = 0.5f; batchBuf[v].rhw = 1.0f; batchBuf[v].diffuse = diffuse; batchBuf[v].u = u0; batchBuf[v].v = v0; v++;
-    batchBuf[v].x = x1; batchBuf[v].y = y0; batchBuf[v].z = 0.5f; batchBuf[v].rhw = 1.0f; batchBuf[v].diffuse = diffuse; batchBuf[v].u = u1; batchBuf[v].v = v0; v++;
-    batchBuf[v].x = x0; batchBuf[v].y = y1; batchBuf[v].z = 0.5f; batchBuf[v].rhw = 1.0f; batchBuf[v].diffuse = diffuse; batchBuf[v].u = u0; batchBuf[v].v = v1; v++;
-    batchBuf[v].x = x1; batchBuf[v].y = y0; batchBuf[v].z = 0.5f; batchBuf[v].rhw = 1.0f; batchBuf[v].diffuse = diffuse; batchBuf[v].u = u1; batchBuf[v].v = v0; v++;
-    batchBuf[v].x = x1; batchBuf[v].y = y1; batchBuf[v].z = 0.5f; batchBuf[v].rhw = 1.0f; batchBuf[v].diffuse = diffuse; batchBuf[v].u = u1; batchBuf[v].v = v1; v++;
-    batchBuf[v].x = x0; batchBuf[v].y = y1; batchBuf[v].z = 0.5f; batchBuf[v].rhw = 1.0f; batchBuf[v].diffuse = diffuse; batchBuf[v].u = u0; batchBuf[v].v = v1; v++;
-
-    batchBuf[v].x = x1; batchBuf[v].y = y0; batchBuf[v].z = 0.5f; batchBuf[v].rhw = 1.0f; batchBuf[v].diffuse = diffuse; batchBuf[v].u = u1; batchBuf[v].v = v0; v++;
-    batchBuf[v].x = x2; batchBuf[v].y = y0; batchBuf[v].z = 0.5f; batchBuf[v].rhw = 1.0f; batchBuf[v].diffuse = diffuse; batchBuf[v].u = u2; batchBuf[v].v = v0; v++;
-    batchBuf[v].x = x1; batchBuf[v].y = y1; batchBuf[v].z = 0.5f; batchBuf[v].rhw = 1.0f; batchBuf[v].diffuse = diffuse; batchBuf[v].u = u1; batchBuf[v].v = v1; v++;
-    batchBuf[v].x = x2; batchBuf[v].y = y0; batchBuf[v].z = 0.5f; batchBuf[v].rhw = 1.0f; batchBuf[v].diffuse = diffuse; batchBuf[v].u = u2; batchBuf[v].v = v0; v++;
-    batchBuf[v].x = x2; batchBuf[v].y = y1; batchBuf[v].z = 0.5f; batchBuf[v].rhw = 1.0f; batchBuf[v].diffuse = diffuse; batchBuf[v].u = u2; batchBuf[v].v = v1; v++;
-    batchBuf[v].x = x1; batchBuf[v].y = y1; batchBuf[v].z = 0.5f; batchBuf[v].rhw = 1.0f; batchBuf[v].diffuse = diffuse; batchBuf[v].u = u1; batchBuf[v].v = v1; v++;
-
-    batchBuf[v].x = x2; batchBuf[v].y = y0; batchBuf[v].z = 0.5f; batchBuf[v].rhw = 1.0f; batchBuf[v].diffuse = diffuse; batchBuf[v].u = u2; batchBuf[v].v = v0; v++;
-    batchBuf[v].x = x3; batchBuf[v].y = y0; batchBuf[v].z = 0.5f; batchBuf[v].rhw = 1.0f; batchBuf[v].diffuse = diffuse; batchBuf[v].u = u3; batchBuf[v].v = v0; v++;
-    batchBuf[v].x = x2; batchBuf[v].y = y1; batchBuf[v].z = 0.5f; batchBuf[v].rhw = 1.0f; batchBuf[v].diffuse = diffuse; batchBuf[v].u = u2; batchBuf[v].v = v1; v++;
-    batchBuf[v].x = x3; batchBuf[v].y = y0; batchBuf[v].z = 0.5f; batchBuf[v].rhw = 1.0f; batchBuf[v].diffuse = diffuse; batchBuf[v].u = u3; batchBuf[v].v = v0; v++;
-    batchBuf[v].x = x3; batchBuf[v].y = y1; batchBuf[v].z = 0.5f; batchBuf[v].rhw = 1.0f; batchBuf[v].diffuse = diffuse; batchBuf[v].u = u3; batchBuf[v].v = v1; v++;
-    batchBuf[v].x = x2; batchBuf[v].y = y1; batchBuf[v].z = 0.5f; batchBuf[v].rhw = 1.0f; batchBuf[v].diffuse = diffuse; batchBuf[v].u = u2; batchBuf[v].v = v1; v++;
-
-    batchBuf[v].x = x0; batchBuf[v].y = y1; batchBuf[v].z = 0.5f; batchBuf[v].rhw = 1.0f; batchBuf[v].diffuse = diffuse; batchBuf[v].u = u0; batchBuf[v].v = v1; v++;
-    batchBuf[v].x = x1; batchBuf[v].y = y1; batchBuf[v].z = 0.5f; batchBuf[v].rhw = 1.0f; batchBuf[v].diffuse = diffuse; batchBuf[v].u = u1; batchBuf[v].v = v1; v++;
-    batchBuf[v].x = x0; batchBuf[v].y = y2; batchBuf[v].z = 0.5f; batchBuf[v].rhw = 1.0f; batchBuf[v].diffuse = diffuse; batchBuf[v].u = u0; batchBuf[v].v = v2; v++;
-    batchBuf[v].x = x1; batchBuf[v].y = y1; batchBuf[v].z = 0.5f; batchBuf[v].rhw = 1.0f; batchBuf[v].diffuse = diffuse; batchBuf[v].u = u1; batchBuf[v].v = v1; v++;
-    batchBuf[v].x = x1; batchBuf[v].y = y2; batchBuf[v].z = 0.5f; batchBuf[v].rhw = 1.0f; batchBuf[v].diffuse = diffuse; batchBuf[v].u = u1; batchBuf[v].v = v2; v++;
-    batchBuf[v].x = x0; batchBuf[v].y = y2; batchBuf[v].z = 0.5f; batchBuf[v].rhw = 1.0f; batchBuf[v].diffuse = diffuse; batchBuf[v].u = u0; batchBuf[v].v = v2; v++;
-
-    batchBuf[v].x = x1; batchBuf[v].y = y1; batchBuf[v].z = 0.5f; batchBuf[v].rhw = 1.0f; batchBuf[v].diffuse = diffuse; batchBuf[v].u = u1; batchBuf[v].v = v1; v++;
-    batchBuf[v].x = x2; batchBuf[v].y = y1; batchBuf[v].z = 0.5f; batchBuf[v].rhw = 1.0f; batchBuf[v].diffuse = diffuse; batchBuf[v].u = u2; batchBuf[v].v = v1; v++;
-    batchBuf[v].x = x1; batchBuf[v].y = y2; batchBuf[v].z = 0.5f; batchBuf[v].rhw = 1.0f; batchBuf[v].diffuse = diffuse; batchBuf[v].u = u1; batchBuf[v].v = v2; v++;
-    batchBuf[v].x = x2; batchBuf[v].y = y1; batchBuf[v].z = 0.5f; batchBuf[v].rhw = 1.0f; batchBuf[v].diffuse = diffuse; batchBuf[v].u = u2; batchBuf[v].v = v1; v++;
-    batchBuf[v].x = x2; batchBuf[v].y = y2; batchBuf[v].z = 0.5f; batchBuf[v].rhw = 1.0f; batchBuf[v].diffuse = diffuse; batchBuf[v].u = u2; batchBuf[v].v = v2; v++;
-    batchBuf[v].x = x1; batchBuf[v].y = y2; batchBuf[v].z = 0.5f; batchBuf[v].rhw = 1.0f; batchBuf[v].diffuse = diffuse; batchBuf[v].u = u1; batchBuf[v].v = v2; v++;
-
-    batchBuf[v].x = x2; batchBuf[v].y = y1; batchBuf[v].z = 0.5f; batchBuf[v].rhw = 1.0f; batchBuf[v].diffuse = diffuse; batchBuf[v].u = u2; batchBuf[v].v = v1; v++;
-    batchBuf[v].x = x3; batchBuf[v].y = y1; batchBuf[v].z = 0.5f; batchBuf[v].rhw = 1.0f; batchBuf[v].diffuse = diffuse; batchBuf[v].u = u3; batchBuf[v].v = v1; v++;
-    batchBuf[v].x = x2; batchBuf[v].y = y2; batchBuf[v].z = 0.5f; batchBuf[v].rhw = 1.0f; batchBuf[v].diffuse = diffuse; batchBuf[v].u = u2; batchBuf[v].v = v2; v++;
-    batchBuf[v].x = x3; batchBuf[v].y = y1; batchBuf[v].z = 0.5f; batchBuf[v].rhw = 1.0f; batchBuf[v].diffuse = diffuse; batchBuf[v].u = u3; batchBuf[v].v = v1; v++;
-    batchBuf[v].x = x3; batchBuf[v].y = y2; batchBuf[v].z = 0.5f; batchBuf[v].rhw = 1.0f; batchBuf[v].diffuse = diffuse; batchBuf[v].u = u3; batchBuf[v].v = v2; v++;
-    batchBuf[v].x = x2; batchBuf[v].y = y2; batchBuf[v].z = 0.5f; batchBuf[v].rhw = 1.0f; batchBuf[v].diffuse = diffuse; batchBuf[v].u = u2; batchBuf[v].v = v2; v++;
-
-    batchBuf[v].x = x0; batchBuf[v].y = y2; batchBuf[v].z = 0.5f; batchBuf[v].rhw = 1.0f; batchBuf[v].diffuse = diffuse; batchBuf[v].u = u0; batchBuf[v].v = v2; v++;
-    batchBuf[v].x = x1; batchBuf[v].y = y2; batchBuf[v].z = 0.5f; batchBuf[v].rhw = 1.0f; batchBuf[v].diffuse = diffuse; batchBuf[v].u = u1; batchBuf[v].v = v2; v++;
-    batchBuf[v].x = x0; batchBuf[v].y = y3; batchBuf[v].z = 0.5f; batchBuf[v].rhw = 1.0f; batchBuf[v].diffuse = diffuse; batchBuf[v].u = u0; batchBuf[v].v = v3; v++;
-    batchBuf[v].x = x1; batchBuf[v].y = y2; batchBuf[v].z = 0.5f; batchBuf[v].rhw = 1.0f; batchBuf[v].diffuse = diffuse; batchBuf[v].u = u1; batchBuf[v].v = v2; v++;
-    batchBuf[v].x = x1; batchBuf[v].y = y3; batchBuf[v].z = 0.5f; batchBuf[v].rhw = 1.0f; batchBuf[v].diffuse = diffuse; batchBuf[v].u = u1; batchBuf[v].v = v3; v++;
-    batchBuf[v].x = x0; batchBuf[v].y = y3; batchBuf[v].z = 0.5f; batchBuf[v].rhw = 1.0f; batchBuf[v].diffuse = diffuse; batchBuf[v].u = u0; batchBuf[v].v = v3; v++;
-
-    batchBuf[v].x = x1; batchBuf[v].y = y2; batchBuf[v].z = 0.5f; batchBuf[v].rhw = 1.0f; batchBuf[v].diffuse = diffuse; batchBuf[v].u = u1; batchBuf[v].v = v2; v++;
-    batchBuf[v].x = x2; batchBuf[v].y = y2; batchBuf[v].z = 0.5f; batchBuf[v].rhw = 1.0f; batchBuf[v].diffuse = diffuse; batchBuf[v].u = u2; batchBuf[v].v = v2; v++;
-    batchBuf[v].x = x1; batchBuf[v].y = y3; batchBuf[v].z = 0.5f; batchBuf[v].rhw = 1.0f; batchBuf[v].diffuse = diffuse; batchBuf[v].u = u1; batchBuf[v].v = v3; v++;
-    batchBuf[v].x = x2; batchBuf[v].y = y2; batchBuf[v].z = 0.5f; batchBuf[v].rhw = 1.0f; batchBuf[v].diffuse = diffuse; batchBuf[v].u = u2; batchBuf[v].v = v2; v++;
-    batchBuf[v].x = x2; batchBuf[v].y = y3; batchBuf[v].z = 0.5f; batchBuf[v].rhw = 1.0f; batchBuf[v].diffuse = diffuse; batchBuf[v].u = u2; batchBuf[v].v = v3; v++;
-    batchBuf[v].x = x1; batchBuf[v].y = y3; batchBuf[v].z = 0.5f; batchBuf[v].rhw = 1.0f; batchBuf[v].diffuse = diffuse; batchBuf[v].u = u1; batchBuf[v].v = v3; v++;
-
-    batchBuf[v].x = x2; batchBuf[v].y = y2; batchBuf[v].z = 0.5f; batchBuf[v].rhw = 1.0f; batchBuf[v].diffuse = diffuse; batchBuf[v].u = u2; batchBuf[v].v = v2; v++;
-    batchBuf[v].x = x3; batchBuf[v].y = y2; batchBuf[v].z = 0.5f; batchBuf[v].rhw = 1.0f; batchBuf[v].diffuse = diffuse; batchBuf[v].u = u3; batchBuf[v].v = v2; v++;
-    batchBuf[v].x = x2; batchBuf[v].y = y3; batchBuf[v].z = 0.5f; batchBuf[v].rhw = 1.0f; batchBuf[v].diffuse = diffuse; batchBuf[v].u = u2; batchBuf[v].v = v3; v++;
-    batchBuf[v].x = x3; batchBuf[v].y = y2; batchBuf[v].z = 0.5f; batchBuf[v].rhw = 1.0f; batchBuf[v].diffuse = diffuse; batchBuf[v].u = u3; batchBuf[v].v = v2; v++;
-    batchBuf[v].x = x3; batchBuf[v].y = y3; batchBuf[v].z = 0.5f; batchBuf[v].rhw = 1.0f; batchBuf[v].diffuse = diffuse; batchBuf[v].u = u3; batchBuf[v].v = v3; v++;
-    batchBuf[v].x = x2; batchBuf[v].y = y3; batchBuf[v].z = 0.5f; batchBuf[v].rhw = 1.0f; batchBuf[v].diffuse = diffuse; batchBuf[v].u = u2; batchBuf[v].v = v3; v++;
-
-    SaveRenderState();
-    Context::GetD3dDevice()->SetVertexShader(D3DFVF_XYZRHW | D3DFVF_DIFFUSE | D3DFVF_TEX1);
-    Context::GetD3dDevice()->SetTexture(0, texture);
-    Context::GetD3dDevice()->SetTextureStageState(0, D3DTSS_MINFILTER, D3DTEXF_LINEAR);
-    Context::GetD3dDevice()->SetTextureStageState(0, D3DTSS_MAGFILTER, D3DTEXF_LINEAR);
-    Context::GetD3dDevice()->SetTextureStageState(0, D3DTSS_COLOROP, D3DTOP_MODULATE);
-    Context::GetD3dDevice()->SetTextureStageState(0, D3DTSS_ALPHAOP, D3DTOP_MODULATE);
-    Context::GetD3dDevice()->SetTextureStageState(0, D3DTSS_COLORARG1, D3DTA_TEXTURE);
-    Context::GetD3dDevice()->SetTextureStageState(0, D3DTSS_COLORARG2, D3DTA_DIFFUSE);
-    Context::GetD3dDevice()->DrawPrimitiveUP(D3DPT_TRIANGLELIST, 18, batchBuf, sizeof(TEXVERTEX));
-    RestoreRenderState();
+    const float us[4] = { 0.0f, cw / surfaceW, (contentW - cw) / surfaceW, contentW / surfaceW };
+    const float vs[4] = { 0.0f, ch / surfaceH, (contentH - ch) / surfaceH, contentH / surfaceH };
+    const float xs[4] = { x, x + cw, x + width - cw, x + width };
+    const float ys[4] = { y, y + ch, y + height - ch, y + height };
+
+    for (int32_t row = 0; row < 3; row++)
+    {
+        for (int32_t col = 0; col < 3; col++) {
+            AppendQuad(xs[col], ys[row], xs[col + 1], ys[row + 1], us[col], vs[row], us[col + 1], vs[row + 1], diffuse);
+        }
+    }
+    SubmitScratch(texture);
 }
 
+// Clipping is applied to quads on the CPU as they are recorded, which keeps
+// clipped text batchable with everything else. Stencil regions do not nest.
 void Drawing::BeginStencil(float x, float y, float w, float h)
 {
     const float sx = Context::GetScaleX(), sy = Context::GetScaleY();
-    x *= sx; y *= sy; w *= sx; h *= sy;
-    SaveRenderState();
-
-    Context::GetD3dDevice()->SetRenderState(D3DRS_STENCILENABLE, TRUE);
-    Context::GetD3dDevice()->SetRenderState(D3DRS_STENCILFUNC, D3DCMP_ALWAYS);
-    Context::GetD3dDevice()->SetRenderState(D3DRS_STENCILREF, 1);
-    Context::GetD3dDevice()->SetRenderState(D3DRS_STENCILMASK, 0xFFFFFFFF);
-    Context::GetD3dDevice()->SetRenderState(D3DRS_STENCILWRITEMASK, 0xFFFFFFFF);
-    Context::GetD3dDevice()->SetRenderState(D3DRS_STENCILPASS, D3DSTENCILOP_REPLACE);
-    Context::GetD3dDevice()->SetRenderState(D3DRS_COLORWRITEENABLE, 0);
-    Context::GetD3dDevice()->SetRenderState(D3DRS_ZENABLE, FALSE);
-
-    struct stencil_vertex { float x,y,z,rhw; };
-    stencil_vertex quad[4] = {
-        { x, y, 0.0f, 1.0f },
-        { x + w, y, 0.0f, 1.0f },
-        { x, y + h, 0.0f, 1.0f },
-        { x + w, y + h, 0.0f, 1.0f },
-    };
-
-    Context::GetD3dDevice()->Clear(0L, nullptr, D3DCLEAR_STENCIL, 0, 1.0f, 0L);
-    Context::GetD3dDevice()->SetVertexShader(D3DFVF_XYZRHW);
-    Context::GetD3dDevice()->DrawPrimitiveUP(D3DPT_TRIANGLESTRIP, 2, quad, sizeof(stencil_vertex));
-
-    Context::GetD3dDevice()->SetRenderState(D3DRS_COLORWRITEENABLE, D3DCOLORWRITEENABLE_RED | D3DCOLORWRITEENABLE_GREEN | D3DCOLORWRITEENABLE_BLUE | D3DCOLORWRITEENABLE_ALPHA);
-    Context::GetD3dDevice()->SetRenderState(D3DRS_STENCILFUNC, D3DCMP_EQUAL);
-    Context::GetD3dDevice()->SetRenderState(D3DRS_STENCILREF, 1);
-    Context::GetD3dDevice()->SetRenderState(D3DRS_STENCILPASS, D3DSTENCILOP_KEEP);
+    mClipEnabled = true;
+    mClipX0 = x * sx;
+    mClipY0 = y * sy;
+    mClipX1 = (x + w) * sx;
+    mClipY1 = (y + h) * sy;
 }
 
 void Drawing::EndStencil()
 {
-    Context::GetD3dDevice()->SetRenderState(D3DRS_STENCILENABLE, FALSE);
-    RestoreRenderState();
+    mClipEnabled = false;
 }
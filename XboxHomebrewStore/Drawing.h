@@ -17,12 +17,47 @@ typedef struct {
     D3DTexture* texture;
 } Image;
 
+#define GLYPH_DIRECT_COUNT 256
+
+typedef struct
+{
+    uint32_t unicode;
+    Rect rect;
+    float u0, v0, u1, v1;
+    int32_t advance;
+    uint32_t lastUsed;
+    bool present;
+    bool pinned;
+    bool missing;
+} Glyph;
+
+typedef struct
+{
+    int32_t x;
+    int32_t y;
+    int32_t width;
+} SkylineNode;
+
+// Latin-1 glyphs are indexed directly by code point; anything above lives in
+// a small open addressed table (power of two size, linear probing).
+// Glyphs outside the pinned warm set are rasterised on demand through the
+// ssfn context and packed with a skyline allocator. generation changes
+// whenever eviction moves glyphs, which invalidates cached layouts.
 typedef struct 
 {    
-    std::map<uint32_t, Rect> charmap;
+    Glyph glyphs[GLYPH_DIRECT_COUNT];
+    std::vector<Glyph> extendedGlyphs;
+    uint32_t extendedCount;
     int32_t line_height;
     int32_t spacing;
     Image image;
+    void* context;
+    std::string fontName;
+    int32_t fontStyle;
+    int32_t fontSize;
+    std::vector<SkylineNode> skyline;
+    std::vector<SkylineNode> pinnedSkyline;
+    uint32_t generation;
 } BitmapFont;
 
 typedef struct
@@ -38,20 +73,63 @@ typedef struct
     uint32_t diffuse;
 } VERTEX;
 
+typedef struct
+{
+    float x, y, width, height;
+    float u0, v0, u1, v1;
+    uint32_t diffuse;
+} Sprite;
+
+// Glyph quads in layout space (origin at the top left of the first line),
+// with the index of the first quad on each line.
+typedef struct
+{
+    BitmapFont* font;
+    std::string message;
+    float maxWidth;
+    uint32_t generation;
+    std::vector<Sprite> quads;
+    std::vector<uint32_t> lineStarts;
+    std::vector<uint32_t> dynamicGlyphs;
+    float lineHeight;
+    float width;
+    float height;
+} TextLayout;
+
 class Drawing
 {
 public:
-    static void SaveRenderState();
-    static void RestoreRenderState();
     static void Init();
+    static void BeginFrame();
+    static void EndFrame();
+    static void Flush();
+    static uint32_t GetDrawCallCount();
+    static uint32_t GetVertexCount();
+    static uint32_t GetStateChangesIssued();
+    static uint32_t GetStateChangesSuppressed();
+    static void InvalidateDeviceState();
+    static void SetRenderState(D3DRENDERSTATETYPE state, DWORD value);
+    static void SetTextureStageState(DWORD stage, D3DTEXTURESTAGESTATETYPE type, DWORD value);
+    static void SetTexture(DWORD stage, D3DTexture* texture);
+    static void SetVertexShader(DWORD handle);
     static void Swizzle(const void* src, const uint32_t& depth, const uint32_t& width, const uint32_t& height, void* dest);
+    static void Deswizzle(const void* src, const uint32_t& depth, const uint32_t& width, const uint32_t& height, void* dest);
     static bool TryCreateImage(uint8_t* imageData, D3DFORMAT format, int32_t width, int32_t height, Image* image);
     static bool LoadFont(const std::string filePath, void* context);
+    static void ClearGlyphs(BitmapFont* font);
+    static void SetGlyph(BitmapFont* font, uint32_t unicode, const Rect& rect, int32_t textureWidth, int32_t textureHeight);
+    static const Glyph* FindGlyph(const BitmapFont* font, uint32_t unicode);
+    static const Glyph* GetGlyph(BitmapFont* font, uint32_t unicode);
     static bool TryGenerateBitmapFont(void* context, const std::string fontName, int32_t fontStyle, int32_t fontSize, int32_t lineHeight, int32_t spacing, int32_t textureDimension, BitmapFont* bitmapFont);
+    static bool TrySaveBakedFont(BitmapFont* bitmapFont, const std::string filePath, uint32_t sourceStamp);
+    static bool TryLoadBakedFont(void* context, const std::string filePath, uint32_t sourceStamp, const std::string fontName, int32_t fontStyle, int32_t fontSize, int32_t lineHeight, int32_t spacing, int32_t textureDimension, BitmapFont* bitmapFont);
     static void DrawFont(BitmapFont* font, const std::string message, uint32_t color, float x, float y);
     static void DrawFontWrapped(BitmapFont* font, const std::string message, uint32_t color, float x, float y, float maxWidth);
+    static void BuildTextLayout(BitmapFont* font, const std::string& message, float maxWidth, TextLayout* layout);
+    static void DrawTextLayout(TextLayout* layout, uint32_t color, float x, float y);
     static void DrawFilledRect(uint32_t color, float x, float y, float width, float height);
     static void DrawTexturedRect(D3DTexture* texture, uint32_t diffuse, float x, float y, float width, float height);
+    static void DrawSprites(D3DTexture* texture, const Sprite* sprites, int32_t count);
     static void DrawNinePatch(D3DTexture* texture, uint32_t diffuse, float x, float y, float width, float height, float cornerWidthPx = 0, float cornerHeightPx = 0, float contentWidthPx = 0, float contentHeightPx = 0);
     static void BeginStencil(float x, float y, float w, float h);
     static void EndStencil();
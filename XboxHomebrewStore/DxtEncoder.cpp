@@ -0,0 +1,365 @@
+//=============================================================================
+// DxtEncoder.cpp - BC1 (DXT1) / BC3 (DXT5) block compressor
+//
+// Bounding box endpoint selection with diagonal flip and inset (as used by
+// most real-time encoders), then nearest palette index per texel. The inner
+// loops work on flat 16 element arrays with no data dependent branches so
+// the compiler can keep them in registers / vectorise them.
+//=============================================================================
+
+#include "DxtEncoder.h"
+
+#define DXT_INSET_SHIFT 4
+
+namespace {
+
+    inline uint16_t PackRgb565(int32_t r, int32_t g, int32_t b)
+    {
+        return (uint16_t)(((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3));
+    }
+
+    inline void UnpackRgb565(uint16_t c, int32_t* rgb)
+    {
+        int32_t r = (c >> 11) & 0x1f;
+        int32_t g = (c >> 5) & 0x3f;
+        int32_t b = c & 0x1f;
+        rgb[0] = (r << 3) | (r >> 2);
+        rgb[1] = (g << 2) | (g >> 4);
+        rgb[2] = (b << 3) | (b >> 2);
+    }
+
+    inline int32_t Clamp255(int32_t value)
+    {
+        return value < 0 ? 0 : (value > 255 ? 255 : value);
+    }
+
+    inline void WriteUInt16(uint8_t* out, uint16_t value)
+    {
+        out[0] = (uint8_t)(value & 0xff);
+        out[1] = (uint8_t)(value >> 8);
+    }
+
+    inline void WriteUInt32(uint8_t* out, uint32_t value)
+    {
+        out[0] = (uint8_t)(value & 0xff);
+        out[1] = (uint8_t)((value >> 8) & 0xff);
+        out[2] = (uint8_t)((value >> 16) & 0xff);
+        out[3] = (uint8_t)(value >> 24);
+    }
+
+    void EncodeColorBlock(const uint8_t* rgba, uint8_t* out)
+    {
+        int32_t minColor[3] = { 255, 255, 255 };
+        int32_t maxColor[3] = { 0, 0, 0 };
+        int32_t sum[3] = { 0, 0, 0 };
+        for (int32_t i = 0; i < 16; i++)
+        {
+            for (int32_t c = 0; c < 3; c++)
+            {
+                int32_t v = rgba[(i << 2) + c];
+                minColor[c] = v < minColor[c] ? v : minColor[c];
+                maxColor[c] = v > maxColor[c] ? v : maxColor[c];
+                sum[c] += v;
+            }
+        }
+
+        // Pick the bounding box diagonal that follows the colour distribution
+        int32_t covRB = 0;
+        int32_t covGB = 0;
+        for (int32_t i = 0; i < 16; i++)
+        {
+            int32_t r = (rgba[(i << 2) + 0] << 4) - sum[0];
+            int32_t g = (rgba[(i << 2) + 1] << 4) - sum[1];
+            int32_t b = (rgba[(i << 2) + 2] << 4) - sum[2];
+            covRB += (r >> 4) * (b >> 4);
+            covGB += (g >> 4) * (b >> 4);
+        }
+        if (covRB < 0)
+        {
+            int32_t temp = minColor[0];
+            minColor[0] = maxColor[0];
+            maxColor[0] = temp;
+        }
+        if (covGB < 0)
+        {
+            int32_t temp = minColor[1];
+            minColor[1] = maxColor[1];
+            maxColor[1] = temp;
+        }
+
+        // Inset the endpoints to reduce the error of the outermost texels
+        for (int32_t c = 0; c < 3; c++)
+        {
+            int32_t inset = (maxColor[c] - minColor[c]) >> DXT_INSET_SHIFT;
+            minColor[c] = Clamp255(minColor[c] + inset);
+            maxColor[c] = Clamp255(maxColor[c] - inset);
+        }
+
+        uint16_t color0 = PackRgb565(maxColor[0], maxColor[1], maxColor[2]);
+        uint16_t color1 = PackRgb565(minColor[0], minColor[1], minColor[2]);
+        if (color0 < color1)
+        {
+            uint16_t temp = color0;
+            color0 = color1;
+            color1 = temp;
+        }
+
+        WriteUInt16(out + 0, color0);
+        WriteUInt16(out + 2, color1);
+        if (color0 == color1)
+        {
+            WriteUInt32(out + 4, 0);
+            return;
+        }
+
+        // Four colour mode (color0 > color1): 0, 1, 2/3 0 + 1/3 1, 1/3 0 + 2/3 1
+        int32_t palette[4][3];
+        UnpackRgb565(color0, palette[0]);
+        UnpackRgb565(color1, palette[1]);
+        for (int32_t c = 0; c < 3; c++)
+        {
+            palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+            palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+        }
+
+        uint32_t indices = 0;
+        for (int32_t i = 0; i < 16; i++)
+        {
+            const uint8_t* texel = rgba + (i << 2);
+            uint32_t best = 0;
+            int32_t bestError = 0x7fffffff;
+            for (uint32_t p = 0; p < 4; p++)
+            {
+                int32_t dr = texel[0] - palette[p][0];
+                int32_t dg = texel[1] - palette[p][1];
+                int32_t db = texel[2] - palette[p][2];
+                int32_t error = dr * dr + dg * dg + db * db;
+                bool closer = error < bestError;
+                best = closer ? p : best;
+                bestError = closer ? error : bestError;
+            }
+            indices |= best << (i << 1);
+        }
+        WriteUInt32(out + 4, indices);
+    }
+
+    void EncodeAlphaBlock(const uint8_t* rgba, uint8_t* out)
+    {
+        int32_t minAlpha = 255;
+        int32_t maxAlpha = 0;
+        for (int32_t i = 0; i < 16; i++)
+        {
+            int32_t a = rgba[(i << 2) + 3];
+            minAlpha = a < minAlpha ? a : minAlpha;
+            maxAlpha = a > maxAlpha ? a : maxAlpha;
+        }
+
+        int32_t inset = (maxAlpha - minAlpha) >> (DXT_INSET_SHIFT + 1);
+        minAlpha += inset;
+        maxAlpha -= inset;
+
+        out[0] = (uint8_t)maxAlpha;
+        out[1] = (uint8_t)minAlpha;
+        memset(out + 2, 0, 6);
+        if (maxAlpha == minAlpha)
+        {
+            return;
+        }
+
+        // Eight alpha mode (alpha0 > alpha1): 0, 1, then six interpolated steps
+        int32_t palette[8];
+        palette[0] = maxAlpha;
+        palette[1] = minAlpha;
+        for (int32_t p = 1; p < 7; p++)
+        {
+            palette[p + 1] = ((7 - p) * maxAlpha + p * minAlpha) / 7;
+        }
+
+        uint32_t bits[2] = { 0, 0 };
+        for (int32_t i = 0; i < 16; i++)
+        {
+            int32_t a = rgba[(i << 2) + 3];
+            uint32_t best = 0;
+            int32_t bestError = 0x7fffffff;
+            for (uint32_t p = 0; p < 8; p++)
+            {
+                int32_t error = a - palette[p];
+                error = error < 0 ? -error : error;
+                bool closer = error < bestError;
+                best = closer ? p : best;
+                bestError = closer ? error : bestError;
+            }
+            bits[i >> 3] |= best << ((i & 7) * 3);
+        }
+
+        // Two groups of eight 3 bit indices, 24 bits each
+        out[2] = (uint8_t)(bits[0] & 0xff);
+        out[3] = (uint8_t)((bits[0] >> 8) & 0xff);
+        out[4] = (uint8_t)((bits[0] >> 16) & 0xff);
+        out[5] = (uint8_t)(bits[1] & 0xff);
+        out[6] = (uint8_t)((bits[1] >> 8) & 0xff);
+        out[7] = (uint8_t)((bits[1] >> 16) & 0xff);
+    }
+
+    void DecodeColorBlock(const uint8_t* block, uint8_t* rgba)
+    {
+        uint16_t color0 = (uint16_t)(block[0] | (block[1] << 8));
+        uint16_t color1 = (uint16_t)(block[2] | (block[3] << 8));
+        uint32_t indices = block[4] | (block[5] << 8) | (block[6] << 16) | ((uint32_t)block[7] << 24);
+
+        int32_t palette[4][4];
+        UnpackRgb565(color0, palette[0]);
+        UnpackRgb565(color1, palette[1]);
+        palette[0][3] = 255;
+        palette[1][3] = 255;
+        for (int32_t c = 0; c < 3; c++)
+        {
+            if (color0 > color1)
+            {
+                palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+                palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+            }
+            else
+            {
+                palette[2][c] = (palette[0][c] + palette[1][c]) / 2;
+                palette[3][c] = 0;
+            }
+        }
+        palette[2][3] = 255;
+        palette[3][3] = color0 > color1 ? 255 : 0;
+
+        for (int32_t i = 0; i < 16; i++)
+        {
+            const int32_t* color = palette[(indices >> (i << 1)) & 3];
+            rgba[(i << 2) + 0] = (uint8_t)color[0];
+            rgba[(i << 2) + 1] = (uint8_t)color[1];
+            rgba[(i << 2) + 2] = (uint8_t)color[2];
+            rgba[(i << 2) + 3] = (uint8_t)color[3];
+        }
+    }
+
+    void DecodeAlphaBlock(const uint8_t* block, uint8_t* rgba)
+    {
+        int32_t alpha0 = block[0];
+        int32_t alpha1 = block[1];
+        int32_t palette[8];
+        palette[0] = alpha0;
+        palette[1] = alpha1;
+        if (alpha0 > alpha1)
+        {
+            for (int32_t p = 1; p < 7; p++)
+            {
+                palette[p + 1] = ((7 - p) * alpha0 + p * alpha1) / 7;
+            }
+        }
+        else
+        {
+            for (int32_t p = 1; p < 5; p++)
+            {
+                palette[p + 1] = ((5 - p) * alpha0 + p * alpha1) / 5;
+            }
+            palette[6] = 0;
+            palette[7] = 255;
+        }
+
+        uint32_t bits[2];
+        bits[0] = block[2] | (block[3] << 8) | (block[4] << 16);
+        bits[1] = block[5] | (block[6] << 8) | (block[7] << 16);
+        for (int32_t i = 0; i < 16; i++)
+        {
+            rgba[(i << 2) + 3] = (uint8_t)palette[(bits[i >> 3] >> ((i & 7) * 3)) & 7];
+        }
+    }
+}
+
+uint32_t DxtEncoder::GetBlockSize(DxtFormat format)
+{
+    return format == DXT_FORMAT_BC1 ? 8 : 16;
+}
+
+uint32_t DxtEncoder::GetEncodedSize(DxtFormat format, int32_t width, int32_t height)
+{
+    uint32_t blocksX = (uint32_t)(width + 3) >> 2;
+    uint32_t blocksY = (uint32_t)(height + 3) >> 2;
+    return blocksX * blocksY * GetBlockSize(format);
+}
+
+void DxtEncoder::EncodeBC1Block(const uint8_t* rgba, uint8_t* out)
+{
+    EncodeColorBlock(rgba, out);
+}
+
+void DxtEncoder::EncodeBC3Block(const uint8_t* rgba, uint8_t* out)
+{
+    EncodeAlphaBlock(rgba, out);
+    EncodeColorBlock(rgba, out + 8);
+}
+
+bool DxtEncoder::EncodeImage(const uint8_t* rgba, int32_t width, int32_t height, DxtFormat format, uint8_t* out)
+{
+    if (rgba == NULL || out == NULL || width <= 0 || height <= 0)
+    {
+        return false;
+    }
+
+    uint32_t blockSize = GetBlockSize(format);
+    uint8_t block[64];
+    for (int32_t by = 0; by < height; by += 4)
+    {
+        for (int32_t bx = 0; bx < width; bx += 4)
+        {
+            // Gather the 4x4 texels, clamping to the image edge for partial blocks
+            for (int32_t y = 0; y < 4; y++)
+            {
+                int32_t sy = by + y < height ? by + y : height - 1;
+                const uint8_t* row = rgba + (size_t)sy * width * 4;
+                for (int32_t x = 0; x < 4; x++)
+                {
+                    int32_t sx = bx + x < width ? bx + x : width - 1;
+                    memcpy(block + (((y << 2) + x) << 2), row + (sx << 2), 4);
+                }
+            }
+
+            if (format == DXT_FORMAT_BC1)
+            {
+                EncodeBC1Block(block, out);
+            }
+            else
+            {
+                EncodeBC3Block(block, out);
+            }
+            out += blockSize;
+        }
+    }
+    return true;
+}
+
+void DxtEncoder::DecodeImage(const uint8_t* blocks, int32_t width, int32_t height, DxtFormat format, uint8_t* rgba)
+{
+    uint32_t blockSize = GetBlockSize(format);
+    uint8_t block[64];
+    for (int32_t by = 0; by < height; by += 4)
+    {
+        for (int32_t bx = 0; bx < width; bx += 4)
+        {
+            if (format == DXT_FORMAT_BC1)
+            {
+                DecodeColorBlock(blocks, block);
+            }
+            else
+            {
+                DecodeColorBlock(blocks + 8, block);
+                DecodeAlphaBlock(blocks, block);
+            }
+            blocks += blockSize;
+
+            for (int32_t y = 0; y < 4 && by + y < height; y++)
+            {
+                for (int32_t x = 0; x < 4 && bx + x < width; x++)
+                {
+                    memcpy(rgba + ((size_t)(by + y) * width + bx + x) * 4, block + (((y << 2) + x) << 2), 4);
+                }
+            }
+        }
+    }
+}
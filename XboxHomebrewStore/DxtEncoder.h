@@ -0,0 +1,28 @@
+//=============================================================================
+// DxtEncoder.h - BC1 (DXT1) / BC3 (DXT5) block compressor
+//
+// Platform independent (no XTL / D3D dependencies) so it can run on the image
+// worker thread and be built on a PC for quality and speed checks.
+//=============================================================================
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+enum DxtFormat
+{
+    DXT_FORMAT_BC1,
+    DXT_FORMAT_BC3
+};
+
+class DxtEncoder
+{
+public:
+    static uint32_t GetBlockSize(DxtFormat format);
+    static uint32_t GetEncodedSize(DxtFormat format, int32_t width, int32_t height);
+    static void EncodeBC1Block(const uint8_t* rgba, uint8_t* out);
+    static void EncodeBC3Block(const uint8_t* rgba, uint8_t* out);
+    static bool EncodeImage(const uint8_t* rgba, int32_t width, int32_t height, DxtFormat format, uint8_t* out);
+    static void DecodeImage(const uint8_t* blocks, int32_t width, int32_t height, DxtFormat format, uint8_t* rgba);
+};
@@ -29,6 +29,33 @@ FileContainer* getFileContainer(uint32_t fileHandle) {
 void deleteFileContainer(uint32_t fileHandle) {
     mFileContainerMap.erase(fileHandle);
 }
+
+void toFileTime(const FILETIME& fileTime, bool local, FileTime& out) {
+    out.month = 1;
+    out.day = 1;
+    out.year = 2000;
+    out.hour = 0;
+    out.minute = 0;
+    out.second = 0;
+    if (fileTime.dwHighDateTime == 0 && fileTime.dwLowDateTime == 0) {
+        return;
+    }
+
+    FILETIME converted = fileTime;
+    if (local && FileTimeToLocalFileTime(&fileTime, &converted) == FALSE) {
+        return;
+    }
+    SYSTEMTIME systemTime;
+    if (FileTimeToSystemTime(&converted, &systemTime) == FALSE) {
+        return;
+    }
+    out.month = systemTime.wMonth;
+    out.day = systemTime.wDay;
+    out.year = systemTime.wYear;
+    out.hour = systemTime.wHour;
+    out.minute = systemTime.wMinute;
+    out.second = systemTime.wSecond;
+}
 } // namespace
 
 bool FileSystem::FileGetFileInfoDetail(const std::string path, FileInfoDetail& out) {
@@ -147,6 +174,40 @@ std::vector<FileInfoDetail> FileSystem::FileGetFileInfoDetails(const std::string
     return fileInfoDetails;
 }
 
+// Unlike FileGetFileInfoDetails nothing is opened, collected or sorted: each
+// entry is built from the find data and handed over as FindNextFile yields it.
+// The detail passed to the callback is reused, and its path is only the name.
+bool FileSystem::FileEnumerateFileInfoDetails(const std::string path, FileInfoDetailFn callback, void* userData) {
+    WIN32_FIND_DATAA findData;
+
+    std::string searchPath = CombinePath(path, "*");
+    HANDLE findHandle = FindFirstFileA(searchPath.c_str(), &findData);
+    if (findHandle == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+
+    FileInfoDetail fileInfoDetail;
+    bool result = true;
+    do {
+        if (strcmp(findData.cFileName, ".") == 0 || strcmp(findData.cFileName, "..") == 0) {
+            continue;
+        }
+        fileInfoDetail.path.assign(findData.cFileName);
+        fileInfoDetail.isDirectory = (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+        fileInfoDetail.isFile = fileInfoDetail.isDirectory == false;
+        fileInfoDetail.size = fileInfoDetail.isDirectory ? 0 : findData.nFileSizeLow;
+        toFileTime(findData.ftLastAccessTime, false, fileInfoDetail.accessTime);
+        toFileTime(findData.ftLastWriteTime, true, fileInfoDetail.writeTime);
+        if (callback(fileInfoDetail, userData) == false) {
+            result = false;
+            break;
+        }
+    } while (FindNextFile(findHandle, &findData));
+    FindClose(findHandle);
+
+    return result;
+}
+
 bool FileSystem::FileOpen(const std::string path, FileMode fileMode, uint32_t& fileHandle) {
     const char* access = "";
     if (fileMode == FileModeRead) {
@@ -306,48 +367,63 @@ bool FileSystem::FileDelete(const std::string path) {
 }
 
 bool FileSystem::FileCopy(const std::string sourcePath, const std::string destPath) {
-    uint32_t sourceFileHandle;
-    if (FileOpen(sourcePath, FileModeRead, sourceFileHandle) == false) {
+    return FileCopy(sourcePath, destPath, NULL, NULL);
+}
+
+// Copies in large blocks straight through the Win32 handles, with the
+// destination sized up front so FATX can allocate its clusters in one run.
+bool FileSystem::FileCopy(const std::string sourcePath, const std::string destPath, FileCopyProgressFn progress, void* userData) {
+    HANDLE sourceFile = CreateFileA(sourcePath.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+        FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (sourceFile == INVALID_HANDLE_VALUE) {
         return false;
     }
 
-    uint32_t destFileHandle;
-    if (FileOpen(destPath, FileModeWrite, destFileHandle) == false) {
-        FileClose(sourceFileHandle);
+    HANDLE destFile = CreateFileA(destPath.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (destFile == INVALID_HANDLE_VALUE) {
+        CloseHandle(sourceFile);
         return false;
     }
 
-    char* buffer = (char*)malloc(32768);
-
-    uint32_t bytesRead;
-    if (FileRead(sourceFileHandle, buffer, 32768, bytesRead) == false) {
-        free(buffer);
-        FileClose(sourceFileHandle);
-        FileClose(destFileHandle);
-        return false;
+    const DWORD size = GetFileSize(sourceFile, NULL);
+    if (size != INVALID_FILE_SIZE && size > 0) {
+        SetFilePointer(destFile, size, NULL, FILE_BEGIN);
+        SetEndOfFile(destFile);
+        SetFilePointer(destFile, 0, NULL, FILE_BEGIN);
     }
 
-    while (bytesRead > 0) {
-        uint32_t bytesWritten;
-        if (FileWrite(destFileHandle, buffer, bytesRead, bytesWritten) == false || bytesWritten != bytesRead) {
-            free(buffer);
-            FileClose(sourceFileHandle);
-            FileClose(destFileHandle);
-            return false;
+    char* buffer = (char*)VirtualAlloc(NULL, FILE_COPY_BUFFER_SIZE, MEM_COMMIT, PAGE_READWRITE);
+    bool result = buffer != NULL;
+    while (result) {
+        DWORD bytesRead = 0;
+        if (ReadFile(sourceFile, buffer, FILE_COPY_BUFFER_SIZE, &bytesRead, NULL) == FALSE) {
+            result = false;
+            break;
         }
-        if (FileRead(sourceFileHandle, buffer, 32768, bytesRead) == false) {
-            free(buffer);
-            FileClose(sourceFileHandle);
-            FileClose(destFileHandle);
-            return false;
+        if (bytesRead == 0) {
+            break;
+        }
+        DWORD bytesWritten = 0;
+        if (WriteFile(destFile, buffer, bytesRead, &bytesWritten, NULL) == FALSE || bytesWritten != bytesRead) {
+            result = false;
+            break;
+        }
+        if (progress != NULL && progress(bytesRead, userData) == false) {
+            result = false;
         }
     }
 
-    free(buffer);
-
-    FileClose(sourceFileHandle);
-    FileClose(destFileHandle);
-    return true;
+    // Trims the reservation back if the source shrank or the copy stopped early
+    if (buffer != NULL) {
+        VirtualFree(buffer, 0, MEM_RELEASE);
+    }
+    SetEndOfFile(destFile);
+    CloseHandle(sourceFile);
+    CloseHandle(destFile);
+    if (result == false) {
+        DeleteFileA(destPath.c_str());
+    }
+    return result;
 }
 
 bool FileSystem::FileMove(const std::string sourcePath, const std::string destPath) {
@@ -2,6 +2,8 @@
 
 #include "Main.h"
 
+#define FILE_COPY_BUFFER_SIZE (1024 * 1024)
+
 typedef enum FileMode {
     FileModeRead = 0,
     FileModeWrite = 1,
@@ -47,8 +49,14 @@ typedef struct FileInfoDetail {
 
 class FileSystem {
   public:
+    // Called once per entry, in directory order; return false to stop early.
+    typedef bool (*FileInfoDetailFn)(const FileInfoDetail& fileInfoDetail, void* userData);
+    // Called after each block a copy writes, with its size; return false to cancel.
+    typedef bool (*FileCopyProgressFn)(uint32_t bytesCopied, void* userData);
+
     static bool FileGetFileInfoDetail(const std::string path, FileInfoDetail& out);
     static std::vector<FileInfoDetail> FileGetFileInfoDetails(const std::string path);
+    static bool FileEnumerateFileInfoDetails(const std::string path, FileInfoDetailFn callback, void* userData);
 
     static bool FileOpen(const std::string path, FileMode fileMode, uint32_t& fileHandle);
     static bool FileRead(uint32_t fileHandle, char* readBuffer, uint32_t bytesToRead, uint32_t& bytesRead);
@@ -64,6 +72,7 @@ class FileSystem {
     static bool DirectoryDelete(const std::string path, bool recursive);
     static bool FileDelete(const std::string path);
     static bool FileCopy(const std::string sourcePath, const std::string destPath);
+    static bool FileCopy(const std::string sourcePath, const std::string destPath, FileCopyProgressFn progress, void* userData);
     static bool FileMove(const std::string sourcePath, const std::string destPath);
     static bool FileSize(uint32_t fileHandle, uint32_t& size);
     static bool FileExists(const std::string path, bool& exists);
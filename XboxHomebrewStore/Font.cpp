@@ -2,7 +2,14 @@
 #include "Context.h"
 #include "Drawing.h"
 #include "Defines.h"
+#include "FileSystem.h"
+#include "Debug.h"
+#include "Deflate.h"
 #include "ssfn.h"
+
+#define FONT_SOURCE_PATH "D:\\Media\\Fonts\\Font.sfn"
+#define FONT_BAKED_DIRECTORY "T:\\Cache\\Fonts"
+
 namespace
 {
     ssfn_t      mMainFontContext;
@@ -14,6 +21,38 @@ namespace
         return (font == FONT_NORMAL) ? &mNormalMainFont : &mLargeMainFont;
     }
 
+    // The baked atlases are keyed on a CRC of the source font so a replaced
+    // Font.sfn is picked up on the next boot, even at the same size.
+    uint32_t GetSourceStamp()
+    {
+        uint32_t crc = 0;
+        FILE* fp = fopen(FONT_SOURCE_PATH, "rb");
+        if (fp)
+        {
+            uint8_t buffer[4096];
+            size_t bytesRead;
+            while ((bytesRead = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+                crc = Deflate::UpdateCrc32(crc, buffer, (uint32_t)bytesRead);
+            }
+            fclose(fp);
+        }
+        return crc;
+    }
+
+    // Returns true when the atlas came from the baked blob.
+    bool LoadOrGenerate(const std::string bakedPath, uint32_t sourceStamp, int32_t fontSize, int32_t lineHeight, int32_t textureDimension, BitmapFont* bitmapFont)
+    {
+        if (Drawing::TryLoadBakedFont(&mMainFontContext, bakedPath, sourceStamp, "FreeSans", SSFN_STYLE_REGULAR, fontSize, lineHeight, 0, textureDimension, bitmapFont)) {
+            return true;
+        }
+        if (Drawing::TryGenerateBitmapFont(&mMainFontContext, "FreeSans", SSFN_STYLE_REGULAR, fontSize, lineHeight, 0, textureDimension, bitmapFont)) {
+            if (!Drawing::TrySaveBakedFont(bitmapFont, bakedPath, sourceStamp)) {
+                Debug::Print("Font: failed to write %s\n", bakedPath.c_str());
+            }
+        }
+        return false;
+    }
+
     void MeasureInternal(BitmapFont* bitmapFont, const std::string message, float* outWidth)
     {
         float width = 0;
@@ -24,125 +63,100 @@ namespace
             char* cursor = (char*)p;
             uint32_t unicode = ssfn_utf8(&cursor);
             p = cursor;
-            std::map<uint32_t, Rect>::const_iterator it = bitmapFont->charmap.find(unicode);
-            if (it == bitmapFont->charmap.end()) {
+            const Glyph* glyph = Drawing::GetGlyph(bitmapFont, unicode);
+            if (glyph == nullptr) {
                 continue;
             }
-            if (!first) {
-                width += bitmapFont->spacing;
-            }
-            width += it->second.width;
+            width += glyph->advance;
             first = false;
         }
+        if (!first) {
+            width -= bitmapFont->spacing;
+        }
         if (outWidth) {
             *outWidth = width;
         }
     }
 
-    float MeasureWordWidth(BitmapFont* font, const char* p, const char** outEnd)
+    typedef struct
     {
-        float width = 0;
-        bool first = true;
-        while (*p)
+        FontType font;
+        float maxWidth;
+        std::string message;
+    } TextLayoutKey;
+
+    struct TextLayoutKeyLess
+    {
+        bool operator()(const TextLayoutKey& a, const TextLayoutKey& b) const
         {
-            char* cursor = (char*)p;
-            uint32_t unicode = ssfn_utf8(&cursor);
-            if (unicode == ' ' || unicode == '\n' || unicode == '\t') {
-                break;
+            if (a.font != b.font) {
+                return a.font < b.font;
             }
-            std::map<uint32_t, Rect>::const_iterator it = font->charmap.find(unicode);
-            if (it != font->charmap.end())
-            {
-                if (!first) {
-                    width += (float)font->spacing;
-                }
-                width += (float)it->second.width;
-                first = false;
+            if (a.maxWidth != b.maxWidth) {
+                return a.maxWidth < b.maxWidth;
             }
-            p = cursor;
+            return a.message < b.message;
         }
-        *outEnd = p;
-        return width;
-    }
+    };
 
-    void MeasureTextWrappedInternal(BitmapFont* font, const std::string message, float maxWidth, float* outWidth, float* outHeight)
+    typedef struct
     {
-        float lineWidth = 0;
-        float maxLineWidth = 0;
-        float maxHeight = (float)font->line_height;
-        const char* p = message.c_str();
-        while (*p)
-        {
-            char* cursor = (char*)p;
-            uint32_t unicode = ssfn_utf8(&cursor);
-            p = cursor;
+        TextLayout layout;
+        uint32_t lastUsed;
+    } TextLayoutEntry;
 
-            if (unicode == '\n')
-            {
-                if (lineWidth > maxLineWidth) {
-                    maxLineWidth = lineWidth;
-                }
-                lineWidth = 0;
-                maxHeight += (float)font->line_height;
-                continue;
-            }
+    typedef std::map<TextLayoutKey, TextLayoutEntry, TextLayoutKeyLess> TextLayoutMap;
 
-            std::map<uint32_t, Rect>::const_iterator it = font->charmap.find(unicode);
-            if (it == font->charmap.end()) {
-                continue;
-            }
+    TextLayoutMap mTextLayouts;
+    uint32_t mTextLayoutClock;
 
-            const Rect& rect = it->second;
-            float charWidth = (float)rect.width + (lineWidth > 0 ? (float)font->spacing : 0);
+    // Wrapped and scrolling labels are laid out once and then only translated
+    // each frame. The least recently used layout is dropped when full.
+    TextLayout* GetTextLayout(const FontType font, const std::string& message, float maxWidth)
+    {
+        TextLayoutKey key;
+        key.font = font;
+        key.maxWidth = maxWidth;
+        key.message = message;
+
+        mTextLayoutClock++;
+        TextLayoutMap::iterator it = mTextLayouts.find(key);
+        if (it != mTextLayouts.end())
+        {
+            it->second.lastUsed = mTextLayoutClock;
+            return &it->second.layout;
+        }
 
-            if (unicode == ' ')
-            {
-                const char* nextWordStart = p;
-                float nextWordW = MeasureWordWidth(font, nextWordStart, &nextWordStart);
-                if (lineWidth > 0 && lineWidth + (float)font->spacing + (float)rect.width + nextWordW > maxWidth)
-                {
-                    if (lineWidth > maxLineWidth) {
-                        maxLineWidth = lineWidth;
-                    }
-                    lineWidth = 0;
-                    maxHeight += (float)font->line_height;
-                    continue;
-                }
-                lineWidth += (lineWidth > 0 ? (float)font->spacing : 0) + (float)rect.width;
-            }
-            else
+        if (mTextLayouts.size() >= TEXT_LAYOUT_CACHE_SIZE)
+        {
+            TextLayoutMap::iterator oldest = mTextLayouts.begin();
+            for (TextLayoutMap::iterator candidate = mTextLayouts.begin(); candidate != mTextLayouts.end(); ++candidate)
             {
-                if (lineWidth > 0 && lineWidth + charWidth > maxWidth)
-                {
-                    if (lineWidth > maxLineWidth) {
-                        maxLineWidth = lineWidth;
-                    }
-                    lineWidth = 0;
-                    maxHeight += (float)font->line_height;
-                    charWidth = (float)rect.width;
+                if (candidate->second.lastUsed < oldest->second.lastUsed) {
+                    oldest = candidate;
                 }
-                lineWidth += charWidth;
             }
+            mTextLayouts.erase(oldest);
         }
-        if (lineWidth > maxLineWidth) {
-            maxLineWidth = lineWidth;
-        }
-        if (outWidth) {
-            *outWidth = maxLineWidth;
-        }
-        if (outHeight) {
-            *outHeight = maxHeight;
-        }
-    }
 
+        TextLayoutEntry& entry = mTextLayouts[key];
+        entry.lastUsed = mTextLayoutClock;
+        Drawing::BuildTextLayout(GetBitmapFont(font), message, maxWidth, &entry.layout);
+        return &entry.layout;
+    }
 }
 
 void Font::Init()
 {
-    if (Drawing::LoadFont("D:\\Media\\Fonts\\Font.sfn", &mMainFontContext))
+    DWORD start = GetTickCount();
+    if (Drawing::LoadFont(FONT_SOURCE_PATH, &mMainFontContext))
     {
-        Drawing::TryGenerateBitmapFont(&mMainFontContext, "FreeSans", SSFN_STYLE_REGULAR, 16, 16, 0, 256, &mNormalMainFont);
-        Drawing::TryGenerateBitmapFont(&mMainFontContext, "FreeSans", SSFN_STYLE_REGULAR, 24, 24, 0, 512, &mLargeMainFont);
+        uint32_t sourceStamp = GetSourceStamp();
+        FileSystem::DirectoryCreate("T:\\Cache");
+        FileSystem::DirectoryCreate(FONT_BAKED_DIRECTORY);
+        bool baked = LoadOrGenerate(FONT_BAKED_DIRECTORY "\\Normal.bin", sourceStamp, 16, 16, 256, &mNormalMainFont);
+        baked = LoadOrGenerate(FONT_BAKED_DIRECTORY "\\Large.bin", sourceStamp, 24, 24, 512, &mLargeMainFont) && baked;
+        Debug::Print("Font: atlases ready in %u ms (%s)\n", (uint32_t)(GetTickCount() - start), baked ? "baked" : "generated");
     }
 }
 
@@ -153,7 +167,13 @@ void Font::MeasureText(const FontType font, const std::string message, float* ou
 
 void Font::MeasureTextWrapped(const FontType font, const std::string message, float maxWidth, float* outWidth, float* outHeight)
 {
-    MeasureTextWrappedInternal(GetBitmapFont(font), message, maxWidth, outWidth, outHeight);
+    TextLayout* layout = GetTextLayout(font, message, maxWidth);
+    if (outWidth) {
+        *outWidth = layout->width;
+    }
+    if (outHeight) {
+        *outHeight = layout->height;
+    }
 }
 
 std::string Font::TruncateText(const FontType font, const std::string message, float maxWidth)
@@ -181,12 +201,12 @@ std::string Font::TruncateText(const FontType font, const std::string message, f
         uint32_t unicode = ssfn_utf8(&cursor);
         p = cursor;
 
-        std::map<uint32_t, Rect>::const_iterator it = bitmapFont->charmap.find(unicode);
-        if (it == bitmapFont->charmap.end()) {
+        const Glyph* glyph = Drawing::GetGlyph(bitmapFont, unicode);
+        if (glyph == nullptr) {
             continue;
         }
 
-        int32_t charW = it->second.width + (truncated.empty() ? 0 : bitmapFont->spacing);
+        int32_t charW = glyph->rect.width + (truncated.empty() ? 0 : bitmapFont->spacing);
         if (width + charW > budget) {
             break;
         }
@@ -205,16 +225,25 @@ void Font::DrawText(const FontType font, const std::string message, uint32_t col
 
 void Font::DrawTextWrapped(const FontType font, const std::string message, uint32_t color, float x, float y, float maxWidth)
 {
-    Drawing::DrawFontWrapped(GetBitmapFont(font), message, color, x, y, maxWidth);
+    Drawing::DrawTextLayout(GetTextLayout(font, message, maxWidth), color, x, y);
 }
 
 void Font::DrawTextScrolling(const FontType font, const std::string message, uint32_t color, float x, float y, float maxWidth, ScrollState& scrollState)
 {
-    BitmapFont* bitmapFont = GetBitmapFont(font);
+    // A scrolling label is one line; drop line breaks like DrawText's glyph
+    // loop used to rather than letting the layout start a second line.
+    TextLayout* layout;
+    if (message.find('\n') == std::string::npos) {
+        layout = GetTextLayout(font, message, 0);
+    } else {
+        std::string line = message;
+        line.erase(std::remove(line.begin(), line.end(), '\n'), line.end());
+        layout = GetTextLayout(font, line, 0);
+    }
 
     if (!scrollState.active)
     {
-        MeasureInternal(bitmapFont, message, &scrollState.textWidth);
+        scrollState.textWidth  = layout->width;
         scrollState.offset     = 0.0f;
         scrollState.lastTick   = GetTickCount();
         scrollState.pauseTimer = SCROLL_PAUSE;
@@ -223,24 +252,28 @@ void Font::DrawTextScrolling(const FontType font, const std::string message, uin
 
     if (scrollState.textWidth <= maxWidth)
     {
-        Drawing::DrawFont(bitmapFont, message, color, x, y);
+        Drawing::DrawTextLayout(layout, color, x, y);
         return;
     }
 
     DWORD now = GetTickCount();
     float dt = (float)(now - scrollState.lastTick) / 1000.0f;
-    if (dt > 0.1f) {
-        dt = 0.1f;
-    }
     scrollState.lastTick = now;
 
+    // The pause runs on wall time since idle frames may be skipped during it;
+    // wake the main loop when it ends rather than redrawing a static label.
     if (scrollState.pauseTimer > 0.0f)
     {
         scrollState.pauseTimer -= dt;
-        Drawing::DrawFont(bitmapFont, message, color, x, y);
+        Context::InvalidateAfter(scrollState.pauseTimer > 0.0f ? (uint32_t)(scrollState.pauseTimer * 1000.0f) : 0);
+        Drawing::DrawTextLayout(layout, color, x, y);
         return;
     }
 
+    if (dt > 0.1f) {
+        dt = 0.1f;
+    }
+    Context::Invalidate();
     scrollState.offset += SCROLL_SPEED * dt;
 
     float loopWidth = (float)(scrollState.textWidth + SCROLL_GAP);
@@ -252,10 +285,10 @@ void Font::DrawTextScrolling(const FontType font, const std::string message, uin
 
     float offsetPx = scrollState.offset;
 
-    Drawing::DrawFont(bitmapFont, message, color, x - offsetPx, y);
+    Drawing::DrawTextLayout(layout, color, x - offsetPx, y);
 
     float secondOffset = offsetPx - (scrollState.textWidth + SCROLL_GAP);
     if (secondOffset < maxWidth) {
-        Drawing::DrawFont(bitmapFont, message, color, x - secondOffset, y);
+        Drawing::DrawTextLayout(layout, color, x - secondOffset, y);
     }
 }
\ No newline at end of file
@@ -0,0 +1,325 @@
+//=============================================================================
+// FtpJobs.cpp - Server side copy and unzip jobs started over FTP (SITE commands)
+//
+// Jobs run one at a time on a single thread, since they are bound by the one
+// hard drive and two at once would only make both seek. The FTP session that
+// queued a job is free as soon as it has its job number; SITE JOBS reads the
+// progress the worker publishes here under the lock.
+//=============================================================================
+
+#include "FtpJobs.h"
+#include "FtpListingCache.h"
+#include "FileSystem.h"
+#include "String.h"
+#include "Debug.h"
+
+#include <list>
+
+namespace {
+    typedef struct
+    {
+        std::string source;
+        std::string destination;
+        bool isDirectory;
+        uint32_t size;
+    } CopyItem;
+
+    CRITICAL_SECTION mLock;
+    HANDLE mEvent = NULL;
+    HANDLE mThread = NULL;
+    volatile bool mQuit = false;
+    uint32_t mNextId = 1;
+    std::list<FtpJobInfo> mJobs;
+
+    // Only the worker's own job is ever looked up, and running jobs are never
+    // trimmed, so the pointer stays valid while it works
+    FtpJobInfo* FindJob(uint32_t id)
+    {
+        for (std::list<FtpJobInfo>::iterator it = mJobs.begin(); it != mJobs.end(); ++it) {
+            if (it->id == id) {
+                return &*it;
+            }
+        }
+        return NULL;
+    }
+
+    void TrimHistory()
+    {
+        uint32_t finished = 0;
+        for (std::list<FtpJobInfo>::iterator it = mJobs.begin(); it != mJobs.end(); ++it) {
+            if (it->state == FTP_JOB_DONE || it->state == FTP_JOB_FAILED) {
+                finished++;
+            }
+        }
+        std::list<FtpJobInfo>::iterator it = mJobs.begin();
+        while (finished > FTP_JOBS_HISTORY && it != mJobs.end()) {
+            if (it->state == FTP_JOB_DONE || it->state == FTP_JOB_FAILED) {
+                it = mJobs.erase(it);
+                finished--;
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    uint32_t Queue(FtpJobType type, const std::string source, const std::string destination,
+        const std::string sourceVirtual, const std::string destinationVirtual)
+    {
+        FtpJobInfo job;
+        job.type = type;
+        job.state = FTP_JOB_QUEUED;
+        job.source = source;
+        job.destination = destination;
+        job.sourceVirtual = sourceVirtual;
+        job.destinationVirtual = destinationVirtual;
+        job.bytesDone = 0;
+        job.bytesTotal = 0;
+        job.filesDone = 0;
+        job.fileCount = 0;
+        job.startTick = 0;
+        job.endTick = 0;
+
+        EnterCriticalSection(&mLock);
+        job.id = mNextId++;
+        mJobs.push_back(job);
+        TrimHistory();
+        SetEvent(mEvent);
+        LeaveCriticalSection(&mLock);
+        return job.id;
+    }
+
+    bool TakeJob(FtpJobInfo* job)
+    {
+        bool found = false;
+        EnterCriticalSection(&mLock);
+        for (std::list<FtpJobInfo>::iterator it = mJobs.begin(); it != mJobs.end(); ++it) {
+            if (it->state == FTP_JOB_QUEUED) {
+                it->state = FTP_JOB_RUNNING;
+                it->startTick = GetTickCount();
+                *job = *it;
+                found = true;
+                break;
+            }
+        }
+        if (found == false && mQuit == false) {
+            ResetEvent(mEvent);
+        }
+        LeaveCriticalSection(&mLock);
+        return found;
+    }
+
+    void FinishJob(uint32_t id, bool success)
+    {
+        EnterCriticalSection(&mLock);
+        FtpJobInfo* job = FindJob(id);
+        if (job != NULL) {
+            job->state = success ? FTP_JOB_DONE : FTP_JOB_FAILED;
+            job->endTick = GetTickCount();
+        }
+        LeaveCriticalSection(&mLock);
+    }
+
+    typedef struct
+    {
+        const std::string* source;
+        const std::string* destination;
+        std::vector<CopyItem>* items;
+    } CopyItemCollector;
+
+    bool CollectCopyItem(const FileInfoDetail& fileInfoDetail, void* userData)
+    {
+        if (mQuit) {
+            return false;
+        }
+        CopyItemCollector* collector = (CopyItemCollector*)userData;
+        CopyItem item;
+        item.source = FileSystem::CombinePath(*collector->source, fileInfoDetail.path);
+        item.destination = FileSystem::CombinePath(*collector->destination, fileInfoDetail.path);
+        item.isDirectory = fileInfoDetail.isDirectory;
+        item.size = fileInfoDetail.isDirectory ? 0 : fileInfoDetail.size;
+        collector->items->push_back(item);
+        return true;
+    }
+
+    // Walks the source once up front, so progress has a total to count against.
+    // Sizes come from the directory entries, so no file is opened, and each
+    // directory's find handle is closed before its subdirectories are walked
+    bool CollectCopyItems(const std::string source, const std::string destination, std::vector<CopyItem>& items)
+    {
+        CopyItemCollector collector;
+        collector.source = &source;
+        collector.destination = &destination;
+        collector.items = &items;
+        const size_t first = items.size();
+        if (FileSystem::FileEnumerateFileInfoDetails(source, CollectCopyItem, &collector) == false) {
+            // An empty directory has no first entry, which is not an error here
+            DWORD error = GetLastError();
+            if (mQuit || (error != ERROR_FILE_NOT_FOUND && error != ERROR_NO_MORE_FILES)) {
+                return false;
+            }
+        }
+
+        const size_t last = items.size();
+        for (size_t i = first; i < last; i++) {
+            if (items[i].isDirectory && CollectCopyItems(items[i].source, items[i].destination, items) == false) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool CopyProgress(uint32_t bytesCopied, void* userData)
+    {
+        EnterCriticalSection(&mLock);
+        FtpJobInfo* job = FindJob((uint32_t)(uintptr_t)userData);
+        if (job != NULL) {
+            job->bytesDone += bytesCopied;
+        }
+        LeaveCriticalSection(&mLock);
+        return mQuit == false;
+    }
+
+    bool RunCopy(const FtpJobInfo& job)
+    {
+        void* userData = (void*)(uintptr_t)job.id;
+        bool isDirectory = false;
+        if (FileSystem::DirectoryExists(job.source, isDirectory) == false || isDirectory == false) {
+            FileInfoDetail fileInfoDetail;
+            if (FileSystem::FileGetFileInfoDetail(job.source, fileInfoDetail) == false) {
+                return false;
+            }
+            EnterCriticalSection(&mLock);
+            FtpJobInfo* running = FindJob(job.id);
+            running->bytesTotal = fileInfoDetail.size;
+            running->fileCount = 1;
+            LeaveCriticalSection(&mLock);
+            return FileSystem::FileCopy(job.source, job.destination, CopyProgress, userData);
+        }
+
+        std::vector<CopyItem> items;
+        if (CollectCopyItems(job.source, job.destination, items) == false) {
+            return false;
+        }
+        uint64_t bytesTotal = 0;
+        uint32_t fileCount = 0;
+        for (size_t i = 0; i < items.size(); i++) {
+            if (items[i].isDirectory == false) {
+                bytesTotal += items[i].size;
+                fileCount++;
+            }
+        }
+        EnterCriticalSection(&mLock);
+        FtpJobInfo* running = FindJob(job.id);
+        running->bytesTotal = bytesTotal;
+        running->fileCount = fileCount;
+        LeaveCriticalSection(&mLock);
+
+        // Items are in walk order, so every directory comes before its contents
+        FileSystem::DirectoryCreate(job.destination);
+        for (size_t i = 0; i < items.size(); i++) {
+            const CopyItem& item = items[i];
+            if (item.isDirectory) {
+                FileSystem::DirectoryCreate(item.destination);
+                continue;
+            }
+            if (FileSystem::FileCopy(item.source, item.destination, CopyProgress, userData) == false) {
+                Debug::Print("Error: SITE CPTO could not copy %s\n", item.source.c_str());
+                return false;
+            }
+            EnterCriticalSection(&mLock);
+            FindJob(job.id)->filesDone++;
+            LeaveCriticalSection(&mLock);
+        }
+        return true;
+    }
+
+    bool UnzipProgress(int currentFile, int totalFiles, const char* currentFileName, void* userData)
+    {
+        EnterCriticalSection(&mLock);
+        FtpJobInfo* job = FindJob((uint32_t)(uintptr_t)userData);
+        if (job != NULL) {
+            job->filesDone = currentFile > 0 ? (uint32_t)currentFile - 1 : 0;
+            job->fileCount = (uint32_t)totalFiles;
+        }
+        LeaveCriticalSection(&mLock);
+        return mQuit == false;
+    }
+
+    // The same extraction the version scene installs with
+    bool RunUnzip(const FtpJobInfo& job)
+    {
+        FileSystem::DirectoryCreate(job.destination);
+        bool result = xunzipFromFile(job.source.c_str(), job.destination.c_str(), true, true, false, UnzipProgress,
+            (void*)(uintptr_t)job.id);
+        if (result) {
+            EnterCriticalSection(&mLock);
+            FtpJobInfo* running = FindJob(job.id);
+            running->filesDone = running->fileCount;
+            LeaveCriticalSection(&mLock);
+        }
+        return result;
+    }
+
+    DWORD WINAPI JobThread(LPVOID lParam)
+    {
+        while (mQuit == false) {
+            WaitForSingleObject(mEvent, INFINITE);
+            FtpJobInfo job;
+            while (mQuit == false && TakeJob(&job)) {
+                bool success = job.type == FTP_JOB_COPY ? RunCopy(job) : RunUnzip(job);
+                FtpListingCache::Invalidate(job.destination);
+                FinishJob(job.id, success);
+                Debug::Print("FTP job %u %s: %s\n", job.id, job.type == FTP_JOB_COPY ? "copy" : "unzip",
+                    success ? "done" : "failed");
+            }
+        }
+        return 0;
+    }
+}
+
+void FtpJobs::Init()
+{
+    InitializeCriticalSection(&mLock);
+    mQuit = false;
+    mEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    mThread = CreateThread(0, 0, JobThread, NULL, 0, NULL);
+    if (mThread == NULL) {
+        Debug::Print("Error: Could not start FTP job thread.\n");
+    }
+}
+
+// A running job stops at its next block or archive entry and is marked failed
+void FtpJobs::Close()
+{
+    if (mThread == NULL) {
+        return;
+    }
+    EnterCriticalSection(&mLock);
+    mQuit = true;
+    SetEvent(mEvent);
+    LeaveCriticalSection(&mLock);
+    WaitForSingleObject(mThread, INFINITE);
+    CloseHandle(mThread);
+    CloseHandle(mEvent);
+    mThread = NULL;
+    mEvent = NULL;
+    DeleteCriticalSection(&mLock);
+}
+
+uint32_t FtpJobs::QueueCopy(const std::string source, const std::string destination, const std::string sourceVirtual, const std::string destinationVirtual)
+{
+    return Queue(FTP_JOB_COPY, source, destination, sourceVirtual, destinationVirtual);
+}
+
+uint32_t FtpJobs::QueueUnzip(const std::string source, const std::string destination, const std::string sourceVirtual, const std::string destinationVirtual)
+{
+    return Queue(FTP_JOB_UNZIP, source, destination, sourceVirtual, destinationVirtual);
+}
+
+std::vector<FtpJobInfo> FtpJobs::GetJobs()
+{
+    EnterCriticalSection(&mLock);
+    std::vector<FtpJobInfo> jobs(mJobs.begin(), mJobs.end());
+    LeaveCriticalSection(&mLock);
+    return jobs;
+}
@@ -0,0 +1,52 @@
+//=============================================================================
+// FtpJobs.h - Server side copy and unzip jobs started over FTP (SITE commands)
+//=============================================================================
+
+#pragma once
+
+#include "Main.h"
+
+// Finished jobs kept for SITE JOBS; older ones are forgotten
+#define FTP_JOBS_HISTORY 16
+
+enum FtpJobType
+{
+    FTP_JOB_COPY,
+    FTP_JOB_UNZIP
+};
+
+enum FtpJobState
+{
+    FTP_JOB_QUEUED,
+    FTP_JOB_RUNNING,
+    FTP_JOB_DONE,
+    FTP_JOB_FAILED
+};
+
+// Paths are drive paths for the worker and virtual ones for reporting back
+struct FtpJobInfo
+{
+    uint32_t id;
+    FtpJobType type;
+    FtpJobState state;
+    std::string source;
+    std::string destination;
+    std::string sourceVirtual;
+    std::string destinationVirtual;
+    uint64_t bytesDone;
+    uint64_t bytesTotal;
+    uint32_t filesDone;
+    uint32_t fileCount;
+    DWORD startTick;
+    DWORD endTick;
+};
+
+class FtpJobs
+{
+public:
+    static void Init();
+    static void Close();
+    static uint32_t QueueCopy(const std::string source, const std::string destination, const std::string sourceVirtual, const std::string destinationVirtual);
+    static uint32_t QueueUnzip(const std::string source, const std::string destination, const std::string sourceVirtual, const std::string destinationVirtual);
+    static std::vector<FtpJobInfo> GetJobs();
+};
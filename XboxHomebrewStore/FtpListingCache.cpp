@@ -0,0 +1,176 @@
+//=============================================================================
+// FtpListingCache.cpp - Recently served FTP directory listings, kept in memory
+//
+// Keyed by mapped (drive) path, lower cased since FATX ignores case. The
+// server drops entries itself when it changes a directory; anything changed
+// behind its back (the dashboard, another title) is picked up once the TTL
+// runs out. Large directories are never cached, so listing them keeps its
+// constant memory use, and the total entry count is capped with LRU eviction.
+//
+// A listing read from disk is only stored if nothing was invalidated while it
+// was being read (the generation check), so a STOR racing a LIST on another
+// worker cannot leave a stale listing behind.
+//=============================================================================
+
+#include "FtpListingCache.h"
+#include "String.h"
+#include "Debug.h"
+
+#define FTP_LISTING_CACHE_MAX_DIRECTORIES 32
+#define FTP_LISTING_CACHE_TTL_MS 10000
+
+namespace {
+    typedef struct
+    {
+        std::vector<FileInfoDetail> entries;
+        DWORD storedTick;
+        DWORD lastUsedTick;
+    } CachedListing;
+
+    CRITICAL_SECTION mLock;
+    bool mInitialized = false;
+    std::map<std::string, CachedListing> mListings;
+    uint32_t mEntryCount = 0;
+    uint32_t mGeneration = 0;
+    uint32_t mHits = 0;
+    uint32_t mMisses = 0;
+
+    std::string MakeKey(const std::string path)
+    {
+        std::string key = String::ToLower(path);
+        while (key.size() > 1 && (key[key.size() - 1] == '\\' || key[key.size() - 1] == '/')) {
+            key.resize(key.size() - 1);
+        }
+        return key;
+    }
+
+    void EraseListing(std::map<std::string, CachedListing>::iterator it)
+    {
+        mEntryCount -= (uint32_t)it->second.entries.size();
+        mListings.erase(it);
+    }
+
+    void EvictOldest()
+    {
+        std::map<std::string, CachedListing>::iterator oldest = mListings.begin();
+        for (std::map<std::string, CachedListing>::iterator it = mListings.begin(); it != mListings.end(); ++it) {
+            if (it->second.lastUsedTick - oldest->second.lastUsedTick > 0x80000000) {
+                oldest = it;
+            }
+        }
+        EraseListing(oldest);
+    }
+}
+
+void FtpListingCache::Init()
+{
+    if (mInitialized == false) {
+        InitializeCriticalSection(&mLock);
+        mInitialized = true;
+    }
+}
+
+// Read before listing from disk and hand to Store afterwards
+uint32_t FtpListingCache::GetGeneration()
+{
+    EnterCriticalSection(&mLock);
+    uint32_t generation = mGeneration;
+    LeaveCriticalSection(&mLock);
+    return generation;
+}
+
+bool FtpListingCache::TryGet(const std::string path, std::vector<FileInfoDetail>& out)
+{
+    std::string key = MakeKey(path);
+    DWORD now = GetTickCount();
+
+    EnterCriticalSection(&mLock);
+    bool found = false;
+    std::map<std::string, CachedListing>::iterator it = mListings.find(key);
+    if (it != mListings.end()) {
+        if (now - it->second.storedTick < FTP_LISTING_CACHE_TTL_MS) {
+            it->second.lastUsedTick = now;
+            out = it->second.entries;
+            found = true;
+        } else {
+            EraseListing(it);
+        }
+    }
+    if (found) {
+        mHits++;
+    } else {
+        mMisses++;
+    }
+    LeaveCriticalSection(&mLock);
+    return found;
+}
+
+void FtpListingCache::Store(const std::string path, uint32_t generation, const std::vector<FileInfoDetail>& entries)
+{
+    if (entries.size() > FTP_LISTING_CACHE_MAX_ENTRIES) {
+        return;
+    }
+
+    std::string key = MakeKey(path);
+    DWORD now = GetTickCount();
+
+    EnterCriticalSection(&mLock);
+    if (generation == mGeneration) {
+        std::map<std::string, CachedListing>::iterator it = mListings.find(key);
+        if (it != mListings.end()) {
+            EraseListing(it);
+        }
+        while (mListings.empty() == false && (mListings.size() >= FTP_LISTING_CACHE_MAX_DIRECTORIES ||
+                                                 mEntryCount + entries.size() > FTP_LISTING_CACHE_MAX_ENTRIES)) {
+            EvictOldest();
+        }
+
+        CachedListing& listing = mListings[key];
+        listing.entries = entries;
+        listing.storedTick = now;
+        listing.lastUsedTick = now;
+        mEntryCount += (uint32_t)entries.size();
+    }
+    LeaveCriticalSection(&mLock);
+}
+
+// path is a file or directory that was created, changed or removed. Drops the
+// listing of the directory holding it and, for directories, its own listing
+// and everything cached below it.
+void FtpListingCache::Invalidate(const std::string path)
+{
+    std::string key = MakeKey(path);
+    std::string parent = MakeKey(FileSystem::GetDirectory(key));
+    std::string prefix = key + "\\";
+
+    EnterCriticalSection(&mLock);
+    mGeneration++;
+    std::map<std::string, CachedListing>::iterator it = mListings.begin();
+    while (it != mListings.end()) {
+        const std::string& cachedKey = it->first;
+        if (cachedKey == parent || cachedKey == key || cachedKey.compare(0, prefix.size(), prefix) == 0) {
+            EraseListing(it++);
+        } else {
+            ++it;
+        }
+    }
+    LeaveCriticalSection(&mLock);
+}
+
+uint32_t FtpListingCache::GetHitCount()
+{
+    return mHits;
+}
+
+uint32_t FtpListingCache::GetMissCount()
+{
+    return mMisses;
+}
+
+uint32_t FtpListingCache::GetDirectoryCount()
+{
+    EnterCriticalSection(&mLock);
+    uint32_t count = (uint32_t)mListings.size();
+    LeaveCriticalSection(&mLock);
+    return count;
+}
@@ -0,0 +1,24 @@
+//=============================================================================
+// FtpListingCache.h - Recently served FTP directory listings, kept in memory
+//=============================================================================
+
+#pragma once
+
+#include "Main.h"
+#include "FileSystem.h"
+
+// Total across all cached directories; a larger directory is never cached
+#define FTP_LISTING_CACHE_MAX_ENTRIES 8192
+
+class FtpListingCache
+{
+public:
+    static void Init();
+    static uint32_t GetGeneration();
+    static bool TryGet(const std::string path, std::vector<FileInfoDetail>& out);
+    static void Store(const std::string path, uint32_t generation, const std::vector<FileInfoDetail>& entries);
+    static void Invalidate(const std::string path);
+    static uint32_t GetHitCount();
+    static uint32_t GetMissCount();
+    static uint32_t GetDirectoryCount();
+};
@@ -1,4 +1,6 @@
 #include "FtpServer.h"
+#include "FtpListingCache.h"
+#include "FtpJobs.h"
 #include "SocketUtility.h"
 #include "FileSystem.h"
 #include "DriveMount.h"
@@ -6,6 +8,7 @@
 #include "String.h"
 
 #include <cstdlib>
+#include <bearssl_hash.h>
 
 #define SERVERID "Xbox Homebrew Store FTP, welcome..."
 
@@ -24,6 +27,18 @@ sockaddr_in saiListen;
 
 HANDLE mListenThreadHandle;
 
+// Control connections are all served by the listen thread; commands that
+// touch the disk are handed to the worker pool, and data transfers each get a
+// thread of their own so they can never use up the pool.
+std::vector<FtpServer::Session*> mSessions;
+uint32_t mPeakSessions;
+
+HANDLE mWorkerThreadHandles[FTP_WORKER_COUNT];
+CRITICAL_SECTION mJobLock;
+HANDLE mJobEvent;
+std::deque<FtpServer::Session*> mJobs;
+bool mWorkersQuit;
+
 int incrementConnections() {
     return (int)_InterlockedIncrement(&activeConnections);
 }
@@ -127,744 +142,1613 @@ std::string resolveRelative(const std::string currentVirtual, const std::string
     return cleanVirtualPath(relativeVirtual);
 }
 
-std::vector<FileInfoDetail> getDirectoryListing(const std::string virtualPath) {
-    if (String::EqualsIgnoreCase(virtualPath, "/")) {
-        std::vector<FileInfoDetail> fileInfoDetails;
-        std::vector<std::string> drives = DriveMount::GetMountedDrives();
+bool isCommandSpace(char c) {
+    return c == ' ' || (unsigned char)c < 32;
+}
 
-        for (size_t i = 0; i < drives.size(); i++) {
-            FileInfoDetail fileInfoDetail;
-            fileInfoDetail.isDirectory = true;
-            fileInfoDetail.isFile = false;
-            fileInfoDetail.isVirtual = true;
-            fileInfoDetail.path = drives[i];
-            fileInfoDetail.accessTime.day = 1;
-            fileInfoDetail.accessTime.month = 1;
-            fileInfoDetail.accessTime.year = 2000;
-            fileInfoDetail.accessTime.minute = 0;
-            fileInfoDetail.accessTime.hour = 0;
-            fileInfoDetail.accessTime.second = 0;
-            fileInfoDetail.writeTime.day = 1;
-            fileInfoDetail.writeTime.month = 1;
-            fileInfoDetail.writeTime.year = 2000;
-            fileInfoDetail.writeTime.minute = 0;
-            fileInfoDetail.writeTime.hour = 0;
-            fileInfoDetail.writeTime.second = 0;
-            fileInfoDetails.push_back(fileInfoDetail);
-        }
-
-        return fileInfoDetails;
+// Trims [first, last) in place and splits it at the first space. The line is
+// NUL terminated where it ends and where the command ends, so both views can
+// also be used as C strings.
+void parseCommandLine(char* first, char* last, FtpServer::CommandLine* line) {
+    while (first < last && isCommandSpace(*first))
+        first++;
+    while (last > first && isCommandSpace(last[-1]))
+        last--;
+    *last = '\0';
+
+    line->command = first;
+    char* space = (char*)memchr(first, ' ', last - first);
+    if (space == NULL) {
+        line->commandLength = (uint32_t)(last - first);
+        line->param = last;
+        line->paramLength = 0;
+        return;
     }
 
+    *space = '\0';
+    line->commandLength = (uint32_t)(space - first);
+    char* param = space + 1;
+    while (param < last && isCommandSpace(*param))
+        param++;
+    line->param = param;
+    line->paramLength = (uint32_t)(last - param);
+}
+
+const char* hashNames[FtpServer::HashAlgorithm_Count] = {"CRC32", "MD5", "SHA-1", "SHA-256"};
+
+const br_hash_class* hashClasses[FtpServer::HashAlgorithm_Count] = {
+    NULL, &br_md5_vtable, &br_sha1_vtable, &br_sha256_vtable};
+
+bool tryParseHashAlgorithm(const std::string& name, FtpServer::HashAlgorithm& algorithm) {
+    for (int32_t i = 0; i < FtpServer::HashAlgorithm_Count; i++) {
+        if (String::EqualsIgnoreCase(name, hashNames[i])) {
+            algorithm = (FtpServer::HashAlgorithm)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+// FEAT line for HASH; the session's current algorithm is marked with a star
+std::string hashFeature(FtpServer::HashAlgorithm selected) {
+    std::string feature = " HASH ";
+    for (int32_t i = 0; i < FtpServer::HashAlgorithm_Count; i++) {
+        if (i > 0) {
+            feature += ";";
+        }
+        feature += hashNames[i];
+        if (i == selected) {
+            feature += "*";
+        }
+    }
+    return feature + "\r\n";
+}
+
+// Strips a trailing " <number>" from text, for the optional XCRC ranges
+bool splitTrailingNumber(std::string& text, uint32_t& value) {
+    size_t space = text.find_last_of(' ');
+    if (space == std::string::npos || space + 1 == text.size()) {
+        return false;
+    }
+    for (size_t i = space + 1; i < text.size(); i++) {
+        if (text[i] < '0' || text[i] > '9') {
+            return false;
+        }
+    }
+    value = (uint32_t)strtoul(text.c_str() + space + 1, NULL, 10);
+    text.resize(space);
+    while (!text.empty() && text[text.size() - 1] == ' ') {
+        text.resize(text.size() - 1);
+    }
+    return true;
+}
+
+// MODE Z still frames these in a zlib stream, but stored rather than compressed,
+// since deflating them again costs CPU time and saves next to nothing
+bool isCompressedFile(const std::string& path) {
+    static const char* extensions[] = {"zip", "7z", "rar", "gz", "tgz", "bz2", "xz", "cab", "iso", "cso", "cci",
+        "jpg", "jpeg", "png", "gif", "mp3", "ogg", "wma", "wmv", "mp4", "avi", "mkv"};
+    size_t dot = path.find_last_of('.');
+    if (dot == std::string::npos || path.find_first_of("\\/", dot) != std::string::npos) {
+        return false;
+    }
+    std::string extension = String::ToLower(path.substr(dot + 1));
+    for (size_t i = 0; i < sizeof(extensions) / sizeof(extensions[0]); i++) {
+        if (extension == extensions[i]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Deflate output callback; userData points at the data socket
+bool sendDeflated(const uint8_t* data, uint32_t size, void* userData) {
+    uint64_t s = *(uint64_t*)userData;
+    while (size > 0) {
+        int sent = send((SOCKET)s, (const char*)data, (int)size, 0);
+        if (sent < 1) {
+            return false;
+        }
+        data += sent;
+        size -= (uint32_t)sent;
+    }
+    return true;
+}
+
+// Inflate and zip input callback; userData points at the data socket
+bool receiveDataSocket(uint8_t* buffer, uint32_t size, uint32_t* bytesRead, void* userData) {
+    return FtpServer::SocketReceiveData(*(uint64_t*)userData, (char*)buffer, size, bytesRead) ==
+           FtpServer::ReceiveStatus_OK;
+}
+
+// Inflate output callback, copying into the STOR pipeline a buffer at a time
+bool fillReceivePipeline(const uint8_t* data, uint32_t size, void* userData) {
+    FtpServer::ReceivePipeline* pipeline = (FtpServer::ReceivePipeline*)userData;
+    while (size > 0) {
+        if (pipeline->holdingSlot == false) {
+            WaitForSingleObject(pipeline->empty, INFINITE);
+            pipeline->holdingSlot = true;
+            pipeline->slotFilled = 0;
+        }
+        if (pipeline->writeFailed) {
+            return false;
+        }
+
+        char* buffer = pipeline->memory + pipeline->index * FTP_RECV_BUFFER_SIZE;
+        uint32_t count = min(size, FTP_RECV_BUFFER_SIZE - pipeline->slotFilled);
+        memcpy(buffer + pipeline->slotFilled, data, count);
+        pipeline->slotFilled += count;
+        data += count;
+        size -= count;
+
+        if (pipeline->slotFilled == FTP_RECV_BUFFER_SIZE) {
+            pipeline->lengths[pipeline->index] = FTP_RECV_BUFFER_SIZE;
+            pipeline->totalReceived += FTP_RECV_BUFFER_SIZE;
+            pipeline->holdingSlot = false;
+            ReleaseSemaphore(pipeline->filled, 1, NULL);
+            pipeline->index = (pipeline->index + 1) % FTP_RECV_BUFFER_COUNT;
+        }
+    }
+    return true;
+}
+
+// Ends a MODE Z transfer with its sizes and rates, file and wire side
+void sendDeflateSummary(uint64_t sCmd, const std::string& name, uint32_t fileBytes, uint32_t wireBytes, DWORD started) {
+    DWORD elapsed = GetTickCount() - started;
+    if (elapsed == 0) {
+        elapsed = 1;
+    }
+    const uint32_t effectiveRate = (uint32_t)((uint64_t)fileBytes * 1000 / 1024 / elapsed);
+    const uint32_t wireRate = (uint32_t)((uint64_t)wireBytes * 1000 / 1024 / elapsed);
+    Debug::Print("FTP MODE Z \"%s\": %u bytes as %u, %u KB/s effective, %u KB/s wire\n", name.c_str(), fileBytes,
+        wireBytes, effectiveRate, wireRate);
+    FtpServer::SocketSendString(sCmd,
+        "226 \"%s\" transferred successfully (MODE Z: %u bytes as %u, %u KB/s effective, %u KB/s wire).\r\n",
+        name.c_str(), fileBytes, wireBytes, effectiveRate, wireRate);
+}
+
+// One line of SITE JOBS, e.g. " #3 COPY running 45% (120/268 MB, 7/31 files, 12 s) "/E/a" -> "/E/b""
+std::string formatJob(const FtpJobInfo& job) {
+    static const char* states[] = {"queued", "running", "done", "failed"};
+    DWORD seconds = 0;
+    if (job.state != FTP_JOB_QUEUED) {
+        seconds = ((job.state == FTP_JOB_RUNNING ? GetTickCount() : job.endTick) - job.startTick) / 1000;
+    }
+
+    std::string progress;
+    if (job.type == FTP_JOB_COPY) {
+        const uint32_t percent = job.bytesTotal > 0 ? (uint32_t)(job.bytesDone * 100 / job.bytesTotal) : 0;
+        progress = String::Format("%u%% (%u/%u MB, ", percent, (uint32_t)(job.bytesDone >> 20),
+            (uint32_t)(job.bytesTotal >> 20));
+    } else {
+        progress = "(";
+    }
+    return String::Format(" #%u %s %s %s%u/%u files, %u s) \"%s\" -> \"%s\"\r\n", job.id,
+        job.type == FTP_JOB_COPY ? "COPY" : "UNZIP", states[job.state], progress.c_str(), job.filesDone,
+        job.fileCount, (uint32_t)seconds, job.sourceVirtual.c_str(), job.destinationVirtual.c_str());
+}
+
+// True when path is base or lies below it, so a copy would feed on itself
+bool isSameOrBelow(const std::string& path, const std::string& base) {
+    std::string lowerPath = String::ToLower(path);
+    std::string lowerBase = String::ToLower(base);
+    if (lowerPath.compare(0, lowerBase.size(), lowerBase) != 0) {
+        return false;
+    }
+    return lowerPath.size() == lowerBase.size() || lowerPath[lowerBase.size()] == '\\' ||
+           lowerPath[lowerBase.size()] == '/';
+}
+
+// Short commands that may block on the disk are run on a worker, so a slow
+// drive never stalls the other sessions.
+bool isBlockingCommand(const char* command) {
+    static const char* blockingCommands[] = {"CWD", "XCWD", "STAT", "SIZE", "MDTM", "DELE", "RNFR", "RNTO", "MKD",
+        "XMKD", "RMD", "XRMD", "AVBL", "MLST", "SITE"};
+    for (size_t i = 0; i < sizeof(blockingCommands) / sizeof(blockingCommands[0]); i++) {
+        if (_stricmp(command, blockingCommands[i]) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Commands that use a data connection or read a whole file can run for as
+// long as the transfer takes, so they get their own thread instead of a worker
+bool isTransferCommand(const char* command) {
+    static const char* transferCommands[] = {"LIST", "NLST", "MLSD", "RETR", "STOR", "APPE", "HASH", "XCRC", "XMD5",
+        "XSHA1", "XSHA256"};
+    for (size_t i = 0; i < sizeof(transferCommands) / sizeof(transferCommands[0]); i++) {
+        if (_stricmp(command, transferCommands[i]) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void queueJob(FtpServer::Session* session) {
+    EnterCriticalSection(&mJobLock);
+    mJobs.push_back(session);
+    SetEvent(mJobEvent);
+    LeaveCriticalSection(&mJobLock);
+}
+
+void recordLatency(FtpServer::Session* session) {
+    const DWORD latency = GetTickCount() - session->commandStart;
+    session->commandCount++;
+    session->totalLatency += latency;
+    if (latency > session->maxLatency) {
+        session->maxLatency = latency;
+    }
+}
+
+// Falls back to the worker pool if no thread can be created
+void startTransfer(FtpServer::Session* session) {
+    HANDLE transferThreadHandle = CreateThread(0, 0, FtpServer::TransferThread, session, 0, NULL);
+    if (transferThreadHandle == NULL) {
+        Debug::Print("Error: Could not start FTP transfer thread.\n");
+        queueJob(session);
+        return;
+    }
+    SetThreadPriority(transferThreadHandle, 2);
+    CloseHandle(transferThreadHandle);
+}
+
+FtpServer::Session* takeJob() {
+    FtpServer::Session* session = NULL;
+    EnterCriticalSection(&mJobLock);
+    if (mJobs.empty() == false) {
+        session = mJobs.front();
+        mJobs.pop_front();
+    }
+    if (mJobs.empty() && mWorkersQuit == false) {
+        ResetEvent(mJobEvent);
+    }
+    LeaveCriticalSection(&mJobLock);
+    return session;
+}
+
+typedef enum ListingFormat {
+    ListingFormatList,
+    ListingFormatNlst,
+    ListingFormatStat,
+    ListingFormatMlsd
+} ListingFormat;
+
+// Listing lines are gathered here and sent a few KB at a time, so a large
+// directory costs neither one send per entry nor memory per entry.
+typedef struct ListingWriter {
+    uint64_t s;
+    ListingFormat format;
+    char buffer[8192];
+    uint32_t length;
+    bool failed;
+    DeflateStream* deflate;
+} ListingWriter;
+
+// Writes each entry on and keeps a copy for the listing cache, giving up on
+// the copy once the directory is too large to be worth caching.
+typedef struct ListingCollector {
+    ListingWriter* writer;
+    std::vector<FileInfoDetail> entries;
+    bool overflow;
+} ListingCollector;
+
+const char* months[12] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+
+void setVirtualDirectory(const std::string& name, FileInfoDetail& fileInfoDetail) {
+    fileInfoDetail.isDirectory = true;
+    fileInfoDetail.isFile = false;
+    fileInfoDetail.isVirtual = true;
+    fileInfoDetail.path = name;
+    fileInfoDetail.size = 0;
+    fileInfoDetail.accessTime.day = 1;
+    fileInfoDetail.accessTime.month = 1;
+    fileInfoDetail.accessTime.year = 2000;
+    fileInfoDetail.accessTime.minute = 0;
+    fileInfoDetail.accessTime.hour = 0;
+    fileInfoDetail.accessTime.second = 0;
+    fileInfoDetail.writeTime = fileInfoDetail.accessTime;
+}
+
+// RFC 3659 facts for one entry, ending in the space that precedes its name.
+// Times are the same console clock MDTM reports, so the two always agree.
+int formatFacts(const FileInfoDetail& fileInfoDetail, char* line) {
+    const char* perm = "adfrw";
+    if (fileInfoDetail.isDirectory) {
+        perm = fileInfoDetail.isVirtual ? "cel" : "cdeflmp";
+    }
+    return sprintf(line, "type=%s;size=%u;modify=%04u%02u%02u%02u%02u%02u;perm=%s; ",
+        fileInfoDetail.isDirectory ? "dir" : "file", fileInfoDetail.size, fileInfoDetail.writeTime.year,
+        fileInfoDetail.writeTime.month, fileInfoDetail.writeTime.day, fileInfoDetail.writeTime.hour,
+        fileInfoDetail.writeTime.minute, fileInfoDetail.writeTime.second, perm);
+}
+
+bool flushListing(ListingWriter* writer) {
+    if (writer->length > 0 && writer->failed == false) {
+        if (writer->deflate != NULL) {
+            writer->failed = Deflate::Compress(writer->deflate, writer->buffer, writer->length) == false;
+        } else if (send((SOCKET)writer->s, writer->buffer, writer->length, 0) == SOCKET_ERROR) {
+            writer->failed = true;
+        }
+    }
+    writer->length = 0;
+    return writer->failed == false;
+}
+
+bool writeListingEntry(const FileInfoDetail& fileInfoDetail, void* userData) {
+    ListingWriter* writer = (ListingWriter*)userData;
+
+    char line[512];
+    int length = 0;
+    if (writer->format == ListingFormatNlst) {
+        length = sprintf(line, "%s\r\n", fileInfoDetail.path.c_str());
+    } else if (writer->format == ListingFormatMlsd) {
+        length = formatFacts(fileInfoDetail, line);
+        length += sprintf(line + length, "%s\r\n", fileInfoDetail.path.c_str());
+    } else {
+        const uint16_t month = fileInfoDetail.writeTime.month >= 1 && fileInfoDetail.writeTime.month <= 12
+            ? fileInfoDetail.writeTime.month
+            : 1;
+        length = sprintf(line, "%c--------- 1 ftp ftp %u %s %2i %.2i:%.2i %s%s\r\n",
+            fileInfoDetail.isDirectory ? 'd' : '-', fileInfoDetail.size, months[month - 1],
+            fileInfoDetail.writeTime.day, fileInfoDetail.writeTime.hour, fileInfoDetail.writeTime.minute,
+            fileInfoDetail.path.c_str(),
+            writer->format == ListingFormatStat && fileInfoDetail.isDirectory ? "/" : "");
+    }
+
+    if (writer->length + length > sizeof(writer->buffer) && flushListing(writer) == false) {
+        return false;
+    }
+    memcpy(writer->buffer + writer->length, line, length);
+    writer->length += length;
+    return true;
+}
+
+bool collectListingEntry(const FileInfoDetail& fileInfoDetail, void* userData) {
+    ListingCollector* collector = (ListingCollector*)userData;
+    if (collector->overflow == false) {
+        if (collector->entries.size() < FTP_LISTING_CACHE_MAX_ENTRIES) {
+            collector->entries.push_back(fileInfoDetail);
+        } else {
+            collector->overflow = true;
+            std::vector<FileInfoDetail>().swap(collector->entries);
+        }
+    }
+    return writeListingEntry(fileInfoDetail, collector->writer);
+}
+
+bool directoryExists(const std::string virtualPath) {
+    if (String::EqualsIgnoreCase(virtualPath, "/")) {
+        return true;
+    }
     if (DriveMount::FtpPathMounted(virtualPath) == false) {
-        return std::vector<FileInfoDetail>();
+        return false;
+    }
+    std::string ftpPath = DriveMount::MapFtpPath(virtualPath);
+    if (ftpPath.size() >= 1 && ftpPath[ftpPath.size() - 1] == ':') {
+        return true;
+    }
+    bool exists = false;
+    return FileSystem::DirectoryExists(ftpPath, exists) && exists;
+}
+
+// Streams the entries of virtualPath through writer, from the listing cache
+// when it has them and otherwise as the drive yields them.
+bool writeDirectoryListing(const std::string virtualPath, ListingWriter* writer) {
+    if (String::EqualsIgnoreCase(virtualPath, "/")) {
+        std::vector<std::string> drives = DriveMount::GetMountedDrives();
+        FileInfoDetail fileInfoDetail;
+        for (size_t i = 0; i < drives.size(); i++) {
+            setVirtualDirectory(drives[i], fileInfoDetail);
+            if (writeListingEntry(fileInfoDetail, writer) == false) {
+                return false;
+            }
+        }
+        return flushListing(writer);
     }
 
     std::string ftpPath = DriveMount::MapFtpPath(virtualPath);
-    std::vector<FileInfoDetail> fileInfoDetails = FileSystem::FileGetFileInfoDetails(ftpPath);
+    std::vector<FileInfoDetail> cached;
+    if (FtpListingCache::TryGet(ftpPath, cached)) {
+        for (size_t i = 0; i < cached.size(); i++) {
+            if (writeListingEntry(cached[i], writer) == false) {
+                return false;
+            }
+        }
+        return flushListing(writer);
+    }
+
+    uint32_t generation = FtpListingCache::GetGeneration();
+    ListingCollector collector;
+    collector.writer = writer;
+    collector.overflow = false;
+    bool enumerated = FileSystem::FileEnumerateFileInfoDetails(ftpPath, collectListingEntry, &collector);
+    DWORD error = enumerated ? ERROR_SUCCESS : GetLastError();
+    if (writer->failed) {
+        return false;
+    }
 
-    for (size_t i = 0; i < fileInfoDetails.size(); i++) {
-        fileInfoDetails[i].path = FileSystem::GetFileName(fileInfoDetails[i].path);
+    // An empty directory has no first entry, which is not an error here; any
+    // other failure may have cut the listing short, so it is not cached
+    bool complete = enumerated || error == ERROR_FILE_NOT_FOUND || error == ERROR_NO_MORE_FILES;
+    if (complete && collector.overflow == false) {
+        FtpListingCache::Store(ftpPath, generation, collector.entries);
     }
+    return flushListing(writer);
+}
 
-    return fileInfoDetails;
+std::string listingPathArgument(const std::string& param) {
+    std::string pathArg = param;
+    if (!pathArg.empty() && pathArg[0] == '-') {
+        size_t sp2 = pathArg.find(' ');
+        pathArg = sp2 != std::string::npos ? pathArg.substr(sp2 + 1) : "";
+    }
+    return pathArg;
 }
 } // namespace
 
-bool WINAPI FtpServer::ConnectionThread(uint64_t sCmd) {
-    uint64_t sData = 0;
-    uint64_t sPasv = 0;
-    char cmdBuffer[512];
-    std::string szPeerName;
-    std::string szCmd;
-    std::string pszParam;
-    std::string user;
-    std::string currentVirtual("");
-    std::string rnfr;
+void FtpServer::ExecuteCommand(Session* session) {
+    const uint64_t sCmd = session->sCmd;
+    uint64_t& sData = session->sData;
+    uint64_t& sPasv = session->sPasv;
+    SOCKADDR_IN& saiPasv = session->saiPasv;
+    SOCKADDR_IN& saiData = session->saiData;
+    CommandReader* reader = &session->reader;
+    const std::string& szCmd = session->szCmd;
+    const std::string& pszParam = session->pszParam;
+    std::string& user = session->user;
+    std::string& currentVirtual = session->currentVirtual;
+    std::string& rnfr = session->rnfr;
+    uint32_t& dwRestOffset = session->dwRestOffset;
+    uint32_t& dwAllocSize = session->dwAllocSize;
+    bool& isLoggedIn = session->isLoggedIn;
     uint32_t dw = 0;
-    uint32_t dwRestOffset = 0;
-    ReceiveStatus status = ReceiveStatus_OK;
-    bool isLoggedIn = false;
     FileTime fileTime;
     UINT_PTR i;
 
-    SOCKADDR_IN saiCmd;
-    memset(&saiCmd, 0, sizeof(SOCKADDR_IN));
-    SOCKADDR_IN saiCmdPeer;
-    memset(&saiCmdPeer, 0, sizeof(SOCKADDR_IN));
-    SOCKADDR_IN saiPasv;
-    memset(&saiPasv, 0, sizeof(SOCKADDR_IN));
-    SOCKADDR_IN saiData;
-    memset(&saiData, 0, sizeof(SOCKADDR_IN));
+    if (String::EqualsIgnoreCase(szCmd, "USER")) {
+        if (pszParam.empty()) {
+            SocketSendString(sCmd, "501 Syntax error in parameters or arguments.\r\n");
+            return;
+        } else if (isLoggedIn) {
+            SocketSendString(sCmd, "503 Already logged in. Use REIN to change users.\r\n");
+            return;
+        } else {
+            user = pszParam;
+            if (String::EqualsIgnoreCase(user, "xbox")) {
+                SocketSendString(sCmd, "331 Need password for user \"%s\".\r\n", user.c_str());
+                return;
+            }
+        }
+    }
 
-    // Get peer address
-    dw = sizeof(SOCKADDR_IN);
-    getpeername((SOCKET)sCmd, (SOCKADDR*)&saiCmdPeer, (int*)&dw);
-    szPeerName = String::Format("%u.%u.%u.%u", saiCmdPeer.sin_addr.S_un.S_un_b.s_b1, saiCmdPeer.sin_addr.S_un.S_un_b.s_b2,
-        saiCmdPeer.sin_addr.S_un.S_un_b.s_b3, saiCmdPeer.sin_addr.S_un.S_un_b.s_b4);
+    if (String::EqualsIgnoreCase(szCmd, "PASS")) {
+        if (user.empty()) {
+            SocketSendString(sCmd, "503 Bad sequence of commands. Send USER first.\r\n");
+        } else if (isLoggedIn) {
+            SocketSendString(sCmd, "503 Already logged in. Use REIN to change users.\r\n");
+        } else {
+            if (String::EqualsIgnoreCase(user, "xbox") && String::EqualsIgnoreCase(pszParam, "xbox")) {
+                if (incrementConnections() <= mMaxConnections) {
+                    isLoggedIn = true;
+                    currentVirtual = "/";
+                    SocketSendString(sCmd, "230 User \"%s\" logged in.\r\n", user.c_str());
+                } else {
+                    decrementConnections();
+                    SocketSendString(sCmd, "421 Your login was refused due to a server connection limit.\r\n");
+                    session->closeRequested = true;
+                    return;
+                }
+            } else {
+                SocketSendString(sCmd, "530 Incorrect password.\r\n");
+            }
+        }
+    }
 
-    // Send greeting
-    SocketSendString(sCmd, "220-%s\r\n220-You are connecting from %s:%u.\r\n220 Proceed with login.\r\n", SERVERID,
-        szPeerName.c_str(), ntohs(saiCmdPeer.sin_port));
+    else if (String::EqualsIgnoreCase(szCmd, "REIN")) {
+        if (isLoggedIn) {
+            isLoggedIn = false;
+            decrementConnections();
+            SocketSendString(sCmd, "220-User \"%s\" logged out.\r\n", user.c_str());
+            user.clear();
+        }
+        SocketSendString(sCmd, "220 REIN command successful.\r\n");
+    }
 
-    SocketUtility::GetSocketName(sCmd, &saiCmd);
+    else if (String::EqualsIgnoreCase(szCmd, "HELP")) {
+        SocketSendString(sCmd, "214 For help, please cry to mom.\r\n");
+    }
 
-    // Command processing loop
-    while (mStopRequested == false) {
-        const int result = SocketUtility::GetReadStatus(sCmd);
-        if (result != 1) {
-            Sleep(50);
-            continue;
-        }
+    else if (String::EqualsIgnoreCase(szCmd, "FEAT")) {
+        SocketSendString(sCmd,
+            "211-Extensions supported:\r\n SIZE\r\n REST STREAM\r\n RANG STREAM\r\n MDTM\r\n"
+            " MLST type*;size*;modify*;perm*;\r\n MODE Z\r\n%s TVFS\r\n XCRC\r\n XMD5\r\n XSHA1\r\n XSHA256\r\n211 END\r\n",
+            hashFeature(session->hashAlgorithm).c_str());
+    }
 
-        status = SocketReceiveString(sCmd, cmdBuffer, 512, &dw);
+    // else if (!stricmp(szCmd, "SYST")) {
+    //	sprintf(szOutput, "215 Windows_NT\r\n");
+    //	SocketSendString(sCmd, szOutput);
+    // }
 
-        if (status == ReceiveStatus_Network_Error) {
-            SocketSendString(sCmd, "421 Network error.\r\n");
-            break;
-        } else if (status == ReceiveStatus_Timeout) {
-            SocketSendString(sCmd, "421 Connection timed out.\r\n");
-            break;
-        } else if (status == ReceiveStatus_Invalid_Data) {
-            SocketSendString(sCmd, "500 Malformed request.\r\n");
-            continue;
-        } else if (status == ReceiveStatus_Insufficient_Buffer) {
-            SocketSendString(sCmd, "500 Command line too long.\r\n");
-            continue;
+    else if (String::EqualsIgnoreCase(szCmd, "QUIT")) {
+        if (isLoggedIn) {
+            isLoggedIn = false;
+            decrementConnections();
+            SocketSendString(sCmd, "221-User \"%s\" logged out.\r\n", user.c_str());
         }
+        SocketSendString(sCmd, "221 Goodbye!\r\n");
+        session->closeRequested = true;
+    }
 
-        if (dw >= 512)
-            dw = 511;
-        cmdBuffer[dw] = '\0';
+    else if (String::EqualsIgnoreCase(szCmd, "NOOP")) {
+        SocketSendString(sCmd, "200 NOOP command successful.\r\n");
+    }
 
-        {
-            std::string line(cmdBuffer);
-            while (line.size() > 0 && (line[0] == ' ' || line[0] == '\r' || line[0] == '\n' || (unsigned char)line[0] < 32))
-                line = line.substr(1);
-            while (line.size() > 0 && (line[line.size() - 1] == ' ' || line[line.size() - 1] == '\r' || line[line.size() - 1] == '\n' || (unsigned char)line[line.size() - 1] < 32))
-                line = line.substr(0, line.size() - 1);
-            size_t sp = line.find(' ');
-            szCmd = (sp != std::string::npos) ? line.substr(0, sp) : line;
-            pszParam = (sp != std::string::npos) ? line.substr(sp + 1) : "";
-            while (pszParam.size() > 0 && (pszParam[0] == ' ' || pszParam[0] == '\r' || pszParam[0] == '\n' || (unsigned char)pszParam[0] < 32))
-                pszParam = pszParam.substr(1);
-            while (pszParam.size() > 0 && (pszParam[pszParam.size() - 1] == ' ' || pszParam[pszParam.size() - 1] == '\r' || pszParam[pszParam.size() - 1] == '\n' || (unsigned char)pszParam[pszParam.size() - 1] < 32))
-                pszParam = pszParam.substr(0, pszParam.size() - 1);
+    else if (String::EqualsIgnoreCase(szCmd, "PWD") || String::EqualsIgnoreCase(szCmd, "XPWD")) {
+        if (!isLoggedIn) {
+            SocketSendString(sCmd, "530 Not logged in.\r\n");
+        } else {
+            SocketSendString(sCmd, "257 \"%s\" is current directory.\r\n", currentVirtual.c_str());
         }
+    }
 
-        if (String::EqualsIgnoreCase(szCmd, "USER")) {
-            if (pszParam.empty()) {
-                SocketSendString(sCmd, "501 Syntax error in parameters or arguments.\r\n");
-                continue;
-            } else if (isLoggedIn) {
-                SocketSendString(sCmd, "503 Already logged in. Use REIN to change users.\r\n");
-                continue;
+    else if (String::EqualsIgnoreCase(szCmd, "CWD") || String::EqualsIgnoreCase(szCmd, "XCWD")) {
+        if (pszParam.empty()) {
+            SocketSendString(sCmd, "501 Syntax error in parameters or arguments.\r\n");
+        } else if (!isLoggedIn) {
+            SocketSendString(sCmd, "530 Not logged in.\r\n");
+        } else {
+            std::string newVirtual = resolveRelative(currentVirtual, pszParam);
+            bool isFolder = false;
+            if (newVirtual == "/") {
+                isFolder = true;
             } else {
-                user = pszParam;
-                if (String::EqualsIgnoreCase(user, "xbox")) {
-                    SocketSendString(sCmd, "331 Need password for user \"%s\".\r\n", user.c_str());
-                    continue;
+                std::string ftpPath = DriveMount::MapFtpPath(newVirtual);
+                if (ftpPath.size() >= 1 && ftpPath[ftpPath.size() - 1] == ':') {
+                    isFolder = true;
+                } else {
+                    FileSystem::DirectoryExists(ftpPath, isFolder);
                 }
             }
-        }
 
-        if (String::EqualsIgnoreCase(szCmd, "PASS")) {
-            if (user.empty()) {
-                SocketSendString(sCmd, "503 Bad sequence of commands. Send USER first.\r\n");
-            } else if (isLoggedIn) {
-                SocketSendString(sCmd, "503 Already logged in. Use REIN to change users.\r\n");
+            if (isFolder == true) {
+                currentVirtual = newVirtual;
+                SocketSendString(sCmd, "250 \"%s\" is now current directory.\r\n", currentVirtual.c_str());
             } else {
-                if (String::EqualsIgnoreCase(user, "xbox") && String::EqualsIgnoreCase(pszParam, "xbox")) {
-                    if (incrementConnections() <= mMaxConnections) {
-                        isLoggedIn = true;
-                        currentVirtual = "/";
-                        SocketSendString(sCmd, "230 User \"%s\" logged in.\r\n", user.c_str());
-                    } else {
-                        decrementConnections();
-                        SocketSendString(sCmd, "421 Your login was refused due to a server connection limit.\r\n");
-                        break;
-                    }
-                } else {
-                    SocketSendString(sCmd, "530 Incorrect password.\r\n");
-                }
+                SocketSendString(sCmd, "550 %s failed. \"%s\": directory not found.\r\n", szCmd.c_str(), newVirtual.c_str());
             }
         }
+    }
 
-        else if (String::EqualsIgnoreCase(szCmd, "REIN")) {
-            if (isLoggedIn) {
-                isLoggedIn = false;
-                decrementConnections();
-                SocketSendString(sCmd, "220-User \"%s\" logged out.\r\n", user.c_str());
-                user.clear();
-            }
-            SocketSendString(sCmd, "220 REIN command successful.\r\n");
+    else if (String::EqualsIgnoreCase(szCmd, "CDUP") || String::EqualsIgnoreCase(szCmd, "XCUP")) {
+        if (!isLoggedIn) {
+            SocketSendString(sCmd, "530 Not logged in.\r\n");
+        } else {
+            currentVirtual = resolveRelative(currentVirtual, "..");
+            SocketSendString(sCmd, "250 \"%s\" is now current directory.\r\n", currentVirtual.c_str());
         }
+    }
 
-        else if (String::EqualsIgnoreCase(szCmd, "HELP")) {
-            SocketSendString(sCmd, "214 For help, please cry to mom.\r\n");
+    else if (String::EqualsIgnoreCase(szCmd, "TYPE")) {
+        if (pszParam.empty()) {
+            SocketSendString(sCmd, "501 Syntax error in parameters or arguments.\r\n");
+        } else if (!isLoggedIn) {
+            SocketSendString(sCmd, "530 Not logged in.\r\n");
+        } else {
+            SocketSendString(sCmd, "200 TYPE command successful.\r\n");
         }
+    }
 
-        else if (String::EqualsIgnoreCase(szCmd, "FEAT")) {
-            SocketSendString(
-                sCmd, "211-Extensions supported:\r\n SIZE\r\n REST STREAM\r\n MDTM\r\n TVFS\r\n XCRC\r\n211 END\r\n");
+    else if (String::EqualsIgnoreCase(szCmd, "REST")) {
+        if (pszParam.empty() || (!(dw = atoi(pszParam.c_str())) && (pszParam[0] != '0'))) {
+            SocketSendString(sCmd, "501 Syntax error in parameters or arguments.\r\n");
+        } else if (!isLoggedIn) {
+            SocketSendString(sCmd, "530 Not logged in.\r\n");
+        } else {
+            dwRestOffset = dw;
+            session->hasRange = false;
+            SocketSendString(sCmd, "350 Ready to resume transfer at %u bytes.\r\n", dwRestOffset);
         }
+    }
 
-        // else if (!stricmp(szCmd, "SYST")) {
-        //	sprintf(szOutput, "215 Windows_NT\r\n");
-        //	SocketSendString(sCmd, szOutput);
-        // }
+    else if (String::EqualsIgnoreCase(szCmd, "ALLO")) {
+        if (pszParam.empty() || (!(dw = atoi(pszParam.c_str())) && (pszParam[0] != '0'))) {
+            SocketSendString(sCmd, "501 Syntax error in parameters or arguments.\r\n");
+        } else if (!isLoggedIn) {
+            SocketSendString(sCmd, "530 Not logged in.\r\n");
+        } else {
+            // Kept for the next STOR, which reserves the space before writing
+            dwAllocSize = dw;
+            SocketSendString(sCmd, "200 ALLO command successful.\r\n");
+        }
+    }
 
-        else if (String::EqualsIgnoreCase(szCmd, "QUIT")) {
-            if (isLoggedIn) {
-                isLoggedIn = false;
-                decrementConnections();
-                SocketSendString(sCmd, "221-User \"%s\" logged out.\r\n", user.c_str());
-            }
-            SocketSendString(sCmd, "221 Goodbye!\r\n");
-            break;
+    else if (String::EqualsIgnoreCase(szCmd, "MODE")) {
+        if (pszParam.empty()) {
+            SocketSendString(sCmd, "501 Syntax error in parameters or arguments.\r\n");
+        } else if (!isLoggedIn) {
+            SocketSendString(sCmd, "530 Not logged in.\r\n");
+        } else if (String::EqualsIgnoreCase(pszParam, "S")) {
+            session->modeZ = false;
+            SocketSendString(sCmd, "200 MODE set to S.\r\n");
+        } else if (String::EqualsIgnoreCase(pszParam, "Z")) {
+            session->modeZ = true;
+            SocketSendString(sCmd, "200 MODE set to Z.\r\n");
+        } else {
+            SocketSendString(sCmd, "504 Command not implemented for that parameter.\r\n");
         }
+    }
 
-        else if (String::EqualsIgnoreCase(szCmd, "NOOP")) {
-            SocketSendString(sCmd, "200 NOOP command successful.\r\n");
+    else if (String::EqualsIgnoreCase(szCmd, "RANG")) {
+        uint32_t rangeStart = 0;
+        uint32_t rangeEnd = 0;
+        if (sscanf(pszParam.c_str(), "%u %u", &rangeStart, &rangeEnd) != 2) {
+            SocketSendString(sCmd, "501 Syntax error in parameters or arguments.\r\n");
+        } else if (!isLoggedIn) {
+            SocketSendString(sCmd, "530 Not logged in.\r\n");
+        } else if (rangeStart == 1 && rangeEnd == 0) {
+            session->hasRange = false;
+            SocketSendString(sCmd, "350 Restart range reset.\r\n");
+        } else if (rangeEnd < rangeStart) {
+            SocketSendString(sCmd, "501 Ending byte is before starting byte.\r\n");
+        } else {
+            session->hasRange = true;
+            session->dwRangeStart = rangeStart;
+            session->dwRangeEnd = rangeEnd;
+            dwRestOffset = 0;
+            SocketSendString(sCmd, "350 Restarting at %u. Ending byte %u.\r\n", rangeStart, rangeEnd);
         }
+    }
 
-        else if (String::EqualsIgnoreCase(szCmd, "PWD") || String::EqualsIgnoreCase(szCmd, "XPWD")) {
-            if (!isLoggedIn) {
-                SocketSendString(sCmd, "530 Not logged in.\r\n");
+    else if (String::EqualsIgnoreCase(szCmd, "PORT")) {
+        if (pszParam.empty()) {
+            SocketSendString(sCmd, "501 Syntax error in parameters or arguments.\r\n");
+        } else if (!isLoggedIn) {
+            SocketSendString(sCmd, "530 Not logged in.\r\n");
+        } else {
+            memset(&saiData, 0, sizeof(SOCKADDR_IN));
+            saiData.sin_family = AF_INET;
+
+            unsigned short h1 = 0;
+            unsigned short h2 = 0;
+            unsigned short h3 = 0;
+            unsigned short h4 = 0;
+            unsigned short p1 = 0;
+            unsigned short p2 = 0;
+
+            dw = sscanf(pszParam.c_str(), "%hu,%hu,%hu,%hu,%hu,%hu", &h1, &h2, &h3, &h4, &p1, &p2);
+
+            saiData.sin_addr.S_un.S_un_b.s_b1 = (u_char)h1;
+            saiData.sin_addr.S_un.S_un_b.s_b2 = (u_char)h2;
+            saiData.sin_addr.S_un.S_un_b.s_b3 = (u_char)h3;
+            saiData.sin_addr.S_un.S_un_b.s_b4 = (u_char)h4;
+            saiData.sin_port = (p2 << 8) + p1;
+
+            if (dw == 6) {
+                SocketUtility::CloseSocket(sPasv);
+                SocketSendString(sCmd, "200 PORT command successful.\r\n");
             } else {
-                SocketSendString(sCmd, "257 \"%s\" is current directory.\r\n", currentVirtual.c_str());
+                SocketSendString(sCmd, "501 Syntax error in parameters or arguments.\r\n");
+                memset(&saiData, 0, sizeof(SOCKADDR_IN));
             }
         }
+    }
 
-        else if (String::EqualsIgnoreCase(szCmd, "CWD") || String::EqualsIgnoreCase(szCmd, "XCWD")) {
-            if (pszParam.empty()) {
-                SocketSendString(sCmd, "501 Syntax error in parameters or arguments.\r\n");
-            } else if (!isLoggedIn) {
-                SocketSendString(sCmd, "530 Not logged in.\r\n");
-            } else {
-                std::string newVirtual = resolveRelative(currentVirtual, pszParam);
-                bool isFolder = false;
-                if (newVirtual == "/") {
-                    isFolder = true;
-                } else {
-                    std::string ftpPath = DriveMount::MapFtpPath(newVirtual);
-                    if (ftpPath.size() >= 1 && ftpPath[ftpPath.size() - 1] == ':') {
-                        isFolder = true;
-                    } else {
-                        FileSystem::DirectoryExists(ftpPath, isFolder);
-                    }
-                }
+    else if (String::EqualsIgnoreCase(szCmd, "PASV")) {
+        if (!isLoggedIn) {
+            SocketSendString(sCmd, "530 Not logged in.\r\n");
+        } else {
+            if (sPasv) {
+                SocketUtility::CloseSocket(sPasv);
+            }
+
+            static u_short portTest = 6000;
+
+            XNADDR addr;
+            XNetGetTitleXnAddr(&addr);
 
-                if (isFolder == true) {
-                    currentVirtual = newVirtual;
-                    SocketSendString(sCmd, "250 \"%s\" is now current directory.\r\n", currentVirtual.c_str());
+            bool found = false;
+            while (!found) {
+                memset(&saiPasv, 0, sizeof(SOCKADDR_IN));
+                saiPasv.sin_family = AF_INET;
+                saiPasv.sin_addr.s_addr = INADDR_ANY;
+                saiPasv.sin_port = htons(portTest);
+                if (SocketUtility::CreateSocket(AF_INET, SOCK_STREAM, IPPROTO_TCP, sPasv)) {
+                    found = true;
                 } else {
-                    SocketSendString(sCmd, "550 %s failed. \"%s\": directory not found.\r\n", szCmd.c_str(), newVirtual.c_str());
+                    Debug::Print(
+                        "Error: Could not create socket on port %u, trying to find next available.\n", portTest);
+                }
+                portTest++;
+                if (portTest > 6999) {
+                    portTest = 6000;
                 }
             }
+
+            SocketUtility::BindSocket(sPasv, &saiPasv);
+            SocketUtility::ListenSocket(sPasv, 1);
+            SocketUtility::GetSocketName(sPasv, &saiPasv);
+
+            SocketSendString(sCmd, "227 Entering Passive Mode (%u,%u,%u,%u,%u,%u)\r\n", addr.ina.S_un.S_un_b.s_b1,
+                addr.ina.S_un.S_un_b.s_b2, addr.ina.S_un.S_un_b.s_b3, addr.ina.S_un.S_un_b.s_b4,
+                ((unsigned char*)&saiPasv.sin_port)[0], ((unsigned char*)&saiPasv.sin_port)[1]);
         }
+    }
 
-        else if (String::EqualsIgnoreCase(szCmd, "CDUP") || String::EqualsIgnoreCase(szCmd, "XCUP")) {
-            if (!isLoggedIn) {
-                SocketSendString(sCmd, "530 Not logged in.\r\n");
+    else if (String::EqualsIgnoreCase(szCmd, "LIST") || String::EqualsIgnoreCase(szCmd, "NLST") ||
+             String::EqualsIgnoreCase(szCmd, "MLSD")) {
+        if (!isLoggedIn) {
+            SocketSendString(sCmd, "530 Not logged in.\r\n");
+        } else {
+            // A range only covers the transfer that follows it
+            session->hasRange = false;
+            bool isMlsd = String::EqualsIgnoreCase(szCmd, "MLSD");
+            std::string pathArg = isMlsd ? pszParam : listingPathArgument(pszParam);
+            std::string newVirtual =
+                pathArg.empty() ? currentVirtual : resolveRelative(currentVirtual, pathArg);
+
+            if (directoryExists(newVirtual)) {
+                sData = EstablishDataConnection(&saiData, &sPasv);
+                if (sData) {
+                    SocketSendString(sCmd, "150 Opened %s mode data connection for \"%s\".\r\n",
+                        sPasv ? "passive" : "active", newVirtual.c_str());
+                    ListingWriter* writer = (ListingWriter*)malloc(sizeof(ListingWriter));
+                    writer->s = sData;
+                    writer->format = isMlsd ? ListingFormatMlsd
+                        : String::EqualsIgnoreCase(szCmd, "NLST") ? ListingFormatNlst
+                                                                   : ListingFormatList;
+                    writer->length = 0;
+                    writer->failed = false;
+                    writer->deflate = NULL;
+                    DWORD started = GetTickCount();
+                    if (session->modeZ) {
+                        writer->deflate = Deflate::CreateCompressor(session->deflateLevel, sendDeflated, &sData);
+                        writer->failed = writer->deflate == NULL;
+                    }
+                    bool sent = writeDirectoryListing(newVirtual, writer);
+                    uint32_t listingBytes = 0;
+                    uint32_t wireBytes = 0;
+                    if (writer->deflate != NULL) {
+                        sent = sent && Deflate::Finish(writer->deflate);
+                        listingBytes = Deflate::GetCompressorTotalIn(writer->deflate);
+                        wireBytes = Deflate::GetCompressorTotalOut(writer->deflate);
+                        Deflate::DestroyCompressor(writer->deflate);
+                    }
+                    free(writer);
+                    SocketUtility::CloseSocket(sData);
+                    if (sent && session->modeZ) {
+                        sendDeflateSummary(sCmd, newVirtual, listingBytes, wireBytes, started);
+                    } else if (sent) {
+                        SocketSendString(sCmd, "226 %s command successful.\r\n", szCmd.c_str());
+                    } else {
+                        SocketSendString(sCmd, "426 Connection closed; transfer aborted.\r\n");
+                    }
+                } else {
+                    SocketSendString(sCmd, "425 Can't open data connection.\r\n");
+                }
             } else {
-                currentVirtual = resolveRelative(currentVirtual, "..");
-                SocketSendString(sCmd, "250 \"%s\" is now current directory.\r\n", currentVirtual.c_str());
+                SocketSendString(sCmd, "550 \"%s\": Path not found.\r\n", newVirtual.c_str());
             }
         }
+    }
 
-        else if (String::EqualsIgnoreCase(szCmd, "TYPE")) {
-            if (pszParam.empty()) {
-                SocketSendString(sCmd, "501 Syntax error in parameters or arguments.\r\n");
-            } else if (!isLoggedIn) {
-                SocketSendString(sCmd, "530 Not logged in.\r\n");
+    else if (String::EqualsIgnoreCase(szCmd, "MLST")) {
+        if (!isLoggedIn) {
+            SocketSendString(sCmd, "530 Not logged in.\r\n");
+        } else {
+            std::string newVirtual = pszParam.empty() ? currentVirtual : resolveRelative(currentVirtual, pszParam);
+            std::string ftpPath = DriveMount::MapFtpPath(newVirtual);
+
+            FileInfoDetail fileInfoDetail;
+            bool found = true;
+            if (String::EqualsIgnoreCase(newVirtual, "/") ||
+                (ftpPath.size() >= 1 && ftpPath[ftpPath.size() - 1] == ':')) {
+                setVirtualDirectory(newVirtual, fileInfoDetail);
             } else {
-                SocketSendString(sCmd, "200 TYPE command successful.\r\n");
+                found = DriveMount::FtpPathMounted(newVirtual) && FileSystem::FileGetFileInfoDetail(ftpPath, fileInfoDetail);
             }
-        }
 
-        else if (String::EqualsIgnoreCase(szCmd, "REST")) {
-            if (pszParam.empty() || (!(dw = atoi(pszParam.c_str())) && (pszParam[0] != '0'))) {
-                SocketSendString(sCmd, "501 Syntax error in parameters or arguments.\r\n");
-            } else if (!isLoggedIn) {
-                SocketSendString(sCmd, "530 Not logged in.\r\n");
+            if (found) {
+                char facts[256];
+                formatFacts(fileInfoDetail, facts);
+                SocketSendString(sCmd, "250-Listing \"%s\"\r\n %s%s\r\n250 End.\r\n", newVirtual.c_str(), facts,
+                    newVirtual.c_str());
             } else {
-                dwRestOffset = dw;
-                SocketSendString(sCmd, "350 Ready to resume transfer at %u bytes.\r\n", dwRestOffset);
+                SocketSendString(sCmd, "550 \"%s\": Path not found.\r\n", newVirtual.c_str());
             }
         }
+    }
 
-        else if (String::EqualsIgnoreCase(szCmd, "PORT")) {
-            if (pszParam.empty()) {
-                SocketSendString(sCmd, "501 Syntax error in parameters or arguments.\r\n");
-            } else if (!isLoggedIn) {
-                SocketSendString(sCmd, "530 Not logged in.\r\n");
+    else if (String::EqualsIgnoreCase(szCmd, "STAT")) {
+        if (!isLoggedIn) {
+            SocketSendString(sCmd, "530 Not logged in.\r\n");
+        } else if (pszParam.empty()) {
+            SocketSendString(sCmd,
+                "211-%s\r\n Logged in as \"%s\", %u users logged in.\r\n"
+                " Listing cache: %u hits, %u misses, %u directories.\r\n211 End of status.\r\n",
+                SERVERID, user.c_str(), (uint32_t)activeConnections, FtpListingCache::GetHitCount(),
+                FtpListingCache::GetMissCount(), FtpListingCache::GetDirectoryCount());
+        } else {
+            std::string pathArg = listingPathArgument(pszParam);
+            std::string newVirtual =
+                pathArg.empty() ? currentVirtual : resolveRelative(currentVirtual, pathArg);
+
+            if (directoryExists(newVirtual)) {
+                SocketSendString(sCmd, "212-Sending directory listing of \"%s\".\r\n", newVirtual.c_str());
+                ListingWriter* writer = (ListingWriter*)malloc(sizeof(ListingWriter));
+                writer->s = sCmd;
+                writer->format = ListingFormatStat;
+                writer->length = 0;
+                writer->failed = false;
+                writer->deflate = NULL;
+                writeDirectoryListing(newVirtual, writer);
+                free(writer);
+                SocketSendString(sCmd, "212 End of status.\r\n");
             } else {
-                memset(&saiData, 0, sizeof(SOCKADDR_IN));
-                saiData.sin_family = AF_INET;
-
-                unsigned short h1 = 0;
-                unsigned short h2 = 0;
-                unsigned short h3 = 0;
-                unsigned short h4 = 0;
-                unsigned short p1 = 0;
-                unsigned short p2 = 0;
-
-                dw = sscanf(pszParam.c_str(), "%hu,%hu,%hu,%hu,%hu,%hu", &h1, &h2, &h3, &h4, &p1, &p2);
-
-                saiData.sin_addr.S_un.S_un_b.s_b1 = (u_char)h1;
-                saiData.sin_addr.S_un.S_un_b.s_b2 = (u_char)h2;
-                saiData.sin_addr.S_un.S_un_b.s_b3 = (u_char)h3;
-                saiData.sin_addr.S_un.S_un_b.s_b4 = (u_char)h4;
-                saiData.sin_port = (p2 << 8) + p1;
-
-                if (dw == 6) {
-                    SocketUtility::CloseSocket(sPasv);
-                    SocketSendString(sCmd, "200 PORT command successful.\r\n");
-                } else {
-                    SocketSendString(sCmd, "501 Syntax error in parameters or arguments.\r\n");
-                    memset(&saiData, 0, sizeof(SOCKADDR_IN));
-                }
+                SocketSendString(sCmd, "550 \"%s\": Path not found.\r\n", newVirtual.c_str());
             }
         }
+    }
 
-        else if (String::EqualsIgnoreCase(szCmd, "PASV")) {
-            if (!isLoggedIn) {
-                SocketSendString(sCmd, "530 Not logged in.\r\n");
-            } else {
-                if (sPasv) {
-                    SocketUtility::CloseSocket(sPasv);
+    else if (String::EqualsIgnoreCase(szCmd, "RETR")) {
+        if (pszParam.empty()) {
+            SocketSendString(sCmd, "501 Syntax error in parameters or arguments.\r\n");
+        } else if (!isLoggedIn) {
+            SocketSendString(sCmd, "530 Not logged in.\r\n");
+        } else {
+            std::string newVirtual = resolveRelative(currentVirtual, pszParam);
+            std::string ftpPath = DriveMount::MapFtpPath(newVirtual);
+
+            // RANG gives an inclusive last byte; REST only a start
+            uint32_t start = dwRestOffset;
+            uint32_t length = 0xFFFFFFFF;
+            if (session->hasRange) {
+                start = session->dwRangeStart;
+                if (session->dwRangeEnd - start < 0xFFFFFFFF) {
+                    length = session->dwRangeEnd - start + 1;
                 }
-
-                static u_short portTest = 6000;
-
-                XNADDR addr;
-                XNetGetTitleXnAddr(&addr);
-
-                bool found = false;
-                while (!found) {
-                    memset(&saiPasv, 0, sizeof(SOCKADDR_IN));
-                    saiPasv.sin_family = AF_INET;
-                    saiPasv.sin_addr.s_addr = INADDR_ANY;
-                    saiPasv.sin_port = htons(portTest);
-                    if (SocketUtility::CreateSocket(AF_INET, SOCK_STREAM, IPPROTO_TCP, sPasv)) {
-                        found = true;
+            }
+            session->hasRange = false;
+
+            // Starts reading ahead while the client opens the data connection
+            SendPipeline pipeline;
+            if (OpenSendPipeline(ftpPath, start, &pipeline) == true) {
+                dwRestOffset = 0;
+                sData = EstablishDataConnection(&saiData, &sPasv);
+                if (sData) {
+                    SocketSendString(sCmd, "150 Opened %s mode data connection for \"%s\".\r\n",
+                        sPasv ? "passive" : "active", newVirtual.c_str());
+                    DeflateStream* deflate = NULL;
+                    if (session->modeZ) {
+                        deflate = Deflate::CreateCompressor(
+                            isCompressedFile(ftpPath) ? DEFLATE_LEVEL_STORE : session->deflateLevel, sendDeflated, &sData);
+                    }
+                    DWORD started = GetTickCount();
+                    if (session->modeZ && deflate == NULL) {
+                        SocketSendString(sCmd, "451 Not enough memory to compress.\r\n");
+                    } else if (SendSocketFile(sCmd, reader, sData, &pipeline, length, deflate, &dw)) {
+                        if (deflate != NULL) {
+                            sendDeflateSummary(sCmd, newVirtual, Deflate::GetCompressorTotalIn(deflate),
+                                Deflate::GetCompressorTotalOut(deflate), started);
+                        } else {
+                            SocketSendString(sCmd, "226 \"%s\" transferred successfully.\r\n", newVirtual.c_str());
+                        }
                     } else {
-                        Debug::Print(
-                            "Error: Could not create socket on port %u, trying to find next available.\n", portTest);
+                        SocketSendString(sCmd, "426 Connection closed; transfer aborted.\r\n");
+                        if (dw) {
+                            SocketSendString(sCmd, "226 ABOR command successful.\r\n");
+                        }
                     }
-                    portTest++;
-                    if (portTest > 6999) {
-                        portTest = 6000;
+                    if (deflate != NULL) {
+                        Deflate::DestroyCompressor(deflate);
                     }
+                    SocketUtility::CloseSocket(sData);
                 }
 
-                SocketUtility::BindSocket(sPasv, &saiPasv);
-                SocketUtility::ListenSocket(sPasv, 1);
-                SocketUtility::GetSocketName(sPasv, &saiPasv);
-
-                SocketSendString(sCmd, "227 Entering Passive Mode (%u,%u,%u,%u,%u,%u)\r\n", addr.ina.S_un.S_un_b.s_b1,
-                    addr.ina.S_un.S_un_b.s_b2, addr.ina.S_un.S_un_b.s_b3, addr.ina.S_un.S_un_b.s_b4,
-                    ((unsigned char*)&saiPasv.sin_port)[0], ((unsigned char*)&saiPasv.sin_port)[1]);
+                else {
+                    SocketSendString(sCmd, "425 Can't open data connection.\r\n");
+                }
+                CloseSendPipeline(&pipeline);
+            } else {
+                SocketSendString(sCmd, "550 \"%s\": Unable to open file.\r\n", newVirtual.c_str());
             }
         }
+    }
 
-        else if (String::EqualsIgnoreCase(szCmd, "LIST") || String::EqualsIgnoreCase(szCmd, "NLST")) {
-            if (!isLoggedIn) {
-                SocketSendString(sCmd, "530 Not logged in.\r\n");
-            } else {
-                std::string pathArg = pszParam;
-                if (!pathArg.empty() && pathArg[0] == '-') {
-                    size_t sp2 = pathArg.find(' ');
-                    if (sp2 != std::string::npos)
-                        pathArg = pathArg.substr(sp2 + 1);
-                }
-                std::string newVirtual =
-                    pathArg.empty() ? currentVirtual : resolveRelative(currentVirtual, pathArg);
-
-                std::vector<FileInfoDetail> fileInfoDetails = getDirectoryListing(newVirtual);
-                if (!fileInfoDetails.empty()) {
-                    sData = EstablishDataConnection(&saiData, &sPasv);
-                    if (sData) {
-                        SocketSendString(sCmd, "150 Opened %s mode data connection for \"%s\".\r\n",
-                            sPasv ? "passive" : "active", newVirtual.c_str());
-                        const char* months[12] = {
-                            "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
-                        for (size_t i = 0; i < fileInfoDetails.size(); i++) {
-                            char szLine[512];
-                            const FileInfoDetail& fileInfoDetail = fileInfoDetails[i];
-                            if (String::EqualsIgnoreCase(szCmd, "NLST")) {
-                                strcpy(szLine, fileInfoDetail.path.c_str());
-                            } else {
-                                sprintf(szLine, "%c--------- 1 ftp ftp %llu ", fileInfoDetail.isDirectory ? 'd' : '-',
-                                    fileInfoDetail.size);
-                                strcat(szLine, months[fileInfoDetail.writeTime.month - 1]);
-                                sprintf(szLine + strlen(szLine), " %2i %.2i:%.2i ", fileInfoDetail.writeTime.day,
-                                    fileInfoDetail.writeTime.hour, fileInfoDetail.writeTime.minute);
-                                strcat(szLine, fileInfoDetail.path.c_str());
-                            }
-                            strcat(szLine, "\r\n");
-                            SocketSendString(sData, szLine);
-                        }
-                        SocketUtility::CloseSocket(sData);
-                        SocketSendString(sCmd, "226 %s command successful.\r\n", String::EqualsIgnoreCase(szCmd, "NLST") ? "LIST" : "NLST");
+    else if (String::EqualsIgnoreCase(szCmd, "STOR") || String::EqualsIgnoreCase(szCmd, "APPE")) {
+        if (pszParam.empty()) {
+            SocketSendString(sCmd, "501 Syntax error in parameters or arguments.\r\n");
+        } else if (!isLoggedIn) {
+            SocketSendString(sCmd, "530 Not logged in.\r\n");
+        } else if (session->hasRange) {
+            // Uploads only take a REST start, so a range is refused rather than ignored
+            session->hasRange = false;
+            SocketSendString(sCmd, "504 RANG is not supported for %s.\r\n", szCmd.c_str());
+        } else {
+            std::string newVirtual = resolveRelative(currentVirtual, pszParam);
+            std::string ftpPath = DriveMount::MapFtpPath(newVirtual);
+
+            ReceivePipeline pipeline;
+            bool append = String::EqualsIgnoreCase(szCmd, "APPE");
+            bool extract = session->autoUnzip && append == false && dwRestOffset == 0 && session->modeZ == false &&
+                           String::EndsWith(String::ToLower(ftpPath), ".zip");
+            if (extract) {
+                // Members land next to where the archive would have been
+                std::string destination = FileSystem::GetDirectory(ftpPath);
+                dwAllocSize = 0;
+                sData = EstablishDataConnection(&saiData, &sPasv);
+                if (sData) {
+                    SocketSendString(sCmd, "150 Opened %s mode data connection for \"%s\", extracting.\r\n",
+                        sPasv ? "passive" : "active", newVirtual.c_str());
+                    DWORD started = GetTickCount();
+                    ZipStreamResult result;
+                    bool extracted = ReceiveZipSocketFile(sData, destination, &result);
+                    FtpListingCache::Invalidate(destination);
+                    DWORD elapsed = GetTickCount() - started;
+                    Debug::Print("FTP AUTOUNZIP \"%s\": %u files, %u folders, %u bytes read in %u ms\n",
+                        newVirtual.c_str(), result.fileCount, result.directoryCount, result.bytesRead, elapsed);
+                    if (extracted) {
+                        SocketSendString(sCmd,
+                            "226 \"%s\" extracted (%u files, %u folders, %u KB from %u KB received, %u s).\r\n",
+                            newVirtual.c_str(), result.fileCount, result.directoryCount,
+                            (uint32_t)(result.bytesWritten / 1024), result.bytesRead / 1024, elapsed / 1000);
+                    } else if (result.failedEntry.empty()) {
+                        SocketSendString(sCmd, "426 Connection closed; extraction aborted.\r\n");
                     } else {
-                        SocketSendString(sCmd, "425 Can't open data connection.\r\n");
+                        SocketSendString(sCmd, "426 Extraction aborted at \"%s\".\r\n", result.failedEntry.c_str());
                     }
+                    SocketUtility::CloseSocket(sData);
                 } else {
-                    SocketSendString(sCmd, "550 \"%s\": Path not found.\r\n", newVirtual.c_str());
+                    SocketSendString(sCmd, "425 Can't open data connection.\r\n");
                 }
-            }
-        }
-
-        else if (String::EqualsIgnoreCase(szCmd, "STAT")) {
-            if (!isLoggedIn) {
-                SocketSendString(sCmd, "530 Not logged in.\r\n");
-            } else {
-                std::string pathArg = pszParam;
-                if (!pathArg.empty() && pathArg[0] == '-') {
-                    size_t sp2 = pathArg.find(' ');
-                    if (sp2 != std::string::npos)
-                        pathArg = pathArg.substr(sp2 + 1);
-                }
-                std::string newVirtual =
-                    pathArg.empty() ? currentVirtual : resolveRelative(currentVirtual, pathArg);
-
-                std::vector<FileInfoDetail> fileInfoDetails = getDirectoryListing(newVirtual);
-                if (!fileInfoDetails.empty()) {
-                    SocketSendString(sCmd, "212-Sending directory listing of \"%s\".\r\n", newVirtual.c_str());
-                    const char* months[12] = {
-                        "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
-                    for (size_t i = 0; i < fileInfoDetails.size(); i++) {
-                        char szLine[512];
-                        const FileInfoDetail& fileInfoDetail = fileInfoDetails[i];
-                        sprintf(szLine, "%c--------- 1 ftp ftp %llu ", fileInfoDetail.isDirectory ? 'd' : '-',
-                            fileInfoDetail.size);
-                        strcat(szLine, months[fileInfoDetail.writeTime.month - 1]);
-                        sprintf(szLine + strlen(szLine), " %2i %.2i:%.2i ", fileInfoDetail.writeTime.day,
-                            fileInfoDetail.writeTime.hour, fileInfoDetail.writeTime.minute);
-                        strcat(szLine, fileInfoDetail.path.c_str());
-                        if (fileInfoDetail.isDirectory == true) {
-                            strcat(szLine, "/");
-                        }
-                        strcat(szLine, "\r\n");
-                        SocketSendString(sCmd, szLine);
+            } else if (OpenReceivePipeline(ftpPath, append, dwRestOffset, dwAllocSize, &pipeline) == true) {
+                dwRestOffset = 0;
+                dwAllocSize = 0;
+                sData = EstablishDataConnection(&saiData, &sPasv);
+                if (sData) {
+                    SocketSendString(sCmd, "150 Opened %s mode data connection for \"%s\".\r\n",
+                        sPasv ? "passive" : "active", newVirtual.c_str());
+                    // Only report success once the writer has put everything on disk
+                    DWORD started = GetTickCount();
+                    uint32_t wireBytes = 0;
+                    bool received = session->modeZ ? ReceiveDeflatedSocketFile(sData, &pipeline, &wireBytes)
+                                                   : ReceiveSocketFile(sCmd, sData, &pipeline);
+                    uint32_t fileBytes = pipeline.totalReceived;
+                    bool written = CloseReceivePipeline(&pipeline);
+                    FtpListingCache::Invalidate(ftpPath);
+                    if (written && received && session->modeZ) {
+                        sendDeflateSummary(sCmd, newVirtual, fileBytes, wireBytes, started);
+                    } else if (written && received) {
+                        SocketSendString(sCmd, "226 \"%s\" transferred successfully.\r\n", newVirtual.c_str());
+                    } else {
+                        SocketSendString(sCmd, "426 Connection closed; transfer aborted.\r\n");
                     }
+                    SocketUtility::CloseSocket(sData);
                 } else {
-                    SocketSendString(sCmd, "550 \"%s\": Path not found.\r\n", newVirtual.c_str());
+                    SocketSendString(sCmd, "425 Can't open data connection.\r\n");
+                    CloseReceivePipeline(&pipeline);
+                    FtpListingCache::Invalidate(ftpPath);
                 }
+            } else {
+                SocketSendString(sCmd, "550 \"%s\": Unable to open file.\r\n", newVirtual.c_str());
             }
         }
+    }
 
-        else if (String::EqualsIgnoreCase(szCmd, "RETR")) {
-            if (pszParam.empty()) {
-                SocketSendString(sCmd, "501 Syntax error in parameters or arguments.\r\n");
-            } else if (!isLoggedIn) {
-                SocketSendString(sCmd, "530 Not logged in.\r\n");
+    else if (String::EqualsIgnoreCase(szCmd, "HASH") || String::EqualsIgnoreCase(szCmd, "XCRC") ||
+             String::EqualsIgnoreCase(szCmd, "XMD5") || String::EqualsIgnoreCase(szCmd, "XSHA1") ||
+             String::EqualsIgnoreCase(szCmd, "XSHA256")) {
+        if (pszParam.empty()) {
+            SocketSendString(sCmd, "501 Syntax error in parameters or arguments.\r\n");
+        } else if (!isLoggedIn) {
+            SocketSendString(sCmd, "530 Not logged in.\r\n");
+        } else {
+            bool isHash = String::EqualsIgnoreCase(szCmd, "HASH");
+            HashAlgorithm algorithm = session->hashAlgorithm;
+            std::string pathArg = pszParam;
+            uint32_t start = 0;
+            uint32_t end = 0;
+
+            if (isHash) {
+                // RANG gives an inclusive last byte; REST only a start
+                if (session->hasRange) {
+                    start = session->dwRangeStart;
+                    end = session->dwRangeEnd + 1;
+                } else {
+                    start = dwRestOffset;
+                }
+                dwRestOffset = 0;
             } else {
-                std::string newVirtual = resolveRelative(currentVirtual, pszParam);
-                std::string ftpPath = DriveMount::MapFtpPath(newVirtual);
-
-                uint32_t fileHandle;
-                if (FileSystem::FileOpen(ftpPath, FileModeRead, fileHandle) == true) {
-                    if (dwRestOffset) {
-                        FileSystem::FileSeek(fileHandle, FileSeekModeStart, dwRestOffset);
-                        dwRestOffset = 0;
-                    }
-                    sData = EstablishDataConnection(&saiData, &sPasv);
-                    if (sData) {
-                        SocketSendString(sCmd, "150 Opened %s mode data connection for \"%s\".\r\n",
-                            sPasv ? "passive" : "active", newVirtual.c_str());
-                        if (SendSocketFile(sCmd, sData, fileHandle, &dw)) {
-                            SocketSendString(sCmd, "226 \"%s\" transferred successfully.\r\n", newVirtual.c_str());
+                algorithm = String::EqualsIgnoreCase(szCmd, "XCRC")   ? HashAlgorithm_CRC32
+                            : String::EqualsIgnoreCase(szCmd, "XMD5") ? HashAlgorithm_MD5
+                            : String::EqualsIgnoreCase(szCmd, "XSHA1") ? HashAlgorithm_SHA1
+                                                                        : HashAlgorithm_SHA256;
+
+                // XCRC "name" [start [end]], or unquoted when the name has no trailing numbers
+                if (pathArg[0] == '"') {
+                    size_t quote = pathArg.find('"', 1);
+                    std::string range = quote == std::string::npos ? "" : pathArg.substr(quote + 1);
+                    pathArg = pathArg.substr(1, quote == std::string::npos ? std::string::npos : quote - 1);
+                    sscanf(range.c_str(), "%u %u", &start, &end);
+                } else {
+                    bool exists = false;
+                    FileSystem::FileExists(DriveMount::MapFtpPath(resolveRelative(currentVirtual, pathArg)), exists);
+                    uint32_t first = 0;
+                    uint32_t second = 0;
+                    if (exists == false && splitTrailingNumber(pathArg, second)) {
+                        if (splitTrailingNumber(pathArg, first)) {
+                            start = first;
+                            end = second;
                         } else {
-                            SocketSendString(sCmd, "426 Connection closed; transfer aborted.\r\n");
-                            if (dw) {
-                                SocketSendString(sCmd, "226 ABOR command successful.\r\n");
-                            }
+                            start = second;
                         }
-                        SocketUtility::CloseSocket(sData);
-                    }
-
-                    else {
-                        SocketSendString(sCmd, "425 Can't open data connection.\r\n");
                     }
-                    FileSystem::FileClose(fileHandle);
+                }
+            }
+            session->hasRange = false;
+
+            std::string newVirtual = resolveRelative(currentVirtual, pathArg);
+            std::string ftpPath = DriveMount::MapFtpPath(newVirtual);
+
+            // Read through the RETR pipeline, so the next block loads while this one is hashed
+            SendPipeline pipeline;
+            if (end != 0 && end <= start) {
+                SocketSendString(sCmd, "501 Ending byte is before starting byte.\r\n");
+            } else if (OpenSendPipeline(ftpPath, start, &pipeline) == true) {
+                std::string digest;
+                uint32_t hashed = 0;
+                bool hashedOk = HashSendPipeline(
+                    sCmd, reader, &pipeline, algorithm, end != 0 ? end - start : 0xFFFFFFFF, digest, &hashed, &dw);
+                CloseSendPipeline(&pipeline);
+                if (hashedOk && isHash) {
+                    SocketSendString(sCmd, "213 %s %u-%u %s %s\r\n", hashNames[algorithm], start,
+                        hashed > 0 ? start + hashed - 1 : start, digest.c_str(), pathArg.c_str());
+                } else if (hashedOk) {
+                    SocketSendString(sCmd, "250 %s\r\n", digest.c_str());
+                } else if (dw) {
+                    SocketSendString(sCmd, "426 %s aborted.\r\n226 ABOR command successful.\r\n", szCmd.c_str());
                 } else {
-                    SocketSendString(sCmd, "550 \"%s\": Unable to open file.\r\n", newVirtual.c_str());
+                    SocketSendString(sCmd, "550 \"%s\": Unable to read file.\r\n", newVirtual.c_str());
                 }
+            } else {
+                SocketSendString(sCmd, "550 \"%s\": File not found.\r\n", newVirtual.c_str());
             }
         }
+    }
 
-        else if (String::EqualsIgnoreCase(szCmd, "STOR") || String::EqualsIgnoreCase(szCmd, "APPE")) {
-            if (pszParam.empty()) {
-                SocketSendString(sCmd, "501 Syntax error in parameters or arguments.\r\n");
-            } else if (!isLoggedIn) {
-                SocketSendString(sCmd, "530 Not logged in.\r\n");
-            } else {
-                std::string newVirtual = resolveRelative(currentVirtual, pszParam);
-                std::string ftpPath = DriveMount::MapFtpPath(newVirtual);
+    else if (String::EqualsIgnoreCase(szCmd, "ABOR")) {
+        SocketUtility::CloseSocket(sPasv);
+        dwRestOffset = 0;
+        dwAllocSize = 0;
+        session->hasRange = false;
+        SocketSendString(sCmd, "200 ABOR command successful.\r\n");
+    }
 
-                uint32_t fileHandle;
-                if (FileSystem::FileOpen(ftpPath, FileModeWriteUpdate, fileHandle) == true) {
-                    if (String::EqualsIgnoreCase(szCmd, "APPE")) {
-                        FileSystem::FileSeek(fileHandle, FileSeekModeEnd, 0);
-                    } else {
-                        FileSystem::FileSeek(fileHandle, FileSeekModeStart, dwRestOffset);
-                        FileSystem::FileTruncate(fileHandle, dwRestOffset);
-                    }
-                    dwRestOffset = 0;
-                    sData = EstablishDataConnection(&saiData, &sPasv);
-                    if (sData) {
-                        SocketSendString(sCmd, "150 Opened %s mode data connection for \"%s\".\r\n",
-                            sPasv ? "passive" : "active", newVirtual.c_str());
-                        if (ReceiveSocketFile(sCmd, sData, fileHandle)) {
-                            SocketSendString(sCmd, "226 \"%s\" transferred successfully.\r\n", newVirtual.c_str());
-                        } else {
-                            SocketSendString(sCmd, "426 Connection closed; transfer aborted.\r\n");
-                        }
-                        SocketUtility::CloseSocket(sData);
-                    } else {
-                        SocketSendString(sCmd, "425 Can't open data connection.\r\n");
-                    }
-                    FileSystem::FileClose(fileHandle);
-                } else {
-                    SocketSendString(sCmd, "550 \"%s\": Unable to open file.\r\n", newVirtual.c_str());
-                }
+    else if (String::EqualsIgnoreCase(szCmd, "SIZE")) {
+        if (pszParam.empty()) {
+            SocketSendString(sCmd, "501 Syntax error in parameters or arguments.\r\n");
+        } else if (!isLoggedIn) {
+            SocketSendString(sCmd, "530 Not logged in.\r\n");
+        } else {
+            std::string newVirtual = resolveRelative(currentVirtual, pszParam);
+            std::string ftpPath = DriveMount::MapFtpPath(newVirtual);
+
+            // Straight to the OS, FileSystem's handle table is not safe across the workers
+            HANDLE fileHandle = CreateFileA(ftpPath.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                OPEN_EXISTING, 0, NULL);
+            if (fileHandle != INVALID_HANDLE_VALUE) {
+                DWORD fileSize = GetFileSize(fileHandle, NULL);
+                SocketSendString(sCmd, "213 %llu\r\n", (unsigned long long)fileSize);
+                CloseHandle(fileHandle);
+            } else {
+                SocketSendString(sCmd, "550 \"%s\": File not found.\r\n", newVirtual.c_str());
             }
         }
+    }
 
-        else if (String::EqualsIgnoreCase(szCmd, "ABOR")) {
-            SocketUtility::CloseSocket(sPasv);
-            dwRestOffset = 0;
-            SocketSendString(sCmd, "200 ABOR command successful.\r\n");
-        }
+    else if (String::EqualsIgnoreCase(szCmd, "MDTM")) {
+        if (pszParam.empty()) {
+            SocketSendString(sCmd, "501 Syntax error in parameters or arguments.\r\n");
+        } else if (!isLoggedIn) {
+            SocketSendString(sCmd, "530 Not logged in.\r\n");
+        } else {
+            for (i = 0; i < 14; i++) {
+                if ((pszParam[i] < '0') || (pszParam[i] > '9')) {
+                    break;
+                }
+            }
+            std::string paramPath = pszParam;
+            if ((i == 14) && (pszParam.size() > 14 && pszParam[14] == ' ')) {
+                fileTime.year = (WORD)atoi(pszParam.substr(0, 4).c_str());
+                fileTime.month = (WORD)atoi(pszParam.substr(4, 2).c_str());
+                fileTime.day = (WORD)atoi(pszParam.substr(6, 2).c_str());
+                fileTime.hour = (WORD)atoi(pszParam.substr(8, 2).c_str());
+                fileTime.minute = (WORD)atoi(pszParam.substr(10, 2).c_str());
+                fileTime.second = (WORD)atoi(pszParam.substr(12, 2).c_str());
+                paramPath = pszParam.substr(15);
+                dw = 1;
+            } else {
+                dw = 0;
+            }
 
-        else if (String::EqualsIgnoreCase(szCmd, "SIZE")) {
-            if (pszParam.empty()) {
-                SocketSendString(sCmd, "501 Syntax error in parameters or arguments.\r\n");
-            } else if (!isLoggedIn) {
-                SocketSendString(sCmd, "530 Not logged in.\r\n");
+            std::string newVirtual = resolveRelative(currentVirtual, paramPath);
+            if (dw == 1) {
+                std::string ftpPath = DriveMount::MapFtpPath(newVirtual);
+                if (FileSystem::SetFileTime(ftpPath, fileTime) == true) {
+                    FtpListingCache::Invalidate(ftpPath);
+                    SocketSendString(sCmd, "250 MDTM command successful.\r\n");
+                } else {
+                    SocketSendString(sCmd, "550 \"%s\": File not found.\r\n", newVirtual.c_str());
+                }
             } else {
-                std::string newVirtual = resolveRelative(currentVirtual, pszParam);
                 std::string ftpPath = DriveMount::MapFtpPath(newVirtual);
-
-                uint32_t fileHandle;
-                if (FileSystem::FileOpen(ftpPath, FileModeRead, fileHandle) == true) {
-                    uint32_t fileSize = 0;
-                    FileSystem::FileSize(fileHandle, fileSize);
-                    SocketSendString(sCmd, "213 %llu\r\n", (unsigned long long)fileSize);
-                    FileSystem::FileClose(fileHandle);
+                FileInfoDetail fileInfoDetail;
+                if (FileSystem::FileGetFileInfoDetail(ftpPath, fileInfoDetail)) {
+                    SocketSendString(sCmd, "213 %04u%02u%02u%02u%02u%02u\r\n", fileInfoDetail.writeTime.year,
+                        fileInfoDetail.writeTime.month, fileInfoDetail.writeTime.day,
+                        fileInfoDetail.writeTime.hour, fileInfoDetail.writeTime.minute,
+                        fileInfoDetail.writeTime.second);
                 } else {
                     SocketSendString(sCmd, "550 \"%s\": File not found.\r\n", newVirtual.c_str());
                 }
             }
         }
+    }
 
-        else if (String::EqualsIgnoreCase(szCmd, "MDTM")) {
-            if (pszParam.empty()) {
-                SocketSendString(sCmd, "501 Syntax error in parameters or arguments.\r\n");
-            } else if (!isLoggedIn) {
-                SocketSendString(sCmd, "530 Not logged in.\r\n");
+    else if (String::EqualsIgnoreCase(szCmd, "DELE")) {
+        if (pszParam.empty()) {
+            SocketSendString(sCmd, "501 Syntax error in parameters or arguments.\r\n");
+        } else if (!isLoggedIn) {
+            SocketSendString(sCmd, "530 Not logged in.\r\n");
+        } else {
+            std::string newVirtual = resolveRelative(currentVirtual, pszParam);
+            std::string ftpPath = DriveMount::MapFtpPath(newVirtual);
+            if (FileSystem::FileDelete(ftpPath) == true) {
+                FtpListingCache::Invalidate(ftpPath);
+                SocketSendString(sCmd, "250 \"%s\" deleted successfully.\r\n", newVirtual.c_str());
             } else {
-                for (i = 0; i < 14; i++) {
-                    if ((pszParam[i] < '0') || (pszParam[i] > '9')) {
-                        break;
-                    }
-                }
-                std::string paramPath = pszParam;
-                if ((i == 14) && (pszParam.size() > 14 && pszParam[14] == ' ')) {
-                    fileTime.year = (WORD)atoi(pszParam.substr(0, 4).c_str());
-                    fileTime.month = (WORD)atoi(pszParam.substr(4, 2).c_str());
-                    fileTime.day = (WORD)atoi(pszParam.substr(6, 2).c_str());
-                    fileTime.hour = (WORD)atoi(pszParam.substr(8, 2).c_str());
-                    fileTime.minute = (WORD)atoi(pszParam.substr(10, 2).c_str());
-                    fileTime.second = (WORD)atoi(pszParam.substr(12, 2).c_str());
-                    paramPath = pszParam.substr(15);
-                    dw = 1;
-                } else {
-                    dw = 0;
-                }
-
-                std::string newVirtual = resolveRelative(currentVirtual, paramPath);
-                if (dw == 1) {
-                    std::string ftpPath = DriveMount::MapFtpPath(newVirtual);
-                    if (FileSystem::SetFileTime(ftpPath, fileTime) == true) {
-                        SocketSendString(sCmd, "250 MDTM command successful.\r\n");
-                    } else {
-                        SocketSendString(sCmd, "550 \"%s\": File not found.\r\n", newVirtual.c_str());
-                    }
-                } else {
-                    std::string ftpPath = DriveMount::MapFtpPath(newVirtual);
-                    FileInfoDetail fileInfoDetail;
-                    if (FileSystem::FileGetFileInfoDetail(ftpPath, fileInfoDetail)) {
-                        SocketSendString(sCmd, "213 %04u%02u%02u%02u%02u%02u\r\n", fileInfoDetail.writeTime.year,
-                            fileInfoDetail.writeTime.month, fileInfoDetail.writeTime.day,
-                            fileInfoDetail.writeTime.hour, fileInfoDetail.writeTime.minute,
-                            fileInfoDetail.writeTime.second);
-                    } else {
-                        SocketSendString(sCmd, "550 \"%s\": File not found.\r\n", newVirtual.c_str());
-                    }
-                }
+                SocketSendString(sCmd, "550 \"%s\": File not found.\r\n", newVirtual.c_str());
             }
         }
+    }
 
-        else if (String::EqualsIgnoreCase(szCmd, "DELE")) {
-            if (pszParam.empty()) {
-                SocketSendString(sCmd, "501 Syntax error in parameters or arguments.\r\n");
-            } else if (!isLoggedIn) {
-                SocketSendString(sCmd, "530 Not logged in.\r\n");
+    else if (String::EqualsIgnoreCase(szCmd, "RNFR")) {
+        if (pszParam.empty()) {
+            SocketSendString(sCmd, "501 Syntax error in parameters or arguments.\r\n");
+        } else if (!isLoggedIn) {
+            SocketSendString(sCmd, "530 Not logged in.\r\n");
+        } else {
+            std::string newVirtual = resolveRelative(currentVirtual, pszParam);
+            std::string ftpPath = DriveMount::MapFtpPath(newVirtual);
+            bool exists;
+            if ((FileSystem::FileExists(ftpPath, exists) == true && exists == true) ||
+                (FileSystem::DirectoryExists(ftpPath, exists) == true && exists == true)) {
+                rnfr = ftpPath;
+                SocketSendString(sCmd, "350 \"%s\": File/Directory exists; proceed with RNTO.\r\n", newVirtual.c_str());
             } else {
-                std::string newVirtual = resolveRelative(currentVirtual, pszParam);
-                std::string ftpPath = DriveMount::MapFtpPath(newVirtual);
-                if (FileSystem::FileDelete(ftpPath) == true) {
-                    SocketSendString(sCmd, "250 \"%s\" deleted successfully.\r\n", newVirtual.c_str());
-                } else {
-                    SocketSendString(sCmd, "550 \"%s\": File not found.\r\n", newVirtual.c_str());
-                }
+                SocketSendString(sCmd, "550 \"%s\": File/Directory not found.\r\n", newVirtual.c_str());
             }
         }
+    }
 
-        else if (String::EqualsIgnoreCase(szCmd, "RNFR")) {
-            if (pszParam.empty()) {
-                SocketSendString(sCmd, "501 Syntax error in parameters or arguments.\r\n");
-            } else if (!isLoggedIn) {
-                SocketSendString(sCmd, "530 Not logged in.\r\n");
+    else if (String::EqualsIgnoreCase(szCmd, "RNTO")) {
+        if (pszParam.empty()) {
+            SocketSendString(sCmd, "501 Syntax error in parameters or arguments.\r\n");
+        } else if (!isLoggedIn) {
+            SocketSendString(sCmd, "530 Not logged in.\r\n");
+        } else if (rnfr.empty()) {
+            SocketSendString(sCmd, "503 Bad sequence of commands. Send RNFR first.\r\n");
+        } else {
+            std::string newVirtual = resolveRelative(currentVirtual, pszParam);
+            std::string ftpPath = DriveMount::MapFtpPath(newVirtual);
+
+            if (FileSystem::FileMove(rnfr, ftpPath) == true) {
+                FtpListingCache::Invalidate(rnfr);
+                FtpListingCache::Invalidate(ftpPath);
+                SocketSendString(sCmd, "250 RNTO command successful.\r\n");
+                rnfr.clear();
             } else {
-                std::string newVirtual = resolveRelative(currentVirtual, pszParam);
-                std::string ftpPath = DriveMount::MapFtpPath(newVirtual);
-                bool exists;
-                if ((FileSystem::FileExists(ftpPath, exists) == true && exists == true) ||
-                    (FileSystem::DirectoryExists(ftpPath, exists) == true && exists == true)) {
-                    rnfr = ftpPath;
-                    SocketSendString(sCmd, "350 \"%s\": File/Directory exists; proceed with RNTO.\r\n", newVirtual.c_str());
-                } else {
-                    SocketSendString(sCmd, "550 \"%s\": File/Directory not found.\r\n", newVirtual.c_str());
-                }
+                SocketSendString(sCmd, "553 \"%s\": Unable to rename file.\r\n", newVirtual.c_str());
             }
         }
+    }
 
-        else if (String::EqualsIgnoreCase(szCmd, "RNTO")) {
-            if (pszParam.empty()) {
+    else if (String::EqualsIgnoreCase(szCmd, "SITE")) {
+        size_t space = pszParam.find(' ');
+        std::string siteCmd = pszParam.substr(0, space);
+        std::string siteParam = space != std::string::npos ? pszParam.substr(space + 1) : "";
+
+        if (pszParam.empty()) {
+            SocketSendString(sCmd, "501 Syntax error in parameters or arguments.\r\n");
+        } else if (!isLoggedIn) {
+            SocketSendString(sCmd, "530 Not logged in.\r\n");
+        } else if (String::EqualsIgnoreCase(siteCmd, "HELP")) {
+            SocketSendString(sCmd, "214-The following SITE commands are recognized:\r\n CPFR CPTO UNZIP AUTOUNZIP JOBS HELP\r\n214 Help OK.\r\n");
+        } else if (String::EqualsIgnoreCase(siteCmd, "CPFR")) {
+            std::string newVirtual = resolveRelative(currentVirtual, siteParam);
+            std::string ftpPath = DriveMount::MapFtpPath(newVirtual);
+            bool exists;
+            if (siteParam.empty()) {
                 SocketSendString(sCmd, "501 Syntax error in parameters or arguments.\r\n");
-            } else if (!isLoggedIn) {
-                SocketSendString(sCmd, "530 Not logged in.\r\n");
-            } else if (rnfr.empty()) {
-                SocketSendString(sCmd, "503 Bad sequence of commands. Send RNFR first.\r\n");
+            } else if ((FileSystem::FileExists(ftpPath, exists) == true && exists == true) ||
+                       (FileSystem::DirectoryExists(ftpPath, exists) == true && exists == true)) {
+                session->cpfr = newVirtual;
+                SocketSendString(sCmd, "350 \"%s\": File/Directory exists; proceed with SITE CPTO.\r\n", newVirtual.c_str());
             } else {
-                std::string newVirtual = resolveRelative(currentVirtual, pszParam);
-                std::string ftpPath = DriveMount::MapFtpPath(newVirtual);
-
-                if (FileSystem::FileMove(rnfr, ftpPath) == true) {
-                    SocketSendString(sCmd, "250 RNTO command successful.\r\n");
-                    rnfr.clear();
-                } else {
-                    SocketSendString(sCmd, "553 \"%s\": Unable to rename file.\r\n", newVirtual.c_str());
+                SocketSendString(sCmd, "550 \"%s\": File/Directory not found.\r\n", newVirtual.c_str());
+            }
+        } else if (String::EqualsIgnoreCase(siteCmd, "CPTO")) {
+            std::string newVirtual = resolveRelative(currentVirtual, siteParam);
+            std::string ftpPath = DriveMount::MapFtpPath(newVirtual);
+            std::string sourcePath = DriveMount::MapFtpPath(session->cpfr);
+            if (siteParam.empty()) {
+                SocketSendString(sCmd, "501 Syntax error in parameters or arguments.\r\n");
+            } else if (session->cpfr.empty()) {
+                SocketSendString(sCmd, "503 Bad sequence of commands. Send SITE CPFR first.\r\n");
+            } else if (DriveMount::FtpPathMounted(newVirtual) == false || isSameOrBelow(ftpPath, sourcePath)) {
+                SocketSendString(sCmd, "553 \"%s\": Cannot copy there.\r\n", newVirtual.c_str());
+            } else {
+                uint32_t id = FtpJobs::QueueCopy(sourcePath, ftpPath, session->cpfr, newVirtual);
+                session->cpfr.clear();
+                SocketSendString(sCmd, "200 Copy queued as job %u, see SITE JOBS.\r\n", id);
+            }
+        } else if (String::EqualsIgnoreCase(siteCmd, "UNZIP")) {
+            // Extracts next to the archive, as unzip does in its own directory
+            std::string newVirtual = resolveRelative(currentVirtual, siteParam);
+            std::string ftpPath = DriveMount::MapFtpPath(newVirtual);
+            bool exists;
+            if (siteParam.empty()) {
+                SocketSendString(sCmd, "501 Syntax error in parameters or arguments.\r\n");
+            } else if (FileSystem::FileExists(ftpPath, exists) == true && exists == true) {
+                uint32_t id = FtpJobs::QueueUnzip(ftpPath, FileSystem::GetDirectory(ftpPath), newVirtual,
+                    resolveRelative(newVirtual, ".."));
+                SocketSendString(sCmd, "200 Unzip queued as job %u, see SITE JOBS.\r\n", id);
+            } else {
+                SocketSendString(sCmd, "550 \"%s\": File not found.\r\n", newVirtual.c_str());
+            }
+        } else if (String::EqualsIgnoreCase(siteCmd, "AUTOUNZIP")) {
+            // Opt in per session; STOR of a .zip then extracts instead of storing
+            if (String::EqualsIgnoreCase(siteParam, "ON")) {
+                session->autoUnzip = true;
+                SocketSendString(sCmd, "200 AUTOUNZIP on; zip uploads are extracted as they arrive.\r\n");
+            } else if (String::EqualsIgnoreCase(siteParam, "OFF")) {
+                session->autoUnzip = false;
+                SocketSendString(sCmd, "200 AUTOUNZIP off.\r\n");
+            } else if (siteParam.empty()) {
+                SocketSendString(sCmd, "200 AUTOUNZIP is %s.\r\n", session->autoUnzip ? "on" : "off");
+            } else {
+                SocketSendString(sCmd, "501 Use SITE AUTOUNZIP ON or OFF.\r\n");
+            }
+        } else if (String::EqualsIgnoreCase(siteCmd, "JOBS")) {
+            std::vector<FtpJobInfo> jobs = FtpJobs::GetJobs();
+            if (jobs.empty()) {
+                SocketSendString(sCmd, "211 No background jobs.\r\n");
+            } else {
+                std::string reply = "211-Background jobs:\r\n";
+                for (size_t i = 0; i < jobs.size(); i++) {
+                    reply += formatJob(jobs[i]);
                 }
+                reply += "211 End of jobs.\r\n";
+                SocketSendString(sCmd, "%s", reply.c_str());
             }
+        } else {
+            SocketSendString(sCmd, "504 SITE %s not understood.\r\n", siteCmd.c_str());
         }
+    }
 
-        else if (String::EqualsIgnoreCase(szCmd, "MKD") || String::EqualsIgnoreCase(szCmd, "XMKD")) {
-            if (pszParam.empty()) {
-                SocketSendString(sCmd, "501 Syntax error in parameters or arguments.\r\n");
-            } else if (!isLoggedIn) {
-                SocketSendString(sCmd, "530 Not logged in.\r\n");
+    else if (String::EqualsIgnoreCase(szCmd, "MKD") || String::EqualsIgnoreCase(szCmd, "XMKD")) {
+        if (pszParam.empty()) {
+            SocketSendString(sCmd, "501 Syntax error in parameters or arguments.\r\n");
+        } else if (!isLoggedIn) {
+            SocketSendString(sCmd, "530 Not logged in.\r\n");
+        } else {
+            std::string newVirtual = resolveRelative(currentVirtual, pszParam);
+            std::string ftpPath = DriveMount::MapFtpPath(newVirtual);
+            if (FileSystem::DirectoryCreate(ftpPath) == true) {
+                FtpListingCache::Invalidate(ftpPath);
+                SocketSendString(sCmd, "250 \"%s\" created successfully.\r\n", newVirtual.c_str());
             } else {
-                std::string newVirtual = resolveRelative(currentVirtual, pszParam);
-                std::string ftpPath = DriveMount::MapFtpPath(newVirtual);
-                if (FileSystem::DirectoryCreate(ftpPath) == true) {
-                    SocketSendString(sCmd, "250 \"%s\" created successfully.\r\n", newVirtual.c_str());
-                } else {
-                    SocketSendString(sCmd, "550 \"%s\": Unable to create directory.\r\n", newVirtual.c_str());
-                }
+                SocketSendString(sCmd, "550 \"%s\": Unable to create directory.\r\n", newVirtual.c_str());
             }
         }
+    }
 
-        else if (String::EqualsIgnoreCase(szCmd, "RMD") || String::EqualsIgnoreCase(szCmd, "XRMD")) {
-            if (pszParam.empty()) {
-                SocketSendString(sCmd, "501 Syntax error in parameters or arguments.\r\n");
-            } else if (!isLoggedIn) {
-                SocketSendString(sCmd, "530 Not logged in.\r\n");
+    else if (String::EqualsIgnoreCase(szCmd, "RMD") || String::EqualsIgnoreCase(szCmd, "XRMD")) {
+        if (pszParam.empty()) {
+            SocketSendString(sCmd, "501 Syntax error in parameters or arguments.\r\n");
+        } else if (!isLoggedIn) {
+            SocketSendString(sCmd, "530 Not logged in.\r\n");
+        } else {
+            std::string newVirtual = resolveRelative(currentVirtual, pszParam);
+            std::string ftpPath = DriveMount::MapFtpPath(newVirtual);
+            if (FileSystem::DirectoryDelete(ftpPath, true) == true) {
+                FtpListingCache::Invalidate(ftpPath);
+                SocketSendString(sCmd, "250 \"%s\" removed successfully.\r\n", newVirtual.c_str());
             } else {
-                std::string newVirtual = resolveRelative(currentVirtual, pszParam);
-                std::string ftpPath = DriveMount::MapFtpPath(newVirtual);
-                if (FileSystem::DirectoryDelete(ftpPath, true) == true) {
-                    SocketSendString(sCmd, "250 \"%s\" removed successfully.\r\n", newVirtual.c_str());
-                } else {
-                    SocketSendString(sCmd, "550 \"%s\": Unable to remove directory.\r\n", newVirtual.c_str());
-                }
+                SocketSendString(sCmd, "550 \"%s\": Unable to remove directory.\r\n", newVirtual.c_str());
             }
         }
-        else if (String::EqualsIgnoreCase(szCmd, "OPTS")) {
-            if (pszParam.empty()) {
-                SocketSendString(sCmd, "501 Syntax error in parameters or arguments.\r\n");
-            } else if (String::EqualsIgnoreCase(pszParam, "UTF8 On")) {
-                SocketSendString(sCmd, "200 Always in UTF8 mode.\r\n");
+    }
+    else if (String::EqualsIgnoreCase(szCmd, "OPTS")) {
+        if (pszParam.empty()) {
+            SocketSendString(sCmd, "501 Syntax error in parameters or arguments.\r\n");
+        } else if (String::EqualsIgnoreCase(pszParam, "UTF8 On")) {
+            SocketSendString(sCmd, "200 Always in UTF8 mode.\r\n");
+        } else if (pszParam.size() >= 4 && String::EqualsIgnoreCase(pszParam.substr(0, 4), "HASH")) {
+            std::string name = pszParam.size() > 5 ? pszParam.substr(5) : "";
+            HashAlgorithm algorithm = session->hashAlgorithm;
+            if (name.empty() || tryParseHashAlgorithm(name, algorithm)) {
+                session->hashAlgorithm = algorithm;
+                SocketSendString(sCmd, "200 %s\r\n", hashNames[algorithm]);
+            } else {
+                SocketSendString(sCmd, "501 Unknown algorithm, current selection not changed.\r\n");
+            }
+        } else if (pszParam.size() >= 6 && String::EqualsIgnoreCase(pszParam.substr(0, 6), "MODE Z")) {
+            int32_t level = -1;
+            char keyword[8];
+            if (sscanf(pszParam.c_str() + 6, " %7s %d", keyword, &level) == 2 &&
+                String::EqualsIgnoreCase(keyword, "LEVEL") && level >= DEFLATE_LEVEL_STORE && level <= DEFLATE_LEVEL_MAX) {
+                session->deflateLevel = level;
+                SocketSendString(sCmd, "200 MODE Z LEVEL set to %d.\r\n", level);
             } else {
-                SocketSendString(sCmd, "501 Option not understood.\r\n");
+                SocketSendString(sCmd, "501 MODE Z options are LEVEL 0 to %d.\r\n", DEFLATE_LEVEL_MAX);
             }
+        } else if (pszParam.size() >= 4 && String::EqualsIgnoreCase(pszParam.substr(0, 4), "MLST")) {
+            // Every fact is always sent, whatever the client asks for
+            SocketSendString(sCmd, "200 MLST OPTS type;size;modify;perm;\r\n");
+        } else {
+            SocketSendString(sCmd, "501 Option not understood.\r\n");
         }
+    }
 
-        else if (String::EqualsIgnoreCase(szCmd, "AVBL")) {
-            if (pszParam.empty()) {
-                SocketSendString(sCmd, "550 Syntax error in parameters or arguments.\r\n");
-            } else {
-                std::string newVirtual = resolveRelative(currentVirtual, pszParam);
-                std::string ftpPath = DriveMount::MapFtpPath(newVirtual);
+    else if (String::EqualsIgnoreCase(szCmd, "AVBL")) {
+        if (pszParam.empty()) {
+            SocketSendString(sCmd, "550 Syntax error in parameters or arguments.\r\n");
+        } else {
+            std::string newVirtual = resolveRelative(currentVirtual, pszParam);
+            std::string ftpPath = DriveMount::MapFtpPath(newVirtual);
 
-                uint64_t totalFree;
-                if (DriveMount::GetTotalFreeNumberOfBytes(ftpPath, totalFree)) {
-                    SocketSendString(sCmd, "213 %llu\r\n", (unsigned long long)totalFree);
-                } else {
-                    SocketSendString(sCmd, "550 \"%s\": not found.\r\n", pszParam.c_str());
-                }
+            uint64_t totalFree;
+            if (DriveMount::GetTotalFreeNumberOfBytes(ftpPath, totalFree)) {
+                SocketSendString(sCmd, "213 %llu\r\n", (unsigned long long)totalFree);
+            } else {
+                SocketSendString(sCmd, "550 \"%s\": not found.\r\n", pszParam.c_str());
             }
         }
+    }
 
-        else {
-            SocketSendString(sCmd, "500 Syntax error, command \"%s\" unrecognized.\r\n", szCmd.c_str());
-        }
+    else {
+        SocketSendString(sCmd, "500 Syntax error, command \"%s\" unrecognized.\r\n", szCmd.c_str());
+    }
+}
+
+void FtpServer::OpenSession(uint64_t sCmd) {
+    if (mSessions.size() >= FTP_MAX_SESSIONS) {
+        SocketSendString(sCmd, "421 Too many connections, try again later.\r\n");
+        SocketUtility::CloseSocket(sCmd);
+        return;
     }
 
-    SocketUtility::CloseSocket(sPasv);
-    SocketUtility::CloseSocket(sCmd);
+    Session* session = new Session();
+    session->sCmd = sCmd;
+    session->sData = 0;
+    session->sPasv = 0;
+    memset(&session->saiCmd, 0, sizeof(SOCKADDR_IN));
+    memset(&session->saiCmdPeer, 0, sizeof(SOCKADDR_IN));
+    memset(&session->saiPasv, 0, sizeof(SOCKADDR_IN));
+    memset(&session->saiData, 0, sizeof(SOCKADDR_IN));
+    ResetCommandReader(&session->reader);
+    session->dwRestOffset = 0;
+    session->dwAllocSize = 0;
+    session->hashAlgorithm = HashAlgorithm_SHA1;
+    session->hasRange = false;
+    session->dwRangeStart = 0;
+    session->dwRangeEnd = 0;
+    session->modeZ = false;
+    session->autoUnzip = false;
+    session->deflateLevel = DEFLATE_LEVEL_DEFAULT;
+    session->isLoggedIn = false;
+    session->closeRequested = false;
+    session->busy = 0;
+    session->lastActivity = GetTickCount();
+    session->commandStart = 0;
+    session->commandCount = 0;
+    session->totalLatency = 0;
+    session->maxLatency = 0;
+
+    // Get peer address
+    int length = sizeof(SOCKADDR_IN);
+    getpeername((SOCKET)sCmd, (SOCKADDR*)&session->saiCmdPeer, &length);
+    std::string szPeerName = String::Format("%u.%u.%u.%u", session->saiCmdPeer.sin_addr.S_un.S_un_b.s_b1,
+        session->saiCmdPeer.sin_addr.S_un.S_un_b.s_b2, session->saiCmdPeer.sin_addr.S_un.S_un_b.s_b3,
+        session->saiCmdPeer.sin_addr.S_un.S_un_b.s_b4);
+
+    // Send greeting
+    SocketSendString(sCmd, "220-%s\r\n220-You are connecting from %s:%u.\r\n220 Proceed with login.\r\n", SERVERID,
+        szPeerName.c_str(), ntohs(session->saiCmdPeer.sin_port));
+
+    SocketUtility::GetSocketName(sCmd, &session->saiCmd);
 
-    if (isLoggedIn) {
+    mSessions.push_back(session);
+    if (mSessions.size() > mPeakSessions) {
+        mPeakSessions = (uint32_t)mSessions.size();
+        Debug::Print("FTP: %u concurrent sessions (new peak)\n", mPeakSessions);
+    }
+}
+
+void FtpServer::CloseSession(Session* session) {
+    if (session->isLoggedIn) {
         decrementConnections();
     }
+    SocketUtility::CloseSocket(session->sPasv);
+    SocketUtility::CloseSocket(session->sCmd);
+
+    if (session->commandCount > 0) {
+        Debug::Print("FTP: session closed after %u commands, latency avg %u ms, max %u ms\n", session->commandCount,
+            session->totalLatency / session->commandCount, session->maxLatency);
+    }
+    delete session;
+}
+
+// Runs every complete line in the session's reader. A transfer, or on the
+// listen thread a blocking command, hands the session on and stops there
+// (returning true); whoever takes it carries on with whatever was pipelined
+// behind it. A transfer thread runs everything itself.
+bool FtpServer::ProcessCommands(Session* session, CommandContext context) {
+    CommandLine line;
+    while (session->closeRequested == false && mStopRequested == false) {
+        const ReceiveStatus status = TakeCommand(&session->reader, &line);
+        if (status == ReceiveStatus_Incomplete) {
+            break;
+        }
+
+        session->commandStart = GetTickCount();
+        if (status == ReceiveStatus_Insufficient_Buffer) {
+            SocketSendString(session->sCmd, "500 Command line too long.\r\n");
+            continue;
+        }
 
+        // assign() reuses the strings' capacity, so steady state commands do not allocate
+        session->szCmd.assign(line.command, line.commandLength);
+        session->pszParam.assign(line.param, line.paramLength);
+
+        if (context != CommandContext_Transfer && isTransferCommand(line.command)) {
+            InterlockedExchange((LONG*)&session->busy, 1);
+            startTransfer(session);
+            return true;
+        }
+        if (context == CommandContext_Listen && isBlockingCommand(line.command)) {
+            InterlockedExchange((LONG*)&session->busy, 1);
+            queueJob(session);
+            return true;
+        }
+
+        ExecuteCommand(session);
+
+        recordLatency(session);
+    }
     return false;
 }
 
+DWORD WINAPI FtpServer::WorkerThread(LPVOID lParam) {
+    while (true) {
+        WaitForSingleObject(mJobEvent, INFINITE);
+        Session* session = takeJob();
+        if (session == NULL) {
+            if (mWorkersQuit) {
+                break;
+            }
+            continue;
+        }
+
+        ExecuteCommand(session);
+
+        recordLatency(session);
+
+        if (ProcessCommands(session, CommandContext_Worker) == false) {
+            session->lastActivity = GetTickCount();
+
+            // Hands the session back to the listen thread
+            InterlockedExchange((LONG*)&session->busy, 0);
+        }
+    }
+    return 0;
+}
+
+DWORD WINAPI FtpServer::TransferThread(LPVOID lParam) {
+    Session* session = (Session*)lParam;
+
+    ExecuteCommand(session);
+
+    recordLatency(session);
+
+    ProcessCommands(session, CommandContext_Transfer);
+    session->lastActivity = GetTickCount();
+
+    // Hands the session back to the listen thread
+    InterlockedExchange((LONG*)&session->busy, 0);
+    return 0;
+}
+
 bool WINAPI FtpServer::ListenThread(LPVOID lParam) {
     uint64_t sIncoming = 0;
+    TIMEVAL tv;
+    fd_set fds;
 
     while (mStopRequested == false) {
-        const int result = SocketUtility::GetReadStatus(sListen);
-        if (result == SOCKET_ERROR) {
+        bool anyBusy = false;
+        FD_ZERO(&fds);
+        FD_SET((SOCKET)sListen, &fds);
+        for (size_t i = 0; i < mSessions.size(); i++) {
+            if (mSessions[i]->busy) {
+                anyBusy = true;
+            } else {
+                FD_SET((SOCKET)mSessions[i]->sCmd, &fds);
+            }
+        }
+
+        // Poll quicker while a worker holds a session so it is picked up again promptly
+        const int waitMs = anyBusy ? FTP_REACTOR_BUSY_MS : FTP_REACTOR_IDLE_MS;
+        tv.tv_sec = 0;
+        tv.tv_usec = waitMs * 1000;
+        const int ready = select(0, &fds, 0, 0, &tv);
+        if (ready == SOCKET_ERROR) {
             Debug::Print("Error: Socket status failed: %i\n", WSAGetLastError());
             break;
         }
 
-        if (result == 1 && SocketUtility::AcceptSocket(sListen, sIncoming)) {
-            HANDLE connectionThreadHandle =
-                CreateThread(0, 0, (LPTHREAD_START_ROUTINE)ConnectionThread, (void*)sIncoming, 0, NULL);
-            if (connectionThreadHandle != NULL) {
-                SetThreadPriority(connectionThreadHandle, 2);
-                CloseHandle(connectionThreadHandle);
+        if (ready > 0 && FD_ISSET((SOCKET)sListen, &fds) && SocketUtility::AcceptSocket(sListen, sIncoming)) {
+            OpenSession(sIncoming);
+            sIncoming = 0;
+        }
+
+        const DWORD now = GetTickCount();
+        for (size_t i = 0; i < mSessions.size(); i++) {
+            Session* session = mSessions[i];
+            if (session->busy) {
+                continue;
             }
-        } else {
-            Sleep(50);
+
+            if (ready > 0 && FD_ISSET((SOCKET)session->sCmd, &fds)) {
+                if (FillCommandReader(session->sCmd, &session->reader) != ReceiveStatus_OK) {
+                    session->closeRequested = true;
+                } else {
+                    session->lastActivity = now;
+                    ProcessCommands(session, CommandContext_Listen);
+                }
+            } else if (now - session->lastActivity > (DWORD)mCommandTimeout * 1000) {
+                SocketSendString(session->sCmd, "421 Connection timed out.\r\n");
+                session->closeRequested = true;
+            }
+
+            if (session->busy == 0 && session->closeRequested) {
+                CloseSession(session);
+                mSessions.erase(mSessions.begin() + i);
+                i--;
+            }
+        }
+    }
+
+    // Let any transfer in flight see mStopRequested and hand its session back
+    for (size_t i = 0; i < mSessions.size(); i++) {
+        while (mSessions[i]->busy) {
+            Sleep(10);
         }
+        CloseSession(mSessions[i]);
     }
+    mSessions.clear();
 
     SocketUtility::CloseSocket(sListen);
-    SocketUtility::CloseSocket(sIncoming);
     return false;
 }
 
 bool FtpServer::Init() {
     mStopRequested = false;
+    mWorkersQuit = false;
+    mPeakSessions = 0;
+    FtpListingCache::Init();
+    FtpJobs::Init();
 
     mListenThreadHandle = NULL;
 
@@ -888,6 +1772,15 @@ bool FtpServer::Init() {
 
     SocketUtility::ListenSocket(sListen, SOMAXCONN);
 
+    InitializeCriticalSection(&mJobLock);
+    mJobEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    for (int i = 0; i < FTP_WORKER_COUNT; i++) {
+        mWorkerThreadHandles[i] = CreateThread(0, 0, WorkerThread, 0, 0, NULL);
+        if (mWorkerThreadHandles[i] != NULL) {
+            SetThreadPriority(mWorkerThreadHandles[i], 2);
+        }
+    }
+
     mListenThreadHandle = CreateThread(0, 0, (LPTHREAD_START_ROUTINE)ListenThread, 0, 0, NULL);
     if (mListenThreadHandle != NULL) {
         SetThreadPriority(mListenThreadHandle, 2);
@@ -900,6 +1793,20 @@ void FtpServer::Close() {
     mStopRequested = true;
     WaitForSingleObject(mListenThreadHandle, INFINITE);
     CloseHandle(mListenThreadHandle);
+
+    EnterCriticalSection(&mJobLock);
+    mWorkersQuit = true;
+    SetEvent(mJobEvent);
+    LeaveCriticalSection(&mJobLock);
+    for (int i = 0; i < FTP_WORKER_COUNT; i++) {
+        if (mWorkerThreadHandles[i] != NULL) {
+            WaitForSingleObject(mWorkerThreadHandles[i], INFINITE);
+            CloseHandle(mWorkerThreadHandles[i]);
+        }
+    }
+    CloseHandle(mJobEvent);
+    DeleteCriticalSection(&mJobLock);
+    FtpJobs::Close();
 }
 
 bool FtpServer::SocketSendString(uint64_t s, const char* format, ...) {
@@ -920,79 +1827,73 @@ bool FtpServer::SocketSendString(uint64_t s, const char* format, ...) {
     return bSuccess;
 }
 
-FtpServer::ReceiveStatus FtpServer::SocketReceiveString(
-    uint64_t s, char* psz, uint32_t dwMaxChars, uint32_t* pdwCharsReceived) {
-    uint32_t dwChars = 0;
-    ReceiveStatus status, statusError;
-    char buf[2];
-    uint32_t dw;
+void FtpServer::ResetCommandReader(CommandReader* reader) {
+    reader->start = 0;
+    reader->end = 0;
+    reader->discarding = false;
+}
 
-    for (;;) {
-        if (dwChars == dwMaxChars) {
-            statusError = ReceiveStatus_Insufficient_Buffer;
-            break;
-        }
+bool FtpServer::HasBufferedCommand(const CommandReader* reader) {
+    return memchr(reader->buffer + reader->start, '\n', reader->end - reader->start) != NULL;
+}
 
-        status = SocketReceiveLetter(s, psz, dwMaxChars - dwChars, &dw);
-        if (status == ReceiveStatus_OK) {
-            dwChars += dw;
-            if (*psz == '\r')
-                *psz = 0;
-            else if (*psz == '\n') {
-                *psz = 0;
-                *pdwCharsReceived = dwChars;
-                return ReceiveStatus_OK;
-            }
-            psz += dw;
-        } else if (status == ReceiveStatus_Invalid_Data || status == ReceiveStatus_Insufficient_Buffer) {
-            statusError = status;
-            break;
-        } else {
-            return status;
-        }
+FtpServer::ReceiveStatus FtpServer::TakeCommand(CommandReader* reader, CommandLine* line) {
+    char* newline = (char*)memchr(reader->buffer + reader->start, '\n', reader->end - reader->start);
+    if (newline == NULL) {
+        return ReceiveStatus_Incomplete;
     }
 
-    // A non-critical error occurred, read until end of line
-    for (;;) {
-        status = SocketReceiveLetter(s, buf, sizeof(buf) / sizeof(char), &dw);
-        if (status == ReceiveStatus_OK) {
-            if (*buf == '\n') {
-                return statusError;
-            }
-        } else if (status == ReceiveStatus_Invalid_Data || status == ReceiveStatus_Insufficient_Buffer) {
-            // Go on...
-        } else {
-            return status;
-        }
+    char* first = reader->buffer + reader->start;
+    reader->start = (uint32_t)(newline - reader->buffer) + 1;
+    if (reader->discarding) {
+        reader->discarding = false;
+        return ReceiveStatus_Insufficient_Buffer;
     }
+    parseCommandLine(first, newline, line);
+    return ReceiveStatus_OK;
 }
 
-FtpServer::ReceiveStatus FtpServer::SocketReceiveLetter(
-    uint64_t s, char* pch, uint32_t dwMaxChars, uint32_t* pdwCharsReceived) {
-    char buf[4];
-    uint32_t dw;
-    TIMEVAL tv;
-    fd_set fds;
+// One recv into the reader. Only call it when the socket is readable.
+FtpServer::ReceiveStatus FtpServer::FillCommandReader(uint64_t s, CommandReader* reader) {
+    // Only a partial line is left; move it to the front and receive more behind it
+    if (reader->start > 0) {
+        memmove(reader->buffer, reader->buffer + reader->start, reader->end - reader->start);
+        reader->end -= reader->start;
+        reader->start = 0;
+    }
+    if (reader->end == FTP_COMMAND_BUFFER_SIZE) {
+        // Longer than the buffer, drop what we have and skip to its end of line
+        reader->discarding = true;
+        reader->end = 0;
+    }
 
-    tv.tv_sec = mCommandTimeout;
-    tv.tv_usec = 0;
-    FD_ZERO(&fds);
-    FD_SET((SOCKET)s, &fds);
-    dw = select(0, &fds, 0, 0, &tv);
-    if (dw == SOCKET_ERROR || dw == 0)
-        return ReceiveStatus_Timeout;
-    dw = recv((SOCKET)s, &buf[0], 1, 0);
-    if (dw == SOCKET_ERROR || dw == 0)
+    int received = recv((SOCKET)s, reader->buffer + reader->end, FTP_COMMAND_BUFFER_SIZE - reader->end, 0);
+    if (received == SOCKET_ERROR || received == 0)
         return ReceiveStatus_Network_Error;
+    reader->end += (uint32_t)received;
+    return ReceiveStatus_OK;
+}
 
-    if (dwMaxChars == 0) {
-        return ReceiveStatus_Insufficient_Buffer;
-    }
+FtpServer::ReceiveStatus FtpServer::ReceiveCommand(uint64_t s, CommandReader* reader, CommandLine* line) {
+    TIMEVAL tv;
+    fd_set fds;
 
-    pch[0] = buf[0];
+    for (;;) {
+        ReceiveStatus status = TakeCommand(reader, line);
+        if (status != ReceiveStatus_Incomplete)
+            return status;
 
-    *pdwCharsReceived = 1;
-    return ReceiveStatus_OK;
+        tv.tv_sec = mCommandTimeout;
+        tv.tv_usec = 0;
+        FD_ZERO(&fds);
+        FD_SET((SOCKET)s, &fds);
+        int ready = select(0, &fds, 0, 0, &tv);
+        if (ready == SOCKET_ERROR || ready == 0)
+            return ReceiveStatus_Timeout;
+        status = FillCommandReader(s, reader);
+        if (status != ReceiveStatus_OK)
+            return status;
+    }
 }
 
 FtpServer::ReceiveStatus FtpServer::SocketReceiveData(
@@ -1049,99 +1950,396 @@ uint64_t FtpServer::EstablishDataConnection(sockaddr_in* psaiData, uint64_t* psP
     }
 }
 
-bool FtpServer::ReceiveSocketFile(uint64_t sCmd, uint64_t sData, uint32_t fileHandle) {
-    uint32_t socketBufferSize = RECV_SOCKET_BUFFER_SIZE;
-    SocketUtility::SetSocketRecvSize(sData, socketBufferSize);
+bool FtpServer::OpenReceivePipeline(
+    const std::string path, bool append, uint32_t offset, uint32_t allocSize, ReceivePipeline* pipeline) {
+    memset(pipeline, 0, sizeof(ReceivePipeline));
+
+    // Unbuffered writes must start on a sector, which APPE cannot promise
+    pipeline->unbuffered = append == false && (offset % FTP_SECTOR_SIZE) == 0;
+    pipeline->file = INVALID_HANDLE_VALUE;
+    if (pipeline->unbuffered) {
+        pipeline->file =
+            CreateFileA(path.c_str(), GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_FLAG_NO_BUFFERING, NULL);
+    }
+    if (pipeline->file == INVALID_HANDLE_VALUE) {
+        pipeline->unbuffered = false;
+        pipeline->file = CreateFileA(
+            path.c_str(), GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        if (pipeline->file == INVALID_HANDLE_VALUE) {
+            return false;
+        }
+    }
+
+    pipeline->startOffset = append ? GetFileSize(pipeline->file, NULL) : offset;
+    SetFilePointer(pipeline->file, pipeline->startOffset, NULL, FILE_BEGIN);
+    SetEndOfFile(pipeline->file);
+
+    // Reserving the whole file up front lets FATX hand out its clusters in one run
+    if (allocSize > 0) {
+        SetFilePointer(pipeline->file, pipeline->startOffset + allocSize, NULL, FILE_BEGIN);
+        SetEndOfFile(pipeline->file);
+        SetFilePointer(pipeline->file, pipeline->startOffset, NULL, FILE_BEGIN);
+    }
+
+    pipeline->memory =
+        (char*)VirtualAlloc(NULL, FTP_RECV_BUFFER_COUNT * FTP_RECV_BUFFER_SIZE, MEM_COMMIT, PAGE_READWRITE);
+    if (pipeline->memory == NULL) {
+        CloseHandle(pipeline->file);
+        return false;
+    }
+
+    pipeline->filled = CreateSemaphore(NULL, 0, FTP_RECV_BUFFER_COUNT, NULL);
+    pipeline->empty = CreateSemaphore(NULL, FTP_RECV_BUFFER_COUNT, FTP_RECV_BUFFER_COUNT, NULL);
+    pipeline->thread = CreateThread(0, 0, ReceivePipelineThread, pipeline, 0, NULL);
+    if (pipeline->thread == NULL) {
+        Debug::Print("Error: Could not start STOR writer thread.\n");
+        CloseReceivePipeline(pipeline);
+        return false;
+    }
+    SetThreadPriority(pipeline->thread, 2);
+    return true;
+}
+
+bool FtpServer::CloseReceivePipeline(ReceivePipeline* pipeline) {
+    if (pipeline->thread != NULL) {
+        // A zero length buffer tells the writer it has everything
+        if (pipeline->holdingSlot == false) {
+            WaitForSingleObject(pipeline->empty, INFINITE);
+        }
+        pipeline->lengths[pipeline->index] = 0;
+        ReleaseSemaphore(pipeline->filled, 1, NULL);
+        WaitForSingleObject(pipeline->thread, INFINITE);
+        CloseHandle(pipeline->thread);
+    }
+    CloseHandle(pipeline->filled);
+    CloseHandle(pipeline->empty);
+    VirtualFree(pipeline->memory, 0, MEM_RELEASE);
+
+    // Drops the sector padding of the last write and any unused ALLO reservation
+    SetFilePointer(pipeline->file, pipeline->startOffset + pipeline->totalReceived, NULL, FILE_BEGIN);
+    bool result = SetEndOfFile(pipeline->file) != FALSE && pipeline->writeFailed == false;
+    CloseHandle(pipeline->file);
+    return result;
+}
+
+DWORD WINAPI FtpServer::ReceivePipelineThread(LPVOID lParam) {
+    ReceivePipeline* pipeline = (ReceivePipeline*)lParam;
+    uint32_t index = 0;
+
+    while (true) {
+        WaitForSingleObject(pipeline->filled, INFINITE);
+        const uint32_t length = pipeline->lengths[index];
+        if (length == 0) {
+            break;
+        }
 
-    int driveSectorBufferSize = 128 * 1024;
-    int combinedBufferSize = socketBufferSize + driveSectorBufferSize;
-    char* combinedBuffer = (char*)malloc(combinedBufferSize);
+        // Once a write has failed the rest are only drained so the receiver never blocks
+        if (pipeline->writeFailed == false) {
+            const DWORD bytesToWrite =
+                pipeline->unbuffered ? (length + FTP_SECTOR_SIZE - 1) & ~(FTP_SECTOR_SIZE - 1) : length;
+            DWORD bytesWritten = 0;
+            if (WriteFile(pipeline->file, pipeline->memory + index * FTP_RECV_BUFFER_SIZE, bytesToWrite, &bytesWritten,
+                    NULL) == FALSE ||
+                bytesWritten != bytesToWrite) {
+                Debug::Print("Error: WriteFile failed: %i\n", GetLastError());
+                pipeline->writeFailed = true;
+            }
+        }
 
-    bool fileComplete = false;
+        ReleaseSemaphore(pipeline->empty, 1, NULL);
+        index = (index + 1) % FTP_RECV_BUFFER_COUNT;
+    }
+    return 0;
+}
 
-    uint32_t totalBytesToWrite = 0;
-    uint32_t totalWritten = 0;
+bool FtpServer::ReceiveSocketFile(uint64_t sCmd, uint64_t sData, ReceivePipeline* pipeline) {
+    uint32_t socketBufferSize = RECV_SOCKET_BUFFER_SIZE;
+    SocketUtility::SetSocketRecvSize(sData, socketBufferSize);
 
     while (true) {
-        while (!fileComplete && totalBytesToWrite < (uint32_t)driveSectorBufferSize) {
+        WaitForSingleObject(pipeline->empty, INFINITE);
+        pipeline->holdingSlot = true;
+        if (pipeline->writeFailed) {
+            return false;
+        }
+
+        // Received straight into place; only whole buffers go to the writer
+        // until the client closes the connection
+        char* buffer = pipeline->memory + pipeline->index * FTP_RECV_BUFFER_SIZE;
+        uint32_t length = 0;
+        bool fileComplete = false;
+        while (length < FTP_RECV_BUFFER_SIZE) {
             uint32_t bytesRead = 0;
-            if (SocketReceiveData(sData, combinedBuffer + totalBytesToWrite, socketBufferSize, &bytesRead) !=
-                ReceiveStatus_OK) {
-                free(combinedBuffer);
+            if (SocketReceiveData(sData, buffer + length, min(FTP_RECV_BUFFER_SIZE - length, socketBufferSize),
+                    &bytesRead) != ReceiveStatus_OK) {
                 return false;
             }
-            totalBytesToWrite += bytesRead;
             if (bytesRead == 0) {
                 fileComplete = true;
                 break;
             }
+            length += bytesRead;
         }
 
-        if (fileComplete && totalBytesToWrite == 0) {
-            free(combinedBuffer);
+        if (length > 0) {
+            pipeline->lengths[pipeline->index] = length;
+            pipeline->totalReceived += length;
+            pipeline->holdingSlot = false;
+            ReleaseSemaphore(pipeline->filled, 1, NULL);
+            pipeline->index = (pipeline->index + 1) % FTP_RECV_BUFFER_COUNT;
+        }
+        if (fileComplete) {
             return true;
         }
+    }
+}
+
+// MODE Z STOR: inflates the data connection into the pipeline's buffers,
+// handing each one to the writer as it fills
+bool FtpServer::ReceiveDeflatedSocketFile(uint64_t sData, ReceivePipeline* pipeline, uint32_t* pdwWireBytes) {
+    uint32_t socketBufferSize = RECV_SOCKET_BUFFER_SIZE;
+    SocketUtility::SetSocketRecvSize(sData, socketBufferSize);
+
+    InflateStream* inflate = Deflate::CreateDecompressor(receiveDataSocket, &sData, fillReceivePipeline, pipeline);
+    if (inflate == NULL) {
+        return false;
+    }
+    bool result = Deflate::Decompress(inflate);
+    *pdwWireBytes = Deflate::GetDecompressorTotalIn(inflate);
+    Deflate::DestroyDecompressor(inflate);
+
+    if (result && pipeline->holdingSlot && pipeline->slotFilled > 0) {
+        pipeline->lengths[pipeline->index] = pipeline->slotFilled;
+        pipeline->totalReceived += pipeline->slotFilled;
+        pipeline->holdingSlot = false;
+        ReleaseSemaphore(pipeline->filled, 1, NULL);
+        pipeline->index = (pipeline->index + 1) % FTP_RECV_BUFFER_COUNT;
+    }
+    return result && pipeline->writeFailed == false;
+}
+
+// SITE AUTOUNZIP STOR: extracts the archive straight off the data connection,
+// so it is never written to the drive as a whole
+bool FtpServer::ReceiveZipSocketFile(uint64_t sData, const std::string destination, ZipStreamResult* result) {
+    uint32_t socketBufferSize = RECV_SOCKET_BUFFER_SIZE;
+    SocketUtility::SetSocketRecvSize(sData, socketBufferSize);
+    return ZipStream::Extract(receiveDataSocket, &sData, destination, result);
+}
 
-        uint32_t bytesWritten = 0;
-        uint32_t bytesToWrite = min((uint32_t)driveSectorBufferSize, totalBytesToWrite);
-        if (!FileSystem::FileWrite(fileHandle, combinedBuffer, bytesToWrite, bytesWritten)) {
-            Debug::Print("Error: WriteFile failed: %i", GetLastError());
-            free(combinedBuffer);
+bool FtpServer::OpenSendPipeline(const std::string path, uint32_t offset, SendPipeline* pipeline) {
+    memset(pipeline, 0, sizeof(SendPipeline));
+
+    // Unbuffered reads go straight from the drive into our buffers, but only
+    // from sector aligned offsets, so REST starts at the sector and skips ahead
+    uint32_t alignedOffset = offset - (offset % FTP_SECTOR_SIZE);
+    pipeline->file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+        FILE_FLAG_NO_BUFFERING | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (pipeline->file == INVALID_HANDLE_VALUE) {
+        alignedOffset = offset;
+        pipeline->file = CreateFileA(
+            path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        if (pipeline->file == INVALID_HANDLE_VALUE) {
             return false;
         }
+    }
+    pipeline->skip = offset - alignedOffset;
 
-        totalBytesToWrite -= bytesWritten;
-        totalWritten += bytesWritten;
-        memmove(combinedBuffer, combinedBuffer + bytesWritten, totalBytesToWrite);
+    if (alignedOffset > 0 && SetFilePointer(pipeline->file, alignedOffset, NULL, FILE_BEGIN) == INVALID_SET_FILE_POINTER) {
+        CloseHandle(pipeline->file);
+        return false;
+    }
+
+    // VirtualAlloc hands back page aligned memory, which satisfies unbuffered reads
+    pipeline->memory =
+        (char*)VirtualAlloc(NULL, FTP_SEND_BUFFER_COUNT * FTP_SEND_BUFFER_SIZE, MEM_COMMIT, PAGE_READWRITE);
+    if (pipeline->memory == NULL) {
+        CloseHandle(pipeline->file);
+        return false;
+    }
+
+    pipeline->filled = CreateSemaphore(NULL, 0, FTP_SEND_BUFFER_COUNT, NULL);
+    pipeline->empty = CreateSemaphore(NULL, FTP_SEND_BUFFER_COUNT, FTP_SEND_BUFFER_COUNT, NULL);
+    pipeline->thread = CreateThread(0, 0, SendPipelineThread, pipeline, 0, NULL);
+    if (pipeline->thread == NULL) {
+        Debug::Print("Error: Could not start RETR reader thread.\n");
+        CloseSendPipeline(pipeline);
+        return false;
+    }
+    SetThreadPriority(pipeline->thread, 2);
+    return true;
+}
+
+void FtpServer::CloseSendPipeline(SendPipeline* pipeline) {
+    if (pipeline->thread != NULL) {
+        // Wakes the reader if it is waiting for a free buffer
+        pipeline->cancelRequested = true;
+        ReleaseSemaphore(pipeline->empty, 1, NULL);
+        WaitForSingleObject(pipeline->thread, INFINITE);
+        CloseHandle(pipeline->thread);
     }
+    CloseHandle(pipeline->filled);
+    CloseHandle(pipeline->empty);
+    VirtualFree(pipeline->memory, 0, MEM_RELEASE);
+    CloseHandle(pipeline->file);
 }
 
-bool FtpServer::SendSocketFile(uint64_t sCmd, uint64_t sData, uint32_t fileHandle, uint32_t* pdwAbortFlag) {
-    uint32_t bufferSize = SEND_SOCKET_BUFFER_SIZE;
-    SocketUtility::SetSocketSendSize(sData, bufferSize);
-    char* szBuffer = (char*)malloc(bufferSize);
+DWORD WINAPI FtpServer::SendPipelineThread(LPVOID lParam) {
+    SendPipeline* pipeline = (SendPipeline*)lParam;
+    uint32_t index = 0;
 
     while (true) {
-        uint32_t bytesRead;
-        if (FileSystem::FileRead(fileHandle, szBuffer, bufferSize, bytesRead) == false) {
-            Debug::Print("Error: ReadFile failed: %i", GetLastError());
-            free(szBuffer);
-            return false;
+        WaitForSingleObject(pipeline->empty, INFINITE);
+        if (pipeline->cancelRequested) {
+            break;
+        }
+
+        DWORD bytesRead = 0;
+        if (ReadFile(pipeline->file, pipeline->memory + index * FTP_SEND_BUFFER_SIZE, FTP_SEND_BUFFER_SIZE, &bytesRead,
+                NULL) == FALSE) {
+            Debug::Print("Error: ReadFile failed: %i\n", GetLastError());
+            pipeline->readFailed = true;
+            bytesRead = 0;
         }
+        pipeline->lengths[index] = bytesRead;
+        ReleaseSemaphore(pipeline->filled, 1, NULL);
 
         if (bytesRead == 0) {
-            free(szBuffer);
-            return true;
+            break;
         }
+        index = (index + 1) % FTP_SEND_BUFFER_COUNT;
+    }
+    return 0;
+}
 
-        int bytesToSend = bytesRead;
-        int bufferOffset = 0;
-
-        while (bytesToSend > 0) {
-            int sent = send((SOCKET)sData, szBuffer + bufferOffset, bytesToSend, 0);
-            int queueLength = 0;
-            SocketUtility::GetReadQueueLength(sCmd, queueLength);
-            if (queueLength > 0) {
-                char cmdBuf[512];
-                uint32_t bytes_received = 0;
-                if (SocketReceiveString(sCmd, cmdBuf, 512, &bytes_received) == ReceiveStatus_OK) {
-                    std::string cmdLine(cmdBuf, bytes_received);
-                    if (String::EqualsIgnoreCase(cmdLine, "ABOR")) {
-                        *pdwAbortFlag = 1;
-                        free(szBuffer);
-                        return false;
-                    } else {
-                        SocketSendString(sCmd, "500 Only command allowed at this time is ABOR.\r\n");
-                    }
-                }
+// Looks at the control connection during a long command; true once ABOR arrives
+bool FtpServer::PollAbort(uint64_t sCmd, CommandReader* reader) {
+    int queueLength = 0;
+    if (HasBufferedCommand(reader) == false) {
+        SocketUtility::GetReadQueueLength(sCmd, queueLength);
+    }
+    if (HasBufferedCommand(reader) || queueLength > 0) {
+        CommandLine line;
+        if (ReceiveCommand(sCmd, reader, &line) == ReceiveStatus_OK) {
+            if (String::EqualsIgnoreCase(line.command, "ABOR")) {
+                return true;
             }
-            bytesToSend -= sent;
-            bufferOffset += (int)sent;
-            if (sent < 1) {
-                free(szBuffer);
+            SocketSendString(sCmd, "500 Only command allowed at this time is ABOR.\r\n");
+        }
+    }
+    return false;
+}
+
+// Hashes up to length bytes from the pipeline; digest is lower case hex, or
+// the upper case CRC32 that XCRC clients expect
+bool FtpServer::HashSendPipeline(uint64_t sCmd, CommandReader* reader, SendPipeline* pipeline, HashAlgorithm algorithm,
+    uint32_t length, std::string& digest, uint32_t* pdwBytesHashed, uint32_t* pdwAbortFlag) {
+    br_hash_compat_context context;
+    const br_hash_class* hashClass = hashClasses[algorithm];
+    if (hashClass != NULL) {
+        hashClass->init(&context.vtable);
+    }
+    uint32_t crc = 0;
+
+    uint32_t skip = pipeline->skip;
+    uint32_t index = 0;
+    *pdwBytesHashed = 0;
+
+    while (*pdwBytesHashed < length) {
+        WaitForSingleObject(pipeline->filled, INFINITE);
+        const char* buffer = pipeline->memory + index * FTP_SEND_BUFFER_SIZE;
+        const uint32_t bufferLength = pipeline->lengths[index];
+        if (bufferLength == 0) {
+            if (pipeline->readFailed) {
                 return false;
             }
+            break;
+        }
+
+        uint32_t bufferOffset = min(skip, bufferLength);
+        skip -= bufferOffset;
+        uint32_t count = min(bufferLength - bufferOffset, length - *pdwBytesHashed);
+        if (hashClass != NULL) {
+            hashClass->update(&context.vtable, buffer + bufferOffset, count);
+        } else {
+            crc = Deflate::UpdateCrc32(crc, (const uint8_t*)buffer + bufferOffset, count);
+        }
+        *pdwBytesHashed += count;
+
+        ReleaseSemaphore(pipeline->empty, 1, NULL);
+        index = (index + 1) % FTP_SEND_BUFFER_COUNT;
+
+        if (PollAbort(sCmd, reader)) {
+            *pdwAbortFlag = 1;
+            return false;
         }
     }
+
+    if (hashClass == NULL) {
+        digest = String::Format("%08X", crc);
+        return true;
+    }
+
+    uint8_t out[64];
+    hashClass->out(&context.vtable, out);
+    const uint32_t size = (uint32_t)((hashClass->desc >> BR_HASHDESC_OUT_OFF) & BR_HASHDESC_OUT_MASK);
+    digest.clear();
+    for (uint32_t i = 0; i < size; i++) {
+        char hex[3];
+        sprintf(hex, "%02x", out[i]);
+        digest += hex;
+    }
     return true;
 }
+
+// Sends up to length bytes from the pipeline
+bool FtpServer::SendSocketFile(uint64_t sCmd, CommandReader* reader, uint64_t sData, SendPipeline* pipeline,
+    uint32_t length, DeflateStream* deflate, uint32_t* pdwAbortFlag) {
+    uint32_t bufferSize = SEND_SOCKET_BUFFER_SIZE;
+    SocketUtility::SetSocketSendSize(sData, bufferSize);
+
+    uint32_t skip = pipeline->skip;
+    uint32_t index = 0;
+    uint32_t remaining = length;
+
+    while (remaining > 0) {
+        WaitForSingleObject(pipeline->filled, INFINITE);
+        const char* buffer = pipeline->memory + index * FTP_SEND_BUFFER_SIZE;
+        const uint32_t bufferLength = pipeline->lengths[index];
+        if (bufferLength == 0) {
+            if (pipeline->readFailed) {
+                return false;
+            }
+            break;
+        }
+
+        uint32_t bufferOffset = min(skip, bufferLength);
+        skip -= bufferOffset;
+        const uint32_t bufferEnd = bufferOffset + min(bufferLength - bufferOffset, remaining);
+        remaining -= bufferEnd - bufferOffset;
+
+        // Sent a socket buffer at a time so ABOR is still noticed promptly;
+        // in MODE Z that much is compressed, which sends whatever it yields
+        while (bufferOffset < bufferEnd) {
+            int bytesToSend = (int)min(bufferEnd - bufferOffset, bufferSize);
+            int sent = bytesToSend;
+            if (deflate == NULL) {
+                sent = send((SOCKET)sData, buffer + bufferOffset, bytesToSend, 0);
+            } else if (Deflate::Compress(deflate, buffer + bufferOffset, bytesToSend) == false) {
+                sent = 0;
+            }
+            if (PollAbort(sCmd, reader)) {
+                *pdwAbortFlag = 1;
+                return false;
+            }
+            if (sent < 1) {
+                return false;
+            }
+            bufferOffset += (uint32_t)sent;
+        }
+
+        // Hands the buffer back to the reader
+        ReleaseSemaphore(pipeline->empty, 1, NULL);
+        index = (index + 1) % FTP_SEND_BUFFER_COUNT;
+    }
+    return deflate == NULL || Deflate::Finish(deflate);
+}
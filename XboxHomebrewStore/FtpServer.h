@@ -3,6 +3,19 @@
 #include "SocketUtility.h"
 #include "Main.h"
 #include "FileSystem.h"
+#include "Deflate.h"
+#include "ZipStream.h"
+
+#define FTP_COMMAND_BUFFER_SIZE 4096
+#define FTP_WORKER_COUNT 3
+#define FTP_MAX_SESSIONS 48
+#define FTP_REACTOR_IDLE_MS 250
+#define FTP_REACTOR_BUSY_MS 10
+#define FTP_SEND_BUFFER_COUNT 4
+#define FTP_SEND_BUFFER_SIZE (128 * 1024)
+#define FTP_RECV_BUFFER_COUNT 4
+#define FTP_RECV_BUFFER_SIZE (256 * 1024)
+#define FTP_SECTOR_SIZE 2048
 
 class FtpServer {
   public:
@@ -11,20 +24,145 @@ class FtpServer {
         ReceiveStatus_Network_Error,
         ReceiveStatus_Timeout,
         ReceiveStatus_Invalid_Data,
-        ReceiveStatus_Insufficient_Buffer
+        ReceiveStatus_Insufficient_Buffer,
+        ReceiveStatus_Incomplete
     } ReceiveStatus;
 
-    static bool WINAPI ConnectionThread(uint64_t pParam);
+    // Digests offered by HASH (draft-bryan-ftp-hash) and the X* checksum commands
+    typedef enum _HashAlgorithm {
+        HashAlgorithm_CRC32 = 0,
+        HashAlgorithm_MD5,
+        HashAlgorithm_SHA1,
+        HashAlgorithm_SHA256,
+        HashAlgorithm_Count
+    } HashAlgorithm;
+
+    // Control channel bytes received in bulk; complete lines are parsed in
+    // place, so pipelined commands are served without touching the socket.
+    typedef struct _CommandReader {
+        char buffer[FTP_COMMAND_BUFFER_SIZE];
+        uint32_t start;
+        uint32_t end;
+        bool discarding;
+    } CommandReader;
+
+    // Views into CommandReader::buffer, NUL terminated, valid until the next read.
+    typedef struct _CommandLine {
+        const char* command;
+        uint32_t commandLength;
+        const char* param;
+        uint32_t paramLength;
+    } CommandLine;
+
+    // RETR read ahead. A reader thread fills a ring of sector aligned buffers
+    // while the sender drains them; filled counts buffers ready to send and
+    // empty counts buffers the reader may refill. A zero length buffer marks
+    // the end of the file (or a read error, see readFailed).
+    typedef struct _SendPipeline {
+        HANDLE file;
+        HANDLE thread;
+        HANDLE filled;
+        HANDLE empty;
+        char* memory;
+        uint32_t lengths[FTP_SEND_BUFFER_COUNT];
+        uint32_t skip;
+        volatile bool cancelRequested;
+        volatile bool readFailed;
+    } SendPipeline;
+
+    // STOR write behind, the mirror of SendPipeline. The receiver fills whole
+    // buffers in place and a writer thread puts them on disk; index is the
+    // buffer the receiver fills next and holdingSlot says it already owns it.
+    typedef struct _ReceivePipeline {
+        HANDLE file;
+        HANDLE thread;
+        HANDLE filled;
+        HANDLE empty;
+        char* memory;
+        uint32_t lengths[FTP_RECV_BUFFER_COUNT];
+        uint32_t index;
+        bool holdingSlot;
+        bool unbuffered;
+        uint32_t startOffset;
+        uint32_t totalReceived;
+        uint32_t slotFilled;
+        volatile bool writeFailed;
+    } ReceivePipeline;
+
+    // Where a session's commands are being run from
+    typedef enum _CommandContext {
+        CommandContext_Listen,
+        CommandContext_Worker,
+        CommandContext_Transfer
+    } CommandContext;
+
+    // State of one control connection. The listen thread owns it while busy
+    // is zero; a worker or transfer thread owns it from the moment a command
+    // is handed over until it clears busy again.
+    typedef struct _Session {
+        uint64_t sCmd;
+        uint64_t sData;
+        uint64_t sPasv;
+        SOCKADDR_IN saiCmd;
+        SOCKADDR_IN saiCmdPeer;
+        SOCKADDR_IN saiPasv;
+        SOCKADDR_IN saiData;
+        CommandReader reader;
+        std::string szCmd;
+        std::string pszParam;
+        std::string user;
+        std::string currentVirtual;
+        std::string rnfr;
+        std::string cpfr;
+        uint32_t dwRestOffset;
+        uint32_t dwAllocSize;
+        HashAlgorithm hashAlgorithm;
+        bool hasRange;
+        uint32_t dwRangeStart;
+        uint32_t dwRangeEnd;
+        bool modeZ;
+        bool autoUnzip;
+        int32_t deflateLevel;
+        bool isLoggedIn;
+        bool closeRequested;
+        volatile LONG busy;
+        DWORD lastActivity;
+        DWORD commandStart;
+        uint32_t commandCount;
+        DWORD totalLatency;
+        DWORD maxLatency;
+    } Session;
 
     static bool WINAPI ListenThread(LPVOID lParam);
+    static DWORD WINAPI WorkerThread(LPVOID lParam);
+    static DWORD WINAPI TransferThread(LPVOID lParam);
 
     static bool Init();
     static void Close();
+    static void OpenSession(uint64_t sCmd);
+    static void CloseSession(Session* session);
+    static bool ProcessCommands(Session* session, CommandContext context);
+    static void ExecuteCommand(Session* session);
     static bool SocketSendString(uint64_t s, const char* format, ...);
-    static ReceiveStatus SocketReceiveString(uint64_t s, char* psz, uint32_t dwMaxChars, uint32_t* pdwCharsReceived);
-    static ReceiveStatus SocketReceiveLetter(uint64_t s, char* pch, uint32_t dwMaxChars, uint32_t* pdwCharsReceived);
+    static void ResetCommandReader(CommandReader* reader);
+    static bool HasBufferedCommand(const CommandReader* reader);
+    static ReceiveStatus FillCommandReader(uint64_t s, CommandReader* reader);
+    static ReceiveStatus TakeCommand(CommandReader* reader, CommandLine* line);
+    static ReceiveStatus ReceiveCommand(uint64_t s, CommandReader* reader, CommandLine* line);
     static ReceiveStatus SocketReceiveData(uint64_t s, char* psz, uint32_t dwBytesToRead, uint32_t* pdwBytesRead);
     static uint64_t EstablishDataConnection(sockaddr_in* psaiData, uint64_t* psPasv);
-    static bool ReceiveSocketFile(uint64_t sCmd, uint64_t sData, uint32_t fileHandle);
-    static bool SendSocketFile(uint64_t sCmd, uint64_t sData, uint32_t fileHandle, uint32_t* pdwAbortFlag);
+    static bool OpenReceivePipeline(const std::string path, bool append, uint32_t offset, uint32_t allocSize, ReceivePipeline* pipeline);
+    static bool CloseReceivePipeline(ReceivePipeline* pipeline);
+    static DWORD WINAPI ReceivePipelineThread(LPVOID lParam);
+    static bool ReceiveSocketFile(uint64_t sCmd, uint64_t sData, ReceivePipeline* pipeline);
+    static bool ReceiveDeflatedSocketFile(uint64_t sData, ReceivePipeline* pipeline, uint32_t* pdwWireBytes);
+    static bool ReceiveZipSocketFile(uint64_t sData, const std::string destination, ZipStreamResult* result);
+    static bool OpenSendPipeline(const std::string path, uint32_t offset, SendPipeline* pipeline);
+    static void CloseSendPipeline(SendPipeline* pipeline);
+    static DWORD WINAPI SendPipelineThread(LPVOID lParam);
+    static bool PollAbort(uint64_t sCmd, CommandReader* reader);
+    static bool HashSendPipeline(uint64_t sCmd, CommandReader* reader, SendPipeline* pipeline, HashAlgorithm algorithm,
+        uint32_t length, std::string& digest, uint32_t* pdwBytesHashed, uint32_t* pdwAbortFlag);
+    static bool SendSocketFile(uint64_t sCmd, CommandReader* reader, uint64_t sData, SendPipeline* pipeline,
+        uint32_t length, DeflateStream* deflate, uint32_t* pdwAbortFlag);
 };
@@ -8,6 +8,7 @@
 #include "TextureHelper.h"
 #include "Debug.h"
 #include "String.h"
+#include "ImageFailureCache.h"
 static uint32_t CRC32( const void* data, size_t size )
 {
     static uint32_t s_table[256];
@@ -30,13 +31,28 @@ static uint32_t CRC32( const void* data, size_t size )
     return crc ^ 0xFFFFFFFFU;
 }
 
-static std::string CachePathFor( const std::string appId, ImageDownloadType type )
+static std::string CacheFileFor( const std::string appId, ImageDownloadType type, const char* extension )
 {
     uint32_t crc = CRC32( appId.c_str(), appId.size() );
     if( type == IMAGE_COVER ) {
-        return String::Format( "T:\\Cache\\Covers\\%08X.jpg", crc );
+        return String::Format( "T:\\Cache\\Covers\\%08X.%s", crc, extension );
+    }
+    if( type == IMAGE_COVER_THUMBNAIL ) {
+        return String::Format( "T:\\Cache\\Covers\\%08X_t.%s", crc, extension );
     }
-    return String::Format( "T:\\Cache\\Screenshots\\%08X.jpg", crc );
+    return String::Format( "T:\\Cache\\Screenshots\\%08X.%s", crc, extension );
+}
+
+/** Block compressed texture that the scenes load (see TextureHelper::LoadCompressedFromFile). */
+static std::string CachePathFor( const std::string appId, ImageDownloadType type )
+{
+    return CacheFileFor( appId, type, "dxt" );
+}
+
+/** Downloaded jpg, only kept until it has been compressed. */
+static std::string DownloadPathFor( const std::string appId, ImageDownloadType type )
+{
+    return CacheFileFor( appId, type, "jpg" );
 }
 
 static bool FileExists( const char* path )
@@ -67,6 +83,12 @@ static bool FileExistsAndAvailable( const char* path )
     return true;
 }
 
+/** Finished writing and loadable; anything else on disk is stale and gets fetched again. */
+static bool CacheFileReady( const std::string path )
+{
+    return FileExistsAndAvailable( path.c_str() ) && TextureHelper::IsCompressedFileValid( path );
+}
+
 std::string ImageDownloader::GetCoverCachePath( const std::string appId )
 {
     return CachePathFor( appId, IMAGE_COVER );
@@ -77,6 +99,11 @@ bool ImageDownloader::IsCoverCached( const std::string appId )
     return FileExistsAndAvailable( GetCoverCachePath( appId ).c_str() );
 }
 
+std::string ImageDownloader::GetCoverThumbnailCachePath( const std::string appId )
+{
+    return CachePathFor( appId, IMAGE_COVER_THUMBNAIL );
+}
+
 std::string ImageDownloader::GetScreenshotCachePath( const std::string appId )
 {
     return CachePathFor( appId, IMAGE_SCREENSHOT );
@@ -89,6 +116,12 @@ bool ImageDownloader::IsScreenshotCached( const std::string appId )
 
 #define CACHE_FILE_LIMIT STORE_CACHE_FILE_LIMIT
 
+namespace {
+    // Shared by every ImageDownloader instance, see ProcessRequest
+    CRITICAL_SECTION mDownloadLock;
+    LONG mDownloadLockRefs = 0;
+}
+
 static void CollectFileWithTime( const char* dir, std::vector<std::pair<std::string, ULONGLONG> >* out )
 {
     std::string pattern = std::string( dir ) + "\\*";
@@ -133,6 +166,17 @@ static std::string FindOldestCacheFile()
     return files[oldest].first;
 }
 
+static std::string RequestKey( const std::string appId, ImageDownloadType type )
+{
+    if( type == IMAGE_COVER ) {
+        return appId + "_cover";
+    }
+    if( type == IMAGE_COVER_THUMBNAIL ) {
+        return appId + "_thumbnail";
+    }
+    return appId + "_screenshot";
+}
+
 static void EnforceCacheLimit()
 {
     while( CountCacheFiles() >= CACHE_FILE_LIMIT )
@@ -146,147 +190,343 @@ static void EnforceCacheLimit()
 }
 
 ImageDownloader::ImageDownloader()
-    : m_thread( nullptr )
-    , m_quit( false )
-    , m_cancelRequested( false )
+    : m_quit( false )
+    , m_sequence( 0 )
+    , m_retrySeconds( 0 )
 {
     InitializeCriticalSection( &m_queueLock );
-    m_thread = CreateThread( nullptr, 0, ThreadProc, this, 0, nullptr );
+    InitializeCriticalSection( &m_completedLock );
+    if( InterlockedIncrement( &mDownloadLockRefs ) == 1 ) {
+        InitializeCriticalSection( &mDownloadLock );
+    }
+    m_queueEvent = CreateEvent( nullptr, TRUE, FALSE, nullptr );
+    for( int32_t i = 0; i < IMAGE_DOWNLOADER_WORKER_COUNT; i++ )
+    {
+        m_workers[i].owner = this;
+        m_workers[i].cancelRequested = false;
+        m_workers[i].thread = CreateThread( nullptr, 0, ThreadProc, &m_workers[i], 0, nullptr );
+    }
 }
 
 ImageDownloader::~ImageDownloader()
 {
+    EnterCriticalSection( &m_queueLock );
     m_quit = true;
-    if( m_thread )
+    m_queue.clear();
+    for( int32_t i = 0; i < IMAGE_DOWNLOADER_WORKER_COUNT; i++ ) {
+        m_workers[i].cancelRequested = true;
+    }
+    SetEvent( m_queueEvent );
+    LeaveCriticalSection( &m_queueLock );
+
+    for( int32_t i = 0; i < IMAGE_DOWNLOADER_WORKER_COUNT; i++ )
     {
-        WaitForSingleObject( m_thread, INFINITE );
-        CloseHandle( m_thread );
+        if( m_workers[i].thread )
+        {
+            WaitForSingleObject( m_workers[i].thread, INFINITE );
+            CloseHandle( m_workers[i].thread );
+        }
     }
+    CloseHandle( m_queueEvent );
     DeleteCriticalSection( &m_completedLock );
     DeleteCriticalSection( &m_queueLock );
+    if( InterlockedDecrement( &mDownloadLockRefs ) == 0 ) {
+        DeleteCriticalSection( &mDownloadLock );
+    }
 }
 
-void ImageDownloader::Queue( D3DTexture** pOutTexture, const std::string appId, ImageDownloadType type)
+void ImageDownloader::Queue( const std::string appId, ImageDownloadType type, ImageRequestPriority priority )
 {
-    if( !pOutTexture || appId.empty() ) return;
+    if( appId.empty() ) return;
 
-    for (uint32_t i = 0; i < m_queue.size(); i++) {
-        Request* item = &m_queue[i];
-        if (item->appId == appId && item->type == type) {
-            return;
+    std::string key = RequestKey( appId, type );
+
+    EnterCriticalSection( &m_queueLock );
+
+    if( m_inFlight.find( key ) != m_inFlight.end() ) {
+        LeaveCriticalSection( &m_queueLock );
+        return;
+    }
+
+    // Backing off after a failure; remember the soonest retry so an idle scene
+    // can wake up and queue it again then
+    uint32_t retrySeconds = ImageFailureCache::GetSecondsUntilRetry( key );
+    if( retrySeconds > 0 ) {
+        if( m_retrySeconds == 0 || retrySeconds < m_retrySeconds ) {
+            m_retrySeconds = retrySeconds;
         }
+        LeaveCriticalSection( &m_queueLock );
+        return;
+    }
+
+    // Already queued, just take the caller's current priority (cursor may have moved)
+    std::map<std::string, Request>::iterator it = m_queue.find( key );
+    if( it != m_queue.end() ) {
+        // Time-to-image is measured from when the card was selected, not from
+        // when it first scrolled into view
+        if( priority == IMAGE_PRIORITY_SELECTED && it->second.priority != IMAGE_PRIORITY_SELECTED ) {
+            it->second.queuedTick = GetTickCount();
+        }
+        it->second.priority = priority;
+        LeaveCriticalSection( &m_queueLock );
+        return;
     }
 
     Request r;
-    r.pOutTexture = pOutTexture;
+    r.key = key;
     r.appId = appId;
     r.type = type;
+    r.priority = priority;
+    r.sequence = m_sequence++;
+    r.queuedTick = GetTickCount();
+
+    // Called from the render thread every frame, so the disk is only touched
+    // by the worker (ProcessRequest hands back files already in the cache)
+    m_queue[key] = r;
+    SetEvent( m_queueEvent );
 
-    EnterCriticalSection( &m_queueLock );
-    m_queue.push_back( r );
     LeaveCriticalSection( &m_queueLock );
 }
 
 void ImageDownloader::CancelAll()
 {
-    m_cancelRequested = true;
     EnterCriticalSection( &m_queueLock );
     m_queue.clear();
+    ResetEvent( m_queueEvent );
+    for( int32_t i = 0; i < IMAGE_DOWNLOADER_WORKER_COUNT; i++ ) {
+        m_workers[i].cancelRequested = true;
+    }
+    LeaveCriticalSection( &m_queueLock );
+}
+
+void ImageDownloader::CancelExcept( const std::set<std::string>& appIds )
+{
+    EnterCriticalSection( &m_queueLock );
+    std::map<std::string, Request>::iterator it = m_queue.begin();
+    while( it != m_queue.end() )
+    {
+        if( appIds.find( it->second.appId ) == appIds.end() ) {
+            m_queue.erase( it++ );
+        } else {
+            ++it;
+        }
+    }
+    if( m_queue.empty() ) {
+        ResetEvent( m_queueEvent );
+    }
+    for( int32_t i = 0; i < IMAGE_DOWNLOADER_WORKER_COUNT; i++ )
+    {
+        Worker* worker = &m_workers[i];
+        if( !worker->activeAppId.empty() && appIds.find( worker->activeAppId ) == appIds.end() ) {
+            worker->cancelRequested = true;
+        }
+    }
+    LeaveCriticalSection( &m_queueLock );
+}
+
+bool ImageDownloader::TryGetCompleted( ImageDownloadResult* result )
+{
+    bool found = false;
+    EnterCriticalSection( &m_completedLock );
+    if( !m_completed.empty() )
+    {
+        *result = m_completed.front();
+        m_completed.pop_front();
+        found = true;
+    }
+    LeaveCriticalSection( &m_completedLock );
+
+    // The caller has the result now, so the key may be queued again
+    if( found )
+    {
+        EnterCriticalSection( &m_queueLock );
+        m_inFlight.erase( RequestKey( result->appId, result->type ) );
+        LeaveCriticalSection( &m_queueLock );
+    }
+    return found;
+}
+
+/** Soonest retry of a request Queue skipped for backoff since the last call. */
+bool ImageDownloader::TryTakeRetryDelay( uint32_t* milliseconds )
+{
+    EnterCriticalSection( &m_queueLock );
+    bool found = m_retrySeconds > 0;
+    *milliseconds = m_retrySeconds * 1000;
+    m_retrySeconds = 0;
     LeaveCriticalSection( &m_queueLock );
+    return found;
 }
 
 DWORD WINAPI ImageDownloader::ThreadProc( LPVOID param )
 {
-    ImageDownloader* p = (ImageDownloader*)param;
-    if( p ) {
-        p->WorkerLoop();
+    Worker* worker = (Worker*)param;
+    if( worker && worker->owner ) {
+        worker->owner->WorkerLoop( worker );
     }
     return 0;
 }
 
-void ImageDownloader::WorkerLoop()
+void ImageDownloader::WorkerLoop( Worker* worker )
 {
-    while( !m_quit )
+    while( true )
     {
+        WaitForSingleObject( m_queueEvent, INFINITE );
         if( m_quit ) {
             break;
         }
 
         Request req;
-        bool haveRequest = false;
-
-        EnterCriticalSection( &m_queueLock );
-
-        if( !m_queue.empty() )
+        if( TryTakeRequest( worker, &req ) )
         {
-            req = m_queue.front();
-            m_queue.pop_front();
-            haveRequest = true;
+            bool completed = ProcessRequest( worker, req );
+
+            // A posted result keeps its key in flight until TryGetCompleted
+            // takes it, so the frames in between do not queue it again
+            EnterCriticalSection( &m_queueLock );
+            if( !completed ) {
+                m_inFlight.erase( req.key );
+            }
+            worker->activeAppId.clear();
+            LeaveCriticalSection( &m_queueLock );
         }
+    }
+}
 
-        if( m_queue.empty() )
-            m_cancelRequested = false;
+int32_t ImageDownloader::GetRank( const Request& request )
+{
+    return ( request.priority * 2 ) + ( request.type == IMAGE_COVER_THUMBNAIL ? 0 : 1 );
+}
 
+bool ImageDownloader::TryTakeRequest( Worker* worker, Request* request )
+{
+    EnterCriticalSection( &m_queueLock );
+    if( m_queue.empty() || m_quit )
+    {
         LeaveCriticalSection( &m_queueLock );
+        return false;
+    }
 
-        if( !haveRequest )
-        {
-            Sleep(10);
-            continue;
+    // Highest priority first, thumbnails ahead of full images within a priority, then oldest first
+    std::map<std::string, Request>::iterator best = m_queue.begin();
+    for( std::map<std::string, Request>::iterator it = m_queue.begin(); it != m_queue.end(); ++it )
+    {
+        int32_t rank = GetRank( it->second );
+        int32_t bestRank = GetRank( best->second );
+        if( rank < bestRank || ( rank == bestRank && it->second.sequence < best->second.sequence ) ) {
+            best = it;
         }
+    }
+    *request = best->second;
+    m_queue.erase( best );
+    if( m_queue.empty() ) {
+        ResetEvent( m_queueEvent );
+    }
 
-        std::string path = CachePathFor( req.appId, req.type );
+    m_inFlight.insert( request->key );
+    worker->activeAppId = request->appId;
+    worker->cancelRequested = false;
+    LeaveCriticalSection( &m_queueLock );
+    return true;
+}
 
-        // Unique key so cover/screenshot are tracked separately
-        std::string failKey = req.appId;
-        if( req.type == IMAGE_COVER )
-            failKey += "_cover";
-        else
-            failKey += "_screenshot";
+bool ImageDownloader::ProcessRequest( Worker* worker, const Request& req )
+{
+    // No point fetching the thumbnail once the full cover is on disk
+    if( req.type == IMAGE_COVER_THUMBNAIL && FileExistsAndAvailable( CachePathFor( req.appId, IMAGE_COVER ).c_str() ) ) {
+        return false;
+    }
 
-        bool haveFile = FileExists( path.c_str() );
-        bool previouslyFailed = ( m_failed.find( failKey ) != m_failed.end() );
+    // Already on disk, hand it straight back
+    std::string path = CachePathFor( req.appId, req.type );
+    if( CacheFileReady( path ) )
+    {
+        Complete( req, true );
+        return true;
+    }
 
-        if( !haveFile && !previouslyFailed )
+    // Left half written by a crash or power off during TryCompressImageFile, or
+    // damaged since; this worker owns the key so nobody else is writing it
+    if( FileExists( path.c_str() ) ) {
+        DeleteFileA( path.c_str() );
+    }
+
+    std::string downloadPath = DownloadPathFor( req.appId, req.type );
+    bool ok = FileExistsAndAvailable( downloadPath.c_str() );
+    if( !ok )
+    {
+        // WebManager resets curl global state per request, so only one worker
+        // downloads at a time while the others decode and compress
+        EnterCriticalSection( &mDownloadLock );
+        if( !worker->cancelRequested )
         {
             EnforceCacheLimit();
-
-            bool ok = false;
-
-            if( req.type == IMAGE_COVER )
-            {
-                ok = WebManager::TryDownloadCover(
-                    req.appId,
-                    144,
-                    204,
-                    path,
-                    NULL,
-                    NULL,
-                    &m_cancelRequested );
-            }
-            else
-            {
-                ok = WebManager::TryDownloadScreenshot(
-                    req.appId,
-                    640,
-                    360,
-                    path,
-                    NULL,
-                    NULL,
-                    &m_cancelRequested );
+            if( req.type == IMAGE_COVER ) {
+                ok = WebManager::TryDownloadCover( req.appId, COVER_DOWNLOAD_WIDTH, COVER_DOWNLOAD_HEIGHT, downloadPath, NULL, NULL, &worker->cancelRequested );
+            } else if( req.type == IMAGE_COVER_THUMBNAIL ) {
+                ok = WebManager::TryDownloadCover( req.appId, COVER_THUMBNAIL_WIDTH, COVER_THUMBNAIL_HEIGHT, downloadPath, NULL, NULL, &worker->cancelRequested );
+            } else {
+                ok = WebManager::TryDownloadScreenshot( req.appId, SCREENSHOT_DOWNLOAD_WIDTH, SCREENSHOT_DOWNLOAD_HEIGHT, downloadPath, NULL, NULL, &worker->cancelRequested );
             }
+        }
+        LeaveCriticalSection( &mDownloadLock );
 
-            if( m_cancelRequested || m_quit )
-            {
-                continue;
-            }
+        if( worker->cancelRequested || m_quit ) {
+            return false;
+        }
+    }
 
-            if( !ok )
-            {
-                // Mark as failed so we don't retry forever
-                m_failed.insert( failKey );
-                continue;
-            }
+    // Decode and block compress here so the render thread only uploads
+    if( ok )
+    {
+        ok = TextureHelper::TryCompressImageFile( downloadPath, path );
+        DeleteFileA( downloadPath.c_str() );
+    }
+
+    if( !ok )
+    {
+        // Back off before retrying, persisted so it survives a restart
+        ImageFailureCache::RecordFailure( req.key );
+        Complete( req, false );
+        return true;
+    }
+
+    ImageFailureCache::RecordSuccess( req.key );
+
+    // The full cover supersedes the thumbnail, drop it from the queue and the cache
+    if( req.type == IMAGE_COVER )
+    {
+        EnterCriticalSection( &m_queueLock );
+        m_queue.erase( RequestKey( req.appId, IMAGE_COVER_THUMBNAIL ) );
+        if( m_queue.empty() ) {
+            ResetEvent( m_queueEvent );
         }
+        LeaveCriticalSection( &m_queueLock );
+        DeleteFileA( CachePathFor( req.appId, IMAGE_COVER_THUMBNAIL ).c_str() );
+    }
+
+    if( req.priority == IMAGE_PRIORITY_SELECTED ) {
+        Debug::Print( "ImageDownloader: selected %s ready in %u ms\n", req.appId.c_str(), GetTickCount() - req.queuedTick );
     }
+    Complete( req, true );
+    return true;
+}
+
+void ImageDownloader::Discard( const std::string appId, ImageDownloadType type )
+{
+    // Backs off like a failed download, so a file that will not load (e.g. no
+    // memory for the texture) is not fetched and reloaded every frame
+    DeleteFileA( CachePathFor( appId, type ).c_str() );
+    ImageFailureCache::RecordFailure( RequestKey( appId, type ) );
+}
+
+void ImageDownloader::Complete( const Request& request, bool success )
+{
+    ImageDownloadResult result;
+    result.appId = request.appId;
+    result.type = request.type;
+    result.success = success;
+
+    EnterCriticalSection( &m_completedLock );
+    m_completed.push_back( result );
+    LeaveCriticalSection( &m_completedLock );
 }
@@ -10,21 +10,43 @@
 enum ImageDownloadType
 {
     IMAGE_COVER,
+    IMAGE_COVER_THUMBNAIL,
     IMAGE_SCREENSHOT
 };
 
+/** Lower value is fetched first. */
+enum ImageRequestPriority
+{
+    IMAGE_PRIORITY_SELECTED,
+    IMAGE_PRIORITY_VISIBLE,
+    IMAGE_PRIORITY_PREFETCH
+};
+
+struct ImageDownloadResult
+{
+    std::string appId;
+    ImageDownloadType type;
+    bool success;
+};
+
+#define IMAGE_DOWNLOADER_WORKER_COUNT 2
+
 class ImageDownloader
 {
 public:
     ImageDownloader();
     ~ImageDownloader();
 
-    void Queue(D3DTexture** pOutTexture, const std::string appId, ImageDownloadType type);
+    void Queue(const std::string appId, ImageDownloadType type, ImageRequestPriority priority = IMAGE_PRIORITY_VISIBLE);
     void CancelAll();
-
+    void CancelExcept(const std::set<std::string>& appIds);
+    bool TryGetCompleted(ImageDownloadResult* result);
+    bool TryTakeRetryDelay(uint32_t* milliseconds);
+    void Discard(const std::string appId, ImageDownloadType type);
 
     static std::string GetCoverCachePath( const std::string appId );
     static bool IsCoverCached( const std::string appId );
+    static std::string GetCoverThumbnailCachePath( const std::string appId );
     static std::string GetScreenshotCachePath( const std::string appId );
     static bool IsScreenshotCached( const std::string appId );
 
@@ -32,18 +54,39 @@ private:
 
     struct Request
     {
-        D3DTexture** pOutTexture;
+        std::string key;
         std::string appId;
         ImageDownloadType type;
+        ImageRequestPriority priority;
+        uint32_t sequence;
+        DWORD queuedTick;
+    };
+
+    struct Worker
+    {
+        ImageDownloader* owner;
+        HANDLE thread;
+        volatile bool cancelRequested;
+        std::string activeAppId;
     };
 
     static DWORD WINAPI ThreadProc( LPVOID param );
-    void WorkerLoop();
-
-    std::deque<Request>    m_queue;
-    CRITICAL_SECTION       m_queueLock;
-    HANDLE                 m_thread;
-    volatile bool          m_quit;
-    volatile bool          m_cancelRequested;
-	std::set<std::string>  m_failed;
+    void WorkerLoop( Worker* worker );
+    static int32_t GetRank( const Request& request );
+    bool TryTakeRequest( Worker* worker, Request* request );
+    bool ProcessRequest( Worker* worker, const Request& request );
+    void Complete( const Request& request, bool success );
+
+    // Queued requests keyed by appId + type, m_inFlight holds keys a worker is
+    // on or whose result has not been taken yet
+    std::map<std::string, Request>   m_queue;
+    std::set<std::string>            m_inFlight;
+    CRITICAL_SECTION                 m_queueLock;
+    HANDLE                           m_queueEvent;
+    std::deque<ImageDownloadResult>  m_completed;
+    CRITICAL_SECTION                 m_completedLock;
+    Worker                           m_workers[IMAGE_DOWNLOADER_WORKER_COUNT];
+    volatile bool                    m_quit;
+    uint32_t                         m_sequence;
+    uint32_t                         m_retrySeconds;
 };
@@ -0,0 +1,171 @@
+//=============================================================================
+// ImageFailureCache.cpp - Persisted record of failed cover/screenshot downloads
+//
+// Each failure pushes the next retry out exponentially (one minute doubling
+// up to a week), so a transient error recovers within the session while apps
+// with no cover stop costing a request every launch. Records older than the
+// TTL are dropped on load.
+//
+// The record file is read and written with stdio rather than FileSystem's
+// handles, since the image workers save from their own threads and
+// FileSystem's handle table is not thread safe.
+//=============================================================================
+
+#include "ImageFailureCache.h"
+#include "FileSystem.h"
+#include "Debug.h"
+
+#define IMAGE_FAILURE_CACHE_PATH "T:\\Cache\\ImageFailures.bin"
+#define IMAGE_FAILURE_RETRY_BASE_SECONDS 60
+#define IMAGE_FAILURE_RETRY_MAX_SECONDS (7 * 24 * 60 * 60)
+#define IMAGE_FAILURE_TTL_SECONDS (30 * 24 * 60 * 60)
+
+namespace {
+    CRITICAL_SECTION mLock;
+    bool mInitialized = false;
+    std::map<std::string, ImageFailureRecord> mRecords;
+
+    uint32_t Now()
+    {
+        return (uint32_t)time(nullptr);
+    }
+}
+
+bool ImageFailureCache::Init()
+{
+    if (mInitialized == false) {
+        InitializeCriticalSection(&mLock);
+        mInitialized = true;
+    }
+
+    EnterCriticalSection(&mLock);
+    mRecords.clear();
+
+    FILE* fp = fopen(IMAGE_FAILURE_CACHE_PATH, "rb");
+    if (fp == nullptr) {
+        LeaveCriticalSection(&mLock);
+        return true;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    long fileSize = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    uint32_t recordCount = fileSize > 0 ? (uint32_t)fileSize / sizeof(ImageFailureRecord) : 0;
+    uint32_t now = Now();
+    bool expired = false;
+    for (uint32_t i = 0; i < recordCount; i++) {
+        ImageFailureRecord record;
+        if (fread(&record, sizeof(record), 1, fp) != 1) {
+            break;
+        }
+        record.key[sizeof(record.key) - 1] = 0;
+        if (now > record.lastFailure && now - record.lastFailure > IMAGE_FAILURE_TTL_SECONDS) {
+            expired = true;
+            continue;
+        }
+        mRecords[record.key] = record;
+    }
+    fclose(fp);
+
+    Debug::Print("ImageFailureCache: loaded %u records\n", (uint32_t)mRecords.size());
+    bool result = expired ? TrySave() : true;
+    LeaveCriticalSection(&mLock);
+    return result;
+}
+
+// Zero once the key may be fetched again
+uint32_t ImageFailureCache::GetSecondsUntilRetry(const std::string key)
+{
+    if (mInitialized == false) {
+        return 0;
+    }
+
+    EnterCriticalSection(&mLock);
+    uint32_t wait = 0;
+    std::map<std::string, ImageFailureRecord>::const_iterator it = mRecords.find(key);
+    if (it != mRecords.end()) {
+        // Clock going backwards (e.g. time sync failed) counts as not yet due, for a full delay
+        uint32_t now = Now();
+        uint32_t delay = GetRetryDelay(it->second.failCount);
+        if (now < it->second.lastFailure) {
+            wait = delay;
+        } else if (now - it->second.lastFailure < delay) {
+            wait = delay - (now - it->second.lastFailure);
+        }
+    }
+    LeaveCriticalSection(&mLock);
+    return wait;
+}
+
+void ImageFailureCache::RecordFailure(const std::string key)
+{
+    if (mInitialized == false || key.size() >= sizeof(((ImageFailureRecord*)0)->key)) {
+        return;
+    }
+
+    EnterCriticalSection(&mLock);
+    std::map<std::string, ImageFailureRecord>::iterator it = mRecords.find(key);
+    if (it == mRecords.end()) {
+        ImageFailureRecord newRecord;
+        memset(&newRecord, 0, sizeof(newRecord));
+        strcpy(newRecord.key, key.c_str());
+        it = mRecords.insert(std::make_pair(key, newRecord)).first;
+    }
+    ImageFailureRecord& record = it->second;
+    record.lastFailure = Now();
+    record.failCount++;
+    Debug::Print("ImageFailureCache: %s failed %u times, retry in %u s\n", key.c_str(), record.failCount, GetRetryDelay(record.failCount));
+    TrySave();
+    LeaveCriticalSection(&mLock);
+}
+
+void ImageFailureCache::RecordSuccess(const std::string key)
+{
+    if (mInitialized == false) {
+        return;
+    }
+
+    EnterCriticalSection(&mLock);
+    if (mRecords.erase(key) > 0) {
+        TrySave();
+    }
+    LeaveCriticalSection(&mLock);
+}
+
+void ImageFailureCache::Clear()
+{
+    if (mInitialized == false) {
+        return;
+    }
+
+    EnterCriticalSection(&mLock);
+    mRecords.clear();
+    FileSystem::FileDelete(IMAGE_FAILURE_CACHE_PATH);
+    LeaveCriticalSection(&mLock);
+}
+
+// Private
+
+uint32_t ImageFailureCache::GetRetryDelay(uint32_t failCount)
+{
+    uint32_t delay = IMAGE_FAILURE_RETRY_BASE_SECONDS;
+    for (uint32_t i = 1; i < failCount && delay < IMAGE_FAILURE_RETRY_MAX_SECONDS; i++) {
+        delay <<= 1;
+    }
+    return delay < IMAGE_FAILURE_RETRY_MAX_SECONDS ? delay : IMAGE_FAILURE_RETRY_MAX_SECONDS;
+}
+
+bool ImageFailureCache::TrySave()
+{
+    FILE* fp = fopen(IMAGE_FAILURE_CACHE_PATH, "wb");
+    if (fp == nullptr) {
+        return false;
+    }
+
+    bool ok = true;
+    for (std::map<std::string, ImageFailureRecord>::iterator it = mRecords.begin(); it != mRecords.end() && ok; ++it) {
+        ok = fwrite(&it->second, sizeof(ImageFailureRecord), 1, fp) == 1;
+    }
+    ok &= fclose(fp) == 0;
+    return ok;
+}
@@ -0,0 +1,27 @@
+//=============================================================================
+// ImageFailureCache.h - Persisted record of failed cover/screenshot downloads
+//=============================================================================
+
+#pragma once
+
+#include "Main.h"
+
+typedef struct
+{
+    char key[80];
+    uint32_t lastFailure;
+    uint32_t failCount;
+} ImageFailureRecord;
+
+class ImageFailureCache
+{
+public:
+    static bool Init();
+    static uint32_t GetSecondsUntilRetry(const std::string key);
+    static void RecordFailure(const std::string key);
+    static void RecordSuccess(const std::string key);
+    static void Clear();
+private:
+    static uint32_t GetRetryDelay(uint32_t failCount);
+    static bool TrySave();
+};
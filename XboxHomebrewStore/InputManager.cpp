@@ -70,6 +70,9 @@ namespace
 {
 	bool mInitialized = false;
 
+    // Set by the Process* calls when a device reports anything new, so the main loop can stay idle otherwise
+    bool mInputActivity = false;
+
     MousePosition mMousePosition;
 
     DWORD mControllerTick;
@@ -139,6 +142,7 @@ void InputManager::ProcessController()
 	DWORD removals = 0;
     if (XGetDeviceChanges(XDEVICE_TYPE_GAMEPAD, &insertions, &removals) == TRUE)
 	{
+        mInputActivity = true;
 		for (int32_t i = 0; i < XGetPortCount(); i++)
 		{
 			if ((insertions & 1) == 1)
@@ -178,6 +182,7 @@ void InputManager::ProcessController()
         memcpy(&mControllerStatesPrevious[i], &mControllerStatesCurrent[i], sizeof(ControllerState));
         if (mControllerLastPacketNumber[i] != controllerInputState.dwPacketNumber)
         {
+            mInputActivity = true;
             mControllerStatesCurrent[i].Buttons[ControllerA] = UPDATE_ANALOG_HYSTERESIS(controllerInputState.Gamepad.bAnalogButtons[XINPUT_GAMEPAD_A], mControllerStatesPrevious[i].Buttons[ControllerA]);
             mControllerStatesCurrent[i].Buttons[ControllerB] = UPDATE_ANALOG_HYSTERESIS(controllerInputState.Gamepad.bAnalogButtons[XINPUT_GAMEPAD_B], mControllerStatesPrevious[i].Buttons[ControllerB]);
             mControllerStatesCurrent[i].Buttons[ControllerX] = UPDATE_ANALOG_HYSTERESIS(controllerInputState.Gamepad.bAnalogButtons[XINPUT_GAMEPAD_X], mControllerStatesPrevious[i].Buttons[ControllerX]);
@@ -230,6 +235,9 @@ void InputManager::ProcessController()
         const float right_stick_scroll_speed = 500.0f;
         mControllerStatesCurrent[i].ThumbRightDx = rx * right_stick_scroll_speed * dt;
         mControllerStatesCurrent[i].ThumbRightDy = ry * right_stick_scroll_speed * dt;
+        if (rx != 0.0f || ry != 0.0f) {
+            mInputActivity = true;
+        }
 
         mControllerLastPacketNumber[i] = controllerInputState.dwPacketNumber;
     }
@@ -267,6 +275,7 @@ void InputManager::ProcessRemote()
 
         if (mRemoteLastPacketNumber[i] != remoteInputState.PacketNumber)
         {
+            mInputActivity = true;
             memcpy(&mRemoteStatesPrevious[i], &mRemoteStatesCurrent[i], sizeof(RemoteState));
             mRemoteStatesCurrent[i].Buttons[RemoteDisplay] = remoteInputState.Buttons == XINPUT_IR_REMOTE_DISPLAY;
             mRemoteStatesCurrent[i].Buttons[RemoteReverse] = remoteInputState.Buttons == XINPUT_IR_REMOTE_REVERSE;
@@ -349,6 +358,7 @@ void InputManager::ProcessMouse()
 
         if (mMouseLastPacketNumber[i] != mouseInputState.dwPacketNumber)
         {
+            mInputActivity = true;
             memcpy(&mMouseStatesPrevious[i], &mouseInputState, sizeof(MouseState));
             mMouseStatesCurrent[i].Dx = mouseInputState.DebugMouse.cMickeysX;
             mMouseStatesCurrent[i].Dy = mouseInputState.DebugMouse.cMickeysY;
@@ -418,6 +428,7 @@ void InputManager::ProcessKeyboard()
             continue;
         }
         mKeyboardState.KeyDown = true;
+        mInputActivity = true;
         mKeyboardState.Ascii = currentKeyStroke.Ascii;
         mKeyboardState.VirtualKey = currentKeyStroke.VirtualKey;
         mKeyboardState.Buttons[KeyboardCtrl] = (currentKeyStroke.Flags & XINPUT_DEBUG_KEYSTROKE_FLAG_CTRL) != 0;
@@ -435,6 +446,7 @@ void InputManager::ProcessMemoryUnit()
     DWORD insertions = 0;
 	DWORD removals = 0;
     if (XGetDeviceChanges(XDEVICE_TYPE_MEMORY_UNIT, &insertions, &removals) == TRUE) {
+        mInputActivity = true;
         for (uint32_t iPort = 0; iPort < XGetPortCount(); iPort++) {
             for (uint32_t iSlot = 0; iSlot < 2; iSlot++) {
                 uint32_t mask = iPort + (iSlot ? 16 : 0);
@@ -638,11 +650,15 @@ bool InputManager::IsMemoryUnitMounted(char letter) {
 
 void InputManager::PumpInput()
 {
+    mInputActivity = false;
     ProcessController();
     ProcessRemote(); 
     ProcessMouse();
     ProcessKeyboard();
     ProcessMemoryUnit();
+    if (mInputActivity == true) {
+        Context::Invalidate();
+    }
 }
 
 MousePosition InputManager::GetMousePosition()
@@ -9,7 +9,10 @@
 #include "Debug.h"
 #include "String.h"
 #include "Context.h"
+#include "Defines.h"
 #include "Math.h"
+#include "Profiler.h"
+#include "Deflate.h"
 #include "Scenes/SceneManager.h"
 #include "Scenes/LoadingScene.h"
 
@@ -148,23 +151,32 @@ bool InitD3D()
 //-----------------------------------------------------------------------------
 VOID Render()
 {
-    // Clear the backbuffer to dark gray (D3DCLEAR_STENCIL set for 32-bit depth perf)
-    g_pd3dDevice->Clear( 0, nullptr, D3DCLEAR_TARGET|D3DCLEAR_ZBUFFER|D3DCLEAR_STENCIL,
-                        D3DCOLOR_XRGB(33,33,33), 1.0f, 0 );
+    {
+        PROFILE_SCOPE( "Render" );
 
-    D3DVIEWPORT8 vp = { 0, 0, (DWORD)Context::GetActualScreenWidth(), (DWORD)Context::GetActualScreenHeight(), 0.0f, 1.0f };
-    g_pd3dDevice->SetViewport(&vp);
+        // Clear the backbuffer to dark gray (D3DCLEAR_STENCIL set for 32-bit depth perf)
+        g_pd3dDevice->Clear( 0, nullptr, D3DCLEAR_TARGET|D3DCLEAR_ZBUFFER|D3DCLEAR_STENCIL,
+                            D3DCOLOR_XRGB(33,33,33), 1.0f, 0 );
 
-    // Begin the scene
-    if( SUCCEEDED( g_pd3dDevice->BeginScene() ) )
-    {
-        if( g_pSceneManager && g_pSceneManager->HasScene() )
-            g_pSceneManager->Render( );
+        D3DVIEWPORT8 vp = { 0, 0, (DWORD)Context::GetActualScreenWidth(), (DWORD)Context::GetActualScreenHeight(), 0.0f, 1.0f };
+        g_pd3dDevice->SetViewport(&vp);
+
+        // Begin the scene
+        if( SUCCEEDED( g_pd3dDevice->BeginScene() ) )
+        {
+            Drawing::BeginFrame();
 
-        g_pd3dDevice->EndScene();
+            if( g_pSceneManager && g_pSceneManager->HasScene() )
+                g_pSceneManager->Render( );
+
+            Profiler::Render();
+            Drawing::EndFrame();
+            g_pd3dDevice->EndScene();
+        }
     }
 
     // Present the backbuffer contents to the display
+    PROFILE_SCOPE( "Present" );
     g_pd3dDevice->Present( nullptr, nullptr, nullptr, nullptr );
 }
 
@@ -180,6 +192,8 @@ VOID __cdecl main()
         return;
     }
 
+    Profiler::Init();
+    Deflate::Init();
     Drawing::Init();
     Font::Init();
     InputManager::Init(); 
@@ -191,10 +205,33 @@ VOID __cdecl main()
 
     OutputDebugString( "Xbox Homebrew Store initialized successfully!\n" );
 
+    // Scenes that can idle are only redrawn when something invalidates them
+    // (input, finished downloads, animation); otherwise the last presented
+    // frame stays on screen and the loop just polls.
     while( TRUE )
     {
-        InputManager::PumpInput();
-        g_pSceneManager->Update();
+        Profiler::BeginFrame();
+        {
+            PROFILE_SCOPE( "Input" );
+            InputManager::PumpInput();
+            Profiler::HandleInput();
+        }
+        {
+            PROFILE_SCOPE( "Update" );
+            g_pSceneManager->Update();
+        }
+
+        bool invalidated = Context::ConsumeInvalidation();
+        if( invalidated == false && g_pSceneManager->CanIdle() )
+        {
+            Profiler::EndFrame( false );
+            Context::CountFrame( false );
+            Sleep( FRAME_IDLE_SLEEP_MS );
+            continue;
+        }
+
         Render();
+        Profiler::EndFrame( true );
+        Context::CountFrame( true );
     }
 }
\ No newline at end of file
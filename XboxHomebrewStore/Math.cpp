@@ -31,4 +31,13 @@ int32_t Math::AspectScaleWidth(int32_t originalWidth, int32_t originalHeight, in
         return originalWidth;
     }
     return (int32_t)(originalWidth * ((float)targetHeight / (float)originalHeight));
+}
+
+uint32_t Math::NextPowerOf2(uint32_t value)
+{
+    uint32_t result = 1;
+    while (result < value) {
+        result <<= 1;
+    }
+    return result;
 }
\ No newline at end of file
@@ -11,4 +11,5 @@ public:
     static float ClampFloat(float value, float min, float max);
     static float CopySign(float a, float b);
     static int32_t AspectScaleWidth(int32_t originalWidth, int32_t originalHeight, int32_t targetHeight);
+    static uint32_t NextPowerOf2(uint32_t value);
 };
@@ -0,0 +1,453 @@
+//=============================================================================
+// Profiler.cpp - Scoped CPU timings, draw statistics and trace capture
+//
+// Scopes are timed with RDTSC on the console (calibrated against the
+// performance counter at startup) and CLOCK_MONOTONIC elsewhere. Each frame
+// the per scope totals and the draw counters go into a ring of recent frames,
+// which the overlay reduces to min/avg/max. A capture records every scope as a
+// Chrome trace event (chrome://tracing, Perfetto) and writes the JSON to
+// T:\Profiler when the requested number of frames is done.
+//
+// Only the main thread is timed; scopes opened on other threads are ignored.
+//=============================================================================
+
+#include "Profiler.h"
+#include "Context.h"
+#include "Defines.h"
+#include "Drawing.h"
+#include "Font.h"
+#include "InputManager.h"
+#include "FileSystem.h"
+#include "String.h"
+#include "Debug.h"
+
+#if !defined(_XBOX)
+#include <time.h>
+#endif
+
+#define PROFILER_MAX_SCOPES 32
+#define PROFILER_MAX_DEPTH 16
+#define PROFILER_HISTORY_FRAMES 120
+#define PROFILER_CAPTURE_FRAMES 300
+#define PROFILER_CAPTURE_EVENTS 32768
+#define PROFILER_TRACE_DIRECTORY "T:\\Profiler"
+#define PROFILER_ROW_HEIGHT 18.0f
+#define PROFILER_PANEL_WIDTH 365.0f
+
+namespace {
+    typedef struct
+    {
+        const char* name;
+        int32_t depth;
+        uint64_t frameTicks;
+        float history[PROFILER_HISTORY_FRAMES];
+    } ProfilerScopeStats;
+
+    typedef struct
+    {
+        int32_t scope;
+        uint64_t start;
+    } ProfilerStackEntry;
+
+    typedef struct
+    {
+        int32_t scope;
+        uint64_t start;
+        uint64_t end;
+    } ProfilerEvent;
+
+    typedef struct
+    {
+        uint64_t start;
+        uint64_t end;
+        uint32_t counters[PROFILER_COUNTER_COUNT];
+    } ProfilerCaptureFrame;
+
+    const char* const mCounterNames[PROFILER_COUNTER_COUNT] = {
+        "drawCalls", "stateChanges", "vertices", "textureBytes"
+    };
+
+    const char* const mCounterLabels[PROFILER_COUNTER_COUNT] = {
+        "Draw calls", "State changes", "Vertices", "Texture KB"
+    };
+
+    DWORD mThreadId = 0;
+    double mTicksPerMs = 1.0;
+
+    ProfilerScopeStats mScopes[PROFILER_MAX_SCOPES];
+    int32_t mScopeCount = 0;
+    ProfilerStackEntry mStack[PROFILER_MAX_DEPTH];
+    int32_t mStackDepth = 0;
+    bool mStackWarned = false;
+
+    uint64_t mFrameStart = 0;
+    uint32_t mCounters[PROFILER_COUNTER_COUNT];
+    float mFrameHistory[PROFILER_HISTORY_FRAMES];
+    float mCounterHistory[PROFILER_COUNTER_COUNT][PROFILER_HISTORY_FRAMES];
+    uint32_t mHistoryIndex = 0;
+    uint32_t mHistoryCount = 0;
+
+    bool mOverlayVisible = false;
+
+    uint32_t mCaptureFramesLeft = 0;
+    uint64_t mCaptureOrigin = 0;
+    bool mCaptureTruncated = false;
+    std::vector<ProfilerEvent> mCaptureEvents;
+    std::vector<ProfilerCaptureFrame> mCaptureFrames;
+
+    int32_t FindOrAddScope(const char* name, int32_t depth)
+    {
+        for (int32_t i = 0; i < mScopeCount; i++) {
+            if (mScopes[i].name == name) {
+                return i;
+            }
+        }
+        for (int32_t i = 0; i < mScopeCount; i++) {
+            if (strcmp(mScopes[i].name, name) == 0) {
+                return i;
+            }
+        }
+        if (mScopeCount == PROFILER_MAX_SCOPES) {
+            return -1;
+        }
+        ProfilerScopeStats* stats = &mScopes[mScopeCount];
+        stats->name = name;
+        stats->depth = depth;
+        stats->frameTicks = 0;
+        memset(stats->history, 0, sizeof(stats->history));
+        return mScopeCount++;
+    }
+
+    double TicksToMicroseconds(uint64_t ticks)
+    {
+        return (double)(int64_t)ticks * 1000.0 / mTicksPerMs;
+    }
+
+    void Reduce(const float* history, float* outMin, float* outAvg, float* outMax)
+    {
+        float minValue = 0.0f;
+        float maxValue = 0.0f;
+        float total = 0.0f;
+        for (uint32_t i = 0; i < mHistoryCount; i++) {
+            float value = history[i];
+            if (i == 0 || value < minValue) {
+                minValue = value;
+            }
+            if (i == 0 || value > maxValue) {
+                maxValue = value;
+            }
+            total += value;
+        }
+        *outMin = minValue;
+        *outMax = maxValue;
+        *outAvg = mHistoryCount > 0 ? total / (float)mHistoryCount : 0.0f;
+    }
+
+    // Complete ("X") events for every scope and a counter ("C") event per
+    // frame, timestamps in microseconds from the start of the capture.
+    bool TryWriteTrace(const std::string& filePath)
+    {
+        FILE* fp = fopen(filePath.c_str(), "wb");
+        if (fp == nullptr) {
+            return false;
+        }
+
+        fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+        fprintf(fp, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,\"args\":{\"name\":\"Main\"}}");
+        for (size_t i = 0; i < mCaptureFrames.size(); i++) {
+            const ProfilerCaptureFrame& frame = mCaptureFrames[i];
+            double ts = TicksToMicroseconds(frame.start - mCaptureOrigin);
+            fprintf(fp, ",\n{\"name\":\"Frame\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":%.3f,\"dur\":%.3f}",
+                ts, TicksToMicroseconds(frame.end - frame.start));
+            fprintf(fp, ",\n{\"name\":\"Counters\",\"ph\":\"C\",\"pid\":1,\"tid\":1,\"ts\":%.3f,\"args\":{", ts);
+            for (int32_t c = 0; c < PROFILER_COUNTER_COUNT; c++) {
+                fprintf(fp, "%s\"%s\":%u", c > 0 ? "," : "", mCounterNames[c], frame.counters[c]);
+            }
+            fprintf(fp, "}}");
+        }
+        for (size_t i = 0; i < mCaptureEvents.size(); i++) {
+            const ProfilerEvent& event = mCaptureEvents[i];
+            fprintf(fp, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":%.3f,\"dur\":%.3f}",
+                mScopes[event.scope].name, TicksToMicroseconds(event.start - mCaptureOrigin), TicksToMicroseconds(event.end - event.start));
+        }
+        fprintf(fp, "\n]}\n");
+
+        bool ok = ferror(fp) == 0;
+        fclose(fp);
+        return ok;
+    }
+
+    void FinishCapture()
+    {
+        FileSystem::DirectoryCreate(PROFILER_TRACE_DIRECTORY);
+        std::string filePath = String::Format(PROFILER_TRACE_DIRECTORY "\\trace_%u.json", (uint32_t)GetTickCount());
+        if (TryWriteTrace(filePath)) {
+            Debug::Print("Profiler: wrote %u frames, %u events to %s%s\n", (uint32_t)mCaptureFrames.size(), (uint32_t)mCaptureEvents.size(),
+                filePath.c_str(), mCaptureTruncated ? " (event buffer full, truncated)" : "");
+        } else {
+            Debug::Print("Profiler: failed to write %s\n", filePath.c_str());
+        }
+
+        std::vector<ProfilerEvent>().swap(mCaptureEvents);
+        std::vector<ProfilerCaptureFrame>().swap(mCaptureFrames);
+    }
+}
+
+void Profiler::Init()
+{
+    mThreadId = GetCurrentThreadId();
+    mScopeCount = 0;
+    mStackDepth = 0;
+    mHistoryIndex = 0;
+    mHistoryCount = 0;
+    memset(mCounters, 0, sizeof(mCounters));
+    memset(mFrameHistory, 0, sizeof(mFrameHistory));
+    memset(mCounterHistory, 0, sizeof(mCounterHistory));
+
+#if defined(_XBOX)
+    // The TSC runs at the CPU clock, which is not the same on every console
+    LARGE_INTEGER frequency;
+    LARGE_INTEGER counterStart;
+    LARGE_INTEGER counterEnd;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counterStart);
+    uint64_t ticksStart = GetTicks();
+    Sleep(20);
+    QueryPerformanceCounter(&counterEnd);
+    uint64_t ticksEnd = GetTicks();
+    double elapsedMs = (double)(counterEnd.QuadPart - counterStart.QuadPart) * 1000.0 / (double)frequency.QuadPart;
+    mTicksPerMs = elapsedMs > 0.0 ? (double)(int64_t)(ticksEnd - ticksStart) / elapsedMs : 733333.0;
+#else
+    mTicksPerMs = 1000000.0;
+#endif
+
+    Debug::Print("Profiler: %.0f ticks per ms\n", mTicksPerMs);
+    mFrameStart = GetTicks();
+}
+
+uint64_t Profiler::GetTicks()
+{
+#if defined(_XBOX)
+    uint32_t low;
+    uint32_t high;
+    __asm {
+        rdtsc
+        mov low, eax
+        mov high, edx
+    }
+    return ((uint64_t)high << 32) | low;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+#endif
+}
+
+void Profiler::BeginFrame()
+{
+    mFrameStart = GetTicks();
+    mStackDepth = 0;
+    memset(mCounters, 0, sizeof(mCounters));
+    for (int32_t i = 0; i < mScopeCount; i++) {
+        mScopes[i].frameTicks = 0;
+    }
+}
+
+void Profiler::EndFrame(bool rendered)
+{
+    uint64_t frameEnd = GetTicks();
+
+    if (mStackDepth != 0 && mStackWarned == false) {
+        Debug::Print("Profiler: %d scopes still open at end of frame\n", mStackDepth);
+        mStackWarned = true;
+    }
+
+    if (rendered == true) {
+        mCounters[PROFILER_COUNTER_DRAW_CALLS] = Drawing::GetDrawCallCount();
+        mCounters[PROFILER_COUNTER_STATE_CHANGES] = Drawing::GetStateChangesIssued();
+        mCounters[PROFILER_COUNTER_VERTICES] = Drawing::GetVertexCount();
+    }
+
+    mFrameHistory[mHistoryIndex] = (float)((double)(int64_t)(frameEnd - mFrameStart) / mTicksPerMs);
+    for (int32_t i = 0; i < mScopeCount; i++) {
+        mScopes[i].history[mHistoryIndex] = (float)((double)(int64_t)mScopes[i].frameTicks / mTicksPerMs);
+    }
+    for (int32_t c = 0; c < PROFILER_COUNTER_COUNT; c++) {
+        mCounterHistory[c][mHistoryIndex] = (float)mCounters[c];
+    }
+    mHistoryIndex = (mHistoryIndex + 1) % PROFILER_HISTORY_FRAMES;
+    if (mHistoryCount < PROFILER_HISTORY_FRAMES) {
+        mHistoryCount++;
+    }
+
+    if (mCaptureFramesLeft > 0) {
+        ProfilerCaptureFrame frame;
+        frame.start = mFrameStart;
+        frame.end = frameEnd;
+        memcpy(frame.counters, mCounters, sizeof(frame.counters));
+        mCaptureFrames.push_back(frame);
+        mCaptureFramesLeft--;
+        if (mCaptureFramesLeft == 0) {
+            FinishCapture();
+        }
+    }
+
+    // Keep frames coming while someone is looking at the numbers
+    if (mOverlayVisible == true || mCaptureFramesLeft > 0) {
+        Context::Invalidate();
+    }
+}
+
+int32_t Profiler::BeginScope(const char* name)
+{
+    if (GetCurrentThreadId() != mThreadId || mStackDepth == PROFILER_MAX_DEPTH) {
+        return -1;
+    }
+    int32_t scope = FindOrAddScope(name, mStackDepth);
+    if (scope < 0) {
+        return -1;
+    }
+    ProfilerStackEntry* entry = &mStack[mStackDepth];
+    entry->scope = scope;
+    entry->start = GetTicks();
+    return mStackDepth++;
+}
+
+void Profiler::EndScope(int32_t token)
+{
+    if (token < 0 || token >= mStackDepth) {
+        return;
+    }
+    uint64_t end = GetTicks();
+    const ProfilerStackEntry& entry = mStack[token];
+    mScopes[entry.scope].frameTicks += end - entry.start;
+    mStackDepth = token;
+
+    if (mCaptureFramesLeft > 0) {
+        if (mCaptureEvents.size() < PROFILER_CAPTURE_EVENTS) {
+            ProfilerEvent event;
+            event.scope = entry.scope;
+            event.start = entry.start;
+            event.end = end;
+            mCaptureEvents.push_back(event);
+        } else {
+            mCaptureTruncated = true;
+        }
+    }
+}
+
+void Profiler::AddCounter(ProfilerCounter counter, uint32_t value)
+{
+    if (GetCurrentThreadId() != mThreadId) {
+        return;
+    }
+    mCounters[counter] += value;
+}
+
+void Profiler::HandleInput()
+{
+    // White toggles the overlay, Black (with the overlay up) captures a trace
+    if (InputManager::ControllerPressed(ControllerWhite, -1)) {
+        SetOverlayVisible(!mOverlayVisible);
+    } else if (mOverlayVisible == true && InputManager::ControllerPressed(ControllerBlack, -1)) {
+        StartCapture(PROFILER_CAPTURE_FRAMES);
+    }
+}
+
+bool Profiler::IsOverlayVisible()
+{
+    return mOverlayVisible;
+}
+
+void Profiler::SetOverlayVisible(bool visible)
+{
+    mOverlayVisible = visible;
+    Context::Invalidate();
+}
+
+void Profiler::StartCapture(uint32_t frames)
+{
+    if (mCaptureFramesLeft > 0 || frames == 0) {
+        return;
+    }
+    mCaptureEvents.clear();
+    mCaptureEvents.reserve(PROFILER_CAPTURE_EVENTS);
+    mCaptureFrames.clear();
+    mCaptureFrames.reserve(frames);
+    mCaptureTruncated = false;
+    mCaptureOrigin = GetTicks();
+    mCaptureFramesLeft = frames;
+    Debug::Print("Profiler: capturing %u frames\n", frames);
+}
+
+bool Profiler::IsCapturing()
+{
+    return mCaptureFramesLeft > 0;
+}
+
+void Profiler::Render()
+{
+    if (mOverlayVisible == false) {
+        return;
+    }
+
+    // Scopes that did not run in the window (other scenes) are left out
+    float minValue;
+    float avgValue;
+    float maxValue;
+    bool scopeVisible[PROFILER_MAX_SCOPES];
+    int32_t rows = 2 + PROFILER_COUNTER_COUNT;
+    for (int32_t i = 0; i < mScopeCount; i++) {
+        Reduce(mScopes[i].history, &minValue, &avgValue, &maxValue);
+        scopeVisible[i] = maxValue > 0.0f;
+        rows += scopeVisible[i] ? 1 : 0;
+    }
+
+    float width = PROFILER_PANEL_WIDTH;
+    float height = rows * PROFILER_ROW_HEIGHT + 12.0f;
+    float x = Context::GetScreenWidth() - Context::GetSafeAreaRight() - width - 8.0f;
+    float y = Context::GetSafeAreaTop() + 8.0f;
+    float nameX = x + 8.0f;
+    float avgX = x + 200.0f;
+    float minX = x + 255.0f;
+    float maxX = x + 310.0f;
+
+    Drawing::DrawFilledRect(0xCC000000, x, y, width, height);
+    y += 6.0f;
+
+    Font::DrawText(FONT_NORMAL, mCaptureFramesLeft > 0 ? String::Format("Capturing (%u)", mCaptureFramesLeft) : "ms", COLOR_TEXT_GRAY, nameX, y);
+    Font::DrawText(FONT_NORMAL, "avg", COLOR_TEXT_GRAY, avgX, y);
+    Font::DrawText(FONT_NORMAL, "min", COLOR_TEXT_GRAY, minX, y);
+    Font::DrawText(FONT_NORMAL, "max", COLOR_TEXT_GRAY, maxX, y);
+    y += PROFILER_ROW_HEIGHT;
+
+    Reduce(mFrameHistory, &minValue, &avgValue, &maxValue);
+    Font::DrawText(FONT_NORMAL, "Frame", COLOR_WHITE, nameX, y);
+    Font::DrawText(FONT_NORMAL, String::Format("%.2f", avgValue), COLOR_WHITE, avgX, y);
+    Font::DrawText(FONT_NORMAL, String::Format("%.2f", minValue), COLOR_WHITE, minX, y);
+    Font::DrawText(FONT_NORMAL, String::Format("%.2f", maxValue), COLOR_WHITE, maxX, y);
+    y += PROFILER_ROW_HEIGHT;
+
+    for (int32_t i = 0; i < mScopeCount; i++) {
+        if (scopeVisible[i] == false) {
+            continue;
+        }
+        Reduce(mScopes[i].history, &minValue, &avgValue, &maxValue);
+        Font::DrawText(FONT_NORMAL, mScopes[i].name, COLOR_WHITE, nameX + 10.0f * mScopes[i].depth, y);
+        Font::DrawText(FONT_NORMAL, String::Format("%.2f", avgValue), COLOR_WHITE, avgX, y);
+        Font::DrawText(FONT_NORMAL, String::Format("%.2f", minValue), COLOR_WHITE, minX, y);
+        Font::DrawText(FONT_NORMAL, String::Format("%.2f", maxValue), COLOR_WHITE, maxX, y);
+        y += PROFILER_ROW_HEIGHT;
+    }
+
+    // Counters are from the previous frame; this frame's are not known until its flush
+    for (int32_t c = 0; c < PROFILER_COUNTER_COUNT; c++) {
+        Reduce(mCounterHistory[c], &minValue, &avgValue, &maxValue);
+        float scale = c == PROFILER_COUNTER_TEXTURE_BYTES ? 1.0f / 1024.0f : 1.0f;
+        Font::DrawText(FONT_NORMAL, mCounterLabels[c], COLOR_PRIMARY, nameX, y);
+        Font::DrawText(FONT_NORMAL, String::Format("%.0f", avgValue * scale), COLOR_WHITE, avgX, y);
+        Font::DrawText(FONT_NORMAL, String::Format("%.0f", minValue * scale), COLOR_WHITE, minX, y);
+        Font::DrawText(FONT_NORMAL, String::Format("%.0f", maxValue * scale), COLOR_WHITE, maxX, y);
+        y += PROFILER_ROW_HEIGHT;
+    }
+}
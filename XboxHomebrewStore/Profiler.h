@@ -0,0 +1,47 @@
+//=============================================================================
+// Profiler.h - Scoped CPU timings, draw statistics and trace capture
+//=============================================================================
+
+#pragma once
+
+#include "Main.h"
+
+enum ProfilerCounter
+{
+    PROFILER_COUNTER_DRAW_CALLS,
+    PROFILER_COUNTER_STATE_CHANGES,
+    PROFILER_COUNTER_VERTICES,
+    PROFILER_COUNTER_TEXTURE_BYTES,
+    PROFILER_COUNTER_COUNT
+};
+
+class Profiler
+{
+public:
+    static void Init();
+    static uint64_t GetTicks();
+    static void BeginFrame();
+    static void EndFrame(bool rendered);
+    static int32_t BeginScope(const char* name);
+    static void EndScope(int32_t token);
+    static void AddCounter(ProfilerCounter counter, uint32_t value);
+    static void HandleInput();
+    static bool IsOverlayVisible();
+    static void SetOverlayVisible(bool visible);
+    static void StartCapture(uint32_t frames);
+    static bool IsCapturing();
+    static void Render();
+};
+
+// Times the enclosing block. Name must be a string literal (it is kept by pointer).
+class ProfileScope
+{
+public:
+    explicit ProfileScope(const char* name) { mToken = Profiler::BeginScope(name); }
+    ~ProfileScope() { Profiler::EndScope(mToken); }
+
+private:
+    int32_t mToken;
+};
+
+#define PROFILE_SCOPE(name) ProfileScope profileScope(name)
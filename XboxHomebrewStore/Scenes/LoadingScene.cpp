@@ -6,6 +6,7 @@
 #include "..\Context.h"
 #include "..\Defines.h"
 #include "..\Drawing.h"
+#include "..\Profiler.h"
 #include "..\Font.h"
 #include "..\String.h"
 #include "..\InputManager.h"
@@ -16,6 +17,8 @@
 #include "..\DriveMount.h"
 #include "..\FtpServer.h"
 #include "..\UserState.h"
+#include "..\ImageFailureCache.h"
+#include "..\CoverAtlas.h"
 
 static void DeleteImageCache()
 {
@@ -50,6 +53,7 @@ static void DeleteImageCache()
         } while( FindNextFileA( h, &fd ) );
         FindClose( h );
     }
+    ImageFailureCache::Clear();
 }
 
 
@@ -91,6 +95,8 @@ void LoadingScene::Update()
             OutputDebugString( "Could not create HDD0-E:\\Homebrew\\Installs\n" );
         }
 
+        ImageFailureCache::Init();
+        CoverAtlas::Init();
         //DeleteImageCache();  // Uncomment to clear image cache on startup
 
         SceneManager* sceneManager = Context::GetSceneManager();
@@ -116,6 +122,7 @@ void LoadingScene::Update()
 
 void LoadingScene::Render()
 {
+    PROFILE_SCOPE("LoadingScene");
     float w = Context::GetScreenWidth();
     float h = Context::GetScreenHeight();
     Drawing::DrawFilledRect(COLOR_BG, 0, 0, w, h);
@@ -9,4 +9,7 @@ public:
     virtual void Render() = 0;
     virtual void Update() = 0;
     virtual void OnResume() {}
+    // True when the scene only changes in response to Context::Invalidate,
+    // so the main loop may skip frames while nothing is invalidated.
+    virtual bool CanIdle() { return false; }
 };
\ No newline at end of file
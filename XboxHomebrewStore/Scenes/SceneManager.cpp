@@ -1,4 +1,5 @@
 #include "SceneManager.h"
+#include "..\Context.h"
 
 SceneManager::SceneManager() : m_pStack(nullptr)
 {
@@ -20,6 +21,7 @@ void SceneManager::PushScene(Scene* pScene)
     pNode->pScene = pScene;
     pNode->pNext = m_pStack;
     m_pStack = pNode;
+    Context::Invalidate();
 }
 
 void SceneManager::PopScene()
@@ -34,6 +36,7 @@ void SceneManager::PopScene()
     if (m_pStack && m_pStack->pScene) {
         m_pStack->pScene->OnResume();
     }
+    Context::Invalidate();
 }
 
 bool SceneManager::HasScene() const
@@ -54,3 +57,11 @@ void SceneManager::Update()
         m_pStack->pScene->Update();
     }
 }
+
+bool SceneManager::CanIdle() const
+{
+    if (m_pStack && m_pStack->pScene) {
+        return m_pStack->pScene->CanIdle();
+    }
+    return false;
+}
@@ -15,6 +15,7 @@ public:
 
     void Render();
     void Update();
+    bool CanIdle() const;
 
 private:
     struct SceneNode
@@ -7,6 +7,7 @@
 #include "..\Defines.h"
 #include "..\Context.h"
 #include "..\Drawing.h"
+#include "..\Profiler.h"
 #include "..\Font.h"
 #include "..\String.h"
 #include "..\InputManager.h"
@@ -14,6 +15,7 @@
 #include "..\StoreManager.h"
 #include "..\ViewState.h"
 #include "..\Debug.h"
+#include "..\CoverAtlas.h"
 
 StoreScene::StoreScene()
 {
@@ -30,11 +32,18 @@ StoreScene::~StoreScene()
 void StoreScene::OnResume()
 {
     StoreManager::SetCategoryIndex(StoreManager::GetCategoryIndex());
+    CancelOffWindowImages();
     mStoreIndex = 0;
 }
 
+bool StoreScene::CanIdle()
+{
+    return true;
+}
+
 void StoreScene::RenderHeader()
 {
+    PROFILE_SCOPE("RenderHeader");
     Drawing::DrawTexturedRect(TextureHelper::GetHeader(), 0xffffffff, 0, 0, Context::GetScreenWidth(), ASSET_HEADER_HEIGHT);
     Font::DrawText(FONT_LARGE, "Xbox Homebrew Store", COLOR_WHITE, 60, 12);
     Drawing::DrawTexturedRect(TextureHelper::GetStore(), 0x8fe386, 16, 12, ASSET_STORE_ICON_WIDTH, ASSET_STORE_ICON_HEIGHT);
@@ -62,6 +71,7 @@ void StoreScene::DrawFooterControl(float& x, float footerY, const char* iconName
 
 void StoreScene::RenderFooter()
 {
+    PROFILE_SCOPE("RenderFooter");
     float footerY = Context::GetScreenHeight() - ASSET_FOOTER_HEIGHT;
     float x = 16.0f;
 
@@ -73,6 +83,7 @@ void StoreScene::RenderFooter()
 
 void StoreScene::RenderCategorySidebar()
 {
+    PROFILE_SCOPE("RenderCategorySidebar");
     float sidebarHeight = (Context::GetScreenHeight() - ASSET_SIDEBAR_Y) - ASSET_FOOTER_HEIGHT;
     Drawing::DrawTexturedRect(TextureHelper::GetSidebar(), 0xffffffff, 0, ASSET_SIDEBAR_Y, ASSET_SIDEBAR_WIDTH, sidebarHeight);
 
@@ -156,21 +167,36 @@ void StoreScene::DrawStoreItem(StoreItem* storeItem, float x, float y, bool sele
     float iconX = x + 9;
     float iconY = y + 9;
 
+    // Atlas covers are collected and drawn in one go by RenderMainGrid
+    Sprite sprite;
+    if (CoverAtlas::TryGetSprite(storeItem->appId, &sprite))
+    {
+        sprite.x = iconX;
+        sprite.y = iconY;
+        sprite.width = iconW;
+        sprite.height = iconH;
+        sprite.diffuse = 0xFFFFFFFF;
+        mCoverSprites.push_back(sprite);
+        return;
+    }
+
     D3DTexture* cover = storeItem->cover;
     if (cover == nullptr) 
     {
-        if (ImageDownloader::IsCoverCached(storeItem->appId) == true)
-        {
-            storeItem->cover = TextureHelper::LoadFromFile(ImageDownloader::GetCoverCachePath(storeItem->appId));
-            cover = storeItem->cover;
-        }
-        else
-        {
-            cover = TextureHelper::GetCover();
-            mImageDownloader->Queue(&storeItem->cover, storeItem->appId, IMAGE_COVER);
+        // Blurry thumbnail (if it arrived first) until the full cover is ready
+        ImageRequestPriority priority = selected ? IMAGE_PRIORITY_SELECTED : IMAGE_PRIORITY_VISIBLE;
+        cover = storeItem->coverThumbnail != nullptr ? storeItem->coverThumbnail : TextureHelper::GetCover();
+        mImageDownloader->Queue(storeItem->appId, IMAGE_COVER, priority);
+        if (storeItem->coverThumbnail == nullptr) {
+            mImageDownloader->Queue(storeItem->appId, IMAGE_COVER_THUMBNAIL, priority);
         }
     }
     Drawing::DrawTexturedRect(cover, 0xFFFFFFFF, iconX, iconY, iconW, iconH);
+}
+
+void StoreScene::DrawStoreItemDetails(StoreItem* storeItem, float x, float y, bool selected)
+{
+    float iconH = ASSET_CARD_HEIGHT - 62;
 
     float textX   = x + 8;
     float nameY   = y + iconH + 14;
@@ -204,8 +230,63 @@ void StoreScene::DrawStoreItem(StoreItem* storeItem, float x, float y, bool sele
     }
 }
 
+void StoreScene::ProcessCompletedImages()
+{
+    ImageDownloadResult result;
+    while (mImageDownloader->TryGetCompleted(&result))
+    {
+        if (result.type == IMAGE_SCREENSHOT) {
+            continue;
+        }
+        // Failures redraw too, so the card queues again and picks up its retry time
+        Context::Invalidate();
+        if (result.success == false) {
+            continue;
+        }
+        for (int32_t i = 0; i < StoreManager::GetWindowStoreItemCount(); i++)
+        {
+            StoreItem* storeItem = StoreManager::GetWindowStoreItem(i);
+            if (storeItem->cover != nullptr || storeItem->appId != result.appId || CoverAtlas::Contains(result.appId)) {
+                continue;
+            }
+            if (result.type == IMAGE_COVER) {
+                // Atlas first, own texture only if the cover does not fit the atlas format
+                std::string path = ImageDownloader::GetCoverCachePath(result.appId);
+                bool loaded = CoverAtlas::TryAdd(result.appId, path);
+                if (loaded == false) {
+                    storeItem->cover = TextureHelper::LoadCompressedFromFile(path);
+                    loaded = storeItem->cover != nullptr;
+                }
+                if (loaded == false) {
+                    // Otherwise DrawStoreItem would queue it again and this reload every frame
+                    mImageDownloader->Discard(result.appId, IMAGE_COVER);
+                } else if (storeItem->coverThumbnail != nullptr) {
+                    storeItem->coverThumbnail->Release();
+                    storeItem->coverThumbnail = nullptr;
+                }
+            } else if (storeItem->coverThumbnail == nullptr) {
+                storeItem->coverThumbnail = TextureHelper::LoadCompressedFromFile(ImageDownloader::GetCoverThumbnailCachePath(result.appId));
+                if (storeItem->coverThumbnail == nullptr) {
+                    mImageDownloader->Discard(result.appId, IMAGE_COVER_THUMBNAIL);
+                }
+            }
+        }
+    }
+}
+
+void StoreScene::CancelOffWindowImages()
+{
+    std::set<std::string> appIds;
+    for (int32_t i = 0; i < StoreManager::GetWindowStoreItemCount(); i++)
+    {
+        appIds.insert(StoreManager::GetWindowStoreItem(i)->appId);
+    }
+    mImageDownloader->CancelExcept(appIds);
+}
+
 void StoreScene::RenderMainGrid()
 {
+    PROFILE_SCOPE("RenderMainGrid");
     float gridX = ASSET_SIDEBAR_WIDTH;
     float gridY = ASSET_HEADER_HEIGHT;
     float gridWidth = Context::GetScreenWidth() - ASSET_SIDEBAR_WIDTH; 
@@ -240,6 +321,21 @@ void StoreScene::RenderMainGrid()
         DrawStoreItem(storeItem, x, y, currentSlot == (mStoreIndex - StoreManager::GetWindowStoreItemOffset()), currentSlot);
     }
 
+    if (mCoverSprites.empty() == false) {
+        Drawing::DrawSprites(CoverAtlas::GetTexture(), &mCoverSprites[0], (int32_t)mCoverSprites.size());
+        mCoverSprites.clear();
+    }
+
+    for (int32_t currentSlot = 0; currentSlot < slotsInView; currentSlot++ )
+    {
+        int32_t row = currentSlot / Context::GetGridCols();
+        int32_t col = currentSlot % Context::GetGridCols();
+        float x = cardX + col * ( cardWidth + CARD_GAP);
+        float y = cardY + row * ( cardHeight + CARD_GAP);
+        StoreItem* storeItem = StoreManager::GetWindowStoreItem(currentSlot);
+        DrawStoreItemDetails(storeItem, x, y, currentSlot == (mStoreIndex - StoreManager::GetWindowStoreItemOffset()));
+    }
+
     std::string pageStr = String::Format("Item %d of %d", mStoreIndex + 1, StoreManager::GetSelectedCategoryTotal());
     float pageStrWidth = 0.0f;
     Font::MeasureText(FONT_NORMAL, pageStr, &pageStrWidth);
@@ -249,16 +345,25 @@ void StoreScene::RenderMainGrid()
 
 void StoreScene::Render()
 {
+    PROFILE_SCOPE("StoreScene");
     Drawing::DrawTexturedRect(TextureHelper::GetBackground(), 0xFFFFFFFF, 0, 0, Context::GetScreenWidth(), Context::GetScreenHeight());
     
     RenderHeader();
     RenderFooter();
     RenderCategorySidebar();
     RenderMainGrid();
+
+    // Covers are only queued while drawing, so wake up when a failed one may be retried
+    uint32_t retryDelay = 0;
+    if (mImageDownloader->TryTakeRetryDelay(&retryDelay)) {
+        Context::InvalidateAfter(retryDelay);
+    }
 }
 
 void StoreScene::Update()
 {
+    ProcessCompletedImages();
+
     if (mSideBarFocused)
     {
         if (InputManager::ControllerPressed(ControllerDpadUp, -1))
@@ -274,6 +379,7 @@ void StoreScene::Update()
             bool needsUpdate = StoreManager::GetCategoryIndex() != mHighlightedCategoryIndex;
             if (needsUpdate == true) {
                 StoreManager::SetCategoryIndex(mHighlightedCategoryIndex);
+                CancelOffWindowImages();
                 mStoreIndex = 0;
             }
         }
@@ -309,6 +415,7 @@ void StoreScene::Update()
             else if (StoreManager::HasPrevious())
             {
                 StoreManager::LoadPrevious();
+                CancelOffWindowImages();
                 mStoreIndex = mStoreIndex >= Context::GetGridCols() ? mStoreIndex - Context::GetGridCols() : 0;
             }
         }
@@ -320,8 +427,8 @@ void StoreScene::Update()
             }
             else if (StoreManager::HasNext())
             {
-                mImageDownloader->CancelAll();
                 StoreManager::LoadNext();
+                CancelOffWindowImages();
                 mStoreIndex = Math::MinInt32(mStoreIndex + Context::GetGridCols(), StoreManager::GetSelectedCategoryTotal() - 1);
             }
         }
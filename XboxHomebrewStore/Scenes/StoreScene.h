@@ -6,6 +6,7 @@
 #include "..\Font.h"
 #include "..\ImageDownloader.h"
 #include "..\StoreManager.h"
+#include "..\Drawing.h"
 
 class StoreScene : public Scene
 {
@@ -15,6 +16,7 @@ public:
     virtual void Render();
     virtual void Update();
     virtual void OnResume();
+    virtual bool CanIdle();
 
 private:
     void RenderHeader();
@@ -23,9 +25,13 @@ private:
     void RenderCategorySidebar();
     void RenderMainGrid();
     void DrawStoreItem(StoreItem* storeItem, float x, float y, bool selected, int32_t slotIndex);
+    void DrawStoreItemDetails(StoreItem* storeItem, float x, float y, bool selected);
+    void ProcessCompletedImages();
+    void CancelOffWindowImages();
 
     ImageDownloader* mImageDownloader;
     bool mSideBarFocused;
     int32_t mHighlightedCategoryIndex;
     int32_t mStoreIndex;
+    std::vector<Sprite> mCoverSprites;
 };
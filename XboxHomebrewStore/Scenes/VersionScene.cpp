@@ -4,6 +4,7 @@
 #include "..\Context.h"
 #include "..\Defines.h"
 #include "..\Drawing.h"
+#include "..\Profiler.h"
 #include "..\Font.h"
 #include "..\Math.h"
 #include "..\String.h"
@@ -67,10 +68,12 @@ VersionScene::~VersionScene()
         CloseHandle(mDownloadThread);
         mDownloadThread = nullptr;
     }
+    delete mImageDownloader;
 }
 
 void VersionScene::Render()
 {
+    PROFILE_SCOPE("VersionScene");
     if (mNeedsUpdate == true)
     {
         mNeedsUpdate = false;
@@ -98,10 +101,17 @@ void VersionScene::Render()
     if (mShowFailedOverlay) {
         RenderFailedOverlay();
     }
+
+    // Images are only queued while drawing, so wake up when a failed one may be retried
+    uint32_t retryDelay = 0;
+    if (mImageDownloader->TryTakeRetryDelay(&retryDelay)) {
+        Context::InvalidateAfter(retryDelay);
+    }
 }
 
 void VersionScene::RenderHeader()
 {
+    PROFILE_SCOPE("RenderHeader");
     Drawing::DrawTexturedRect(TextureHelper::GetHeader(), 0xffffffff, 0, 0, Context::GetScreenWidth(), ASSET_HEADER_HEIGHT);
     Font::DrawText(FONT_LARGE, "Xbox Homebrew Store", COLOR_WHITE, 60, 12);
     Drawing::DrawTexturedRect(TextureHelper::GetStore(), 0x8fe386, 16, 12, ASSET_STORE_ICON_WIDTH, ASSET_STORE_ICON_HEIGHT);
@@ -129,6 +139,7 @@ void VersionScene::DrawFooterControl(float& x, float footerY, const char* iconNa
 
 void VersionScene::RenderFooter()
 {
+    PROFILE_SCOPE("RenderFooter");
     float footerY = Context::GetScreenHeight() - ASSET_FOOTER_HEIGHT;
     float x = 16.0f;
 
@@ -147,6 +158,7 @@ void VersionScene::RenderFooter()
 
 void VersionScene::RenderVersionSidebar()
 {
+    PROFILE_SCOPE("RenderVersionSidebar");
     float sidebarHeight = (Context::GetScreenHeight() - ASSET_SIDEBAR_Y) - ASSET_FOOTER_HEIGHT;
     Drawing::DrawTexturedRect(TextureHelper::GetSidebar(), 0xffffffff, 0, ASSET_SIDEBAR_Y, ASSET_SIDEBAR_WIDTH, sidebarHeight);
 
@@ -220,6 +232,7 @@ void VersionScene::RenderVersionSidebar()
 
 void VersionScene::RenderListView()
 {
+    PROFILE_SCOPE("RenderListView");
     const float titleXPos = 200.0f;
     const float infoXPos = 350.0f;
     const float infoMaxWidth = (float)Context::GetScreenWidth() - infoXPos - 20.0f;
@@ -253,32 +266,16 @@ void VersionScene::RenderListView()
     D3DTexture* screenshot = mStoreVersions.screenshot;
     if (screenshot == nullptr) 
     {
-        if (ImageDownloader::IsScreenshotCached(mStoreVersions.appId) == true)
-        {
-            mStoreVersions.screenshot = TextureHelper::LoadFromFile(ImageDownloader::GetScreenshotCachePath(mStoreVersions.appId));
-            screenshot = mStoreVersions.screenshot;
-        }
-        else
-        {
-            screenshot = TextureHelper::GetScreenshot();
-            mImageDownloader->Queue(&mStoreVersions.screenshot, mStoreVersions.appId, IMAGE_SCREENSHOT);
-        }
+        screenshot = TextureHelper::GetScreenshot();
+        mImageDownloader->Queue(mStoreVersions.appId, IMAGE_SCREENSHOT);
     }
     Drawing::DrawTexturedRect(screenshot, 0xFFFFFFFF, titleXPos, gridY, ASSET_SCREENSHOT_WIDTH, ASSET_SCREENSHOT_HEIGHT);
 
     D3DTexture* cover = mStoreVersions.cover;
     if (cover == nullptr) 
     {
-        if (ImageDownloader::IsCoverCached(mStoreVersions.appId) == true)
-        {
-            mStoreVersions.cover = TextureHelper::LoadFromFile(ImageDownloader::GetCoverCachePath(mStoreVersions.appId));
-            cover = mStoreVersions.cover;
-        }
-        else
-        {
-            cover = TextureHelper::GetCover();
-            mImageDownloader->Queue(&mStoreVersions.cover, mStoreVersions.appId, IMAGE_COVER);
-        }
+        cover = TextureHelper::GetCover();
+        mImageDownloader->Queue(mStoreVersions.appId, IMAGE_COVER, IMAGE_PRIORITY_SELECTED);
     }
     Drawing::DrawTexturedRect(cover, 0xFFFFFFFF, 216 + ASSET_SCREENSHOT_WIDTH, gridY, 144, 204);
 
@@ -317,6 +314,7 @@ void VersionScene::RenderListView()
 
 void VersionScene::RenderDownloadOverlay()
 {
+    PROFILE_SCOPE("RenderDownloadOverlay");
     const float w = Context::GetScreenWidth();
     const float h = Context::GetScreenHeight();
 
@@ -388,6 +386,7 @@ void VersionScene::RenderDownloadOverlay()
 
 void VersionScene::RenderFailedOverlay()
 {
+    PROFILE_SCOPE("RenderFailedOverlay");
     const float w = Context::GetScreenWidth();
     const float h = Context::GetScreenHeight();
 
@@ -607,6 +606,7 @@ DWORD WINAPI VersionScene::DownloadThreadProc(LPVOID param)
 
     scene->mDownloading = false;
     scene->mNeedsUpdate = true;
+    Context::Invalidate();
 
     return 0;
 }
@@ -636,8 +636,44 @@ void VersionScene::StartDownload()
     }
 }
 
+void VersionScene::ProcessCompletedImages()
+{
+    ImageDownloadResult result;
+    while (mImageDownloader->TryGetCompleted(&result))
+    {
+        if (result.appId != mStoreVersions.appId) {
+            continue;
+        }
+        // Failures redraw too, so Render queues again and picks up the retry time
+        Context::Invalidate();
+        if (result.success == false) {
+            continue;
+        }
+        // A file that will not load is discarded, or Render would queue it straight back
+        if (result.type == IMAGE_COVER && mStoreVersions.cover == nullptr) {
+            mStoreVersions.cover = TextureHelper::LoadCompressedFromFile(ImageDownloader::GetCoverCachePath(result.appId));
+            if (mStoreVersions.cover == nullptr) {
+                mImageDownloader->Discard(result.appId, IMAGE_COVER);
+            }
+        } else if (result.type == IMAGE_SCREENSHOT && mStoreVersions.screenshot == nullptr) {
+            mStoreVersions.screenshot = TextureHelper::LoadCompressedFromFile(ImageDownloader::GetScreenshotCachePath(result.appId));
+            if (mStoreVersions.screenshot == nullptr) {
+                mImageDownloader->Discard(result.appId, IMAGE_SCREENSHOT);
+            }
+        }
+    }
+}
+
+bool VersionScene::CanIdle()
+{
+    // Progress is driven by the download thread, so keep drawing until it finishes
+    return mDownloading == false && mUnpacking == false;
+}
+
 void VersionScene::Update()
 {
+    ProcessCompletedImages();
+
     if (mShowFailedOverlay) {
         if (InputManager::ControllerPressed(ControllerA, -1)) {
             mShowFailedOverlay = false;
@@ -14,6 +14,7 @@ public:
     virtual ~VersionScene();
     virtual void Render();
     virtual void Update();
+    virtual bool CanIdle();
 
 private:
     void RenderHeader();
@@ -23,6 +24,7 @@ private:
     void RenderListView();
     void RenderDownloadOverlay();
     void RenderFailedOverlay();
+    void ProcessCompletedImages();
 
     void StartDownload();
     static void DownloadProgressCb(uint32_t dlNow, uint32_t dlTotal, void* userData);
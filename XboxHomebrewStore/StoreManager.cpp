@@ -119,6 +119,9 @@ bool StoreManager::LoadPrevious()
         if (storeItem.cover != nullptr) {
             storeItem.cover->Release();
         }
+        if (storeItem.coverThumbnail != nullptr) {
+            storeItem.coverThumbnail->Release();
+        }
     }
 
     for (int32_t i = mWindowStoreItemCount - itemsToRemove; i > 0; i--)
@@ -134,6 +137,7 @@ bool StoreManager::LoadPrevious()
         dst.latestVersion = src.latestVersion;
         dst.state = src.state;
         dst.cover = src.cover;
+        dst.coverThumbnail = src.coverThumbnail;
     }
 
     for (int32_t i = 0; i < loadedCount; i++)
@@ -149,6 +153,7 @@ bool StoreManager::LoadPrevious()
         dst.latestVersion = src.latestVersion;
         dst.state = src.state;
         dst.cover = src.cover;
+        dst.coverThumbnail = src.coverThumbnail;
     }
 
     mWindowStoreItemOffset = newWindowStoreItemOffset;
@@ -180,6 +185,9 @@ bool StoreManager::LoadNext()
         if (storeItem.cover != nullptr) {
             storeItem.cover->Release();
         }
+        if (storeItem.coverThumbnail != nullptr) {
+            storeItem.coverThumbnail->Release();
+        }
     }
 
     for (int32_t i = itemsToRemove; i < mWindowStoreItemCount; i++)
@@ -196,6 +204,7 @@ bool StoreManager::LoadNext()
         dst.latestVersion = src.latestVersion;
         dst.state = src.state;
         dst.cover = src.cover;
+        dst.coverThumbnail = src.coverThumbnail;
     }
 
     for (int32_t i = 0; i < loadedCount; i++)
@@ -212,6 +221,7 @@ bool StoreManager::LoadNext()
         dst.latestVersion = src.latestVersion;
         dst.state = src.state;
         dst.cover = src.cover;
+        dst.coverThumbnail = src.coverThumbnail;
     }
 
     mWindowStoreItemOffset = newWindowStoreItemOffset;
@@ -358,6 +368,7 @@ bool StoreManager::LoadApplications(void* dest, int32_t offset, int32_t count, i
         storeItems[i].latestVersion = appItem->latestVersion;
         storeItems[i].state = ViewState::GetViewed(appItem->id, storeItems[i].latestVersion) ? 0 : appItem->state;
         storeItems[i].cover = nullptr;
+        storeItems[i].coverThumbnail = nullptr;
 
         std::vector<UserSaveState> userStates;
         if (UserState::TryGetByAppId(storeItems[i].appId, userStates))
@@ -394,6 +405,9 @@ bool StoreManager::RefreshApplications()
         if (storeItem.cover != nullptr) {
             storeItem.cover->Release();
         }
+        if (storeItem.coverThumbnail != nullptr) {
+            storeItem.coverThumbnail->Release();
+        }
     }
 
     mWindowStoreItemOffset = 0;
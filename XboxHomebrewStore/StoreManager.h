@@ -16,6 +16,7 @@ typedef struct
     std::string latestVersion;
     uint32_t state;
     D3DTexture* cover;
+    D3DTexture* coverThumbnail;
 } StoreItem;
 
 typedef struct
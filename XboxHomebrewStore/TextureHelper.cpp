@@ -2,7 +2,45 @@
 #include "Context.h"
 #include "Defines.h"
 #include "String.h"
+#include "Math.h"
+#include "Debug.h"
+#include "FileSystem.h"
+#include "DxtEncoder.h"
+#include "Profiler.h"
+
+#define STB_IMAGE_IMPLEMENTATION
+#define STBI_ONLY_JPEG
+#define STBI_ONLY_PNG
+#define STBI_NO_SIMD
+#include "stb_image.h"
+
+#define DXT_FILE_MAGIC 0x43545844
+#define DXT_FILE_MAX_SIZE 1024
+
 namespace {
+    struct DxtFileHeader
+    {
+        uint32_t magic;
+        uint32_t format;
+        uint32_t width;
+        uint32_t height;
+    };
+
+    // A damaged cache file must not pick the texture size or read past its end,
+    // so the header has to agree with the file's length; leaves fp after the header
+    bool TryReadCompressedHeader(FILE* fp, DxtFileHeader* header)
+    {
+        if (fread(header, sizeof(DxtFileHeader), 1, fp) != 1 || header->magic != DXT_FILE_MAGIC ||
+            (header->format != DXT_FORMAT_BC1 && header->format != DXT_FORMAT_BC3) ||
+            header->width == 0 || header->height == 0 || header->width > DXT_FILE_MAX_SIZE || header->height > DXT_FILE_MAX_SIZE) {
+            return false;
+        }
+        fseek(fp, 0, SEEK_END);
+        long fileSize = ftell(fp);
+        fseek(fp, sizeof(DxtFileHeader), SEEK_SET);
+        return fileSize == (long)(sizeof(DxtFileHeader) + DxtEncoder::GetEncodedSize((DxtFormat)header->format, header->width, header->height));
+    }
+
     D3DTexture* mBackground = nullptr;
     D3DTexture* mHeader = nullptr;
     D3DTexture* mFooter = nullptr;
@@ -93,6 +131,7 @@ bool TextureHelper::Init()
 
 D3DTexture* TextureHelper::LoadFromFile(const std::string filePath)
 {
+    PROFILE_SCOPE("TextureUpload");
     D3DTexture* tex = nullptr;
     if (FAILED(D3DXCreateTextureFromFileEx(Context::GetD3dDevice(), filePath.c_str(),
         D3DX_DEFAULT, D3DX_DEFAULT, D3DX_DEFAULT, 0, D3DFMT_UNKNOWN, D3DPOOL_DEFAULT,
@@ -102,6 +141,195 @@ D3DTexture* TextureHelper::LoadFromFile(const std::string filePath)
     return tex;
 }
 
+bool TextureHelper::TryCompressImageFile(const std::string sourcePath, const std::string destPath)
+{
+    int32_t width = 0;
+    int32_t height = 0;
+    int32_t channels = 0;
+    uint8_t* pixels = stbi_load(sourcePath.c_str(), &width, &height, &channels, 4);
+    if (pixels == nullptr) {
+        Debug::Print("TryCompressImageFile: decode failed %s\n", sourcePath.c_str());
+        return false;
+    }
+
+    bool hasAlpha = false;
+    if (channels == 2 || channels == 4) {
+        for (int32_t i = 0; i < width * height; i++) {
+            if (pixels[(i << 2) + 3] != 0xff) {
+                hasAlpha = true;
+                break;
+            }
+        }
+    }
+
+    // Textures must be power of two, stretch the image the same way D3DX_DEFAULT sizing did,
+    // but no larger than the loader accepts
+    int32_t texWidth = (int32_t)Math::NextPowerOf2((uint32_t)width);
+    int32_t texHeight = (int32_t)Math::NextPowerOf2((uint32_t)height);
+    texWidth = texWidth > DXT_FILE_MAX_SIZE ? DXT_FILE_MAX_SIZE : texWidth;
+    texHeight = texHeight > DXT_FILE_MAX_SIZE ? DXT_FILE_MAX_SIZE : texHeight;
+    uint8_t* resized = (uint8_t*)malloc(texWidth * texHeight * 4);
+    if (resized == nullptr) {
+        stbi_image_free(pixels);
+        return false;
+    }
+    for (int32_t y = 0; y < texHeight; y++) {
+        int32_t fy = (int32_t)((((int64_t)y * 2 + 1) * height * 128) / texHeight) - 128;
+        fy = fy < 0 ? 0 : fy;
+        int32_t y0 = fy >> 8;
+        int32_t y1 = y0 + 1 < height ? y0 + 1 : height - 1;
+        int32_t wy = fy & 0xff;
+        for (int32_t x = 0; x < texWidth; x++) {
+            int32_t fx = (int32_t)((((int64_t)x * 2 + 1) * width * 128) / texWidth) - 128;
+            fx = fx < 0 ? 0 : fx;
+            int32_t x0 = fx >> 8;
+            int32_t x1 = x0 + 1 < width ? x0 + 1 : width - 1;
+            int32_t wx = fx & 0xff;
+            const uint8_t* p00 = pixels + ((y0 * width + x0) << 2);
+            const uint8_t* p01 = pixels + ((y0 * width + x1) << 2);
+            const uint8_t* p10 = pixels + ((y1 * width + x0) << 2);
+            const uint8_t* p11 = pixels + ((y1 * width + x1) << 2);
+            uint8_t* dst = resized + ((y * texWidth + x) << 2);
+            for (int32_t c = 0; c < 4; c++) {
+                int32_t top = (p00[c] << 8) + (p01[c] - p00[c]) * wx;
+                int32_t bottom = (p10[c] << 8) + (p11[c] - p10[c]) * wx;
+                dst[c] = (uint8_t)(((top << 8) + (bottom - top) * wy + 0x8000) >> 16);
+            }
+        }
+    }
+    stbi_image_free(pixels);
+
+    DxtFormat format = hasAlpha ? DXT_FORMAT_BC3 : DXT_FORMAT_BC1;
+    uint32_t encodedSize = DxtEncoder::GetEncodedSize(format, texWidth, texHeight);
+    uint8_t* encoded = (uint8_t*)malloc(encodedSize);
+    if (encoded == nullptr) {
+        free(resized);
+        return false;
+    }
+    DxtEncoder::EncodeImage(resized, texWidth, texHeight, format, encoded);
+    free(resized);
+
+    FILE* fp = fopen(destPath.c_str(), "wb");
+    if (fp == nullptr) {
+        free(encoded);
+        return false;
+    }
+    SetFileAttributesA(destPath.c_str(), FILE_ATTRIBUTE_ARCHIVE);
+
+    DxtFileHeader header;
+    header.magic = DXT_FILE_MAGIC;
+    header.format = (uint32_t)format;
+    header.width = (uint32_t)texWidth;
+    header.height = (uint32_t)texHeight;
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+    ok &= fwrite(encoded, encodedSize, 1, fp) == 1;
+    fclose(fp);
+    free(encoded);
+
+    if (!ok) {
+        FileSystem::FileDelete(destPath);
+        return false;
+    }
+    SetFileAttributesA(destPath.c_str(), FILE_ATTRIBUTE_NORMAL);
+    return true;
+}
+
+bool TextureHelper::IsCompressedFileValid(const std::string filePath)
+{
+    FILE* fp = fopen(filePath.c_str(), "rb");
+    if (fp == nullptr) {
+        return false;
+    }
+    DxtFileHeader header;
+    bool valid = TryReadCompressedHeader(fp, &header);
+    fclose(fp);
+    return valid;
+}
+
+D3DTexture* TextureHelper::LoadCompressedFromFile(const std::string filePath)
+{
+    PROFILE_SCOPE("TextureUpload");
+    FILE* fp = fopen(filePath.c_str(), "rb");
+    if (fp == nullptr) {
+        return nullptr;
+    }
+
+    DxtFileHeader header;
+    if (TryReadCompressedHeader(fp, &header) == false) {
+        fclose(fp);
+        return nullptr;
+    }
+
+    DxtFormat format = (DxtFormat)header.format;
+    D3DTexture* tex = nullptr;
+    if (FAILED(Context::GetD3dDevice()->CreateTexture(header.width, header.height, 1, 0,
+        format == DXT_FORMAT_BC1 ? D3DFMT_DXT1 : D3DFMT_DXT5, D3DPOOL_DEFAULT, &tex))) {
+        fclose(fp);
+        return nullptr;
+    }
+
+    D3DLOCKED_RECT lockedRect;
+    if (FAILED(tex->LockRect(0, &lockedRect, nullptr, 0))) {
+        tex->Release();
+        fclose(fp);
+        return nullptr;
+    }
+
+    // DXT surfaces are block linear (not swizzled), one pitch per row of 4x4 blocks
+    uint32_t rowSize = ((header.width + 3) >> 2) * DxtEncoder::GetBlockSize(format);
+    uint32_t blockRows = (header.height + 3) >> 2;
+    bool ok = true;
+    for (uint32_t row = 0; row < blockRows && ok; row++) {
+        ok = fread((uint8_t*)lockedRect.pBits + row * lockedRect.Pitch, rowSize, 1, fp) == 1;
+    }
+    tex->UnlockRect(0);
+    fclose(fp);
+
+    if (!ok) {
+        tex->Release();
+        return nullptr;
+    }
+    Profiler::AddCounter(PROFILER_COUNTER_TEXTURE_BYTES, rowSize * blockRows);
+    return tex;
+}
+
+bool TextureHelper::TryLoadCompressedIntoTexture(const std::string filePath, D3DTexture* texture, int32_t x, int32_t y, int32_t width, int32_t height)
+{
+    PROFILE_SCOPE("TextureUpload");
+    FILE* fp = fopen(filePath.c_str(), "rb");
+    if (fp == nullptr) {
+        return false;
+    }
+
+    // Only DXT1 of the exact region size can be block copied into a DXT1 texture
+    DxtFileHeader header;
+    if (fread(&header, sizeof(header), 1, fp) != 1 || header.magic != DXT_FILE_MAGIC || header.format != DXT_FORMAT_BC1 ||
+        (int32_t)header.width != width || (int32_t)header.height != height) {
+        fclose(fp);
+        return false;
+    }
+
+    D3DLOCKED_RECT lockedRect;
+    if (FAILED(texture->LockRect(0, &lockedRect, nullptr, 0))) {
+        fclose(fp);
+        return false;
+    }
+
+    uint32_t blockSize = DxtEncoder::GetBlockSize(DXT_FORMAT_BC1);
+    uint32_t rowSize = ((uint32_t)width >> 2) * blockSize;
+    uint8_t* dest = (uint8_t*)lockedRect.pBits + (y >> 2) * lockedRect.Pitch + (x >> 2) * blockSize;
+    bool ok = true;
+    for (int32_t row = 0; row < (height >> 2) && ok; row++) {
+        ok = fread(dest + row * lockedRect.Pitch, rowSize, 1, fp) == 1;
+    }
+    texture->UnlockRect(0);
+    fclose(fp);
+    if (ok) {
+        Profiler::AddCounter(PROFILER_COUNTER_TEXTURE_BYTES, rowSize * (uint32_t)(height >> 2));
+    }
+    return ok;
+}
+
 D3DTexture* TextureHelper::CopyTexture(D3DTexture* source)
 {
     LPDIRECT3DSURFACE8 pSrcSurf = nullptr;
@@ -7,6 +7,10 @@ class TextureHelper
 public:
     static bool Init();
     static D3DTexture* LoadFromFile(const std::string filePath);
+    static bool TryCompressImageFile(const std::string sourcePath, const std::string destPath);
+    static bool IsCompressedFileValid(const std::string filePath);
+    static D3DTexture* LoadCompressedFromFile(const std::string filePath);
+    static bool TryLoadCompressedIntoTexture(const std::string filePath, D3DTexture* texture, int32_t x, int32_t y, int32_t width, int32_t height);
     static D3DTexture* GetBackground();
     static D3DTexture* GetHeader();
     static D3DTexture* GetFooter();
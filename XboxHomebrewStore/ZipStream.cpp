@@ -0,0 +1,435 @@
+//=============================================================================
+// ZipStream.cpp - Extracts a zip archive as it arrives, without storing it first
+//
+// Walks the local file headers in order, which is all a forward only reader
+// can do: the central directory at the end is only drained. Stored and
+// deflated members are supported, including deflated ones whose sizes follow
+// in a data descriptor. Each member's CRC32 and size are checked once it is
+// written; a member that fails is deleted and the extraction stops there.
+//
+// Archives needing Zip64 or encryption are refused, as are names that would
+// land outside the destination.
+//=============================================================================
+
+#include "ZipStream.h"
+#include "FileSystem.h"
+#include "Debug.h"
+
+#define ZIP_INPUT_SIZE (64 * 1024)
+#define ZIP_WRITE_SIZE (256 * 1024)
+#define ZIP_LOCAL_HEADER_SIGNATURE 0x04034b50
+#define ZIP_CENTRAL_HEADER_SIGNATURE 0x02014b50
+#define ZIP_END_SIGNATURE 0x06054b50
+#define ZIP_DESCRIPTOR_SIGNATURE 0x08074b50
+#define ZIP_FLAG_ENCRYPTED 0x0001
+#define ZIP_FLAG_DESCRIPTOR 0x0008
+#define ZIP_METHOD_STORED 0
+#define ZIP_METHOD_DEFLATED 8
+
+namespace {
+    typedef struct
+    {
+        InflateInputFn input;
+        void* userData;
+        uint8_t buffer[ZIP_INPUT_SIZE];
+        uint32_t position;
+        uint32_t length;
+        uint8_t pending[INFLATE_UNUSED_MAX];
+        uint32_t pendingPosition;
+        uint32_t pendingLength;
+        uint32_t bytesRead;
+        bool failed;
+
+        HANDLE file;
+        uint8_t out[ZIP_WRITE_SIZE];
+        uint32_t outLength;
+        uint32_t crc;
+        uint32_t size;
+        bool writeFailed;
+        std::string lastDirectory;
+    } Extractor;
+
+    uint16_t ReadLe16(const uint8_t* data)
+    {
+        return (uint16_t)(data[0] | (data[1] << 8));
+    }
+
+    uint32_t ReadLe32(const uint8_t* data)
+    {
+        return (uint32_t)data[0] | ((uint32_t)data[1] << 8) | ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
+    }
+
+    // Input the inflater read past a member's end comes back through pending
+    // and is read before anything newer
+    bool ReadSome(Extractor* extractor, uint8_t* buffer, uint32_t size, uint32_t* bytesRead)
+    {
+        *bytesRead = 0;
+        if (extractor->pendingPosition < extractor->pendingLength)
+        {
+            *bytesRead = min(size, extractor->pendingLength - extractor->pendingPosition);
+            memcpy(buffer, extractor->pending + extractor->pendingPosition, *bytesRead);
+            extractor->pendingPosition += *bytesRead;
+            return true;
+        }
+        if (extractor->position == extractor->length)
+        {
+            uint32_t received = 0;
+            if (extractor->input(extractor->buffer, ZIP_INPUT_SIZE, &received, extractor->userData) == false)
+            {
+                extractor->failed = true;
+                return false;
+            }
+            extractor->position = 0;
+            extractor->length = received;
+            extractor->bytesRead += received;
+            if (received == 0)
+            {
+                return true;
+            }
+        }
+        *bytesRead = min(size, extractor->length - extractor->position);
+        memcpy(buffer, extractor->buffer + extractor->position, *bytesRead);
+        extractor->position += *bytesRead;
+        return true;
+    }
+
+    bool ReadExact(Extractor* extractor, uint8_t* buffer, uint32_t size)
+    {
+        while (size > 0)
+        {
+            uint32_t bytesRead = 0;
+            if (ReadSome(extractor, buffer, size, &bytesRead) == false || bytesRead == 0)
+            {
+                return false;
+            }
+            buffer += bytesRead;
+            size -= bytesRead;
+        }
+        return true;
+    }
+
+    bool Skip(Extractor* extractor, uint32_t size)
+    {
+        uint8_t scratch[256];
+        while (size > 0)
+        {
+            const uint32_t count = min(size, (uint32_t)sizeof(scratch));
+            if (ReadExact(extractor, scratch, count) == false)
+            {
+                return false;
+            }
+            size -= count;
+        }
+        return true;
+    }
+
+    bool InflateInput(uint8_t* buffer, uint32_t size, uint32_t* bytesRead, void* userData)
+    {
+        return ReadSome((Extractor*)userData, buffer, size, bytesRead);
+    }
+
+    bool FlushMember(Extractor* extractor)
+    {
+        if (extractor->outLength > 0 && extractor->writeFailed == false && extractor->file != INVALID_HANDLE_VALUE)
+        {
+            DWORD bytesWritten = 0;
+            if (WriteFile(extractor->file, extractor->out, extractor->outLength, &bytesWritten, NULL) == FALSE ||
+                bytesWritten != extractor->outLength)
+            {
+                Debug::Print("Error: WriteFile failed: %i\n", GetLastError());
+                extractor->writeFailed = true;
+            }
+        }
+        extractor->outLength = 0;
+        return extractor->writeFailed == false;
+    }
+
+    bool WriteMember(const uint8_t* data, uint32_t size, void* userData)
+    {
+        Extractor* extractor = (Extractor*)userData;
+        extractor->crc = Deflate::UpdateCrc32(extractor->crc, data, size);
+        extractor->size += size;
+        while (size > 0)
+        {
+            const uint32_t count = min(size, ZIP_WRITE_SIZE - extractor->outLength);
+            memcpy(extractor->out + extractor->outLength, data, count);
+            extractor->outLength += count;
+            data += count;
+            size -= count;
+            if (extractor->outLength == ZIP_WRITE_SIZE && FlushMember(extractor) == false)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Zip names use '/', may hold "." segments and must not climb out with
+    // ".." or name a drive; relative comes back with '\' separators
+    bool MakeRelativePath(const std::string& name, std::string& relative)
+    {
+        relative.clear();
+        size_t start = 0;
+        while (start <= name.size())
+        {
+            size_t end = name.find_first_of("/\\", start);
+            if (end == std::string::npos)
+            {
+                end = name.size();
+            }
+            std::string segment = name.substr(start, end - start);
+            if (segment == "..")
+            {
+                return false;
+            }
+            if (segment.find(':') != std::string::npos)
+            {
+                return false;
+            }
+            if (segment.empty() == false && segment != ".")
+            {
+                if (relative.empty() == false)
+                {
+                    relative += "\\";
+                }
+                relative += segment;
+            }
+            start = end + 1;
+        }
+        return relative.empty() == false;
+    }
+
+    // Creates every missing folder on the way to directory, remembering the
+    // last one so the members of one folder cost a single check
+    void CreateDirectories(Extractor* extractor, const std::string& root, const std::string& directory)
+    {
+        if (directory == extractor->lastDirectory)
+        {
+            return;
+        }
+        for (size_t i = root.size() + 1; i <= directory.size(); i++)
+        {
+            if (i == directory.size() || directory[i] == '\\')
+            {
+                FileSystem::DirectoryCreate(directory.substr(0, i));
+            }
+        }
+        extractor->lastDirectory = directory;
+    }
+
+    bool ExtractMember(Extractor* extractor, const std::string& destination, ZipStreamResult* result)
+    {
+        uint8_t header[26];
+        if (ReadExact(extractor, header, sizeof(header)) == false)
+        {
+            return false;
+        }
+        const uint16_t flags = ReadLe16(header + 2);
+        const uint16_t method = ReadLe16(header + 4);
+        uint32_t crc = ReadLe32(header + 10);
+        uint32_t compressedSize = ReadLe32(header + 14);
+        uint32_t size = ReadLe32(header + 18);
+        const uint16_t nameLength = ReadLe16(header + 22);
+        const uint16_t extraLength = ReadLe16(header + 24);
+
+        std::string name(nameLength, '\0');
+        if ((nameLength > 0 && ReadExact(extractor, (uint8_t*)&name[0], nameLength) == false) ||
+            Skip(extractor, extraLength) == false)
+        {
+            return false;
+        }
+        result->failedEntry = name;
+
+        const bool hasDescriptor = (flags & ZIP_FLAG_DESCRIPTOR) != 0;
+        if ((flags & ZIP_FLAG_ENCRYPTED) != 0 || compressedSize == 0xFFFFFFFF || size == 0xFFFFFFFF)
+        {
+            Debug::Print("Error: Zip member %s is encrypted or needs Zip64.\n", name.c_str());
+            return false;
+        }
+        // A stored member with a descriptor has no way to mark its end, unless it is empty
+        if (method != ZIP_METHOD_DEFLATED && (method != ZIP_METHOD_STORED || (hasDescriptor && compressedSize != 0)))
+        {
+            Debug::Print("Error: Zip member %s uses unsupported method %u.\n", name.c_str(), method);
+            return false;
+        }
+
+        std::string relative;
+        if (MakeRelativePath(name, relative) == false)
+        {
+            Debug::Print("Error: Zip member %s has an unsafe name.\n", name.c_str());
+            return false;
+        }
+        const std::string path = FileSystem::CombinePath(destination, relative);
+        const bool isDirectory = name[name.size() - 1] == '/' || name[name.size() - 1] == '\\';
+        // Folders go through the same decoding, with their (empty) data discarded
+        if (isDirectory)
+        {
+            CreateDirectories(extractor, destination, path);
+        }
+        else
+        {
+            CreateDirectories(extractor, destination, FileSystem::GetDirectory(path));
+            extractor->file =
+                CreateFileA(path.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+            if (extractor->file == INVALID_HANDLE_VALUE)
+            {
+                Debug::Print("Error: Could not create %s\n", path.c_str());
+                return false;
+            }
+        }
+        if (extractor->file != INVALID_HANDLE_VALUE && hasDescriptor == false && size > 0)
+        {
+            SetFilePointer(extractor->file, size, NULL, FILE_BEGIN);
+            SetEndOfFile(extractor->file);
+            SetFilePointer(extractor->file, 0, NULL, FILE_BEGIN);
+        }
+        extractor->outLength = 0;
+        extractor->crc = 0;
+        extractor->size = 0;
+        extractor->writeFailed = false;
+
+        bool success = true;
+        if (method == ZIP_METHOD_STORED)
+        {
+            // Read straight into the write buffer
+            uint32_t remaining = compressedSize;
+            while (success && remaining > 0)
+            {
+                uint8_t* chunk = extractor->out + extractor->outLength;
+                uint32_t bytesRead = 0;
+                success = ReadSome(extractor, chunk, min(remaining, ZIP_WRITE_SIZE - extractor->outLength), &bytesRead) &&
+                          bytesRead > 0;
+                extractor->crc = Deflate::UpdateCrc32(extractor->crc, chunk, bytesRead);
+                extractor->size += bytesRead;
+                extractor->outLength += bytesRead;
+                remaining -= bytesRead;
+                if (success && extractor->outLength == ZIP_WRITE_SIZE)
+                {
+                    success = FlushMember(extractor);
+                }
+            }
+        }
+        else
+        {
+            InflateStream* inflate = Deflate::CreateRawDecompressor(InflateInput, extractor, WriteMember, extractor);
+            success = inflate != NULL && Deflate::Decompress(inflate);
+            if (inflate != NULL)
+            {
+                // Whatever it read beyond the member is the start of the next header
+                uint8_t unused[INFLATE_UNUSED_MAX];
+                const uint32_t unusedLength = Deflate::TakeUnusedInput(inflate, unused, sizeof(unused));
+                Deflate::DestroyDecompressor(inflate);
+                const uint32_t leftover = extractor->pendingLength - extractor->pendingPosition;
+                memmove(extractor->pending + unusedLength, extractor->pending + extractor->pendingPosition, leftover);
+                memcpy(extractor->pending, unused, unusedLength);
+                extractor->pendingPosition = 0;
+                extractor->pendingLength = unusedLength + leftover;
+            }
+        }
+        success = FlushMember(extractor) && success;
+
+        // The descriptor's own signature is optional, so a first word that is
+        // not it is already the CRC
+        if (success && hasDescriptor)
+        {
+            uint8_t descriptor[16];
+            success = ReadExact(extractor, descriptor, 12);
+            if (success && ReadLe32(descriptor) == ZIP_DESCRIPTOR_SIGNATURE)
+            {
+                success = ReadExact(extractor, descriptor + 12, 4);
+                crc = ReadLe32(descriptor + 4);
+                size = ReadLe32(descriptor + 12);
+            }
+            else
+            {
+                crc = ReadLe32(descriptor);
+                size = ReadLe32(descriptor + 8);
+            }
+        }
+        if (success && (extractor->crc != crc || extractor->size != size))
+        {
+            Debug::Print("Error: Zip member %s failed its CRC check.\n", name.c_str());
+            success = false;
+        }
+
+        if (isDirectory)
+        {
+            result->directoryCount++;
+            return success;
+        }
+
+        SetFilePointer(extractor->file, extractor->size, NULL, FILE_BEGIN);
+        SetEndOfFile(extractor->file);
+        CloseHandle(extractor->file);
+        extractor->file = INVALID_HANDLE_VALUE;
+        if (success == false)
+        {
+            DeleteFileA(path.c_str());
+            return false;
+        }
+        result->fileCount++;
+        result->bytesWritten += extractor->size;
+        return true;
+    }
+}
+
+// Reads the archive from input until it ends, writing members below
+// destination; result says how far it got even when it fails
+bool ZipStream::Extract(InflateInputFn input, void* userData, const std::string destination, ZipStreamResult* result)
+{
+    result->fileCount = 0;
+    result->directoryCount = 0;
+    result->bytesWritten = 0;
+    result->bytesRead = 0;
+    result->failedEntry.clear();
+
+    Extractor* extractor = new Extractor;
+    extractor->input = input;
+    extractor->userData = userData;
+    extractor->position = 0;
+    extractor->length = 0;
+    extractor->pendingPosition = 0;
+    extractor->pendingLength = 0;
+    extractor->bytesRead = 0;
+    extractor->failed = false;
+    extractor->file = INVALID_HANDLE_VALUE;
+
+    bool success = false;
+    while (true)
+    {
+        uint8_t signature[4];
+        if (ReadExact(extractor, signature, sizeof(signature)) == false)
+        {
+            break;
+        }
+        const uint32_t value = ReadLe32(signature);
+        if (value == ZIP_LOCAL_HEADER_SIGNATURE)
+        {
+            if (ExtractMember(extractor, destination, result) == false)
+            {
+                break;
+            }
+            continue;
+        }
+        if (value == ZIP_CENTRAL_HEADER_SIGNATURE || value == ZIP_END_SIGNATURE)
+        {
+            // The client finishes sending before it reads our reply
+            uint32_t bytesRead = 0;
+            do
+            {
+                success = ReadSome(extractor, extractor->out, ZIP_WRITE_SIZE, &bytesRead);
+            } while (success && bytesRead > 0);
+            if (success)
+            {
+                result->failedEntry.clear();
+            }
+            break;
+        }
+        Debug::Print("Error: Unexpected zip record %08x.\n", value);
+        break;
+    }
+
+    result->bytesRead = extractor->bytesRead;
+    delete extractor;
+    return success;
+}
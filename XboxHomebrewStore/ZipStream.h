@@ -0,0 +1,23 @@
+//=============================================================================
+// ZipStream.h - Extracts a zip archive as it arrives, without storing it first
+//=============================================================================
+
+#pragma once
+
+#include "Main.h"
+#include "Deflate.h"
+
+typedef struct
+{
+    uint32_t fileCount;
+    uint32_t directoryCount;
+    uint64_t bytesWritten;
+    uint32_t bytesRead;
+    std::string failedEntry;
+} ZipStreamResult;
+
+class ZipStream
+{
+public:
+    static bool Extract(InflateInputFn input, void* userData, const std::string destination, ZipStreamResult* result);
+};